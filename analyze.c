@@ -0,0 +1,715 @@
+#define _GNU_SOURCE
+#include <dirent.h>
+#include <errno.h>
+#include <fcntl.h>
+#include <limits.h>
+#include <signal.h>
+#include <stdio.h>
+#include <stdlib.h>
+#include <string.h>
+#include <sys/file.h>
+#include <sys/stat.h>
+#include <sys/wait.h>
+#include <syslog.h>
+#include <time.h>
+#include <unistd.h>
+
+#include "handle_core.h"
+#include "hc_private.h"
+
+/*
+ * Analysis queue
+ *
+ * Running gdb or eu-stack over every core as it arrives turns a crash storm
+ * into a stampede of debuggers, most of them printing the same backtrace.
+ * Instead, capture only queues the core, by dropping a one-line job file
+ * into core_dir/.queue, and starts a worker in the background. One worker
+ * per directory, under .queue/.lock, runs the analyzers pol->analyze.jobs at
+ * a time at the priority the policy gives, starts none while the pressure
+ * stall information says the machine is busy, and stores what each one
+ * prints in the sidecar of its core.
+ *
+ * Only the first core of each signature, exe:func, is analyzed; once that
+ * succeeds, later cores of the same signature are just pointed at it. The
+ * signatures done so far are kept in .queue/.analyzed, so this holds across
+ * workers and reboots, and a job which is never finished, because the
+ * machine went down, stays queued for the next worker.
+ */
+
+#define ANALYZED_NAME ".analyzed"
+#define LOCK_NAME ".lock"
+#define ANALYZE_TICK_US 100000
+#define ANALYZE_TIMEOUT 600	/* seconds before an analyzer is killed */
+#define ANALYZE_OUTPUT_MAX (256 << 10)	/* of each analyzer, kept */
+#define ANALYZE_JOBS_MAX 64
+#define OUTPUT_PREFIX "analysis_output\ttext="
+#define OUTPUT_TRUNCATED "\nanalysis_output\ttruncated=1"
+
+struct analyze_job {
+	char name[NAME_MAX + 1];	/* the job file */
+	char core[NAME_MAX + 1];
+	char exe[HC_EXE_NAME_MAX];
+	char sig[HC_SIG_MAX];	/* empty if the crash has no signature */
+	uint64_t sig_hash;
+	pid_t pid;
+	int out_fd;		/* the analyzer's stdout and stderr */
+	char tmp[PATH_MAX];	/* core decompressed for it, or empty */
+	time_t started;
+	uint64_t start_ns;
+};
+
+/* A signature analyzed so far, by the hash of its name */
+struct analyzed {
+	uint64_t hash;
+	char *core;		/* where */
+};
+
+struct analyze_ctx {
+	const struct hc_policy *pol;
+	struct hc_analyze_stats *stats;
+	struct analyzed *done;	/* open addressing on the hash */
+	size_t ndone, done_mask;
+	struct analyze_job running[ANALYZE_JOBS_MAX];
+	int nrunning;
+	int backing_off;
+};
+
+/* Print the path of name in the queue of core_dir, PATH_MAX bytes */
+static void queue_path(const char *core_dir, const char *name, char *path)
+{
+	snprintf(path, PATH_MAX, "%s/%s/%s", core_dir, HC_QUEUE_DIR, name);
+}
+
+static const char *analyzed_core(struct analyze_ctx *ctx, uint64_t hash)
+{
+	size_t i;
+
+	for (i = hash & ctx->done_mask; ctx->done[i].core;
+	     i = (i + 1) & ctx->done_mask) {
+		if (ctx->done[i].hash == hash)
+			return ctx->done[i].core;
+	}
+	return NULL;
+}
+
+static int analyzed_add(struct analyze_ctx *ctx, uint64_t hash,
+			const char *core)
+{
+	size_t i;
+
+	if (2 * (ctx->ndone + 1) > ctx->done_mask + 1) {
+		size_t n = (ctx->done_mask + 1) * 2, j;
+		struct analyzed *done = calloc(n, sizeof(*done));
+		if (!done)
+			return -ENOMEM;
+		for (j = 0; j <= ctx->done_mask; ++j) {
+			if (!ctx->done[j].core)
+				continue;
+			for (i = ctx->done[j].hash & (n - 1); done[i].core;
+			     i = (i + 1) & (n - 1))
+				;
+			done[i] = ctx->done[j];
+		}
+		free(ctx->done);
+		ctx->done = done;
+		ctx->done_mask = n - 1;
+	}
+	for (i = hash & ctx->done_mask; ctx->done[i].core;
+	     i = (i + 1) & ctx->done_mask) {
+		if (ctx->done[i].hash == hash)
+			return 0;
+	}
+	ctx->done[i].core = strdup(core);
+	if (!ctx->done[i].core)
+		return -ENOMEM;
+	ctx->done[i].hash = hash;
+	ctx->ndone++;
+	return 0;
+}
+
+/* .analyzed is lines of signature, a tab and the core it was analyzed in */
+static int analyzed_load(struct analyze_ctx *ctx)
+{
+	char path[PATH_MAX], *line = NULL, *tab;
+	size_t alloc = 0;
+	ssize_t len;
+	FILE *fp;
+	int ret = 0;
+
+	ctx->done_mask = 63;
+	ctx->done = calloc(ctx->done_mask + 1, sizeof(*ctx->done));
+	if (!ctx->done)
+		return -ENOMEM;
+	queue_path(ctx->pol->core_dir, ANALYZED_NAME, path);
+	fp = fopen(path, "re");
+	if (!fp)
+		return errno == ENOENT ? 0 : -errno;
+	while (ret == 0 && (len = getline(&line, &alloc, fp)) > 0) {
+		if (line[len - 1] == '\n')
+			line[len - 1] = '\0';
+		tab = strrchr(line, '\t');
+		if (!tab)
+			continue;
+		*tab = '\0';
+		ret = analyzed_add(ctx, hc_hash64(line, strlen(line)),
+				   tab + 1);
+	}
+	free(line);
+	fclose(fp);
+	return ret;
+}
+
+static void analyzed_free(struct analyze_ctx *ctx)
+{
+	size_t i;
+
+	for (i = 0; ctx->done && i <= ctx->done_mask; ++i)
+		free(ctx->done[i].core);
+	free(ctx->done);
+}
+
+static int analyzed_append(struct analyze_ctx *ctx,
+			   const struct analyze_job *job)
+{
+	char path[PATH_MAX], line[HC_SIG_MAX + NAME_MAX + 3];
+	int fd, len, ret = 0;
+
+	queue_path(ctx->pol->core_dir, ANALYZED_NAME, path);
+	fd = open(path, O_WRONLY | O_APPEND | O_CREAT | O_CLOEXEC, 0644);
+	if (fd < 0)
+		return -errno;
+	len = snprintf(line, sizeof(line), "%s\t%s\n", job->sig, job->core);
+	if (write(fd, line, len) != len)
+		ret = errno ? -errno : -EIO;
+	close(fd);
+	if (ret == 0)
+		ret = analyzed_add(ctx, job->sig_hash, job->core);
+	return ret;
+}
+
+int hc_analyze_enqueue(const struct hc_policy *pol, const struct hc_record *rec)
+{
+	char name[NAME_MAX + 32], tmp[PATH_MAX], path[PATH_MAX], *line;
+	int fd, len, ret = 0;
+
+	queue_path(pol->core_dir, "", path);
+	if (mkdir(path, 0755) && errno != EEXIST)
+		return -errno;
+	/* Crashes without a function get no signature, and no dedup */
+	len = asprintf(&line, "job\tcore=%s\texe=%s\tsig=%s%s%s\n", rec->core,
+		       rec->exe, rec->func[0] ? rec->exe : "",
+		       rec->func[0] ? ":" : "", rec->func);
+	if (len < 0)
+		return -ENOMEM;
+	/* Named so that they sort in the order they arrived, and complete
+	 * before they appear */
+	queue_path(pol->core_dir, ".job.XXXXXX", tmp);
+	snprintf(name, sizeof(name), "%010lld.%s", (long long)rec->time,
+		 rec->core);
+	queue_path(pol->core_dir, name, path);
+	fd = mkostemp(tmp, O_CLOEXEC);
+	if (fd < 0) {
+		ret = -errno;
+		goto out;
+	}
+	ret = hc_write_all(fd, line, len);
+	if (close(fd) && !ret)
+		ret = -errno;
+	if (ret == 0 && rename(tmp, path))
+		ret = -errno;
+	if (ret)
+		unlink(tmp);
+out:
+	free(line);
+	return ret;
+}
+
+/* Fill in job from its file. Returns -EAGAIN for files that aren't jobs. */
+static int job_read(struct analyze_ctx *ctx, const char *name,
+		    struct analyze_job *job)
+{
+	char path[PATH_MAX], buf[HC_SIG_MAX + HC_EXE_NAME_MAX + NAME_MAX + 64];
+	char *field, *save;
+	ssize_t len;
+	int fd;
+
+	memset(job, 0, sizeof(*job));
+	job->out_fd = -1;
+	if (name[0] == '.')
+		return -EAGAIN;
+	queue_path(ctx->pol->core_dir, name, path);
+	fd = open(path, O_RDONLY | O_CLOEXEC);
+	if (fd < 0)
+		return -errno;
+	len = read(fd, buf, sizeof(buf) - 1);
+	close(fd);
+	if (len <= 0 || buf[len - 1] != '\n')
+		return -EAGAIN;
+	buf[len - 1] = '\0';
+	hc_strlcpy(job->name, name, sizeof(job->name));
+	for (field = strtok_r(buf, "\t", &save); field;
+	     field = strtok_r(NULL, "\t", &save)) {
+		if (!strncmp(field, "core=", 5))
+			hc_strlcpy(job->core, field + 5, sizeof(job->core));
+		else if (!strncmp(field, "exe=", 4))
+			hc_strlcpy(job->exe, field + 4, sizeof(job->exe));
+		else if (!strncmp(field, "sig=", 4))
+			hc_strlcpy(job->sig, field + 4, sizeof(job->sig));
+	}
+	if (!job->core[0])
+		return -EAGAIN;
+	if (job->sig[0])
+		job->sig_hash = hc_hash64(job->sig, strlen(job->sig));
+	return 0;
+}
+
+static void job_remove(struct analyze_ctx *ctx, const struct analyze_job *job)
+{
+	char path[PATH_MAX];
+
+	queue_path(ctx->pol->core_dir, job->name, path);
+	unlink(path);
+}
+
+/* Where the core of job is stored now, which thinning may have changed */
+static int job_core_path(struct analyze_ctx *ctx, const struct analyze_job *job,
+			 char *path)
+{
+	const char *sfx[] = { "", HC_HCZ_SUFFIX, HC_MINI_SUFFIX };
+	unsigned i;
+
+	for (i = 0; i < sizeof(sfx) / sizeof(sfx[0]); ++i) {
+		snprintf(path, PATH_MAX, "%s/%s%s", ctx->pol->core_dir,
+			 job->core, sfx[i]);
+		if (access(path, F_OK) == 0)
+			return 0;
+	}
+	return -ENOENT;
+}
+
+/* Analyzers want an ELF core; give them a compressed one decompressed */
+static int job_decompress(struct analyze_ctx *ctx, struct analyze_job *job,
+			  char *path)
+{
+	struct hc_core_file *cf;
+	unsigned char *buf;
+	uint64_t off;
+	ssize_t n;
+	int fd, ret;
+
+	ret = hc_core_open(path, &cf);
+	if (ret)
+		return ret;
+	if (!hc_core_is_compressed(cf)) {
+		hc_core_close(cf);
+		return 0;
+	}
+	snprintf(job->tmp, sizeof(job->tmp), "%s/.analyze.XXXXXX",
+		 ctx->pol->core_dir);
+	fd = mkostemp(job->tmp, O_CLOEXEC);
+	buf = malloc(HC_HCZ_FRAME_SIZE);
+	if (fd < 0 || !buf) {
+		ret = fd < 0 ? -errno : -ENOMEM;
+		goto out;
+	}
+	for (off = 0; off < hc_core_size(cf) && !ret; off += n) {
+		n = hc_core_pread(cf, buf, HC_HCZ_FRAME_SIZE, off);
+		if (n <= 0)
+			ret = n ? n : -EIO;
+		else if (!hc_is_zero(buf, n) && pwrite(fd, buf, n, off) != n)
+			ret = errno ? -errno : -EIO;
+	}
+	if (ret == 0 && ftruncate(fd, off))
+		ret = -errno;
+	hc_strlcpy(path, job->tmp, PATH_MAX);
+out:
+	if (fd >= 0)
+		close(fd);
+	if (ret) {
+		unlink(job->tmp);
+		job->tmp[0] = '\0';
+	}
+	free(buf);
+	hc_core_close(cf);
+	return ret;
+}
+
+static int job_start(struct analyze_ctx *ctx, struct analyze_job *job)
+{
+	const struct hc_analyze_policy *a = &ctx->pol->analyze;
+	char path[PATH_MAX], out[PATH_MAX];
+	int ret, null_fd;
+
+	ret = job_core_path(ctx, job, path);
+	if (ret == 0)
+		ret = job_decompress(ctx, job, path);
+	if (ret)
+		return ret;
+	queue_path(ctx->pol->core_dir, ".out.XXXXXX", out);
+	job->out_fd = mkostemp(out, O_CLOEXEC);
+	if (job->out_fd < 0) {
+		ret = -errno;
+		goto fail;
+	}
+	unlink(out);
+	job->pid = fork();
+	if (job->pid < 0) {
+		ret = -errno;
+		goto fail;
+	}
+	if (job->pid == 0) {
+		/* In a group of its own, so a timeout kills all of it */
+		setpgid(0, 0);
+		hc_set_priority(a->nice, a->ioprio);
+		null_fd = open("/dev/null", O_RDONLY);
+		if (null_fd >= 0)
+			dup2(null_fd, STDIN_FILENO);
+		dup2(job->out_fd, STDOUT_FILENO);
+		dup2(job->out_fd, STDERR_FILENO);
+		execl("/bin/sh", "sh", "-c", a->command, "handle_core", path,
+		      job->exe, (char *)NULL);
+		_exit(127);
+	}
+	job->started = time(NULL);
+	job->start_ns = hc_now_ns();
+	return 0;
+fail:
+	if (job->out_fd >= 0)
+		close(job->out_fd);
+	if (job->tmp[0])
+		unlink(job->tmp);
+	return ret;
+}
+
+/* Copy what the analyzer printed into the sidecar, a line at a time, in one
+ * write so that the lines stay together */
+static void job_output(struct analyze_ctx *ctx, struct analyze_job *job)
+{
+	char *buf, *out = NULL, *line, *nl;
+	size_t olen = 0, nlines = 1, n;
+	ssize_t len, i;
+
+	buf = malloc(ANALYZE_OUTPUT_MAX + 1);
+	if (!buf)
+		goto out;
+	len = pread(job->out_fd, buf, ANALYZE_OUTPUT_MAX, 0);
+	if (len <= 0)
+		goto out;
+	buf[len] = '\0';
+	/* Each line grows by its prefix and a newline */
+	for (i = 0; i < len; ++i)
+		nlines += buf[i] == '\n';
+	out = malloc(len + nlines * (sizeof(OUTPUT_PREFIX) + 1) +
+		     sizeof(OUTPUT_TRUNCATED));
+	if (!out)
+		goto out;
+	for (line = buf; *line; line = nl) {
+		char *p;
+		nl = strchrnul(line, '\n');
+		n = nl - line;
+		if (*nl)
+			*nl++ = '\0';
+		/* Tabs separate fields */
+		for (p = line; *p; ++p)
+			if (*p == '\t')
+				*p = ' ';
+		if (olen)
+			out[olen++] = '\n';
+		memcpy(out + olen, OUTPUT_PREFIX, sizeof(OUTPUT_PREFIX) - 1);
+		olen += sizeof(OUTPUT_PREFIX) - 1;
+		memcpy(out + olen, line, n);
+		olen += n;
+	}
+	if (len == ANALYZE_OUTPUT_MAX) {
+		memcpy(out + olen, OUTPUT_TRUNCATED,
+		       sizeof(OUTPUT_TRUNCATED) - 1);
+		olen += sizeof(OUTPUT_TRUNCATED) - 1;
+	}
+	hc_sidecar_printf(ctx->pol->core_dir, job->core, "%.*s", (int)olen,
+			  out);
+out:
+	free(buf);
+	free(out);
+}
+
+static void job_finish(struct analyze_ctx *ctx, struct analyze_job *job,
+		       int status, int timed_out)
+{
+	uint64_t ms = (hc_now_ns() - job->start_ns) / 1000000;
+	char result[64];
+	int ok = 0;
+
+	if (timed_out)
+		snprintf(result, sizeof(result), "status=timeout");
+	else if (WIFSIGNALED(status))
+		snprintf(result, sizeof(result), "status=killed\tsignal=%d",
+			 WTERMSIG(status));
+	else if (WEXITSTATUS(status))
+		snprintf(result, sizeof(result), "status=failed\texit=%d",
+			 WEXITSTATUS(status));
+	else
+		ok = snprintf(result, sizeof(result), "status=ok");
+	job_output(ctx, job);
+	hc_sidecar_printf(ctx->pol->core_dir, job->core, "analysis\t%s\t"
+			  "ms=%llu\tsig=%s", result, (unsigned long long)ms,
+			  job->sig);
+	hc_log(ok ? LOG_INFO : LOG_WARNING, "analyzed", "core=\"%s\" %s "
+	       "ms=%llu", job->core, result, (unsigned long long)ms);
+	if (ok && job->sig[0])
+		analyzed_append(ctx, job);
+	if (ok)
+		ctx->stats->analyzed++;
+	else
+		ctx->stats->failed++;
+	close(job->out_fd);
+	if (job->tmp[0])
+		unlink(job->tmp);
+	/* A failure isn't retried; the next core of its signature is
+	 * analyzed instead */
+	job_remove(ctx, job);
+}
+
+/* Collect analyzers which have finished, and kill those out of time */
+static void analyze_reap(struct analyze_ctx *ctx)
+{
+	time_t now = time(NULL);
+	int i, status;
+
+	for (i = 0; i < ctx->nrunning; ) {
+		struct analyze_job *job = &ctx->running[i];
+		int timed_out = now - job->started > ANALYZE_TIMEOUT;
+		if (timed_out)
+			kill(-job->pid, SIGKILL);
+		if (waitpid(job->pid, &status, timed_out ? 0 : WNOHANG) <= 0) {
+			++i;
+			continue;
+		}
+		job_finish(ctx, job, status, timed_out);
+		*job = ctx->running[--ctx->nrunning];
+	}
+}
+
+/* Whether any of the some avg10 pressures is over the limit */
+static int analyze_pressure(const struct analyze_ctx *ctx)
+{
+	const char *res[] = { "cpu", "io", "memory" };
+	char path[64], line[256];
+	double avg10;
+	unsigned i;
+	FILE *fp;
+	int over = 0;
+
+	if (!ctx->pol->analyze.psi_limit)
+		return 0;
+	for (i = 0; i < sizeof(res) / sizeof(res[0]) && !over; ++i) {
+		snprintf(path, sizeof(path), "/proc/pressure/%s", res[i]);
+		fp = fopen(path, "re");
+		if (!fp)
+			continue;
+		if (fgets(line, sizeof(line), fp) &&
+		    sscanf(line, "some avg10=%lf", &avg10) == 1 &&
+		    avg10 > ctx->pol->analyze.psi_limit)
+			over = 1;
+		fclose(fp);
+	}
+	return over;
+}
+
+static int job_running(const struct analyze_ctx *ctx, const char *name,
+		       uint64_t sig_hash)
+{
+	int i;
+
+	for (i = 0; i < ctx->nrunning; ++i) {
+		if ((name && !strcmp(ctx->running[i].name, name)) ||
+		    (sig_hash && ctx->running[i].sig_hash == sig_hash))
+			return 1;
+	}
+	return 0;
+}
+
+static int cmp_name(const void *a, const void *b)
+{
+	return strcmp(*(char *const *)a, *(char *const *)b);
+}
+
+/* Go through the queue in order, starting analyzers in the free slots.
+ * Returns the number of jobs left waiting, or a negative errno. */
+static int analyze_pass(struct analyze_ctx *ctx, int jobs)
+{
+	char path[PATH_MAX], **names = NULL, **tmp;
+	size_t n = 0, alloc = 0, i;
+	struct analyze_job job;
+	struct dirent *de;
+	const char *of;
+	int waiting = 0, ret;
+	DIR *dp;
+
+	queue_path(ctx->pol->core_dir, "", path);
+	dp = opendir(path);
+	if (!dp)
+		return -errno;
+	while ((de = readdir(dp))) {
+		if (de->d_name[0] == '.')
+			continue;
+		if (n == alloc) {
+			alloc = alloc ? alloc * 2 : 64;
+			tmp = realloc(names, alloc * sizeof(*names));
+			if (!tmp)
+				break;
+			names = tmp;
+		}
+		names[n] = strdup(de->d_name);
+		if (!names[n])
+			break;
+		n++;
+	}
+	closedir(dp);
+	if (n)
+		qsort(names, n, sizeof(*names), cmp_name);
+
+	for (i = 0; i < n; ++i) {
+		if (job_running(ctx, names[i], 0) ||
+		    job_read(ctx, names[i], &job))
+			continue;
+		of = job.sig[0] ? analyzed_core(ctx, job.sig_hash) : NULL;
+		if (of) {
+			hc_sidecar_printf(ctx->pol->core_dir, job.core,
+					  "analysis\tstatus=duplicate\t"
+					  "of=%s\tsig=%s", of, job.sig);
+			ctx->stats->duplicates++;
+			job_remove(ctx, &job);
+			continue;
+		}
+		/* Wait for the first of a signature to finish before
+		 * deciding whether the rest need analyzing */
+		if (ctx->nrunning >= jobs || ctx->backing_off ||
+		    job_running(ctx, NULL, job.sig_hash)) {
+			waiting++;
+			continue;
+		}
+		ret = job_start(ctx, &job);
+		if (ret == -ENOENT) {
+			ctx->stats->gone++;
+			job_remove(ctx, &job);
+		}
+		else if (ret) {
+			hc_log(LOG_ERR, "analyze_failed", "core=\"%s\" err=%d",
+			       job.core, -ret);
+			ctx->stats->failed++;
+			job_remove(ctx, &job);
+		}
+		else {
+			ctx->running[ctx->nrunning++] = job;
+		}
+	}
+	for (i = 0; i < n; ++i)
+		free(names[i]);
+	free(names);
+	return waiting;
+}
+
+static int analyze_drain(struct analyze_ctx *ctx)
+{
+	int jobs = ctx->pol->analyze.jobs, waiting, over;
+
+	if (jobs < 1)
+		jobs = 1;
+	if (jobs > ANALYZE_JOBS_MAX)
+		jobs = ANALYZE_JOBS_MAX;
+	while (1) {
+		analyze_reap(ctx);
+		over = analyze_pressure(ctx);
+		if (over && !ctx->backing_off)
+			ctx->stats->backoffs++;
+		ctx->backing_off = over;
+		waiting = analyze_pass(ctx, jobs);
+		if (waiting < 0)
+			return waiting;
+		if (waiting == 0 && ctx->nrunning == 0)
+			return 0;
+		usleep(ANALYZE_TICK_US);
+	}
+}
+
+/* Whether anything is queued */
+static int analyze_pending(const char *core_dir)
+{
+	char queue[PATH_MAX];
+	struct dirent *de;
+	DIR *dp;
+	int found = 0;
+
+	queue_path(core_dir, "", queue);
+	dp = opendir(queue);
+	if (!dp)
+		return 0;
+	while (!found && (de = readdir(dp)))
+		found = de->d_name[0] != '.';
+	closedir(dp);
+	return found;
+}
+
+int hc_analyze_run(const struct hc_policy *pol, struct hc_analyze_stats *stats)
+{
+	struct hc_analyze_stats st_buf;
+	struct analyze_ctx ctx;
+	char path[PATH_MAX];
+	int lock_fd, drained = 0, ret;
+
+	if (!stats)
+		stats = &st_buf;
+	memset(stats, 0, sizeof(*stats));
+	if (!pol->analyze.command)
+		return -EINVAL;
+	memset(&ctx, 0, sizeof(ctx));
+	ctx.pol = pol;
+	ctx.stats = stats;
+	queue_path(pol->core_dir, "", path);
+	if (mkdir(path, 0755) && errno != EEXIST)
+		return -errno;
+	queue_path(pol->core_dir, LOCK_NAME, path);
+	lock_fd = open(path, O_RDWR | O_CREAT | O_CLOEXEC, 0644);
+	if (lock_fd < 0)
+		return -errno;
+	ret = analyzed_load(&ctx);
+	/* A job queued just as the worker finished would otherwise wait for
+	 * the next crash: look again once the lock has been let go */
+	while (ret == 0) {
+		if (flock(lock_fd, LOCK_EX | LOCK_NB)) {
+			ret = drained ? 0 : -EBUSY;
+			break;
+		}
+		ret = analyze_drain(&ctx);
+		drained = 1;
+		flock(lock_fd, LOCK_UN);
+		if (!analyze_pending(pol->core_dir))
+			break;
+	}
+	analyzed_free(&ctx);
+	close(lock_fd);
+	return ret;
+}
+
+int hc_analyze_background(const struct hc_policy *pol)
+{
+	struct hc_analyze_stats st;
+	int ret;
+
+	ret = hc_fork_background();
+	if (ret != 0)
+		return ret < 0 ? ret : 0;
+	ret = hc_analyze_run(pol, &st);
+	if (ret && ret != -EBUSY)
+		hc_log(LOG_ERR, "analyze_failed", "dir=\"%s\" err=%d",
+		       pol->core_dir, -ret);
+	else if (!ret)
+		hc_log(LOG_INFO, "analyzed_queue", "dir=\"%s\" analyzed=%llu "
+		       "failed=%llu duplicates=%llu gone=%llu backoffs=%llu",
+		       pol->core_dir, (unsigned long long)st.analyzed,
+		       (unsigned long long)st.failed,
+		       (unsigned long long)st.duplicates,
+		       (unsigned long long)st.gone,
+		       (unsigned long long)st.backoffs);
+	_exit(0);
+}
@@ -0,0 +1,145 @@
+#include <fcntl.h>
+#include <stdio.h>
+#include <stdlib.h>
+#include <string.h>
+#include <unistd.h>
+#include <zlib.h>
+#if defined(__x86_64__) || defined(__i386__)
+#include <x86intrin.h>
+#endif
+
+#include "hc_private.h"
+
+/*
+ * Micro-benchmark of the ingest stages
+ *
+ * Runs each step of storing a core in the .hcz format on its own, the old
+ * way of running them one after the other over whole frames, and the fused
+ * writer, over a synthetic core with a realistic mix of zero, compressible
+ * and random pages. Results are in bytes per TSC cycle where there is a TSC.
+ *
+ * Usage: hc_bench [megabytes]
+ */
+
+#define PAGE 4096
+
+static uint64_t cycles(void)
+{
+#if defined(__x86_64__) || defined(__i386__)
+	return __rdtsc();
+#else
+	return hc_now_ns();
+#endif
+}
+
+/* Half zero pages, a third compressible, the rest random */
+static void fill(unsigned char *buf, size_t len)
+{
+	size_t off, i;
+	uint32_t x = 1;
+
+	for (off = 0; off < len; off += PAGE) {
+		int kind = (off / PAGE * 7919) % 6;
+		unsigned char *p = buf + off;
+		if (kind < 3) {
+			memset(p, 0, PAGE);
+		}
+		else if (kind < 5) {
+			for (i = 0; i < PAGE; i += 8)
+				snprintf((char *)p + i, 9, "%07zu ", (off + i) % 4099);
+		}
+		else {
+			for (i = 0; i < PAGE; ++i) {
+				x = x * 1103515245 + 12345;
+				p[i] = x >> 16;
+			}
+		}
+	}
+}
+
+static void report(const char *name, size_t len, uint64_t c, uint64_t ns)
+{
+	printf("%-22s %8.3f bytes/cycle %8.2f GB/s\n", name,
+	       (double)len / c, (double)len / ns);
+}
+
+int main(int argc, char **argv)
+{
+	size_t len = (argc > 1 ? strtoull(argv[1], NULL, 10) : 256) << 20;
+	size_t frame = HC_HCZ_FRAME_SIZE, off;
+	unsigned char *src, *zero, *dst, *cbuf;
+	uLongf cbuf_len = compressBound(frame), clen;
+	struct hc_hcz_writer *w;
+	uint64_t c, t, sink = 0;
+	int fd, pass;
+
+	len -= len % frame;
+	src = malloc(len);
+	zero = malloc(len);
+	dst = malloc(frame);
+	cbuf = malloc(cbuf_len);
+	fd = open("/dev/null", O_WRONLY);
+	if (!src || !zero || !dst || !cbuf || fd < 0 || len == 0) {
+		fprintf(stderr, "hc_bench: setup failed\n");
+		return 1;
+	}
+	fill(src, len);
+	/* The zero check stops at the first non-zero byte, so it is only
+	 * measured where it has to read everything. Written, so that the pages
+	 * aren't all the one shared zero page. */
+	memset(zero, 0, len);
+	printf("%zu MiB, %zu KiB frames\n", len >> 20, frame >> 10);
+	for (pass = 0; pass < 7; ++pass) {
+		const char *name;
+		t = hc_now_ns();
+		c = cycles();
+		for (off = 0; off < len && pass < 6; off += frame) {
+			const unsigned char *p = src + off;
+			switch (pass) {
+			case 0:
+				memcpy(dst, p, frame);
+				break;
+			case 1:
+				sink += hc_is_zero(zero + off, frame);
+				break;
+			case 2:
+				sink += hc_hash64(p, frame);
+				break;
+			case 3:
+				sink += crc32(0, p, frame);
+				break;
+			case 4:
+				clen = cbuf_len;
+				compress2(cbuf, &clen, p, frame, HC_HCZ_LEVEL);
+				break;
+			case 5:
+				/* What the writer used to do with each frame */
+				memcpy(dst, p, frame);
+				sink += hc_hash64(dst, frame);
+				if (hc_is_zero(dst, frame))
+					break;
+				clen = cbuf_len;
+				compress2(cbuf, &clen, dst, frame, HC_HCZ_LEVEL);
+				break;
+			}
+		}
+		if (pass == 6) {
+			if (hc_hcz_writer_open(&w, fd, HC_HCZ_LEVEL) ||
+			    hc_hcz_write(w, src, len) ||
+			    hc_hcz_writer_close(w, NULL))
+				return 1;
+		}
+		c = cycles() - c;
+		t = hc_now_ns() - t;
+		name = (const char *[]){ "copy", "zero check (zeroes)", "hash",
+					 "crc32 (reference)", "deflate",
+					 "separate passes", "fused writer" }[pass];
+		report(name, len, c, t);
+	}
+	close(fd);
+	free(src);
+	free(zero);
+	free(dst);
+	free(cbuf);
+	return sink == 42;
+}
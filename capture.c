@@ -0,0 +1,523 @@
+#define _GNU_SOURCE
+#include <errno.h>
+#include <fcntl.h>
+#include <limits.h>
+#include <stdio.h>
+#include <stdlib.h>
+#include <string.h>
+#include <sys/stat.h>
+#include <syslog.h>
+#include <time.h>
+#include <unistd.h>
+
+#include "handle_core.h"
+#include "hc_private.h"
+
+void hc_policy_init(struct hc_policy *pol)
+{
+	memset(pol, 0, sizeof(*pol));
+	pol->core_dir = "/var/core";
+	pol->max_cores = 10;
+	pol->analyze.jobs = 1;
+	pol->analyze.nice = 19;
+	pol->analyze.ioprio = HC_IOPRIO_IDLE;
+	pol->analyze.psi_limit = 40;
+}
+
+void hc_core_name(const char *core_dir, const char *exe_name, time_t now,
+		  char *core_name)
+{
+	struct tm *tm;
+	struct tm tm_buf;
+	tm = localtime_r(&now, &tm_buf);
+	snprintf(core_name, PATH_MAX, "%s/core.%d-%lld-%lld_%lld.%s", core_dir,
+			tm->tm_year + 1900, (long long)tm->tm_mon, (long long)tm->tm_mday,
+			(long long)now, exe_name);
+}
+
+struct ingest_early {
+	struct hc_notifier *notifier;
+	const struct hc_crash *crash;
+	const struct hc_policy *pol;
+	const struct hc_record *rec;
+	const struct hc_input *in;
+	struct hc_mini_writer *mini;
+	struct hc_failover *failover;
+	struct hc_pagehash *pages;
+};
+
+static void ingest_parsed(const struct hc_stream *s, void *arg)
+{
+	struct ingest_early *early = arg;
+	const struct hc_input *in = early->in;
+	int ret;
+
+	hc_log(LOG_NOTICE, "crash", "exe=\"%s\" pid=%d signal=%d threads=%u "
+	       "size=%llu", early->crash->exe_name,
+	       (int)(early->crash->pid ? early->crash->pid : s->meta.pid),
+	       early->crash->signo ? early->crash->signo : s->meta.signo,
+	       s->meta.nthreads, (unsigned long long)s->meta.expected_size);
+	hc_notify_early(early->notifier, early->crash, &s->meta);
+	if (hc_pagehash_new(&s->meta, &early->pages))
+		hc_log(LOG_ERR, "pagehash_failed", "core=\"%s\" err=%d",
+		       early->rec->core, ENOMEM);
+	if (!early->pol->early_minicore)
+		return;
+	ret = hc_mini_writer_open(early->pol, early->rec->core, s->raw,
+				  s->raw_len, &s->meta,
+				  in->regular ? in->fd : -1, in->start,
+				  &early->mini);
+	if (ret) {
+		hc_log(LOG_ERR, "minicore_failed", "core=\"%s\" err=%d",
+		       early->rec->core, -ret);
+	}
+}
+
+/* Hash the pages of the core as they go past, and follow it with the
+ * minicore, publishing that as soon as it has all it needs */
+static void ingest_data(const struct hc_stream *s, uint64_t pos,
+			const void *buf, size_t len, void *arg)
+{
+	struct ingest_early *early = arg;
+	const char *core = early->rec->core;
+	char path[PATH_MAX];
+	uint64_t size, ms;
+	int ret;
+
+	(void)s;
+	if (early->pages)
+		hc_pagehash_feed(early->pages, pos, buf, len);
+	if (!early->mini)
+		return;
+	/* The minicore would be left behind on the disk the core fled */
+	if (early->failover &&
+	    hc_failover_dir(early->failover) != early->pol->core_dir) {
+		hc_mini_writer_close(early->mini);
+		early->mini = NULL;
+		hc_log(LOG_ERR, "minicore_failed", "core=\"%s\" err=%d",
+		       core, EXDEV);
+		return;
+	}
+	ret = hc_mini_writer_feed(early->mini, pos, buf, len);
+	if (ret == 0)
+		return;
+	if (ret > 0)
+		ret = hc_mini_writer_finish(early->mini, &size, &ms);
+	else
+		hc_mini_writer_close(early->mini);
+	early->mini = NULL;
+	if (ret) {
+		hc_log(LOG_ERR, "minicore_failed", "core=\"%s\" err=%d",
+		       core, -ret);
+		return;
+	}
+	hc_mini_path(early->pol->core_dir, core, path);
+	hc_sidecar_printf(early->pol->core_dir, core, "minicore\tbytes=%llu\t"
+			  "ms=%llu\tat=%llu", (unsigned long long)size,
+			  (unsigned long long)ms,
+			  (unsigned long long)(pos + len));
+	hc_log(LOG_NOTICE, "minicore", "core=\"%s\" path=\"%s\" bytes=%llu "
+	       "ms=%llu", core, path, (unsigned long long)size,
+	       (unsigned long long)ms);
+	hc_notify_minicore(early->notifier, early->crash->exe_name, path,
+			   size);
+}
+
+/* Store the input with its duplicate threads left out, compressing it
+ * afterwards if asked to: the deduplicated core is written sparse and
+ * out of order, which the .hcz writer can't follow. */
+static int ingest_dedup(const struct hc_policy *pol, struct hc_input *in,
+			int fd, struct hc_record *rec, struct hc_dedup **d)
+{
+	char tmp[PATH_MAX];
+	struct hc_core_file *cf;
+	struct hc_hcz_stats st;
+	struct stat sb;
+	int tmp_fd, ret;
+
+	if (!pol->compress) {
+		ret = hc_input_dedup(in, fd, d, &rec->size);
+		if (ret == 0 && fstat(fd, &sb) == 0)
+			rec->stored = (uint64_t)sb.st_blocks * 512;
+		return ret;
+	}
+	snprintf(tmp, sizeof(tmp), "%s/.dedup.XXXXXX", pol->core_dir);
+	tmp_fd = mkostemp(tmp, O_CLOEXEC);
+	if (tmp_fd < 0)
+		return -errno;
+	unlink(tmp);
+	ret = hc_input_dedup(in, tmp_fd, d, &rec->size);
+	if (ret == 0) {
+		snprintf(tmp, sizeof(tmp), "/proc/self/fd/%d", tmp_fd);
+		ret = hc_core_open(tmp, &cf);
+	}
+	if (ret == 0) {
+		ret = hc_hcz_compress_core(cf, fd, &st);
+		hc_core_close(cf);
+		rec->stored = st.stored_size;
+		rec->form = HC_FORM_HCZ;
+		rec->hash = st.hash;
+	}
+	close(tmp_fd);
+	return ret;
+}
+
+static void ingest_integrity(const char *core_dir,
+			     const struct hc_record *rec,
+			     const struct hc_stream *s,
+			     const struct hc_integrity_report *ic)
+{
+	hc_integrity_sidecar(s, ic, core_dir, rec->core);
+	if (ic->status == HC_INTEGRITY_COMPLETE)
+		return;
+	hc_log(LOG_WARNING, "core_incomplete", "core=\"%s\" integrity=%s "
+	       "expected=%llu got=%llu segments=%u complete=%u", rec->core,
+	       hc_integrity_name(ic->status),
+	       (unsigned long long)ic->expected, (unsigned long long)ic->got,
+	       ic->nsegs, ic->complete);
+	if (ic->status != HC_INTEGRITY_UNVERIFIED)
+		hc_partial_add(core_dir, rec->core);
+}
+
+/* Keep the page hashes of the core for comparing it with others */
+static void ingest_pages(const char *core_dir, const struct hc_record *rec,
+			 const struct hc_pagehash *pages)
+{
+	int ret;
+
+	ret = hc_pagehash_write(pages, core_dir, rec->core);
+	if (ret) {
+		hc_log(LOG_ERR, "pagehash_failed", "core=\"%s\" err=%d",
+		       rec->core, -ret);
+		return;
+	}
+	hc_sidecar_printf(core_dir, rec->core, "pages\tsize=%u\tunknown=%llu",
+			  HC_PAGE_SIZE,
+			  (unsigned long long)hc_pagehash_unknown(pages));
+}
+
+/* Create the core file at path. If --prepare left reserve files, one is
+ * renamed into place instead, so a disk which has filled up since still
+ * takes the core; *reserved says so, and the file wants cutting down to the
+ * core's size. Deduplicated cores are written sparsely and don't fit one. */
+static int ingest_open(const struct hc_policy *pol, const char *path,
+		       int *reserved)
+{
+	struct hc_ready ready;
+	int fd;
+
+	*reserved = 0;
+	if (!pol->dedup_threads && hc_ready_read(pol->core_dir, &ready) == 0 &&
+	    ready.nreserve &&
+	    hc_reserve_take(pol->core_dir, &ready, path) == 0) {
+		fd = open(path, O_RDWR | O_CLOEXEC);
+		if (fd >= 0) {
+			*reserved = 1;
+			return fd;
+		}
+	}
+	/* Read back as well, should the core have to move */
+	return open(path, O_RDWR | O_CREAT | O_TRUNC | O_CLOEXEC, 0666);
+}
+
+/* hc_ingest(), announcing the crash through notifier as soon as its notes
+ * have gone past. *dir is set to the directory the core was written to. */
+static int ingest(const struct hc_policy *pol_in,
+		  const struct hc_crash *crash, int in_fd,
+		  struct hc_record *rec, struct hc_notifier *notifier,
+		  const char **dir)
+{
+	struct hc_policy here = *pol_in, *pol = &here;
+	struct ingest_early early = { notifier, crash, pol, rec, NULL, NULL,
+				      NULL, NULL };
+	struct hc_dedup *dedup = NULL;
+	struct hc_integrity_report ic;
+	char core_name[PATH_MAX];
+	struct hc_stream stream;
+	struct hc_input in;
+	const char *base;
+	int fd, tries, reserved, oversized = 0, ret = 0;
+
+	memset(rec, 0, sizeof(*rec));
+	time(&rec->time);
+	rec->pid = crash->pid;
+	rec->signo = crash->signo;
+	hc_strlcpy(rec->exe, crash->exe_name, sizeof(rec->exe));
+	/* Start out wherever writes have lately been going well, and move on
+	 * from a directory the core can't even be created in */
+	if (pol->nalt_dirs)
+		here.core_dir = hc_health_choose(pol_in);
+	for (tries = 0; ; ++tries) {
+		hc_core_name(pol->core_dir, crash->exe_name, rec->time,
+			     core_name);
+		if (pol->compress)
+			strncat(core_name, HC_HCZ_SUFFIX,
+				PATH_MAX - strlen(core_name) - 1);
+		base = strrchr(core_name, '/');
+		hc_strlcpy(rec->core, base ? base + 1 : core_name,
+			   sizeof(rec->core));
+		fd = ingest_open(pol, core_name, &reserved);
+		if (fd >= 0)
+			break;
+		ret = -errno;
+		hc_log(LOG_ERR, "open_failed", "path=\"%s\" err=%d",
+		       core_name, -ret);
+		if (!pol->nalt_dirs || tries == pol->nalt_dirs)
+			return ret;
+		hc_health_record(pol->core_dir, 0, 0, ret);
+		base = hc_health_choose(pol_in);
+		if (base == pol->core_dir)
+			return ret;
+		here.core_dir = base;
+	}
+	*dir = here.core_dir;
+	early.failover = hc_failover_new(pol_in, pol->core_dir, rec->core);
+	hc_stream_init(&stream);
+	stream.on_parsed = ingest_parsed;
+	stream.on_parsed_arg = &early;
+	stream.on_data = ingest_data;
+	stream.on_data_arg = &early;
+	early.in = &in;
+	hc_progress_begin(crash->exe_name);
+	ret = hc_input_init(&in, in_fd, &stream);
+	in.failover = early.failover;
+	hc_flight_record(HC_EV_ADMIT, ret, pol->compress, in.regular);
+	if (ret == 0 && pol->dedup_threads) {
+		ret = ingest_dedup(pol, &in, fd, rec, &dedup);
+	}
+	else if (ret == 0 && pol->compress) {
+		struct hc_hcz_stats st;
+		ret = hc_input_compress(&in, fd, &st);
+		rec->size = st.raw_size;
+		rec->stored = st.stored_size;
+		rec->form = HC_FORM_HCZ;
+		rec->hash = st.hash;
+	}
+	else if (ret == 0) {
+		ret = hc_input_copy(&in, fd, &rec->size);
+		rec->stored = rec->size;
+	}
+	if (ret == 0 && reserved && ftruncate(fd, rec->stored)) {
+		ret = -errno;
+		oversized = 1;
+	}
+	/* Compressed and deduplicated cores can't move mid-stream, but the
+	 * next capture can still stay away */
+	if (ret && early.failover && (pol->dedup_threads || pol->compress))
+		hc_health_record(pol->core_dir, 0, 0, ret);
+	if (ret) {
+		hc_log(LOG_ERR, "copy_failed", "path=\"%s\" err=%d",
+		       core_name, -ret);
+	}
+	hc_input_release(&in);
+	hc_progress_end();
+	/* A core which ended before the minicore had everything */
+	hc_mini_writer_close(early.mini);
+	/* Fill in what the caller didn't know from the core's own notes */
+	if (stream.state == HC_STREAM_PARSED) {
+		if (!rec->pid)
+			rec->pid = stream.meta.pid;
+		if (!rec->signo)
+			rec->signo = stream.meta.signo;
+	}
+	if (early.failover)
+		here.core_dir = *dir = hc_failover_dir(early.failover);
+	/* A core the kernel couldn't finish is still kept, but known for
+	 * what it is */
+	hc_stream_check(&stream, &ic);
+	rec->integrity = ic.status;
+	if (ret == 0)
+		ingest_integrity(pol->core_dir, rec, &stream, &ic);
+	hc_stream_free(&stream);
+	/* The core's own data; its name and index record are left to the
+	 * shared commit */
+	if (ret == 0 && pol->sync && fdatasync(fd))
+		ret = -errno;
+	if (close(fd) && !ret)
+		ret = -errno;
+	/* A reserve file left at its full size would pass for a core that
+	 * big, and its tail for part of it */
+	if (oversized) {
+		snprintf(core_name, sizeof(core_name), "%s/%s", pol->core_dir,
+			 rec->core);
+		unlink(core_name);
+	}
+	if (ret == 0 && dedup)
+		hc_dedup_sidecar(dedup, pol->core_dir, rec->core);
+	if (ret == 0 && early.failover)
+		hc_failover_sidecar(early.failover);
+	if (ret == 0 && early.pages)
+		ingest_pages(pol->core_dir, rec, early.pages);
+	hc_pagehash_free(early.pages);
+	hc_dedup_free(dedup);
+	hc_failover_free(early.failover);
+	return ret;
+}
+
+int hc_ingest(const struct hc_policy *pol, const struct hc_crash *crash,
+	      int in_fd, struct hc_record *rec)
+{
+	const char *dir;
+	int ret;
+
+	ret = ingest(pol, crash, in_fd, rec, NULL, &dir);
+	if (ret == 0 && dir != pol->core_dir)
+		hc_strlcpy(rec->dir, dir, sizeof(rec->dir));
+	return ret;
+}
+
+/* Record how long a phase took, and whether it failed, in the flight
+ * recorder. *t is the time the phase started and is advanced to now. */
+static void capture_phase(enum hc_phase phase, int err, uint64_t *t)
+{
+	uint64_t now = hc_now_ns();
+
+	if (err)
+		hc_flight_record(HC_EV_ERROR, err, phase, 0);
+	hc_flight_record(HC_EV_PHASE, 0, phase, now - *t);
+	*t = now;
+}
+
+static int capture_func(const struct hc_symbol *sym, void *arg)
+{
+	struct hc_record *rec = arg;
+
+	hc_symbol_format(sym, rec->func, sizeof(rec->func));
+	return 1;
+}
+
+/* Record the allocator's view of the heap while the core still has one */
+static void capture_heap(const char *core_dir, const struct hc_record *rec)
+{
+	struct hc_heap_stats st;
+	struct hc_core_meta meta;
+	struct hc_core_file *cf;
+	char path[PATH_MAX];
+	int ret;
+
+	snprintf(path, sizeof(path), "%s/%s", core_dir, rec->core);
+	ret = hc_core_open(path, &cf);
+	if (ret)
+		goto out;
+	ret = hc_core_meta_read(cf, &meta);
+	if (ret == 0) {
+		ret = hc_heap_stats(cf, &meta, &st);
+		hc_core_meta_free(&meta);
+	}
+	hc_core_close(cf);
+	if (ret == -ENOENT) {
+		hc_sidecar_printf(core_dir, rec->core,
+				  "heap\tallocator=unknown");
+		return;
+	}
+	if (ret == 0) {
+		ret = hc_heap_sidecar(&st, core_dir, rec->core);
+		hc_log(LOG_INFO, "heap_stats", "core=\"%s\" arenas=%u "
+		       "in_use=%llu free=%llu partial=%d ms=%llu", rec->core,
+		       st.narenas, (unsigned long long)st.in_use,
+		       (unsigned long long)st.free_bytes, st.partial,
+		       (unsigned long long)st.ms);
+		hc_heap_free(&st);
+	}
+out:
+	if (ret) {
+		hc_log(LOG_ERR, "heap_stats_failed", "core=\"%s\" err=%d",
+		       rec->core, -ret);
+	}
+}
+
+int hc_capture(const struct hc_policy *pol_in, const struct hc_crash *crash,
+	       int in_fd, struct hc_record *rec)
+{
+	struct hc_policy here = *pol_in, *pol = &here;
+	char path[PATH_MAX];
+	struct hc_notifier *notifier;
+	struct hc_record rec_buf;
+	uint64_t start, t;
+	int deleted, ret, synced = 0;
+
+	if (!rec)
+		rec = &rec_buf;
+	hc_flight_open(crash->exe_name);
+	start = t = hc_now_ns();
+	hc_flight_record(HC_EV_START, 0, crash->pid, crash->signo);
+	notifier = hc_notifier_new(pol);
+	ret = ingest(pol_in, crash, in_fd, rec, notifier, &here.core_dir);
+	capture_phase(HC_PHASE_INGEST, ret, &t);
+	if (ret) {
+		hc_notify_done(notifier, pol->core_dir, rec, ret);
+		hc_notifier_finish(notifier);
+		hc_flight_record(HC_EV_EXIT, ret, hc_now_ns() - start, 0);
+		return ret;
+	}
+
+	/* Where the crashing thread was. The first crash of a new build only
+	 * starts building its symbol table. */
+	snprintf(path, sizeof(path), "%s/%s", pol->core_dir, rec->core);
+	ret = hc_symbolize(pol->core_dir, path, HC_SYM_BUILD_BG, capture_func,
+			   rec);
+	capture_phase(HC_PHASE_SYMBOLIZE, ret < 0 ? ret : 0, &t);
+	if (pol->heap_stats)
+		capture_heap(pol->core_dir, rec);
+
+	ret = hc_index_append(pol->core_dir, rec);
+	if (ret) {
+		hc_log(LOG_ERR, "index_failed", "core=\"%s\" err=%d",
+		       rec->core, -ret);
+	}
+	else if (pol->sync) {
+		/* hc_commit() logs its own failures */
+		ret = synced = hc_commit(pol->core_dir);
+	}
+	/* Leave a pointer to a core which went elsewhere where it would have
+	 * been looked for. The disk may be failing, so this may not get far. */
+	if (pol->core_dir != pol_in->core_dir) {
+		struct hc_record ptr = *rec;
+		hc_strlcpy(ptr.dir, pol->core_dir, sizeof(ptr.dir));
+		hc_index_append(pol_in->core_dir, &ptr);
+	}
+	capture_phase(HC_PHASE_INDEX, ret, &t);
+	hc_notify_done(notifier, pol->core_dir, rec, 0);
+
+	/* Make sure we don't have too many cores sitting around. Thinning
+	 * rewrites old cores, which is too slow to do while the kernel waits,
+	 * so it runs in the background. */
+	deleted = -ENOSYS;
+	if (hc_thin_enabled(pol))
+		deleted = hc_thin_background(pol);
+	if (deleted < 0)
+		deleted = hc_enforce_retention(pol);
+	if (deleted < 0) {
+		hc_log(LOG_ERR, "retention_failed", "dir=\"%s\" err=%d",
+		       pol->core_dir, -deleted);
+	}
+	capture_phase(HC_PHASE_RETENTION, deleted < 0 ? deleted : 0, &t);
+
+	/* Analysis only gets queued here, for a background worker */
+	if (pol->analyze.command) {
+		ret = hc_analyze_enqueue(pol, rec);
+		if (ret == 0)
+			ret = hc_analyze_background(pol);
+		if (ret) {
+			hc_log(LOG_ERR, "enqueue_failed", "core=\"%s\" err=%d",
+			       rec->core, -ret);
+		}
+	}
+
+	/* Only waits for whatever the notifier hasn't sent yet */
+	ret = notifier ? hc_notifier_finish(notifier) : hc_send_mail(pol, rec);
+	if (ret) {
+		hc_log(LOG_ERR, "mail_failed", "err=%d", ret);
+	}
+	capture_phase(HC_PHASE_NOTIFY, ret > 0 ? -ret : ret, &t);
+
+	hc_log(LOG_NOTICE, "wrote_core", "dir=\"%s\" core=\"%s\" pid=%d "
+	       "signal=%d func=\"%s\" integrity=%s size=%llu stored=%llu "
+	       "deleted=%d ms=%llu", pol->core_dir, rec->core, rec->pid,
+	       rec->signo, rec->func, hc_integrity_name(rec->integrity),
+	       (unsigned long long)rec->size, (unsigned long long)rec->stored,
+	       deleted, (unsigned long long)(hc_now_ns() - start) / 1000000);
+	hc_flight_record(HC_EV_EXIT, synced, hc_now_ns() - start, rec->size);
+	/* The core is there, but --sync promised more than that */
+	return synced;
+}
@@ -0,0 +1,448 @@
+#include <elf.h>
+#include <errno.h>
+#include <fcntl.h>
+#include <limits.h>
+#include <stdio.h>
+#include <stdlib.h>
+#include <string.h>
+#include <sys/stat.h>
+#include <unistd.h>
+
+#include "handle_core.h"
+#include "hc_private.h"
+
+/*
+ * Checks of how untrusted files are read
+ *
+ * Builds small cores in memory, some whole, some cut short and some with
+ * headers whose offsets point outside the core or wrap around, streams each
+ * through hc_stream_feed() in uneven pieces, and compares what
+ * hc_stream_check() makes of it with what it should. Then writes a .hcz core,
+ * corrupts its header and frame table one field at a time, and checks that
+ * reading each copy back fails as it should rather than going astray, and
+ * does the same for an export of the crash index. Run by make check.
+ *
+ * Usage: hc_check
+ */
+
+#define DATA_LEN 8192
+#define CORE_LEN (sizeof(Elf64_Ehdr) + 2 * sizeof(Elf64_Phdr) + DATA_LEN)
+
+static void build(unsigned char *buf)
+{
+	Elf64_Ehdr *eh = (Elf64_Ehdr *)buf;
+	Elf64_Phdr *ph = (Elf64_Phdr *)(eh + 1);
+	size_t data = sizeof(*eh) + 2 * sizeof(*ph);
+
+	memset(buf, 0, CORE_LEN);
+	memcpy(eh->e_ident, ELFMAG, SELFMAG);
+	eh->e_ident[EI_CLASS] = ELFCLASS64;
+	eh->e_ident[EI_DATA] = __BYTE_ORDER == __LITTLE_ENDIAN ?
+			       ELFDATA2LSB : ELFDATA2MSB;
+	eh->e_ident[EI_VERSION] = EV_CURRENT;
+	eh->e_type = ET_CORE;
+	eh->e_phoff = sizeof(*eh);
+	eh->e_phentsize = sizeof(*ph);
+	eh->e_phnum = 2;
+	ph[0].p_type = PT_NOTE;
+	ph[0].p_offset = data;
+	ph[1].p_type = PT_LOAD;
+	ph[1].p_flags = PF_R | PF_W;
+	ph[1].p_offset = data;
+	ph[1].p_vaddr = 0x10000;
+	ph[1].p_filesz = ph[1].p_memsz = DATA_LEN;
+	memset(buf + data, 0x5a, DATA_LEN);
+}
+
+static Elf64_Ehdr *ehdr(unsigned char *buf)
+{
+	return (Elf64_Ehdr *)buf;
+}
+
+static Elf64_Phdr *phdr(unsigned char *buf, int i)
+{
+	return (Elf64_Phdr *)(buf + sizeof(Elf64_Ehdr)) + i;
+}
+
+/* Stream len bytes of buf in pieces of 1, 7, 61, ... bytes */
+static int classify(const unsigned char *buf, size_t len)
+{
+	struct hc_integrity_report ic;
+	struct hc_stream s;
+	size_t off, n, step = 1;
+
+	hc_stream_init(&s);
+	for (off = 0; off < len; off += n) {
+		n = len - off < step ? len - off : step;
+		hc_stream_feed(&s, buf + off, n);
+		step = step * 7 + 54;
+	}
+	hc_stream_check(&s, &ic);
+	hc_stream_free(&s);
+	return ic.status;
+}
+
+static int failed;
+
+static void result(const char *what, const char *got, int ok)
+{
+	printf("%-40s %-10s %s\n", what, got, ok ? "ok" : "FAILED");
+	if (!ok)
+		failed = 1;
+}
+
+static void expect(const char *what, const unsigned char *buf, size_t len,
+		   int status)
+{
+	int got = classify(buf, len);
+
+	result(what, hc_integrity_name(got), got == status);
+}
+
+static void expect_ret(const char *what, int got, int want)
+{
+	char name[16];
+
+	switch (got) {
+	case 0:
+		snprintf(name, sizeof(name), "0");
+		break;
+	case -EINVAL:
+		snprintf(name, sizeof(name), "EINVAL");
+		break;
+	case -EIO:
+		snprintf(name, sizeof(name), "EIO");
+		break;
+	case -EBADMSG:
+		snprintf(name, sizeof(name), "EBADMSG");
+		break;
+	default:
+		snprintf(name, sizeof(name), "%d", got);
+		break;
+	}
+	result(what, name, got == want);
+}
+
+/* Write len bytes of buf to path, with the n bytes at off replaced by val */
+static int put(const char *path, const unsigned char *buf, size_t len,
+	       size_t off, const void *val, size_t n)
+{
+	int fd, ret;
+
+	fd = open(path, O_WRONLY | O_CREAT | O_TRUNC | O_CLOEXEC, 0644);
+	if (fd < 0)
+		return -errno;
+	ret = hc_write_all(fd, buf, off < len ? off : len);
+	if (ret == 0 && off < len) {
+		ret = hc_write_all(fd, val, n);
+		if (ret == 0 && off + n < len)
+			ret = hc_write_all(fd, buf + off + n, len - off - n);
+	}
+	close(fd);
+	return ret;
+}
+
+static int slurp(const char *path, unsigned char **buf, size_t *len)
+{
+	struct stat st;
+	int fd, ret = 0;
+
+	fd = open(path, O_RDONLY | O_CLOEXEC);
+	if (fd < 0)
+		return -errno;
+	if (fstat(fd, &st) || !(*buf = malloc(st.st_size)))
+		ret = -ENOMEM;
+	else if (read(fd, *buf, st.st_size) != st.st_size)
+		ret = -EIO;
+	*len = st.st_size;
+	close(fd);
+	return ret;
+}
+
+/*
+ * .hcz cores
+ */
+
+#define HCZ_RAW_SIZE 16
+#define HCZ_NFRAMES 24
+#define HCZ_INDEX_OFF 32
+#define FRAME_OFFSET 0
+#define FRAME_CLEN 8
+#define FRAME_KIND 12
+#define FRAME_LEN 16
+
+/* Two and a half frames: text, zeroes, then noise */
+static int hcz_make(const char *path)
+{
+	struct hc_hcz_writer *w;
+	size_t len = HC_HCZ_FRAME_SIZE * 5 / 2, i;
+	unsigned char *data = calloc(1, len);
+	uint32_t x = 1;
+	int fd, ret;
+
+	if (!data)
+		return -ENOMEM;
+	for (i = 0; i < HC_HCZ_FRAME_SIZE; ++i)
+		data[i] = "crash dump\n"[i % 11];
+	for (i = 2 * HC_HCZ_FRAME_SIZE; i < len; ++i) {
+		x = x * 1103515245 + 12345;
+		data[i] = x >> 16;
+	}
+	fd = open(path, O_RDWR | O_CREAT | O_TRUNC | O_CLOEXEC, 0644);
+	if (fd < 0) {
+		free(data);
+		return -errno;
+	}
+	ret = hc_hcz_writer_open(&w, fd, HC_HCZ_LEVEL);
+	if (ret == 0) {
+		ret = hc_hcz_write(w, data, len);
+		if (ret)
+			hc_hcz_writer_close(w, NULL);
+		else
+			ret = hc_hcz_writer_close(w, NULL);
+	}
+	close(fd);
+	free(data);
+	return ret;
+}
+
+/* Open and read all of path as a stored core */
+static int hcz_read(const char *path)
+{
+	struct hc_core_file *cf;
+	int ret;
+
+	ret = hc_core_open(path, &cf);
+	if (ret)
+		return ret;
+	ret = hc_core_is_compressed(cf) ? hc_core_verify(cf, NULL) : -1;
+	hc_core_close(cf);
+	return ret;
+}
+
+static void hcz_expect(const char *what, const char *path,
+		       const unsigned char *buf, size_t len, size_t off,
+		       uint64_t val, size_t n, int want)
+{
+	uint32_t val32 = val;
+	int ret = put(path, buf, len, off, n == 4 ? (void *)&val32 : &val, n);
+
+	expect_ret(what, ret ? ret : hcz_read(path), want);
+}
+
+static void check_hcz(const char *dir)
+{
+	char good[PATH_MAX], path[PATH_MAX];
+	unsigned char *buf = NULL;
+	uint64_t index, nframes, noise;
+	size_t len;
+	int ret;
+
+	snprintf(good, sizeof(good), "%s/core.hcz", dir);
+	snprintf(path, sizeof(path), "%s/bad.hcz", dir);
+	ret = hcz_make(good);
+	if (ret == 0)
+		ret = slurp(good, &buf, &len);
+	if (ret) {
+		expect_ret("writing a .hcz core", ret, 0);
+		free(buf);
+		return;
+	}
+	memcpy(&index, buf + HCZ_INDEX_OFF, sizeof(index));
+	memcpy(&nframes, buf + HCZ_NFRAMES, sizeof(nframes));
+	noise = index + 2 * FRAME_LEN;	/* the third frame's entry */
+
+	expect_ret(".hcz whole", hcz_read(good), 0);
+	hcz_expect(".hcz cut before its frame table", path, buf, index + 8,
+		   len, 0, 0, -EINVAL);
+	/* Rounding this size up to frames by adding would wrap to none */
+	memcpy(buf + HCZ_NFRAMES, &(uint64_t){ 0 }, 8);
+	hcz_expect(".hcz size near 2^64, no frames", path, buf, len,
+		   HCZ_RAW_SIZE, UINT64_MAX - 5, 8, -EINVAL);
+	/* Frames which would cover it, but whose table can't fit */
+	memcpy(buf + HCZ_NFRAMES, &(uint64_t){ (UINT64_MAX >> 20) + 1 }, 8);
+	hcz_expect(".hcz size and frames near 2^64", path, buf, len,
+		   HCZ_RAW_SIZE, UINT64_MAX, 8, -EINVAL);
+	memcpy(buf + HCZ_NFRAMES, &nframes, 8);
+	hcz_expect(".hcz one frame too many", path, buf, len, HCZ_NFRAMES,
+		   nframes + 1, 8, -EINVAL);
+	hcz_expect(".hcz frame table past the end", path, buf, len,
+		   HCZ_INDEX_OFF, len, 8, -EINVAL);
+	hcz_expect(".hcz frame table offset near 2^64", path, buf, len,
+		   HCZ_INDEX_OFF, UINT64_MAX - 8, 8, -EINVAL);
+	hcz_expect(".hcz frame past the end", path, buf, len,
+		   index + FRAME_OFFSET, len, 8, -EIO);
+	hcz_expect(".hcz frame offset near 2^64", path, buf, len,
+		   noise + FRAME_OFFSET, UINT64_MAX - 8, 8, -EIO);
+	hcz_expect(".hcz frame length near 2^32", path, buf, len,
+		   noise + FRAME_CLEN, UINT32_MAX, 4, -EIO);
+	hcz_expect(".hcz frame of unknown kind", path, buf, len,
+		   index + FRAME_KIND, 99, 4, -EINVAL);
+	free(buf);
+	unlink(good);
+	unlink(path);
+}
+
+/*
+ * Exports of the crash index
+ */
+
+#define EXPORT_NROWS 8
+#define EXPORT_NCOLS 12
+#define EXPORT_COLS 16
+#define COL_OFF 8
+#define COL_LEN 16
+#define COL_RAW_LEN 24
+#define COL_SIZE 32
+#define EXPORT_RECORDS 3
+
+static int export_count(const char *host, const struct hc_record *rec,
+			void *arg)
+{
+	(void)host;
+	(void)rec;
+	++*(int *)arg;
+	return 0;
+}
+
+/* Read all of path as an export. A whole one must have every record. */
+static int export_read(const char *path)
+{
+	int n = 0, ret = hc_export_foreach(path, export_count, &n);
+
+	return ret ? ret : n == EXPORT_RECORDS ? 0 : -1;
+}
+
+static void export_expect(const char *what, const char *path,
+			  const unsigned char *buf, size_t len, size_t off,
+			  uint64_t val, size_t n, int want)
+{
+	uint32_t val32 = val;
+	int ret = put(path, buf, len, off, n == 4 ? (void *)&val32 : &val, n);
+
+	expect_ret(what, ret ? ret : export_read(path), want);
+}
+
+static void check_export(const char *dir)
+{
+	char good[PATH_MAX], path[PATH_MAX];
+	unsigned char *buf = NULL;
+	struct hc_record rec;
+	uint64_t col_len;
+	uint32_t nrows;
+	size_t len;
+	int i, ret = 0;
+
+	for (i = 0; i < EXPORT_RECORDS && ret == 0; ++i) {
+		memset(&rec, 0, sizeof(rec));
+		rec.time = 1700000000 + i;
+		rec.pid = 100 + i;
+		rec.signo = 11;
+		rec.size = rec.stored = 4096;
+		snprintf(rec.exe, sizeof(rec.exe), "check");
+		snprintf(rec.core, sizeof(rec.core), "core.check.%d", i);
+		ret = hc_index_append(dir, &rec);
+	}
+	snprintf(good, sizeof(good), "%s/index.hce", dir);
+	snprintf(path, sizeof(path), "%s/bad.hce", dir);
+	if (ret == 0)
+		ret = hc_export(dir, "host", good, NULL);
+	if (ret == 0)
+		ret = slurp(good, &buf, &len);
+	if (ret) {
+		expect_ret("writing an export", ret, 0);
+		free(buf);
+		return;
+	}
+	memcpy(&nrows, buf + EXPORT_NROWS, sizeof(nrows));
+	memcpy(&col_len, buf + EXPORT_COLS + COL_LEN, sizeof(col_len));
+
+	expect_ret("export whole", export_read(good), 0);
+	export_expect("export header cut short", path, buf, 10, len, 0, 0,
+		      -EBADMSG);
+	export_expect("export column table cut short", path, buf,
+		      EXPORT_COLS + 2 * COL_SIZE, len, 0, 0, -EBADMSG);
+	export_expect("export columns near 2^32", path, buf, len,
+		      EXPORT_NCOLS, UINT32_MAX, 4, -EBADMSG);
+	export_expect("export rows near 2^32", path, buf, len, EXPORT_NROWS,
+		      UINT32_MAX, 4, -EBADMSG);
+	export_expect("export one row too many", path, buf, len, EXPORT_NROWS,
+		      nrows + 1, 4, -EBADMSG);
+	export_expect("export column past the end", path, buf, len,
+		      EXPORT_COLS + COL_OFF, len, 8, -EBADMSG);
+	export_expect("export column offset near 2^64", path, buf, len,
+		      EXPORT_COLS + COL_OFF, UINT64_MAX - 8, 8, -EBADMSG);
+	export_expect("export column length past the end", path, buf, len,
+		      EXPORT_COLS + COL_LEN, len, 8, -EBADMSG);
+	export_expect("export inflated size near 2^64", path, buf, len,
+		      EXPORT_COLS + COL_RAW_LEN, UINT64_MAX, 8, -EBADMSG);
+	export_expect("export inflated size past deflate's", path, buf, len,
+		      EXPORT_COLS + COL_RAW_LEN, col_len * 2000, 8, -EBADMSG);
+	free(buf);
+	unlink(good);
+	unlink(path);
+	snprintf(path, sizeof(path), "%s/%s", dir, HC_INDEX_NAME);
+	unlink(path);
+}
+
+int main(void)
+{
+	static unsigned char buf[CORE_LEN];
+	char dir[] = "/tmp/hc_check.XXXXXX";
+	ssize_t need;
+
+	build(buf);
+	expect("whole core", buf, CORE_LEN, HC_INTEGRITY_COMPLETE);
+	expect("cut short", buf, CORE_LEN - 100, HC_INTEGRITY_TRUNCATED);
+
+	build(buf);
+	memcpy(buf, "\x7fXYZ", 4);
+	expect("not ELF", buf, CORE_LEN, HC_INTEGRITY_MALFORMED);
+
+	build(buf);
+	ehdr(buf)->e_ident[EI_CLASS] = ELFCLASS32;
+	expect("32-bit ELF", buf, CORE_LEN, HC_INTEGRITY_UNVERIFIED);
+
+	build(buf);
+	ehdr(buf)->e_phoff = UINT64_MAX - 16;
+	need = hc_elf_headers_len(buf, CORE_LEN);
+	if (need != -ENOEXEC) {
+		printf("e_phoff near 2^64: headers_len %zd\n", need);
+		failed = 1;
+	}
+	expect("e_phoff near 2^64", buf, CORE_LEN, HC_INTEGRITY_MALFORMED);
+
+	build(buf);
+	ehdr(buf)->e_phoff = (uint64_t)1 << 40;
+	expect("e_phoff past the headers' limit", buf, CORE_LEN,
+	       HC_INTEGRITY_MALFORMED);
+
+	build(buf);
+	phdr(buf, 0)->p_offset = UINT64_MAX - 8;
+	phdr(buf, 0)->p_filesz = 64;
+	expect("note offset wrapping around", buf, CORE_LEN,
+	       HC_INTEGRITY_MALFORMED);
+
+	build(buf);
+	phdr(buf, 0)->p_filesz = UINT64_MAX;
+	expect("note size near 2^64", buf, CORE_LEN, HC_INTEGRITY_MALFORMED);
+
+	build(buf);
+	phdr(buf, 1)->p_filesz = UINT64_MAX - 16;
+	expect("segment end wrapping around", buf, CORE_LEN,
+	       HC_INTEGRITY_MALFORMED);
+
+	build(buf);
+	phdr(buf, 1)->p_offset = 8;
+	expect("segment inside the headers", buf, CORE_LEN,
+	       HC_INTEGRITY_MALFORMED);
+
+	if (!mkdtemp(dir)) {
+		perror("hc_check: mkdtemp");
+		return 1;
+	}
+	check_hcz(dir);
+	check_export(dir);
+	rmdir(dir);
+	return failed;
+}
@@ -0,0 +1,144 @@
+#include <errno.h>
+#include <fcntl.h>
+#include <limits.h>
+#include <stdio.h>
+#include <string.h>
+#include <sys/file.h>
+#include <sys/mman.h>
+#include <sys/stat.h>
+#include <syslog.h>
+#include <time.h>
+#include <unistd.h>
+
+#include "handle_core.h"
+#include "hc_private.h"
+
+/*
+ * Group commit
+ *
+ * With pol->sync, a core only counts as stored once its index record and its
+ * directory entry are on disk. Doing that with an fsync of the index and of
+ * core_dir for every crash would make a storm of small cores run at the speed
+ * of the disk's flush latency, so the handlers of concurrent crashes share
+ * their flushes instead.
+ *
+ * core_dir/.commit holds two counters, mapped shared by every handler: how
+ * many changes have been written and how many of those are known to be on
+ * disk. After its write, a handler takes the next number as its ticket and
+ * then the lock on the file. If the flushed count has reached its ticket by
+ * then, another handler's commit covered it and there is nothing to do.
+ * Otherwise it leads a commit: it waits up to COMMIT_WINDOW_NS for more
+ * tickets to arrive, notes the last one, flushes the index and the
+ * directory, and publishes that as flushed. Everybody queued behind the lock
+ * meanwhile finds their ticket covered.
+ */
+
+#define COMMIT_NAME ".commit"
+#define COMMIT_WINDOW_NS 2000000
+#define COMMIT_TICK_NS 250000	/* give up waiting once this passes quietly */
+
+struct commit_state {
+	uint64_t written;	/* tickets handed out */
+	uint64_t flushed;	/* every ticket up to this one is on disk */
+	uint64_t commits;
+	uint64_t pad[5];
+};
+
+/* Flush the index and the directory which holds the cores */
+static int commit_flush(const char *core_dir)
+{
+	char path[PATH_MAX];
+	int fd, ret = 0;
+
+	hc_index_path(core_dir, path);
+	fd = open(path, O_RDONLY | O_CLOEXEC);
+	if (fd >= 0) {
+		if (fdatasync(fd))
+			ret = -errno;
+		close(fd);
+	}
+	else if (errno != ENOENT) {
+		return -errno;
+	}
+	fd = open(core_dir, O_RDONLY | O_DIRECTORY | O_CLOEXEC);
+	if (fd < 0)
+		return -errno;
+	if (fsync(fd) && !ret)
+		ret = -errno;
+	close(fd);
+	return ret;
+}
+
+static void commit_sleep(uint64_t ns)
+{
+	struct timespec ts = { 0, ns };
+
+	nanosleep(&ts, NULL);
+}
+
+int hc_commit(const char *core_dir)
+{
+	struct commit_state *cs;
+	char path[PATH_MAX];
+	uint64_t ticket, target, last, flushed, t, waited = 0;
+	struct stat st;
+	int fd, ret;
+
+	snprintf(path, sizeof(path), "%s/%s", core_dir, COMMIT_NAME);
+	fd = open(path, O_RDWR | O_CREAT | O_CLOEXEC, 0644);
+	if (fd < 0)
+		return -errno;
+	if (fstat(fd, &st) || (st.st_size < (off_t)sizeof(*cs) &&
+			       ftruncate(fd, sizeof(*cs)))) {
+		ret = -errno;
+		close(fd);
+		return ret;
+	}
+	cs = mmap(NULL, sizeof(*cs), PROT_READ | PROT_WRITE, MAP_SHARED, fd, 0);
+	if (cs == MAP_FAILED) {
+		/* Still durable, just not shared */
+		close(fd);
+		return commit_flush(core_dir);
+	}
+	ticket = __atomic_add_fetch(&cs->written, 1, __ATOMIC_SEQ_CST);
+	if (flock(fd, LOCK_EX)) {
+		ret = -errno;
+		goto out;
+	}
+	ret = 0;
+	flushed = __atomic_load_n(&cs->flushed, __ATOMIC_ACQUIRE);
+	if (flushed >= ticket)
+		goto unlock;
+
+	/* We lead. Let the handlers that are about to write join in. */
+	t = hc_now_ns();
+	last = ticket;
+	while (waited < COMMIT_WINDOW_NS) {
+		commit_sleep(COMMIT_TICK_NS);
+		waited += COMMIT_TICK_NS;
+		target = __atomic_load_n(&cs->written, __ATOMIC_ACQUIRE);
+		if (target == last)
+			break;
+		last = target;
+	}
+	target = __atomic_load_n(&cs->written, __ATOMIC_ACQUIRE);
+	ret = commit_flush(core_dir);
+	if (ret == 0) {
+		__atomic_store_n(&cs->flushed, target, __ATOMIC_RELEASE);
+		__atomic_add_fetch(&cs->commits, 1, __ATOMIC_RELAXED);
+		hc_flight_count(HC_COUNT_COMMITS);
+	}
+	hc_flight_record(HC_EV_COMMIT, ret, target - flushed,
+			 hc_now_ns() - t);
+unlock:
+	if (ret == 0)
+		hc_flight_count(HC_COUNT_COMMITTED);
+	flock(fd, LOCK_UN);
+out:
+	munmap(cs, sizeof(*cs));
+	close(fd);
+	if (ret)
+		hc_log(LOG_ERR, "commit_failed", "dir=\"%s\" err=%d", core_dir,
+		       -ret);
+	return ret;
+}
@@ -0,0 +1,642 @@
+#define _GNU_SOURCE
+#include <elf.h>
+#include <errno.h>
+#include <stdio.h>
+#include <stdlib.h>
+#include <string.h>
+#include <unistd.h>
+
+#include "handle_core.h"
+#include "hc_private.h"
+
+/*
+ * Thread deduplication
+ *
+ * A process with ten thousand threads mostly parked in the same few wait
+ * loops dumps ten thousand sets of register notes and ten thousand stacks,
+ * nearly all of them telling the same story. With pol->dedup_threads the
+ * core is stored with only the crashing thread and one thread for each
+ * distinct stack; the others are listed by group in the sidecar.
+ *
+ * Two threads have the same stack if they stopped at the same pc and the
+ * words on their stacks that point into executable mappings, which is to
+ * say their return addresses, are the same. The rest of a stack differs from
+ * thread to thread even in identical wait loops (frame pointers, the
+ * thread's own descriptor) and is left out of the comparison.
+ *
+ * The notes come first in the stream and the stacks later, so the stored
+ * core is laid out with room for all of the original notes and program
+ * headers, its segments are written in place as they go past, and the
+ * headers are filled in at the end with only the threads that were kept.
+ * Each stack is buffered from its stack pointer up until it has been
+ * compared, and the part below the stack pointer, which is dead, is never
+ * written. Pages of zeros are skipped too, leaving holes, so the time taken
+ * and space used follow the number of distinct stacks rather than threads.
+ */
+
+#define DEDUP_CHUNK (1 << 20)
+#define DEDUP_ZERO_BLOCK 65536	/* holes are left for zero blocks this big */
+#define DEDUP_STACK_MAX (1 << 20)	/* deeper stacks are kept uncompared */
+#define DEDUP_HEADERS_MAX (64 << 20)
+#define DEDUP_PAGE 4096ULL
+#define NOTE_ALIGN(x) (((x) + 3) & ~(size_t)3)
+
+/* Markers in seg_thread[] */
+#define SEG_NO_THREAD -1
+#define SEG_THREADS -2		/* the stack of more than one thread */
+
+struct dedup_group {
+	uint64_t sig;
+	uint64_t pc;
+	unsigned nthreads;
+};
+
+struct hc_dedup {
+	struct hc_core_meta meta;
+	int *group_of;		/* group of each thread, or -1 */
+	unsigned char *kept;	/* whether each thread was kept */
+	struct dedup_group *groups;
+	unsigned ngroups;
+	unsigned *table;	/* open addressing on sig, group + 1 */
+	unsigned table_mask;
+	uint64_t bytes_in;	/* of the original core */
+	uint64_t bytes_written;
+};
+
+struct dedup_ctx {
+	struct hc_input *in;
+	int out_fd;
+	struct hc_dedup *d;
+	unsigned char *buf;	/* DEDUP_CHUNK */
+	unsigned char *stack;	/* DEDUP_STACK_MAX */
+	uint64_t pos;		/* offset in the original core */
+	int64_t delta;		/* output offset - input offset of data */
+	uint64_t out_end;
+	const Elf64_Phdr *ph;
+	int phnum;
+	int *seg_thread;	/* per program header */
+	uint64_t *seg_keep;	/* vaddr the kept part of a stack starts at */
+	unsigned char *seg_dropped;
+};
+
+/* Read exactly len bytes, unless the core ends first */
+static ssize_t dedup_read(struct dedup_ctx *c, void *buf, size_t len)
+{
+	size_t done = 0;
+	ssize_t n;
+
+	while (done < len) {
+		n = hc_input_read(c->in, (char *)buf + done, len - done,
+				  c->d->bytes_written);
+		if (n < 0)
+			return n;
+		if (n == 0)
+			break;
+		done += n;
+	}
+	c->pos += done;
+	return done;
+}
+
+/* Consume the input up to offset to */
+static int dedup_skip(struct dedup_ctx *c, uint64_t to)
+{
+	while (c->pos < to) {
+		uint64_t n = to - c->pos;
+		ssize_t got = dedup_read(c, c->buf, n < DEDUP_CHUNK ? n :
+					 DEDUP_CHUNK);
+		if (got <= 0)
+			return got ? got : -EIO;
+	}
+	return 0;
+}
+
+/* Write buf at out_off, leaving holes where it is all zeros */
+static int dedup_write(struct dedup_ctx *c, const unsigned char *buf,
+		       size_t len, uint64_t out_off)
+{
+	size_t off, n;
+
+	for (off = 0; off < len; off += n) {
+		n = len - off < DEDUP_ZERO_BLOCK ? len - off : DEDUP_ZERO_BLOCK;
+		if (hc_is_zero(buf + off, n))
+			continue;
+		if (pwrite(c->out_fd, buf + off, n, out_off + off) !=
+		    (ssize_t)n)
+			return errno ? -errno : -EIO;
+		c->d->bytes_written += n;
+	}
+	if (out_off + len > c->out_end)
+		c->out_end = out_off + len;
+	return 0;
+}
+
+/* Copy the input from the current position up to offset to */
+static int dedup_copy(struct dedup_ctx *c, uint64_t to)
+{
+	while (c->pos < to) {
+		uint64_t n = to - c->pos, at = c->pos + c->delta;
+		ssize_t got = dedup_read(c, c->buf, n < DEDUP_CHUNK ? n :
+					 DEDUP_CHUNK);
+		int ret;
+		if (got <= 0)
+			return got ? got : -EIO;
+		ret = dedup_write(c, c->buf, got, at);
+		if (ret)
+			return ret;
+	}
+	return 0;
+}
+
+/* Whether v points into an executable mapping */
+static int dedup_is_code(struct dedup_ctx *c, uint64_t v)
+{
+	int i;
+
+	for (i = 0; i < c->phnum; ++i) {
+		const Elf64_Phdr *p = &c->ph[i];
+		if (p->p_type == PT_LOAD && (p->p_flags & PF_X) &&
+		    v >= p->p_vaddr && v < p->p_vaddr + p->p_memsz)
+			return 1;
+	}
+	return 0;
+}
+
+static uint64_t dedup_signature(struct dedup_ctx *c, uint64_t pc,
+				const unsigned char *stack, size_t from,
+				size_t len)
+{
+	uint64_t h = hc_hash64(&pc, sizeof(pc)), w;
+	size_t off;
+
+	for (off = (from + 7) & ~(size_t)7; off + 8 <= len; off += 8) {
+		memcpy(&w, stack + off, sizeof(w));
+		if (dedup_is_code(c, w))
+			h = hc_hash64_combine(h, w);
+	}
+	return h;
+}
+
+/* Put thread t into the group for sig. Returns 1 if it is the first. */
+static int dedup_join(struct hc_dedup *d, unsigned t, uint64_t sig)
+{
+	unsigned i = sig & d->table_mask;
+	struct dedup_group *g;
+
+	while (d->table[i]) {
+		g = &d->groups[d->table[i] - 1];
+		if (g->sig == sig) {
+			g->nthreads++;
+			d->group_of[t] = d->table[i] - 1;
+			return 0;
+		}
+		i = (i + 1) & d->table_mask;
+	}
+	g = &d->groups[d->ngroups];
+	g->sig = sig;
+	g->pc = d->meta.threads[t].pc;
+	g->nthreads = 1;
+	d->group_of[t] = d->ngroups;
+	d->table[i] = ++d->ngroups;
+	return 1;
+}
+
+/* Pass one PT_LOAD segment through, comparing it if it is a stack */
+static int dedup_segment(struct dedup_ctx *c, int j)
+{
+	const Elf64_Phdr *p = &c->ph[j];
+	uint64_t end = p->p_offset + p->p_filesz;
+	uint64_t keep_off = p->p_offset + (c->seg_keep[j] - p->p_vaddr);
+	struct hc_dedup *d = c->d;
+	int t = c->seg_thread[j];
+	size_t len;
+	ssize_t got;
+	int ret;
+
+	if (t == SEG_NO_THREAD)
+		return dedup_copy(c, end);
+	ret = dedup_skip(c, keep_off);
+	if (ret)
+		return ret;
+	len = end - keep_off;
+	if (t == SEG_THREADS || len > DEDUP_STACK_MAX)
+		return dedup_copy(c, end);
+
+	got = dedup_read(c, c->stack, len);
+	if (got < 0)
+		return got;
+	if ((size_t)got < len)
+		return -EIO;
+	if (dedup_join(d, t, dedup_signature(c, d->meta.threads[t].pc,
+					     c->stack,
+					     d->meta.threads[t].sp -
+					     c->seg_keep[j], len)) ||
+	    t == 0) {
+		d->kept[t] = 1;
+		return dedup_write(c, c->stack, len, keep_off + c->delta);
+	}
+	c->seg_dropped[j] = 1;
+	return 0;
+}
+
+/* Copy the notes of the kept threads into out. Notes from one NT_PRSTATUS
+ * up to the next belong to that thread; the process-wide ones are in the
+ * crashing thread's run, which is always kept. */
+static size_t dedup_notes(const struct hc_dedup *d, const unsigned char *hdr,
+			  const Elf64_Phdr *ph, int phnum, unsigned char *out)
+{
+	size_t len = 0, off;
+	int i, thread = -1, keep = 1;
+
+	for (i = 0; i < phnum; ++i) {
+		const unsigned char *p = hdr + ph[i].p_offset;
+		if (ph[i].p_type != PT_NOTE)
+			continue;
+		for (off = 0; off + sizeof(Elf64_Nhdr) <= ph[i].p_filesz; ) {
+			const Elf64_Nhdr *nh = (const Elf64_Nhdr *)(p + off);
+			size_t next = off + sizeof(*nh) +
+				NOTE_ALIGN(nh->n_namesz) +
+				NOTE_ALIGN(nh->n_descsz);
+			if (next > ph[i].p_filesz || next <= off)
+				break;
+			if (nh->n_type == NT_PRSTATUS) {
+				thread++;
+				keep = (unsigned)thread >= d->meta.nthreads_known ||
+				       d->kept[thread];
+			}
+			if (keep) {
+				memcpy(out + len, p + off, next - off);
+				len += next - off;
+			}
+			off = next;
+		}
+	}
+	return len;
+}
+
+/* Fill in the ELF header, program headers and notes of what was written */
+static int dedup_headers(struct dedup_ctx *c, const unsigned char *hdr,
+			 uint64_t notes_off, size_t notes_len)
+{
+	const Elf64_Ehdr *in_eh = (const Elf64_Ehdr *)hdr;
+	Elf64_Ehdr eh = *in_eh;
+	Elf64_Phdr *out, *q;
+	unsigned char *notes;
+	size_t nlen;
+	int j, ret = 0, noted = 0;
+
+	out = calloc(c->phnum + c->d->meta.nthreads_known, sizeof(*out));
+	notes = malloc(notes_len ? notes_len : 1);
+	if (!out || !notes) {
+		free(out);
+		free(notes);
+		return -ENOMEM;
+	}
+	nlen = dedup_notes(c->d, hdr, c->ph, c->phnum, notes);
+	q = out;
+	for (j = 0; j < c->phnum; ++j) {
+		const Elf64_Phdr *p = &c->ph[j];
+		uint64_t keep = c->seg_keep[j];
+		if (p->p_type == PT_NOTE) {
+			if (noted++)
+				continue;
+			*q = *p;
+			q->p_offset = notes_off;
+			q->p_filesz = nlen;
+			q++;
+			continue;
+		}
+		*q = *p;
+		if (p->p_type != PT_LOAD || p->p_filesz == 0) {
+			q++;
+			continue;
+		}
+		if (keep > p->p_vaddr) {
+			/* The dead part of a stack, below its stack pointer */
+			q->p_memsz = keep - p->p_vaddr;
+			q->p_filesz = 0;
+			q->p_offset = 0;
+			q++;
+			*q = *p;
+			q->p_vaddr = keep;
+			q->p_paddr = 0;
+			q->p_memsz = p->p_vaddr + p->p_memsz - keep;
+			q->p_filesz = p->p_vaddr + p->p_filesz - keep;
+			q->p_offset = p->p_offset + (keep - p->p_vaddr);
+		}
+		if (c->seg_dropped[j]) {
+			q->p_filesz = 0;
+			q->p_offset = 0;
+		}
+		else if (q->p_filesz) {
+			q->p_offset += c->delta;
+		}
+		q++;
+	}
+	eh.e_phoff = sizeof(eh);
+	eh.e_phnum = q - out;
+	eh.e_shoff = 0;
+	eh.e_shnum = 0;
+	eh.e_shstrndx = 0;
+	if (pwrite(c->out_fd, notes, nlen, notes_off) != (ssize_t)nlen ||
+	    pwrite(c->out_fd, out, (q - out) * sizeof(*out), sizeof(eh)) !=
+	    (ssize_t)((q - out) * sizeof(*out)) ||
+	    pwrite(c->out_fd, &eh, sizeof(eh), 0) != sizeof(eh))
+		ret = errno ? -errno : -EIO;
+	if (notes_off + nlen > c->out_end)
+		c->out_end = notes_off + nlen;
+	free(out);
+	free(notes);
+	return ret;
+}
+
+/* Find whose stacks are where, and how much of each to keep */
+static void dedup_find_stacks(struct dedup_ctx *c)
+{
+	const struct hc_core_meta *meta = &c->d->meta;
+	unsigned t;
+	int j;
+
+	for (j = 0; j < c->phnum; ++j) {
+		c->seg_thread[j] = SEG_NO_THREAD;
+		c->seg_keep[j] = c->ph[j].p_vaddr;
+	}
+	for (t = 0; t < meta->nthreads_known; ++t) {
+		uint64_t sp = meta->threads[t].sp, page = sp & ~(DEDUP_PAGE - 1);
+		for (j = 0; j < c->phnum; ++j) {
+			const Elf64_Phdr *p = &c->ph[j];
+			if (p->p_type != PT_LOAD || sp < p->p_vaddr ||
+			    sp >= p->p_vaddr + p->p_filesz)
+				continue;
+			if (c->seg_thread[j] == SEG_NO_THREAD) {
+				c->seg_thread[j] = t;
+				c->seg_keep[j] = page;
+			}
+			else {
+				c->seg_thread[j] = SEG_THREADS;
+				if (page < c->seg_keep[j])
+					c->seg_keep[j] = page;
+			}
+			break;
+		}
+	}
+}
+
+/* Threads whose stacks weren't compared: those without one share groups
+ * by pc alone, the others are kept in groups of their own */
+static void dedup_finish_groups(struct dedup_ctx *c)
+{
+	struct hc_dedup *d = c->d;
+	unsigned t;
+	int j;
+
+	for (t = 0; t < d->meta.nthreads_known; ++t) {
+		uint64_t sp = d->meta.threads[t].sp, pc = d->meta.threads[t].pc;
+		int stacked = 0;
+		if (d->group_of[t] >= 0)
+			continue;
+		for (j = 0; j < c->phnum && !stacked; ++j)
+			stacked = c->ph[j].p_type == PT_LOAD &&
+				  sp >= c->ph[j].p_vaddr &&
+				  sp < c->ph[j].p_vaddr + c->ph[j].p_filesz;
+		if (dedup_join(d, t, stacked ? hc_hash64(&sp, sizeof(sp)) :
+			       ~hc_hash64(&pc, sizeof(pc))) || t == 0 ||
+		    stacked)
+			d->kept[t] = 1;
+	}
+}
+
+/* Copy whatever is left of the input as it is */
+static int dedup_fallback(struct dedup_ctx *c, const unsigned char *hdr,
+			  size_t len)
+{
+	int ret;
+
+	c->delta = 0;
+	ret = dedup_write(c, hdr, len, 0);
+	if (ret)
+		return ret;
+	while (1) {
+		ssize_t got = dedup_read(c, c->buf, DEDUP_CHUNK);
+		if (got <= 0)
+			return got;
+		ret = dedup_write(c, c->buf, got, c->pos - got);
+		if (ret)
+			return ret;
+	}
+}
+
+static int cmp_offset(const void *a, const void *b, void *arg)
+{
+	const Elf64_Phdr *ph = arg;
+	uint64_t oa = ph[*(const int *)a].p_offset;
+	uint64_t ob = ph[*(const int *)b].p_offset;
+
+	return oa < ob ? -1 : oa > ob;
+}
+
+int hc_input_dedup(struct hc_input *in, int out_fd, struct hc_dedup **dp,
+		   uint64_t *image_size)
+{
+	struct dedup_ctx c;
+	struct hc_dedup *d;
+	unsigned char *hdr = NULL, *tmp;
+	size_t hlen = 0, want = sizeof(Elf64_Ehdr), notes_len = 0;
+	uint64_t notes_off, data_in = UINT64_MAX, data_out;
+	unsigned n, size;
+	int *order = NULL, i, ret;
+	ssize_t need, got;
+
+	*dp = NULL;
+	memset(&c, 0, sizeof(c));
+	c.in = in;
+	c.out_fd = out_fd;
+	c.d = d = calloc(1, sizeof(*d));
+	c.buf = malloc(DEDUP_CHUNK);
+	c.stack = malloc(DEDUP_STACK_MAX);
+	if (!d || !c.buf || !c.stack) {
+		ret = -ENOMEM;
+		goto out;
+	}
+
+	/* The headers, to decide what to do with the rest */
+	while (1) {
+		need = hc_elf_headers_len(hdr, hlen);
+		if (need >= 0 && (size_t)need <= hlen)
+			break;
+		if (need != -EAGAIN && (need < 0 || need > DEDUP_HEADERS_MAX))
+			goto fallback;
+		if (need > 0)
+			want = need;
+		tmp = realloc(hdr, want);
+		if (!tmp) {
+			ret = -ENOMEM;
+			goto out;
+		}
+		hdr = tmp;
+		got = dedup_read(&c, hdr + hlen, want - hlen);
+		if (got < 0) {
+			ret = got;
+			goto out;
+		}
+		hlen += got;
+		if (hlen < want)
+			goto fallback;
+	}
+	if (hc_elf_parse(hdr, hlen, &d->meta) || d->meta.nthreads_known < 2)
+		goto fallback;
+	c.ph = (const Elf64_Phdr *)(hdr + ((Elf64_Ehdr *)hdr)->e_phoff);
+	c.phnum = ((Elf64_Ehdr *)hdr)->e_phnum;
+	for (i = 0; i < c.phnum; ++i) {
+		if (c.ph[i].p_type == PT_NOTE)
+			notes_len += c.ph[i].p_filesz;
+		else if (c.ph[i].p_type == PT_LOAD && c.ph[i].p_filesz &&
+			 c.ph[i].p_offset < data_in)
+			data_in = c.ph[i].p_offset;
+		if (c.ph[i].p_type == PT_LOAD && c.ph[i].p_filesz &&
+		    c.ph[i].p_offset < hlen)
+			goto fallback;
+	}
+	if (data_in == UINT64_MAX)
+		goto fallback;
+
+	n = d->meta.nthreads_known;
+	for (size = 16; size < 2 * n; size *= 2)
+		;
+	d->group_of = malloc(n * sizeof(*d->group_of));
+	d->kept = calloc(n, 1);
+	d->groups = calloc(n, sizeof(*d->groups));
+	d->table = calloc(size, sizeof(*d->table));
+	d->table_mask = size - 1;
+	c.seg_thread = calloc(c.phnum, sizeof(*c.seg_thread));
+	c.seg_keep = calloc(c.phnum, sizeof(*c.seg_keep));
+	c.seg_dropped = calloc(c.phnum, 1);
+	order = calloc(c.phnum, sizeof(*order));
+	if (!d->group_of || !d->kept || !d->groups || !d->table ||
+	    !c.seg_thread || !c.seg_keep || !c.seg_dropped || !order) {
+		ret = -ENOMEM;
+		goto out;
+	}
+	memset(d->group_of, 0xff, n * sizeof(*d->group_of));
+	dedup_find_stacks(&c);
+
+	/* Room for a program header more per stack, as each is split where
+	 * its dead part ends */
+	notes_off = sizeof(Elf64_Ehdr) + (c.phnum + n) * sizeof(Elf64_Phdr);
+	data_out = (notes_off + notes_len + DEDUP_PAGE - 1) &
+		   ~(DEDUP_PAGE - 1);
+	c.delta = data_out - (data_in & ~(DEDUP_PAGE - 1));
+
+	for (i = 0; i < c.phnum; ++i)
+		order[i] = i;
+	qsort_r(order, c.phnum, sizeof(*order), cmp_offset, (void *)c.ph);
+	for (i = 0; i < c.phnum; ++i) {
+		const Elf64_Phdr *p = &c.ph[order[i]];
+		if (p->p_type != PT_LOAD || p->p_filesz == 0)
+			continue;
+		ret = dedup_skip(&c, p->p_offset);
+		if (ret == 0)
+			ret = dedup_segment(&c, order[i]);
+		if (ret)
+			goto out;
+	}
+	/* Anything after the last segment isn't memory; drain it */
+	while ((got = dedup_read(&c, c.buf, DEDUP_CHUNK)) > 0)
+		;
+	if (got < 0) {
+		ret = got;
+		goto out;
+	}
+	dedup_finish_groups(&c);
+	ret = dedup_headers(&c, hdr, notes_off, notes_len);
+	if (ret)
+		goto out;
+	d->bytes_in = c.pos;
+	*dp = d;
+	d = NULL;
+	goto done;
+
+fallback:
+	hc_core_meta_free(&d->meta);
+	ret = dedup_fallback(&c, hdr, hlen);
+	if (ret)
+		goto out;
+done:
+	if (ftruncate(out_fd, c.out_end))
+		ret = -errno;
+	*image_size = c.out_end;
+out:
+	if (ret && *dp) {
+		hc_dedup_free(*dp);
+		*dp = NULL;
+	}
+	hc_dedup_free(d);
+	free(order);
+	free(c.seg_thread);
+	free(c.seg_keep);
+	free(c.seg_dropped);
+	free(c.buf);
+	free(c.stack);
+	free(hdr);
+	return ret;
+}
+
+int hc_dedup_sidecar(const struct hc_dedup *d, const char *core_dir,
+		     const char *core)
+{
+	unsigned g, t, kept = 0;
+	char *tids, *ktids;
+	size_t len, klen;
+	int ret = 0;
+
+	for (t = 0; t < d->meta.nthreads_known; ++t)
+		kept += d->kept[t];
+	ret = hc_sidecar_printf(core_dir, core, "dedup\tthreads=%u\tkept=%u\t"
+				"groups=%u\tbytes_in=%llu\tbytes_written=%llu",
+				d->meta.nthreads_known, kept, d->ngroups,
+				(unsigned long long)d->bytes_in,
+				(unsigned long long)d->bytes_written);
+	/* Enough for every tid in one group */
+	tids = malloc(d->meta.nthreads_known * 12 + 1);
+	ktids = malloc(d->meta.nthreads_known * 12 + 1);
+	if (!tids || !ktids) {
+		free(tids);
+		free(ktids);
+		return -ENOMEM;
+	}
+	for (g = 0; g < d->ngroups && ret == 0; ++g) {
+		len = klen = 0;
+		tids[0] = ktids[0] = '\0';
+		for (t = 0; t < d->meta.nthreads_known; ++t) {
+			if (d->group_of[t] != (int)g)
+				continue;
+			len += sprintf(tids + len, "%s%d", len ? "," : "",
+				       (int)d->meta.threads[t].tid);
+			if (d->kept[t])
+				klen += sprintf(ktids + klen, "%s%d",
+						klen ? "," : "",
+						(int)d->meta.threads[t].tid);
+		}
+		ret = hc_sidecar_printf(core_dir, core, "threads\tgroup=%u\t"
+					"sig=%016llx\tpc=0x%llx\tcount=%u\t"
+					"kept=%s\ttids=%s", g,
+					(unsigned long long)d->groups[g].sig,
+					(unsigned long long)d->groups[g].pc,
+					d->groups[g].nthreads, ktids, tids);
+	}
+	free(tids);
+	free(ktids);
+	return ret;
+}
+
+void hc_dedup_free(struct hc_dedup *d)
+{
+	if (!d)
+		return;
+	hc_core_meta_free(&d->meta);
+	free(d->group_of);
+	free(d->kept);
+	free(d->groups);
+	free(d->table);
+	free(d);
+}
@@ -0,0 +1,551 @@
+#include <elf.h>
+#include <errno.h>
+#include <signal.h>
+#include <stdlib.h>
+#include <string.h>
+#include <sys/procfs.h>
+#include <sys/user.h>
+
+#include "handle_core.h"
+#include "hc_private.h"
+
+/*
+ * Core file headers
+ *
+ * A Linux core starts with the ELF header, followed by the program header
+ * table and the PT_NOTE segment; the memory segments come after that. Only
+ * 64-bit cores of the host byte order are understood, which is what the
+ * kernel on this machine produces.
+ */
+
+#define NOTE_ALIGN(x) (((x) + 3) & ~(size_t)3)
+#define STREAM_HEADERS_MAX (64 << 20)
+#define INTEGRITY_SEGS_MAX 64	/* incomplete segments listed */
+
+static int elf_check_header(const unsigned char *buf, size_t len)
+{
+	const Elf64_Ehdr *eh = (const Elf64_Ehdr *)buf;
+
+	if (len < sizeof(Elf64_Ehdr))
+		return -EAGAIN;
+	if (memcmp(eh->e_ident, ELFMAG, SELFMAG))
+		return -ENOEXEC;
+	if (eh->e_ident[EI_CLASS] != ELFCLASS64 ||
+	    eh->e_ident[EI_DATA] != (__BYTE_ORDER == __LITTLE_ENDIAN ?
+				     ELFDATA2LSB : ELFDATA2MSB))
+		return -ENOEXEC;
+	if (eh->e_type != ET_CORE)
+		return -ENOEXEC;
+	if (eh->e_phentsize != sizeof(Elf64_Phdr) || eh->e_phnum == 0 ||
+	    eh->e_phnum == PN_XNUM)
+		return -ENOEXEC;
+	return 0;
+}
+
+ssize_t hc_elf_headers_len(const unsigned char *buf, size_t len)
+{
+	const Elf64_Ehdr *eh = (const Elf64_Ehdr *)buf;
+	const Elf64_Phdr *ph;
+	uint64_t need;
+	int i, ret;
+
+	ret = elf_check_header(buf, len);
+	if (ret)
+		return ret;
+	/* Each term is bounded before they are added, so that offsets from a
+	 * corrupt core can't wrap around and point outside buf */
+	if (eh->e_phoff > STREAM_HEADERS_MAX)
+		return -ENOEXEC;
+	need = eh->e_phoff + (uint64_t)eh->e_phnum * sizeof(Elf64_Phdr);
+	if (len < need)
+		return need;
+	ph = (const Elf64_Phdr *)(buf + eh->e_phoff);
+	for (i = 0; i < eh->e_phnum; ++i) {
+		if (ph[i].p_type != PT_NOTE)
+			continue;
+		if (ph[i].p_offset > STREAM_HEADERS_MAX ||
+		    ph[i].p_filesz > STREAM_HEADERS_MAX)
+			return -ENOEXEC;
+		if (ph[i].p_offset + ph[i].p_filesz > need)
+			need = ph[i].p_offset + ph[i].p_filesz;
+	}
+	return need;
+}
+
+/* The program counter and stack pointer saved in a thread's NT_PRSTATUS
+ * note */
+static void elf_prstatus_regs(const struct elf_prstatus *prs,
+			      struct hc_thread *t)
+{
+#if defined(__x86_64__)
+	struct user_regs_struct regs;
+	memcpy(&regs, &prs->pr_reg, sizeof(regs));
+	t->pc = regs.rip;
+	t->sp = regs.rsp;
+#elif defined(__aarch64__)
+	struct user_regs_struct regs;
+	memcpy(&regs, &prs->pr_reg, sizeof(regs));
+	t->pc = regs.pc;
+	t->sp = regs.sp;
+#else
+	(void)prs;
+	t->pc = t->sp = 0;
+#endif
+}
+
+static void elf_add_thread(struct hc_core_meta *meta,
+			   const struct elf_prstatus *prs)
+{
+	struct hc_thread *t;
+
+	t = realloc(meta->threads, (meta->nthreads_known + 1) * sizeof(*t));
+	if (!t)
+		return;
+	meta->threads = t;
+	t[meta->nthreads_known].tid = prs->pr_pid;
+	elf_prstatus_regs(prs, &t[meta->nthreads_known]);
+	meta->nthreads_known++;
+}
+
+static int elf_cmp_mapping(const void *a, const void *b)
+{
+	const struct hc_mapping *ma = a, *mb = b;
+
+	return (ma->start > mb->start) - (ma->start < mb->start);
+}
+
+/*
+ * NT_FILE is a count and a page size, then (start, end, page offset) for
+ * each mapping, then the paths of all the mappings as consecutive
+ * NUL-terminated strings.
+ */
+static void elf_parse_file_note(const unsigned char *desc, size_t len,
+				struct hc_core_meta *meta)
+{
+	uint64_t count, page_size, i;
+	const unsigned char *names;
+	size_t names_len, pos = 0;
+
+	if (meta->maps || len < 16)
+		return;
+	memcpy(&count, desc, 8);
+	memcpy(&page_size, desc + 8, 8);
+	if (count > (len - 16) / 24)
+		return;
+	names = desc + 16 + count * 24;
+	names_len = len - 16 - count * 24;
+	meta->maps = calloc(count, sizeof(*meta->maps));
+	meta->map_paths = malloc(names_len + 1);
+	if (!meta->maps || !meta->map_paths)
+		goto fail;
+	memcpy(meta->map_paths, names, names_len);
+	meta->map_paths[names_len] = '\0';
+	for (i = 0; i < count; ++i) {
+		struct hc_mapping *m = &meta->maps[i];
+		uint64_t v[3];
+		if (pos >= names_len)
+			goto fail;
+		memcpy(v, desc + 16 + i * 24, sizeof(v));
+		m->start = v[0];
+		m->end = v[1];
+		m->offset = v[2] * page_size;
+		m->path = meta->map_paths + pos;
+		pos += strlen(m->path) + 1;
+	}
+	meta->nmaps = count;
+	qsort(meta->maps, count, sizeof(*meta->maps), elf_cmp_mapping);
+	return;
+fail:
+	free(meta->maps);
+	free(meta->map_paths);
+	meta->maps = NULL;
+	meta->map_paths = NULL;
+}
+
+static void elf_parse_note(const Elf64_Nhdr *nh, const unsigned char *desc,
+			   struct hc_core_meta *meta)
+{
+	if (nh->n_type == NT_PRSTATUS &&
+	    nh->n_descsz >= sizeof(struct elf_prstatus)) {
+		struct elf_prstatus prs;
+		/* Notes are only 4-byte aligned, so copy before use */
+		memcpy(&prs, desc, sizeof(prs));
+		/* The first thread is the one that took the signal */
+		if (meta->nthreads++ == 0) {
+			meta->pid = prs.pr_pid;
+			if (!meta->signo)
+				meta->signo = prs.pr_cursig;
+		}
+		elf_add_thread(meta, &prs);
+	}
+	else if (nh->n_type == NT_FILE) {
+		elf_parse_file_note(desc, nh->n_descsz, meta);
+	}
+	else if (nh->n_type == NT_PRPSINFO &&
+		 nh->n_descsz >= sizeof(struct elf_prpsinfo)) {
+		struct elf_prpsinfo psi;
+		memcpy(&psi, desc, sizeof(psi));
+		memcpy(meta->exe, psi.pr_fname, sizeof(psi.pr_fname));
+		meta->exe[sizeof(psi.pr_fname)] = '\0';
+		memcpy(meta->args, psi.pr_psargs, sizeof(psi.pr_psargs));
+		meta->args[sizeof(psi.pr_psargs)] = '\0';
+	}
+	else if (nh->n_type == NT_SIGINFO && nh->n_descsz >= sizeof(siginfo_t)) {
+		siginfo_t si;
+		memcpy(&si, desc, sizeof(si));
+		meta->signo = si.si_signo;
+	}
+}
+
+static void elf_parse_notes(const unsigned char *p, size_t len,
+			    struct hc_core_meta *meta)
+{
+	size_t off = 0;
+
+	while (off + sizeof(Elf64_Nhdr) <= len) {
+		const Elf64_Nhdr *nh = (const Elf64_Nhdr *)(p + off);
+		size_t desc_off = off + sizeof(*nh) + NOTE_ALIGN(nh->n_namesz);
+		size_t next = desc_off + NOTE_ALIGN(nh->n_descsz);
+		if (desc_off > len || next > len || next <= off)
+			break;
+		elf_parse_note(nh, p + desc_off, meta);
+		off = next;
+	}
+}
+
+int hc_elf_parse(const unsigned char *buf, size_t len,
+		 struct hc_core_meta *meta)
+{
+	const Elf64_Ehdr *eh = (const Elf64_Ehdr *)buf;
+	const Elf64_Phdr *ph;
+	ssize_t need;
+	int i;
+
+	memset(meta, 0, sizeof(*meta));
+	need = hc_elf_headers_len(buf, len);
+	if (need < 0)
+		return need;
+	if ((size_t)need > len)
+		return -EAGAIN;
+	ph = (const Elf64_Phdr *)(buf + eh->e_phoff);
+	meta->segs = calloc(eh->e_phnum, sizeof(*meta->segs));
+	if (!meta->segs)
+		return -ENOMEM;
+	for (i = 0; i < eh->e_phnum; ++i) {
+		uint64_t end = ph[i].p_offset + ph[i].p_filesz;
+		if (end < ph[i].p_offset) {
+			hc_core_meta_free(meta);
+			return -ENOEXEC;
+		}
+		if (end > meta->expected_size)
+			meta->expected_size = end;
+		if (ph[i].p_type == PT_NOTE) {
+			elf_parse_notes(buf + ph[i].p_offset, ph[i].p_filesz,
+					meta);
+		}
+		else if (ph[i].p_type == PT_LOAD) {
+			struct hc_segment *seg = &meta->segs[meta->nsegs++];
+			seg->vaddr = ph[i].p_vaddr;
+			seg->memsz = ph[i].p_memsz;
+			seg->offset = ph[i].p_offset;
+			seg->filesz = ph[i].p_filesz;
+			seg->flags = ph[i].p_flags;
+		}
+	}
+	meta->headers_len = need;
+	return 0;
+}
+
+void hc_core_meta_free(struct hc_core_meta *meta)
+{
+	free(meta->segs);
+	free(meta->threads);
+	free(meta->maps);
+	free(meta->map_paths);
+	memset(meta, 0, sizeof(*meta));
+}
+
+int hc_core_meta_read(struct hc_core_file *cf, struct hc_core_meta *meta)
+{
+	unsigned char *buf = NULL, *tmp;
+	size_t len = 0, want = sizeof(Elf64_Ehdr);
+	ssize_t need, n;
+	int ret;
+
+	memset(meta, 0, sizeof(*meta));
+	for (;;) {
+		tmp = realloc(buf, want);
+		if (!tmp) {
+			ret = -ENOMEM;
+			break;
+		}
+		buf = tmp;
+		n = hc_core_pread(cf, buf + len, want - len, len);
+		if (n < 0) {
+			ret = n;
+			break;
+		}
+		len += n;
+		need = hc_elf_headers_len(buf, len);
+		if (need < 0 && (need != -EAGAIN || n == 0)) {
+			ret = need == -EAGAIN ? -ENOEXEC : need;
+			break;
+		}
+		if (need >= 0 && (size_t)need <= len) {
+			ret = hc_elf_parse(buf, len, meta);
+			break;
+		}
+		if (n == 0 || (need >= 0 && need > STREAM_HEADERS_MAX)) {
+			ret = -ENOEXEC;
+			break;
+		}
+		want = need < 0 ? want : (size_t)need;
+	}
+	free(buf);
+	return ret;
+}
+
+int hc_core_read_mem(struct hc_core_file *cf, const struct hc_core_meta *meta,
+		     uint64_t addr, void *buf, size_t len)
+{
+	unsigned i;
+
+	for (i = 0; i < meta->nsegs; ++i) {
+		const struct hc_segment *seg = &meta->segs[i];
+		if (addr < seg->vaddr || addr - seg->vaddr >= seg->memsz)
+			continue;
+		/* Parts of segments the kernel didn't dump read as absent,
+		 * not as zeroes */
+		if (addr - seg->vaddr + len > seg->filesz)
+			return -EFAULT;
+		if (hc_core_pread(cf, buf, len, seg->offset + addr -
+				  seg->vaddr) != (ssize_t)len)
+			return -EFAULT;
+		return 0;
+	}
+	return -EFAULT;
+}
+
+/*
+ * Parsing a core as it streams past
+ *
+ * The headers are buffered until all of them have arrived, then parsed; after
+ * that the stream only tracks its position and which segment it is in. Cores
+ * with absurdly large headers are treated as unparseable rather than buffered
+ * without bound.
+ */
+
+void hc_stream_init(struct hc_stream *s)
+{
+	memset(s, 0, sizeof(*s));
+	s->state = HC_STREAM_COLLECTING;
+}
+
+void hc_stream_free(struct hc_stream *s)
+{
+	free(s->head);
+	s->head = NULL;
+	hc_core_meta_free(&s->meta);
+}
+
+static void stream_parsed(struct hc_stream *s, const unsigned char *buf,
+			  size_t len)
+{
+	s->state = HC_STREAM_PARSED;
+	s->raw = buf;
+	s->raw_len = len;
+	if (s->on_parsed)
+		s->on_parsed(s, s->on_parsed_arg);
+	s->raw = NULL;
+	s->raw_len = 0;
+}
+
+static void stream_collect(struct hc_stream *s, const unsigned char *buf,
+			   size_t len)
+{
+	ssize_t need;
+	int ret;
+
+	while (len > 0) {
+		size_t want, n;
+		need = hc_elf_headers_len(s->head, s->head_len);
+		if (need == -EAGAIN)
+			want = sizeof(Elf64_Ehdr);
+		else if (need < 0 || need > STREAM_HEADERS_MAX)
+			goto unparseable;
+		else
+			want = need;
+		if (s->head_len >= want)
+			break;
+		if (want > s->head_alloc) {
+			unsigned char *head = realloc(s->head, want);
+			if (!head)
+				goto unparseable;
+			s->head = head;
+			s->head_alloc = want;
+		}
+		n = want - s->head_len;
+		if (n > len)
+			n = len;
+		memcpy(s->head + s->head_len, buf, n);
+		s->head_len += n;
+		buf += n;
+		len -= n;
+	}
+	need = hc_elf_headers_len(s->head, s->head_len);
+	if (need < 0 || (size_t)need > s->head_len)
+		return;
+	ret = hc_elf_parse(s->head, s->head_len, &s->meta);
+	if (ret)
+		goto unparseable;
+	stream_parsed(s, s->head, s->head_len);
+	return;
+unparseable:
+	s->state = HC_STREAM_UNPARSEABLE;
+}
+
+void hc_stream_set_headers(struct hc_stream *s, const unsigned char *buf,
+			   size_t len)
+{
+	unsigned char *head;
+
+	hc_core_meta_free(&s->meta);
+	if (hc_elf_parse(buf, len, &s->meta) == 0) {
+		stream_parsed(s, buf, len);
+		return;
+	}
+	s->state = HC_STREAM_UNPARSEABLE;
+	/* Kept to tell a broken core from something else */
+	head = realloc(s->head, len);
+	if (head) {
+		memcpy(head, buf, len);
+		s->head = head;
+		s->head_len = s->head_alloc = len;
+	}
+}
+
+void hc_stream_feed(struct hc_stream *s, const void *buf, size_t len)
+{
+	if (s->state == HC_STREAM_COLLECTING) {
+		if (buf && s->pos == s->head_len)
+			stream_collect(s, buf, len);
+		else
+			s->state = HC_STREAM_UNPARSEABLE;
+	}
+	if (s->on_data)
+		s->on_data(s, s->pos, buf, len, s->on_data_arg);
+	s->pos += len;
+	if (s->state != HC_STREAM_PARSED)
+		return;
+	while (s->cur_seg < s->meta.nsegs &&
+	       s->pos >= s->meta.segs[s->cur_seg].offset +
+			 s->meta.segs[s->cur_seg].filesz)
+		s->cur_seg++;
+}
+
+/*
+ * Checking that all of a core arrived
+ *
+ * The program headers say how long the core should be and where each
+ * segment lies in it, so once the stream has ended, how far it got says
+ * which segments are whole, which one it broke off in, and which never came.
+ */
+
+/* Whether buf holds the headers of a core we would understand but for
+ * offsets which point outside it */
+static int elf_malformed(const unsigned char *buf, size_t len)
+{
+	const Elf64_Ehdr *eh = (const Elf64_Ehdr *)buf;
+	const Elf64_Phdr *ph;
+	ssize_t need;
+	int i;
+
+	if (elf_check_header(buf, len))
+		return 0;
+	need = hc_elf_headers_len(buf, len);
+	if (need == -ENOEXEC)
+		return 1;
+	if (need < 0 || (size_t)need > len)
+		return 0;
+	ph = (const Elf64_Phdr *)(buf + eh->e_phoff);
+	for (i = 0; i < eh->e_phnum; ++i) {
+		if (ph[i].p_offset + ph[i].p_filesz < ph[i].p_offset)
+			return 1;
+	}
+	return 0;
+}
+
+void hc_stream_check(const struct hc_stream *s, struct hc_integrity_report *ic)
+{
+	const struct hc_core_meta *meta = &s->meta;
+	uint64_t end = 0;
+	unsigned i;
+
+	memset(ic, 0, sizeof(*ic));
+	ic->got = s->pos;
+	ic->cut_seg = -1;
+	if (s->state == HC_STREAM_COLLECTING || s->pos == 0) {
+		/* Ended before the headers did */
+		ic->status = HC_INTEGRITY_TRUNCATED;
+		return;
+	}
+	if (s->state == HC_STREAM_UNPARSEABLE) {
+		ic->status = (s->head_len >= SELFMAG &&
+			      memcmp(s->head, ELFMAG, SELFMAG)) ||
+			     elf_malformed(s->head, s->head_len) ?
+			     HC_INTEGRITY_MALFORMED : HC_INTEGRITY_UNVERIFIED;
+		return;
+	}
+	ic->expected = meta->expected_size;
+	ic->nsegs = meta->nsegs;
+	for (i = 0; i < meta->nsegs; ++i) {
+		const struct hc_segment *seg = &meta->segs[i];
+		if (seg->offset < end || seg->offset < meta->headers_len) {
+			ic->status = HC_INTEGRITY_MALFORMED;
+			return;
+		}
+		end = seg->offset + seg->filesz;
+		if (end <= s->pos)
+			ic->complete++;
+		else if (ic->cut_seg < 0)
+			ic->cut_seg = i;
+	}
+	if (s->pos < ic->expected)
+		ic->status = HC_INTEGRITY_TRUNCATED;
+}
+
+int hc_integrity_sidecar(const struct hc_stream *s,
+			 const struct hc_integrity_report *ic,
+			 const char *core_dir, const char *core)
+{
+	const struct hc_core_meta *meta = &s->meta;
+	unsigned i, n = 0;
+	int ret;
+
+	ret = hc_sidecar_printf(core_dir, core, "integrity\tstatus=%s\t"
+				"expected=%llu\tgot=%llu\tsegments=%u\t"
+				"complete=%u", hc_integrity_name(ic->status),
+				(unsigned long long)ic->expected,
+				(unsigned long long)ic->got, ic->nsegs,
+				ic->complete);
+	if (ret || ic->status != HC_INTEGRITY_TRUNCATED || ic->cut_seg < 0)
+		return ret;
+	/* The segments which aren't whole, as many as are worth listing */
+	for (i = ic->cut_seg; i < meta->nsegs && !ret; ++i) {
+		const struct hc_segment *seg = &meta->segs[i];
+		uint64_t got = s->pos > seg->offset ? s->pos - seg->offset : 0;
+		if (got >= seg->filesz)
+			continue;
+		if (n++ == INTEGRITY_SEGS_MAX) {
+			ret = hc_sidecar_printf(core_dir, core, "segment\t"
+						"omitted=%u", meta->nsegs - i);
+			break;
+		}
+		ret = hc_sidecar_printf(core_dir, core, "segment\tindex=%u\t"
+					"vaddr=0x%llx\tfilesz=%llu\tgot=%llu",
+					i, (unsigned long long)seg->vaddr,
+					(unsigned long long)seg->filesz,
+					(unsigned long long)got);
+	}
+	return ret;
+}
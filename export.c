@@ -0,0 +1,751 @@
+#define _GNU_SOURCE
+#include <errno.h>
+#include <fcntl.h>
+#include <limits.h>
+#include <stdio.h>
+#include <stdlib.h>
+#include <string.h>
+#include <sys/mman.h>
+#include <sys/stat.h>
+#include <unistd.h>
+#include <zlib.h>
+
+#include "handle_core.h"
+#include "hc_private.h"
+
+/*
+ * Exporting the crash index
+ *
+ * Crash history is analyzed across hosts by shipping indices, so an export
+ * is built to be small and quick to scan: a header, a directory of columns,
+ * then each column deflated on its own. A scan inflates only the columns it
+ * knows, and readers skip column ids they don't, so columns can be added the
+ * way index fields are.
+ *
+ * Rows are sorted by time, and times are stored as zigzag varint deltas,
+ * which come to a byte or two per crash. Strings (host, exe, signature,
+ * core) are dictionary encoded: each column holds its distinct values once,
+ * then a varint per row; crash histories repeat the same few executables and
+ * signatures, and deflate does the rest. Other integers are varints, hashes
+ * are stored as they are.
+ *
+ * The signature is exe:func, as for analysis, or empty for a crash without a
+ * function. A merge reads every export into one table with shared strings,
+ * sorts it and writes it out again, dropping a host's record of a core if
+ * it is in more than one of the inputs.
+ */
+
+#define EXPORT_MAGIC "HCIDXC01"
+#define EXPORT_LEVEL 9
+/* Deflate shrinks nothing by more than about this much */
+#define EXPORT_RATIO_MAX 1032
+
+struct export_header {
+	char magic[8];
+	uint32_t nrows;
+	uint32_t ncols;
+};
+
+struct export_col {
+	uint32_t id;		/* enum export_col_id */
+	uint32_t reserved;
+	uint64_t off;		/* of the deflated column in the file */
+	uint64_t len;
+	uint64_t raw_len;	/* once inflated */
+};
+
+enum export_col_id {
+	COL_TIME = 1,		/* zigzag varint delta */
+	COL_HOST,		/* dictionary */
+	COL_EXE,		/* dictionary */
+	COL_SIG,		/* dictionary */
+	COL_CORE,		/* dictionary */
+	COL_PID,		/* varint */
+	COL_SIGNO,		/* varint */
+	COL_SIZE,		/* varint */
+	COL_STORED,		/* varint */
+	COL_HASH,		/* 8 bytes */
+	COL_FORM,		/* varint */
+	COL_INTEGRITY,		/* varint */
+	COL_MAX,
+};
+
+/* The string columns, in the order of export_row.str[] */
+enum { STR_HOST, STR_EXE, STR_SIG, STR_CORE, STR_MAX };
+
+static const uint32_t str_cols[STR_MAX] = {
+	[STR_HOST] = COL_HOST,
+	[STR_EXE] = COL_EXE,
+	[STR_SIG] = COL_SIG,
+	[STR_CORE] = COL_CORE,
+};
+
+struct export_row {
+	int64_t time;
+	uint64_t size, stored, hash;
+	uint32_t str[STR_MAX];	/* in the table's strings */
+	int32_t pid, signo;
+	uint8_t form, integrity;
+};
+
+/* Rows and the strings they share */
+struct export_table {
+	struct export_row *rows;
+	size_t nrows, alloc_rows;
+	char **strs;
+	size_t nstrs, alloc_strs;
+	uint32_t *slots;	/* open addressing, string id + 1 */
+	size_t mask;
+};
+
+static void table_free(struct export_table *t)
+{
+	size_t i;
+
+	for (i = 0; i < t->nstrs; ++i)
+		free(t->strs[i]);
+	free(t->strs);
+	free(t->slots);
+	free(t->rows);
+	memset(t, 0, sizeof(*t));
+}
+
+static uint32_t *table_slot(struct export_table *t, const char *s,
+			    size_t len)
+{
+	size_t i = hc_content_hash((const unsigned char *)s, len) & t->mask;
+
+	while (t->slots[i] && strcmp(t->strs[t->slots[i] - 1], s))
+		i = (i + 1) & t->mask;
+	return &t->slots[i];
+}
+
+static int table_intern(struct export_table *t, const char *s, uint32_t *id)
+{
+	size_t len = strlen(s), i;
+	uint32_t *slot;
+
+	if ((t->nstrs + 1) * 2 > t->mask) {
+		size_t mask = t->mask ? t->mask * 2 + 1 : 1023;
+		uint32_t *old = t->slots;
+		t->slots = calloc(mask + 1, sizeof(*t->slots));
+		if (!t->slots) {
+			t->slots = old;
+			return -ENOMEM;
+		}
+		free(old);
+		t->mask = mask;
+		for (i = 0; i < t->nstrs; ++i)
+			*table_slot(t, t->strs[i],
+				    strlen(t->strs[i])) = i + 1;
+	}
+	slot = table_slot(t, s, len);
+	if (*slot) {
+		*id = *slot - 1;
+		return 0;
+	}
+	if (t->nstrs == t->alloc_strs) {
+		size_t alloc = t->alloc_strs ? t->alloc_strs * 2 : 256;
+		char **strs = realloc(t->strs, alloc * sizeof(*strs));
+		if (!strs)
+			return -ENOMEM;
+		t->strs = strs;
+		t->alloc_strs = alloc;
+	}
+	t->strs[t->nstrs] = strdup(s);
+	if (!t->strs[t->nstrs])
+		return -ENOMEM;
+	*id = t->nstrs++;
+	*slot = *id + 1;
+	return 0;
+}
+
+static struct export_row *table_add(struct export_table *t)
+{
+	if (t->nrows == t->alloc_rows) {
+		size_t alloc = t->alloc_rows ? t->alloc_rows * 2 : 1024;
+		struct export_row *rows = realloc(t->rows,
+						  alloc * sizeof(*rows));
+		if (!rows)
+			return NULL;
+		t->rows = rows;
+		t->alloc_rows = alloc;
+	}
+	memset(&t->rows[t->nrows], 0, sizeof(*t->rows));
+	return &t->rows[t->nrows++];
+}
+
+/* Rows by time, then host and core, which also brings copies of a record
+ * together */
+static int cmp_row(const void *a, const void *b, void *arg)
+{
+	const struct export_row *ra = a, *rb = b;
+	char *const *strs = ((const struct export_table *)arg)->strs;
+	int ret;
+
+	if (ra->time != rb->time)
+		return ra->time < rb->time ? -1 : 1;
+	ret = strcmp(strs[ra->str[STR_HOST]], strs[rb->str[STR_HOST]]);
+	if (ret)
+		return ret;
+	return strcmp(strs[ra->str[STR_CORE]], strs[rb->str[STR_CORE]]);
+}
+
+/* Sort the rows, dropping all but the first of any with the same time,
+ * host and core */
+static void table_sort(struct export_table *t)
+{
+	size_t i, n = 0;
+
+	if (!t->nrows)
+		return;
+	qsort_r(t->rows, t->nrows, sizeof(*t->rows), cmp_row, t);
+	for (i = 1; i < t->nrows; ++i) {
+		const struct export_row *r = &t->rows[i];
+		const struct export_row *last = &t->rows[n];
+		if (r->time == last->time &&
+		    r->str[STR_HOST] == last->str[STR_HOST] &&
+		    r->str[STR_CORE] == last->str[STR_CORE])
+			continue;
+		t->rows[++n] = *r;
+	}
+	t->nrows = n + 1;
+}
+
+/*
+ * Encoding
+ */
+
+struct export_buf {
+	unsigned char *p;
+	size_t len, alloc;
+	int err;		/* sticky -ENOMEM */
+};
+
+/* Room for len more bytes at b->p + b->len, or NULL */
+static unsigned char *buf_reserve(struct export_buf *b, size_t len)
+{
+	if (b->err)
+		return NULL;
+	if (b->len + len > b->alloc) {
+		size_t alloc = b->alloc ? b->alloc * 2 : 4096;
+		unsigned char *np;
+		while (alloc < b->len + len)
+			alloc *= 2;
+		np = realloc(b->p, alloc);
+		if (!np) {
+			b->err = -ENOMEM;
+			return NULL;
+		}
+		b->p = np;
+		b->alloc = alloc;
+	}
+	return b->p + b->len;
+}
+
+static void buf_put(struct export_buf *b, const void *p, size_t len)
+{
+	unsigned char *dst = buf_reserve(b, len);
+
+	if (!dst)
+		return;
+	memcpy(dst, p, len);
+	b->len += len;
+}
+
+static void buf_varint(struct export_buf *b, uint64_t v)
+{
+	unsigned char tmp[10];
+	size_t n = 0;
+
+	while (v >= 0x80) {
+		tmp[n++] = v | 0x80;
+		v >>= 7;
+	}
+	tmp[n++] = v;
+	buf_put(b, tmp, n);
+}
+
+/* The distinct strings of column s in order of first use, then each row's
+ * index among them */
+static void encode_strings(const struct export_table *t, int s,
+			   struct export_buf *b)
+{
+	uint32_t *map, n = 0;
+	size_t i;
+
+	map = malloc(t->nstrs * sizeof(*map) + 1);
+	if (!map) {
+		b->err = -ENOMEM;
+		return;
+	}
+	memset(map, 0xff, t->nstrs * sizeof(*map));
+	for (i = 0; i < t->nrows; ++i) {
+		if (map[t->rows[i].str[s]] == UINT32_MAX)
+			map[t->rows[i].str[s]] = n++;
+	}
+	buf_varint(b, n);
+	n = 0;
+	for (i = 0; i < t->nrows; ++i) {
+		const char *str = t->strs[t->rows[i].str[s]];
+		if (map[t->rows[i].str[s]] != n)
+			continue;
+		buf_varint(b, strlen(str));
+		buf_put(b, str, strlen(str));
+		n++;
+	}
+	for (i = 0; i < t->nrows; ++i)
+		buf_varint(b, map[t->rows[i].str[s]]);
+	free(map);
+}
+
+static void encode_col(const struct export_table *t, uint32_t id,
+		       struct export_buf *b)
+{
+	int64_t last = 0, d;
+	size_t i;
+	int s;
+
+	for (s = 0; s < STR_MAX; ++s) {
+		if (str_cols[s] == id) {
+			encode_strings(t, s, b);
+			return;
+		}
+	}
+	for (i = 0; i < t->nrows; ++i) {
+		const struct export_row *r = &t->rows[i];
+		switch (id) {
+		case COL_TIME:
+			d = r->time - last;
+			last = r->time;
+			buf_varint(b, ((uint64_t)d << 1) ^ (uint64_t)(d >> 63));
+			break;
+		case COL_PID:
+			buf_varint(b, (uint32_t)r->pid);
+			break;
+		case COL_SIGNO:
+			buf_varint(b, (uint32_t)r->signo);
+			break;
+		case COL_SIZE:
+			buf_varint(b, r->size);
+			break;
+		case COL_STORED:
+			buf_varint(b, r->stored);
+			break;
+		case COL_HASH:
+			buf_put(b, &r->hash, sizeof(r->hash));
+			break;
+		case COL_FORM:
+			buf_varint(b, r->form);
+			break;
+		case COL_INTEGRITY:
+			buf_varint(b, r->integrity);
+			break;
+		}
+	}
+}
+
+/* Write the table to path, through a temporary file renamed over it */
+static int table_write(const struct export_table *t, const char *path)
+{
+	struct export_col cols[COL_MAX - 1];
+	struct export_buf raw, out;
+	struct export_header hdr;
+	char tmp[PATH_MAX];
+	unsigned char *dst;
+	uLongf clen;
+	uint32_t id;
+	int fd, ret;
+
+	memset(&out, 0, sizeof(out));
+	memset(&hdr, 0, sizeof(hdr));
+	memcpy(hdr.magic, EXPORT_MAGIC, sizeof(hdr.magic));
+	hdr.nrows = t->nrows;
+	hdr.ncols = COL_MAX - 1;
+	for (id = COL_TIME; id < COL_MAX; ++id) {
+		struct export_col *c = &cols[id - COL_TIME];
+		memset(&raw, 0, sizeof(raw));
+		encode_col(t, id, &raw);
+		memset(c, 0, sizeof(*c));
+		c->id = id;
+		c->off = sizeof(hdr) + sizeof(cols) + out.len;
+		c->raw_len = raw.len;
+		clen = compressBound(raw.len);
+		/* Deflate straight into the output */
+		dst = raw.err ? NULL : buf_reserve(&out, clen);
+		if (!dst) {
+			free(raw.p);
+			free(out.p);
+			return -ENOMEM;
+		}
+		ret = compress2(dst, &clen, raw.p, raw.len, EXPORT_LEVEL);
+		free(raw.p);
+		if (ret != Z_OK) {
+			free(out.p);
+			return -ENOMEM;
+		}
+		c->len = clen;
+		out.len += clen;
+	}
+
+	snprintf(tmp, sizeof(tmp), "%s.XXXXXX", path);
+	fd = mkostemp(tmp, O_CLOEXEC);
+	if (fd < 0) {
+		free(out.p);
+		return -errno;
+	}
+	fchmod(fd, 0644);
+	ret = hc_write_all(fd, &hdr, sizeof(hdr));
+	if (ret == 0)
+		ret = hc_write_all(fd, cols, sizeof(cols));
+	if (ret == 0)
+		ret = hc_write_all(fd, out.p, out.len);
+	free(out.p);
+	if (close(fd) && ret == 0)
+		ret = -errno;
+	if (ret == 0 && rename(tmp, path))
+		ret = -errno;
+	if (ret)
+		unlink(tmp);
+	return ret;
+}
+
+/*
+ * Decoding
+ */
+
+struct export_rd {
+	const unsigned char *p, *end;
+	int err;		/* sticky -EBADMSG */
+};
+
+static uint64_t rd_varint(struct export_rd *r)
+{
+	uint64_t v = 0;
+	int shift;
+
+	for (shift = 0; shift < 64; shift += 7) {
+		if (r->p >= r->end)
+			break;
+		v |= (uint64_t)(*r->p & 0x7f) << shift;
+		if (!(*r->p++ & 0x80))
+			return v;
+	}
+	r->err = -EBADMSG;
+	return 0;
+}
+
+static int decode_strings(struct export_table *t, size_t first, int s,
+			  struct export_rd *r)
+{
+	uint64_t n = rd_varint(r), i, len, idx;
+	uint32_t *ids;
+	char *str;
+	int ret = 0;
+
+	if (r->err || n > (uint64_t)(r->end - r->p))
+		return -EBADMSG;
+	ids = malloc(n * sizeof(*ids) + 1);
+	if (!ids)
+		return -ENOMEM;
+	for (i = 0; i < n && ret == 0; ++i) {
+		len = rd_varint(r);
+		if (r->err || len > (uint64_t)(r->end - r->p)) {
+			ret = -EBADMSG;
+			break;
+		}
+		str = strndup((const char *)r->p, len);
+		if (!str) {
+			ret = -ENOMEM;
+			break;
+		}
+		r->p += len;
+		ret = table_intern(t, str, &ids[i]);
+		free(str);
+	}
+	for (i = first; i < t->nrows && ret == 0; ++i) {
+		idx = rd_varint(r);
+		if (r->err || idx >= n)
+			ret = -EBADMSG;
+		else
+			t->rows[i].str[s] = ids[idx];
+	}
+	free(ids);
+	return ret;
+}
+
+static int decode_col(struct export_table *t, size_t first, uint32_t id,
+		      struct export_rd *r)
+{
+	int64_t last = 0;
+	uint64_t v;
+	size_t i;
+	int s;
+
+	for (s = 0; s < STR_MAX; ++s) {
+		if (str_cols[s] == id)
+			return decode_strings(t, first, s, r);
+	}
+	for (i = first; i < t->nrows && !r->err; ++i) {
+		struct export_row *row = &t->rows[i];
+		if (id == COL_HASH) {
+			if ((size_t)(r->end - r->p) < sizeof(row->hash))
+				return -EBADMSG;
+			memcpy(&row->hash, r->p, sizeof(row->hash));
+			r->p += sizeof(row->hash);
+			continue;
+		}
+		v = rd_varint(r);
+		switch (id) {
+		case COL_TIME:
+			last += (int64_t)(v >> 1) ^ -(int64_t)(v & 1);
+			row->time = last;
+			break;
+		case COL_PID:
+			row->pid = v;
+			break;
+		case COL_SIGNO:
+			row->signo = v;
+			break;
+		case COL_SIZE:
+			row->size = v;
+			break;
+		case COL_STORED:
+			row->stored = v;
+			break;
+		case COL_FORM:
+			row->form = v;
+			break;
+		case COL_INTEGRITY:
+			row->integrity = v;
+			break;
+		}
+	}
+	return r->err;
+}
+
+/* Append the rows of the export at path to t */
+static int table_read(struct export_table *t, const char *path)
+{
+	const struct export_header *hdr;
+	const struct export_col *cols;
+	unsigned char *map, *raw = NULL;
+	struct export_rd r;
+	struct stat st;
+	size_t first = t->nrows, i;
+	uLongf raw_len;
+	uint32_t c, empty, known;
+	int fd, s, ret = 0;
+
+	fd = open(path, O_RDONLY | O_CLOEXEC);
+	if (fd < 0)
+		return -errno;
+	if (fstat(fd, &st)) {
+		ret = -errno;
+		close(fd);
+		return ret;
+	}
+	if ((size_t)st.st_size < sizeof(*hdr)) {
+		close(fd);
+		return -EBADMSG;
+	}
+	map = mmap(NULL, st.st_size, PROT_READ, MAP_PRIVATE, fd, 0);
+	close(fd);
+	if (map == MAP_FAILED)
+		return -errno;
+	hdr = (const struct export_header *)map;
+	cols = (const struct export_col *)(hdr + 1);
+	if (memcmp(hdr->magic, EXPORT_MAGIC, sizeof(hdr->magic)) ||
+	    hdr->ncols > (st.st_size - sizeof(*hdr)) / sizeof(*cols)) {
+		ret = -EBADMSG;
+		goto out;
+	}
+	/* Every column we know takes a byte a row at least, so nrows is
+	 * bounded by what there is of them before it is trusted */
+	for (c = 0, known = 0; c < hdr->ncols; ++c) {
+		const struct export_col *col = &cols[c];
+		if (col->id < COL_TIME || col->id >= COL_MAX)
+			continue;
+		if (col->off > (uint64_t)st.st_size ||
+		    col->len > st.st_size - col->off ||
+		    col->raw_len > col->len * EXPORT_RATIO_MAX ||
+		    col->raw_len < hdr->nrows) {
+			ret = -EBADMSG;
+			goto out;
+		}
+		known++;
+	}
+	if (hdr->nrows && !known) {
+		ret = -EBADMSG;
+		goto out;
+	}
+	/* Strings an older export lacks the column for are empty */
+	ret = table_intern(t, "", &empty);
+	for (i = 0; i < hdr->nrows && ret == 0; ++i) {
+		struct export_row *row = table_add(t);
+		if (!row) {
+			ret = -ENOMEM;
+			break;
+		}
+		for (s = 0; s < STR_MAX; ++s)
+			row->str[s] = empty;
+	}
+	for (c = 0; c < hdr->ncols && ret == 0; ++c) {
+		const struct export_col *col = &cols[c];
+		/* Columns of a later version */
+		if (col->id < COL_TIME || col->id >= COL_MAX)
+			continue;
+		raw = malloc(col->raw_len + 1);
+		if (!raw) {
+			ret = -ENOMEM;
+			break;
+		}
+		raw_len = col->raw_len;
+		if (uncompress(raw, &raw_len, map + col->off, col->len) !=
+		    Z_OK || raw_len != col->raw_len) {
+			ret = -EBADMSG;
+		} else {
+			r.p = raw;
+			r.end = raw + raw_len;
+			r.err = 0;
+			ret = decode_col(t, first, col->id, &r);
+		}
+		free(raw);
+	}
+out:
+	if (ret)
+		t->nrows = first;
+	munmap(map, st.st_size);
+	return ret;
+}
+
+/*
+ * Exports
+ */
+
+struct export_ctx {
+	struct export_table *t;
+	uint32_t host;
+};
+
+static int export_cb(const struct hc_record *rec, void *arg)
+{
+	struct export_ctx *ctx = arg;
+	char sig[HC_SIG_MAX], core[HC_DIR_MAX + NAME_MAX + 2];
+	struct export_row *row;
+	int ret;
+
+	row = table_add(ctx->t);
+	if (!row)
+		return -ENOMEM;
+	row->time = rec->time;
+	row->pid = rec->pid;
+	row->signo = rec->signo;
+	row->size = rec->size;
+	row->stored = rec->stored;
+	row->hash = rec->hash;
+	row->form = rec->form;
+	row->integrity = rec->integrity;
+	row->str[STR_HOST] = ctx->host;
+	snprintf(sig, sizeof(sig), "%s%s%s", rec->func[0] ? rec->exe : "",
+		 rec->func[0] ? ":" : "", rec->func);
+	snprintf(core, sizeof(core), "%s%s%s", rec->dir,
+		 rec->dir[0] ? "/" : "", rec->core);
+	ret = table_intern(ctx->t, rec->exe, &row->str[STR_EXE]);
+	if (ret == 0)
+		ret = table_intern(ctx->t, sig, &row->str[STR_SIG]);
+	if (ret == 0)
+		ret = table_intern(ctx->t, core, &row->str[STR_CORE]);
+	return ret;
+}
+
+int hc_export(const char *core_dir, const char *host, const char *path,
+	      uint64_t *nrecords)
+{
+	struct export_table t;
+	struct export_ctx ctx;
+	char hostname[HOST_NAME_MAX + 1];
+	int ret;
+
+	if (!host) {
+		if (gethostname(hostname, sizeof(hostname)))
+			return -errno;
+		hostname[sizeof(hostname) - 1] = '\0';
+		host = hostname;
+	}
+	memset(&t, 0, sizeof(t));
+	ctx.t = &t;
+	ret = table_intern(&t, host, &ctx.host);
+	if (ret == 0)
+		ret = hc_index_foreach(core_dir, export_cb, &ctx);
+	if (ret == 0) {
+		table_sort(&t);
+		ret = table_write(&t, path);
+	}
+	if (nrecords)
+		*nrecords = t.nrows;
+	table_free(&t);
+	return ret;
+}
+
+int hc_export_merge(char *const *in, int nin, const char *path,
+		    uint64_t *nrecords)
+{
+	struct export_table t;
+	int i, ret = 0;
+
+	memset(&t, 0, sizeof(t));
+	for (i = 0; i < nin && ret == 0; ++i)
+		ret = table_read(&t, in[i]);
+	if (ret == 0) {
+		table_sort(&t);
+		ret = table_write(&t, path);
+	}
+	if (nrecords)
+		*nrecords = t.nrows;
+	table_free(&t);
+	return ret;
+}
+
+int hc_export_foreach(const char *path, hc_export_cb_t cb, void *arg)
+{
+	const struct export_row *row;
+	struct export_table t;
+	struct hc_record rec;
+	const char *sig, *core, *slash;
+	size_t i, exe_len;
+	int ret;
+
+	memset(&t, 0, sizeof(t));
+	ret = table_read(&t, path);
+	for (i = 0; i < t.nrows && ret == 0; ++i) {
+		row = &t.rows[i];
+		memset(&rec, 0, sizeof(rec));
+		rec.time = row->time;
+		rec.pid = row->pid;
+		rec.signo = row->signo;
+		rec.size = row->size;
+		rec.stored = row->stored;
+		rec.hash = row->hash;
+		rec.form = row->form;
+		rec.integrity = row->integrity;
+		hc_strlcpy(rec.exe, t.strs[row->str[STR_EXE]],
+			   sizeof(rec.exe));
+		/* func is what follows the exe: of the signature */
+		sig = t.strs[row->str[STR_SIG]];
+		exe_len = strlen(rec.exe);
+		if (!strncmp(sig, rec.exe, exe_len) && sig[exe_len] == ':')
+			hc_strlcpy(rec.func, sig + exe_len + 1,
+				   sizeof(rec.func));
+		core = t.strs[row->str[STR_CORE]];
+		slash = strrchr(core, '/');
+		if (slash && (size_t)(slash - core) < sizeof(rec.dir)) {
+			memcpy(rec.dir, core, slash - core);
+			core = slash + 1;
+		}
+		hc_strlcpy(rec.core, core, sizeof(rec.core));
+		ret = cb(t.strs[row->str[STR_HOST]], &rec, arg);
+	}
+	table_free(&t);
+	return ret;
+}
@@ -0,0 +1,196 @@
+#include <errno.h>
+#include <fcntl.h>
+#include <stdlib.h>
+#include <string.h>
+#include <sys/mman.h>
+#include <sys/stat.h>
+#include <time.h>
+#include <unistd.h>
+
+#include "handle_core.h"
+#include "hc_private.h"
+
+/*
+ * Flight recorder
+ *
+ * Every handler appends fixed-size event records to one ring buffer in a
+ * shared memory file, so that what the handlers did during an incident can be
+ * reconstructed even when syslog was rate-limited or wedged. Recording an
+ * event is an atomic increment to claim a slot, a clock read from the vDSO and
+ * a 64-byte store; there are no locks and no system calls.
+ *
+ * Each slot carries a sequence number which the writer clears before filling
+ * the slot and sets, with release semantics, once the record is complete.
+ * Readers copy a slot and keep it only if the sequence number was the same,
+ * and non-zero, before and after the copy.
+ */
+
+#define FLIGHT_MAGIC 0x68636672u	/* "hcfr" */
+#define FLIGHT_SLOTS 4096
+
+struct flight_ring {
+	uint32_t magic;
+	uint32_t nslots;
+	uint64_t head;		/* number of slots ever claimed */
+	uint64_t counters[HC_COUNT_MAX];
+	char pad[48 - 8 * HC_COUNT_MAX];
+	struct hc_flight_event ev[FLIGHT_SLOTS];
+};
+
+static struct flight_ring *flight;
+static pid_t flight_pid;
+static char flight_tag[16];
+
+static struct flight_ring *flight_map(int flags)
+{
+	struct flight_ring *ring;
+	struct stat st;
+	int fd;
+
+	fd = open(HC_FLIGHT_PATH, flags | O_CLOEXEC, 0644);
+	if (fd < 0)
+		return NULL;
+	if (fstat(fd, &st) || (st.st_size < (off_t)sizeof(*ring) &&
+	    (!(flags & O_CREAT) || ftruncate(fd, sizeof(*ring))))) {
+		close(fd);
+		return NULL;
+	}
+	ring = mmap(NULL, sizeof(*ring),
+		    (flags & O_ACCMODE) == O_RDONLY ? PROT_READ :
+		    PROT_READ | PROT_WRITE, MAP_SHARED, fd, 0);
+	close(fd);
+	if (ring == MAP_FAILED)
+		return NULL;
+	if ((flags & O_CREAT) && !ring->magic) {
+		/* Racing initializers all store the same values */
+		ring->nslots = FLIGHT_SLOTS;
+		__atomic_store_n(&ring->magic, FLIGHT_MAGIC, __ATOMIC_RELEASE);
+	}
+	if (__atomic_load_n(&ring->magic, __ATOMIC_ACQUIRE) != FLIGHT_MAGIC ||
+	    ring->nslots != FLIGHT_SLOTS) {
+		munmap(ring, sizeof(*ring));
+		return NULL;
+	}
+	return ring;
+}
+
+void hc_flight_open(const char *tag)
+{
+	if (flight)
+		return;
+	flight_pid = getpid();
+	hc_strlcpy(flight_tag, tag ? tag : "", sizeof(flight_tag));
+	flight = flight_map(O_RDWR | O_CREAT);
+}
+
+void hc_flight_record(enum hc_flight_type type, int err, uint64_t a,
+		      uint64_t b)
+{
+	struct hc_flight_event *ev;
+	struct timespec ts;
+	uint64_t seq;
+
+	if (!flight)
+		return;
+	seq = __atomic_fetch_add(&flight->head, 1, __ATOMIC_RELAXED);
+	ev = &flight->ev[seq % FLIGHT_SLOTS];
+	__atomic_store_n(&ev->seq, 0, __ATOMIC_RELAXED);
+	__atomic_thread_fence(__ATOMIC_RELEASE);
+	clock_gettime(CLOCK_REALTIME, &ts);
+	ev->time_ns = ts.tv_sec * 1000000000ULL + ts.tv_nsec;
+	ev->pid = flight_pid;
+	ev->type = type;
+	ev->err = err;
+	ev->a = a;
+	ev->b = b;
+	memcpy(ev->tag, flight_tag, sizeof(ev->tag));
+	__atomic_store_n(&ev->seq, seq + 1, __ATOMIC_RELEASE);
+}
+
+void hc_flight_count(enum hc_counter c)
+{
+	if (flight)
+		__atomic_fetch_add(&flight->counters[c], 1, __ATOMIC_RELAXED);
+}
+
+int hc_flight_counters(uint64_t *counters)
+{
+	struct flight_ring *ring;
+	int i;
+
+	ring = flight_map(O_RDONLY);
+	if (!ring)
+		return errno ? -errno : -EINVAL;
+	for (i = 0; i < HC_COUNT_MAX; ++i)
+		counters[i] = __atomic_load_n(&ring->counters[i],
+					      __ATOMIC_RELAXED);
+	munmap(ring, sizeof(*ring));
+	return 0;
+}
+
+int hc_flight_read(struct hc_flight_event *evs, int max)
+{
+	struct flight_ring *ring;
+	uint64_t head, first, i;
+	int n = 0;
+
+	ring = flight_map(O_RDONLY);
+	if (!ring)
+		return errno ? -errno : -EINVAL;
+	head = __atomic_load_n(&ring->head, __ATOMIC_ACQUIRE);
+	first = head > (uint64_t)max ? head - max : 0;
+	if (head - first > FLIGHT_SLOTS)
+		first = head - FLIGHT_SLOTS;
+	for (i = first; i < head; ++i) {
+		struct hc_flight_event *ev = &ring->ev[i % FLIGHT_SLOTS];
+		uint64_t seq = __atomic_load_n(&ev->seq, __ATOMIC_ACQUIRE);
+		if (seq != i + 1)
+			continue;
+		memcpy(&evs[n], ev, sizeof(*ev));
+		__atomic_thread_fence(__ATOMIC_ACQUIRE);
+		if (__atomic_load_n(&ev->seq, __ATOMIC_RELAXED) != seq)
+			continue;
+		n++;
+	}
+	munmap(ring, sizeof(*ring));
+	return n;
+}
+
+const char *hc_flight_type_name(int type)
+{
+	static const char *names[] = {
+		[HC_EV_START] = "start",
+		[HC_EV_ADMIT] = "admit",
+		[HC_EV_PROGRESS] = "progress",
+		[HC_EV_PHASE] = "phase",
+		[HC_EV_ERROR] = "error",
+		[HC_EV_EXIT] = "exit",
+		[HC_EV_SNAPSHOT] = "snapshot",
+		[HC_EV_LOG_DROP] = "log-drop",
+		[HC_EV_STAT_BATCH] = "stat",
+		[HC_EV_UNLINK_BATCH] = "unlink",
+		[HC_EV_COMMIT] = "commit",
+		[HC_EV_FAILOVER] = "failover",
+	};
+
+	if (type < 0 || type >= (int)(sizeof(names) / sizeof(names[0])) ||
+	    !names[type])
+		return "unknown";
+	return names[type];
+}
+
+const char *hc_phase_name(int phase)
+{
+	static const char *names[] = {
+		[HC_PHASE_INGEST] = "ingest",
+		[HC_PHASE_INDEX] = "index",
+		[HC_PHASE_RETENTION] = "retention",
+		[HC_PHASE_NOTIFY] = "notify",
+		[HC_PHASE_SYMBOLIZE] = "symbolize",
+	};
+
+	if (phase < 0 || phase >= (int)(sizeof(names) / sizeof(names[0])) ||
+	    !names[phase])
+		return "unknown";
+	return names[phase];
+}
@@ -1,131 +1,147 @@
-#include <ctype.h>
-#include <dirent.h>
+#include <elf.h>
 #include <errno.h>
-#include <fcntl.h>
-#include <fnmatch.h>
-#include <glob.h>
+#include <getopt.h>
 #include <limits.h>
-#include <netdb.h>
 #include <stdio.h>
 #include <stdlib.h>
 #include <string.h>
-#include <sys/stat.h>
-#include <sys/types.h>
 #include <syslog.h>
 #include <time.h>
 #include <unistd.h>
 
-#define BUF_SIZE 1024
-#define CORE_PREFIX "core."
-#define CORE_PREFIX_SZ (sizeof(CORE_PREFIX)-1)
-#define MAX_CORE_SCAN 500000
+#include "handle_core.h"
 
 /*
  * Core file handler
  *
  * Example usage:
- * echo "|/sbin/handle_core -e %e -d /var/core -m 10 \
+ * echo "|/sbin/handle_core -e %e -p %p -d /var/core -m 10 \
  *		-s '/usr/sbin/sendmail -t sysadmin@example.com'" > \
  *			/proc/sys/kernel/core_pattern
  */
 
-/* Compare two core file names. We want reverse alphabetical order */
-static int compare_core_file_names(const void *a, const void *b)
-{
-	const char *ca = *((const char **)a);
-	const char *cb = *((const char **)b);
-	return strcmp(cb, ca);
-}
+enum hc_mode {
+	MODE_CAPTURE,
+	MODE_LIST,
+	MODE_IMPORT,
+	MODE_RECENT,
+	MODE_TOP,
+	MODE_SNAPSHOT,
+	MODE_SYMBOLIZE,
+	MODE_THIN,
+	MODE_SIMULATE,
+	MODE_SIDECAR,
+	MODE_RUN_QUEUE,
+	MODE_HEALTH,
+	MODE_READ_MEM,
+	MODE_READ_SYM,
+	MODE_EXPORT,
+	MODE_MERGE,
+	MODE_SHOW_EXPORT,
+	MODE_PREPARE,
+	MODE_DIFF,
+};
 
-/* Step through core_dir and delete core files which have old looking names */
-static int limit_core_files(const char *core_dir, int max_cores)
-{
-	int deleted = 0, i, ret, num_cores = 0, alloc_cores = 64;
-	DIR *dp;
-	char **cores = malloc(sizeof(char*) * alloc_cores);
+#define MAX_FALLBACK_DIRS 8
 
-	if (cores == NULL) {
-		ret = -ENOMEM;
-		goto done;
-	}
-	dp = opendir(core_dir);
-	if (!dp) {
-		ret = -errno;
-		goto done;
-	}
-	/* Scan through core files. If the number of files we're looking at is
-	 * getting too large, we content ourselves with just what we've already
-	 * scanned. This does mean we could delete newer files than we really
-	 * intend. However, we need to avoid allocating a ridiculous amount of
-	 * memory.
-	 */
-	while (1) {
-		struct dirent *de = readdir(dp);
-		if (!de)
-			break;
-		/* ignore non-core files */
-		if (strncmp(de->d_name, CORE_PREFIX, CORE_PREFIX_SZ))
-			continue;
-		cores[num_cores] = strdup(de->d_name);
-		if (!cores[num_cores])
-			break;
-		num_cores++;
-		if (num_cores > MAX_CORE_SCAN)
-			break;
-		if (num_cores == alloc_cores) {
-			char **newptr = realloc(cores, sizeof(char*) * alloc_cores * 2);
-			if (!newptr)
-				break;
-			cores = newptr;
-			alloc_cores *= 2;
-		}
-	}
-	qsort(cores, num_cores, sizeof(char**), compare_core_file_names);
-	/* delete core files which are too old. */
-	for (i = num_cores - 1; i >= max_cores; i--) {
-		char path[PATH_MAX];
-		snprintf(path, sizeof(path), "%s/%s", core_dir, cores[i]);
-		if (unlink(path) == 0) {
-			deleted++;
-			continue;
-		}
-		/* ignore ENOENT here. We may be racing with another
-		 * handle_core process which deleted the old core first. */
-		ret = -errno;
-		if (ret != -ENOENT) {
-			syslog(LOG_USER | LOG_ERR, "unlink(%s) "
-				"error: %d (%s)",
-				cores[i], ret, strerror(ret));
-			goto done;
-		}
-	}
-	ret = deleted;
-done:
-	if (cores) {
-		for (i = 0; i < num_cores; ++i) {
-			if (cores[i])
-				free(cores[i]);
-		}
-		free(cores);
-	}
-	if (dp)
-		closedir(dp);
-	return ret;
-}
+struct options {
+	enum hc_mode mode;
+	struct hc_policy pol;
+	struct hc_crash crash;
+	struct hc_import_opts import;
+	struct hc_snapshot_opts snapshot;
+	pid_t snapshot_pid;
+	const char *alt_dirs[MAX_FALLBACK_DIRS];
+	const char *host;	/* for --export */
+	struct hc_prepare_opts prepare;
+	int diff_content;	/* for --diff */
+	char **args;		/* non-option arguments */
+	int nargs;
+};
 
-/* Print the new core name into a buffer of size PATH_MAX */
-static void get_core_name(const char *core_dir, const char *exe_name,
-			  char *core_name)
-{
-	struct tm *tm;
-	struct tm tm_buf;
-	time_t now;
-	time(&now);
-	tm = localtime_r(&now, &tm_buf);
-	snprintf(core_name, PATH_MAX, "%s/core.%d-%lld-%lld_%lld.%s", core_dir,
-			tm->tm_year + 1900, (long long)tm->tm_mon, (long long)tm->tm_mday,
-			(long long)now, exe_name);
-}
+enum {
+	OPT_IMPORT = 256,
+	OPT_IO_BUDGET,
+	OPT_KEEP_ORIGINALS,
+	OPT_RECENT,
+	OPT_TOP,
+	OPT_SNAPSHOT,
+	OPT_SYMBOLIZE,
+	OPT_MAX_BYTES,
+	OPT_THIN_AGES,
+	OPT_THIN,
+	OPT_SYNC,
+	OPT_SIMULATE,
+	OPT_DEDUP_THREADS,
+	OPT_SIDECAR,
+	OPT_ANALYZE,
+	OPT_ANALYZE_JOBS,
+	OPT_ANALYZE_PRIORITY,
+	OPT_PSI_LIMIT,
+	OPT_RUN_QUEUE,
+	OPT_EARLY_MINICORE,
+	OPT_FALLBACK_DIR,
+	OPT_HEALTH,
+	OPT_HEAP_STATS,
+	OPT_READ_MEM,
+	OPT_READ_SYM,
+	OPT_SUMMARIZE,
+	OPT_EXPORT,
+	OPT_HOST,
+	OPT_MERGE,
+	OPT_SHOW_EXPORT,
+	OPT_PREPARE,
+	OPT_RESERVE,
+	OPT_DIFF,
+	OPT_CONTENT,
+};
+
+static const struct option long_options[] = {
+	{ "core-dir", required_argument, NULL, 'd' },
+	{ "exe", required_argument, NULL, 'e' },
+	{ "help", no_argument, NULL, 'h' },
+	{ "jobs", required_argument, NULL, 'j' },
+	{ "list", no_argument, NULL, 'l' },
+	{ "max-cores", required_argument, NULL, 'm' },
+	{ "pid", required_argument, NULL, 'p' },
+	{ "email", required_argument, NULL, 's' },
+	{ "compress", no_argument, NULL, 'z' },
+	{ "import", no_argument, NULL, OPT_IMPORT },
+	{ "io-budget", required_argument, NULL, OPT_IO_BUDGET },
+	{ "keep-originals", no_argument, NULL, OPT_KEEP_ORIGINALS },
+	{ "recent", no_argument, NULL, OPT_RECENT },
+	{ "top", no_argument, NULL, OPT_TOP },
+	{ "snapshot", required_argument, NULL, OPT_SNAPSHOT },
+	{ "symbolize", no_argument, NULL, OPT_SYMBOLIZE },
+	{ "max-bytes", required_argument, NULL, OPT_MAX_BYTES },
+	{ "thin-ages", required_argument, NULL, OPT_THIN_AGES },
+	{ "thin", no_argument, NULL, OPT_THIN },
+	{ "sync", no_argument, NULL, OPT_SYNC },
+	{ "simulate-retention", no_argument, NULL, OPT_SIMULATE },
+	{ "dedup-threads", no_argument, NULL, OPT_DEDUP_THREADS },
+	{ "sidecar", no_argument, NULL, OPT_SIDECAR },
+	{ "analyze", required_argument, NULL, OPT_ANALYZE },
+	{ "analyze-jobs", required_argument, NULL, OPT_ANALYZE_JOBS },
+	{ "analyze-priority", required_argument, NULL, OPT_ANALYZE_PRIORITY },
+	{ "psi-limit", required_argument, NULL, OPT_PSI_LIMIT },
+	{ "run-queue", no_argument, NULL, OPT_RUN_QUEUE },
+	{ "early-minicore", no_argument, NULL, OPT_EARLY_MINICORE },
+	{ "fallback-dir", required_argument, NULL, OPT_FALLBACK_DIR },
+	{ "health", no_argument, NULL, OPT_HEALTH },
+	{ "heap-stats", no_argument, NULL, OPT_HEAP_STATS },
+	{ "read-mem", no_argument, NULL, OPT_READ_MEM },
+	{ "read-sym", no_argument, NULL, OPT_READ_SYM },
+	{ "summarize", no_argument, NULL, OPT_SUMMARIZE },
+	{ "export", no_argument, NULL, OPT_EXPORT },
+	{ "host", required_argument, NULL, OPT_HOST },
+	{ "merge", no_argument, NULL, OPT_MERGE },
+	{ "show-export", no_argument, NULL, OPT_SHOW_EXPORT },
+	{ "prepare", no_argument, NULL, OPT_PREPARE },
+	{ "reserve", required_argument, NULL, OPT_RESERVE },
+	{ "diff", no_argument, NULL, OPT_DIFF },
+	{ "content", no_argument, NULL, OPT_CONTENT },
+	{ NULL, 0, NULL, 0 },
+};
 
 static void usage(void)
 {
@@ -133,44 +149,443 @@ static void usage(void)
 -d <core_dir>			Directory to write core files into\n\
 -e <executable-name>		Name of the executable that is core dumping\n\
 -h				This help message\n\
+-l				List the crash index of core_dir and exit\n\
 -m <max_cores>			This maximum number of core files to allow\n\
 				before deleting older core files.\n\
+--max-bytes <size>[KMG]		Also delete older core files once all of them\n\
+				take up more than this much disk space.\n\
+--thin-ages <c:m:s:e>		Instead of deleting old cores, compress them at\n\
+				age c, cut them down to minicores at m, keep\n\
+				only their index record at s and forget them at\n\
+				e. Ages take an s, m, h or d suffix; 0 skips a\n\
+				step. Quotas are then met by thinning too.\n\
+--thin				Thin core_dir now and exit\n\
+--simulate-retention [policy]...\n\
+				Replay the crash index under each policy and\n\
+				report what it would have kept. A policy is a\n\
+				comma separated list of m=<max_cores>,\n\
+				bytes=<size>, thin=<c:m:s:e> and z; without\n\
+				any, the policy given by the other options.\n\
+				m= defaults to the -m in force.\n\
+-p <pid>			Pid of the process that is core dumping\n\
 -s <email_command>		Send email using email_command.\n\
 				Example: -s '/usr/sbin/sendmail -t sysadmin@example.com'\n\
+-z				Store cores compressed (.hcz)\n\
+--sync				Flush each core and its index record to disk\n\
+				before finishing. Concurrent handlers share\n\
+				their flushes.\n\
+--dedup-threads			Keep only the crashing thread and one thread\n\
+				for each distinct stack; the others are listed\n\
+				in the core's sidecar.\n\
+--early-minicore		Also write a minicore of each core as it comes\n\
+				in, ready (and mailed about) long before the\n\
+				core is\n\
+--heap-stats			Record glibc malloc's statistics (arenas, free\n\
+				and used bytes, fragmentation) in the core's\n\
+				sidecar, so they outlive its heap\n\
+--fallback-dir <dir>		Where cores go instead of core_dir while its\n\
+				disk fails or is slow to write to, moving\n\
+				mid-core if need be. May be given up to 8\n\
+				times; tried in order.\n\
+--health			Show how writes to core_dir and the fallback\n\
+				directories have been going, and exit\n\
+--recent [n]			Print the last n (default 50) events of the\n\
+				flight recorder shared by all handlers\n\
+--top				Show the cores being captured now and how far\n\
+				each has got, refreshing every second on a\n\
+				terminal\n\
+--snapshot <pid>		Write a core of a running process into\n\
+				core_dir, stopping it only briefly, and\n\
+				store it like any other\n\
+  -j <jobs>			Threads reading its memory (default 4)\n\
+--prepare			Create and check core_dir and the fallback\n\
+				directories, preallocate reserve files, time\n\
+				their disks, and record that they are ready.\n\
+				Meant to be run at boot.\n\
+  --reserve <n>x<size>[KMG]	Reserve files to keep in each directory, which\n\
+				captures write cores into so a full disk still\n\
+				takes them (default 1x64M; 0 for none)\n\
+--sidecar <core>...		Print what is recorded about each core beyond\n\
+				its index record\n\
+--symbolize <core>...		Print where each thread of each core was, by\n\
+				function, building symbol tables as needed\n\
+--read-mem <core> <addr> <len>	Dump len bytes of the crashed process's memory\n\
+				at addr, reading only the parts of the core\n\
+				which hold them, whatever form it is now in\n\
+--read-sym <core> [module:]<symbol> [len]\n\
+				Dump a global variable or function the same\n\
+				way, len bytes of it or all of it\n\
+--diff <a> <b>			Compare two cores by the hashes of their pages\n\
+				taken as they came in, listing the ranges of\n\
+				memory which differ, with what is mapped there\n\
+  --content			Also show the lines which differ, reading only\n\
+				the pages which do out of the cores\n\
+--export <file>			Write the crash index to file in a compact\n\
+				column-oriented form, for analysis elsewhere\n\
+  --host <name>			Host to tag the records with (default: this\n\
+				one's hostname)\n\
+--merge <out> <file>...		Combine exports from many hosts into one,\n\
+				sorted by time\n\
+--show-export <file>...		List the records of exports, as -l does\n\
+--analyze <command>		Queue each new core for command, run by a\n\
+				background worker as sh -c with the core and\n\
+				executable name as $1 and $2. Only the first\n\
+				core of each exe:func is analyzed; the output\n\
+				goes into the core's sidecar.\n\
+  --analyze-jobs <n>		Analyzers to run at once (default 1)\n\
+  --analyze-priority <nice>[:idle|be]\n\
+				CPU and I/O priority of the analyzers\n\
+				(default 19:idle)\n\
+  --psi-limit <percent>		Start no analyzer while CPU, I/O or memory\n\
+				pressure is above this (default 40; 0 never\n\
+				waits)\n\
+--run-queue			Work through the analysis queue now and exit\n\
+\n\
+--import <path>...		Import the existing cores found under each path\n\
+				into core_dir, deleting the originals once the\n\
+				stored copies have been verified.\n\
+  -j <jobs>			Number of parallel import workers\n\
+  --io-budget <MB/s>		Limit import I/O to this many megabytes per second\n\
+  --keep-originals		Don't delete imported files\n\
+--summarize <path>...		Index the cores found under each path where they\n\
+				lie, reading only their headers and notes, in\n\
+				parallel as for --import. Cores already indexed\n\
+				are skipped.\n\
 ");
 }
 
-static int parse_options(int argc, char **argv, int *max_cores,
-			  char **exe_name, char **core_dir, char **email)
+/* Parse a byte count with an optional K, M or G suffix. Returns 0 if str
+ * isn't one. */
+static uint64_t parse_size(const char *str)
+{
+	char *end;
+	uint64_t n = strtoull(str, &end, 10);
+
+	switch (*end) {
+	case 'G': case 'g':
+		n *= 1024;
+		/* fall through */
+	case 'M': case 'm':
+		n *= 1024;
+		/* fall through */
+	case 'K': case 'k':
+		n *= 1024;
+		end++;
+		break;
+	}
+	return (*end || end == str) ? 0 : n;
+}
+
+/* Parse a duration with an optional s, m, h or d suffix, in seconds.
+ * Returns -1 if str isn't one. */
+static time_t parse_age(const char *str, char **end)
+{
+	long long n = strtoll(str, end, 10);
+
+	if (*end == str || n < 0)
+		return -1;
+	switch (**end) {
+	case 'd':
+		n *= 24;
+		/* fall through */
+	case 'h':
+		n *= 60;
+		/* fall through */
+	case 'm':
+		n *= 60;
+		/* fall through */
+	case 's':
+		(*end)++;
+		break;
+	}
+	return n;
+}
+
+/* c:m:s:e, trailing fields may be left out */
+static int parse_thin_ages(const char *str, struct hc_thin_policy *thin)
+{
+	time_t *ages[] = { &thin->compress, &thin->minicore, &thin->summary,
+			   &thin->expire };
+	char *end = (char *)str;
+	unsigned i;
+
+	for (i = 0; i < sizeof(ages) / sizeof(ages[0]); ++i) {
+		*ages[i] = parse_age(end, &end);
+		if (*ages[i] < 0)
+			return -1;
+		if (*end == '\0')
+			return 0;
+		if (*end++ != ':')
+			return -1;
+	}
+	return -1;
+}
+
+/* Parse <n>x<size>, or 0 */
+static int parse_reserve(const char *str, struct hc_prepare_opts *p)
+{
+	char *end;
+	long n = strtol(str, &end, 10);
+
+	if (end == str || n < 0 || n > 64)
+		return -1;
+	p->nreserve = n;
+	if (*end == '\0' && n == 0)
+		return 0;
+	if (*end != 'x')
+		return -1;
+	p->reserve_size = parse_size(end + 1);
+	return p->reserve_size ? 0 : -1;
+}
+
+/* Parse <nice>[:idle|be] */
+static int parse_priority(const char *str, struct hc_analyze_policy *a)
+{
+	char *end;
+	long nice = strtol(str, &end, 10);
+
+	if (end == str || nice < -20 || nice > 19)
+		return -1;
+	a->nice = nice;
+	if (*end == '\0')
+		return 0;
+	if (!strcmp(end, ":idle"))
+		a->ioprio = HC_IOPRIO_IDLE;
+	else if (!strcmp(end, ":be"))
+		a->ioprio = HC_IOPRIO_BE;
+	else
+		return -1;
+	return 0;
+}
+
+/* Parse a rate in MB/s into bytes/s. Returns -1 if str isn't one or it
+ * doesn't fit. */
+static int parse_rate(const char *str, uint64_t *bytes)
+{
+	unsigned long long n;
+	char *end;
+
+	errno = 0;
+	n = strtoull(str, &end, 10);
+	if (end == str || *end || errno || *str == '-' ||
+	    n > UINT64_MAX >> 20)
+		return -1;
+	*bytes = (uint64_t)n << 20;
+	return 0;
+}
+
+/* Parse a percentage, 0 to 100. Returns -1 if str isn't one. */
+static int parse_percent(const char *str)
+{
+	char *end;
+	long n = strtol(str, &end, 10);
+
+	if (end == str || *end || n < 0 || n > 100)
+		return -1;
+	return n;
+}
+
+static int parse_options(int argc, char **argv, struct options *opts)
 {
 	int c;
-	*max_cores = 10;
-	*exe_name = NULL;
-	*core_dir = "/var/core";
-	*email = NULL;
-	while ((c = getopt(argc, argv, "d:e:hm:s:")) != -1) {
+	memset(opts, 0, sizeof(*opts));
+	opts->mode = MODE_CAPTURE;
+	hc_policy_init(&opts->pol);
+	opts->import.jobs = 4;
+	opts->snapshot.jobs = 4;
+	opts->prepare.nreserve = 1;
+	opts->prepare.reserve_size = 64 << 20;
+	opts->prepare.probe_bytes = 16 << 20;
+	while ((c = getopt_long(argc, argv, "d:e:hj:lm:p:s:z", long_options,
+				NULL)) != -1) {
 		switch (c) {
 		case 'd':
-			*core_dir = optarg;
+			opts->pol.core_dir = optarg;
 			break;
 		case 'e':
-			*exe_name = optarg;
+			opts->crash.exe_name = optarg;
 			break;
 		case 'h':
 			usage();
 			exit(0);
 			break;
+		case 'j':
+			opts->import.jobs = atoi(optarg);
+			opts->snapshot.jobs = opts->import.jobs;
+			if (opts->import.jobs <= 0) {
+				fprintf(stderr, "handle_core: invalid argument "
+					"for jobs: %s\n", optarg);
+				return 1;
+			}
+			break;
+		case 'l':
+			opts->mode = MODE_LIST;
+			break;
 		case 'm':
-			*max_cores = atoi(optarg);
-			if (*max_cores == 0) {
+			opts->pol.max_cores = atoi(optarg);
+			if (opts->pol.max_cores <= 0) {
 				fprintf(stderr, "handle_core: invalid argument "
 					"for max_cores: %s. Please give a number "
 					"greater than 0.\n", optarg);
 				return 1;
 			}
 			break;
+		case 'p':
+			opts->crash.pid = atoi(optarg);
+			break;
 		case 's':
-			*email = optarg;
+			opts->pol.email = optarg;
+			break;
+		case 'z':
+			opts->pol.compress = 1;
+			break;
+		case OPT_IMPORT:
+			opts->mode = MODE_IMPORT;
+			break;
+		case OPT_PREPARE:
+			opts->mode = MODE_PREPARE;
+			break;
+		case OPT_RESERVE:
+			if (parse_reserve(optarg, &opts->prepare)) {
+				fprintf(stderr, "handle_core: invalid argument "
+					"for reserve: %s\n", optarg);
+				return 1;
+			}
+			break;
+		case OPT_EXPORT:
+			opts->mode = MODE_EXPORT;
+			break;
+		case OPT_HOST:
+			opts->host = optarg;
+			break;
+		case OPT_MERGE:
+			opts->mode = MODE_MERGE;
+			break;
+		case OPT_SHOW_EXPORT:
+			opts->mode = MODE_SHOW_EXPORT;
+			break;
+		case OPT_SUMMARIZE:
+			opts->mode = MODE_IMPORT;
+			opts->import.in_place = 1;
+			break;
+		case OPT_IO_BUDGET:
+			if (parse_rate(optarg, &opts->import.io_budget)) {
+				fprintf(stderr, "handle_core: invalid argument "
+					"for io-budget: %s. Please give a whole "
+					"number of MB/s.\n", optarg);
+				return 1;
+			}
+			break;
+		case OPT_KEEP_ORIGINALS:
+			opts->import.keep_originals = 1;
+			break;
+		case OPT_RECENT:
+			opts->mode = MODE_RECENT;
+			break;
+		case OPT_TOP:
+			opts->mode = MODE_TOP;
+			break;
+		case OPT_SNAPSHOT:
+			opts->mode = MODE_SNAPSHOT;
+			opts->snapshot_pid = atoi(optarg);
+			if (opts->snapshot_pid <= 0) {
+				fprintf(stderr, "handle_core: invalid pid for "
+					"--snapshot: %s\n", optarg);
+				return 1;
+			}
+			break;
+		case OPT_MAX_BYTES:
+			opts->pol.max_bytes = parse_size(optarg);
+			if (opts->pol.max_bytes == 0) {
+				fprintf(stderr, "handle_core: invalid argument "
+					"for max-bytes: %s\n", optarg);
+				return 1;
+			}
+			break;
+		case OPT_SYMBOLIZE:
+			opts->mode = MODE_SYMBOLIZE;
+			break;
+		case OPT_THIN_AGES:
+			if (parse_thin_ages(optarg, &opts->pol.thin)) {
+				fprintf(stderr, "handle_core: invalid argument "
+					"for thin-ages: %s\n", optarg);
+				return 1;
+			}
+			break;
+		case OPT_THIN:
+			opts->mode = MODE_THIN;
+			break;
+		case OPT_SYNC:
+			opts->pol.sync = 1;
+			break;
+		case OPT_SIMULATE:
+			opts->mode = MODE_SIMULATE;
+			break;
+		case OPT_DEDUP_THREADS:
+			opts->pol.dedup_threads = 1;
+			break;
+		case OPT_SIDECAR:
+			opts->mode = MODE_SIDECAR;
+			break;
+		case OPT_ANALYZE:
+			opts->pol.analyze.command = optarg;
+			break;
+		case OPT_ANALYZE_JOBS:
+			opts->pol.analyze.jobs = atoi(optarg);
+			if (opts->pol.analyze.jobs <= 0) {
+				fprintf(stderr, "handle_core: invalid argument "
+					"for analyze-jobs: %s\n", optarg);
+				return 1;
+			}
+			break;
+		case OPT_ANALYZE_PRIORITY:
+			if (parse_priority(optarg, &opts->pol.analyze)) {
+				fprintf(stderr, "handle_core: invalid argument "
+					"for analyze-priority: %s\n", optarg);
+				return 1;
+			}
+			break;
+		case OPT_PSI_LIMIT:
+			opts->pol.analyze.psi_limit = parse_percent(optarg);
+			if (opts->pol.analyze.psi_limit < 0) {
+				fprintf(stderr, "handle_core: invalid argument "
+					"for psi-limit: %s. Please give a "
+					"percentage from 0 to 100.\n", optarg);
+				return 1;
+			}
+			break;
+		case OPT_RUN_QUEUE:
+			opts->mode = MODE_RUN_QUEUE;
+			break;
+		case OPT_EARLY_MINICORE:
+			opts->pol.early_minicore = 1;
+			break;
+		case OPT_FALLBACK_DIR:
+			if (opts->pol.nalt_dirs == MAX_FALLBACK_DIRS) {
+				fprintf(stderr, "handle_core: too many "
+					"fallback directories\n");
+				return 1;
+			}
+			opts->alt_dirs[opts->pol.nalt_dirs++] = optarg;
+			opts->pol.alt_dirs = opts->alt_dirs;
+			break;
+		case OPT_HEAP_STATS:
+			opts->pol.heap_stats = 1;
+			break;
+		case OPT_HEALTH:
+			opts->mode = MODE_HEALTH;
+			break;
+		case OPT_READ_MEM:
+			opts->mode = MODE_READ_MEM;
+			break;
+		case OPT_READ_SYM:
+			opts->mode = MODE_READ_SYM;
+			break;
+		case OPT_DIFF:
+			opts->mode = MODE_DIFF;
+			break;
+		case OPT_CONTENT:
+			opts->diff_content = 1;
 			break;
 		default:
 			fprintf(stderr, "handle_core: invalid usage\n\n");
@@ -178,120 +593,987 @@ static int parse_options(int argc, char **argv, int *max_cores,
 			break;
 		}
 	}
-	if (*exe_name == NULL) {
+	opts->args = argv + optind;
+	opts->nargs = argc - optind;
+	if (opts->mode == MODE_CAPTURE && opts->crash.exe_name == NULL) {
 		fprintf(stderr, "handle_core: you must supply the executable "
 			"name with -e. Try -h for help.\n");
 		return 1;
 	}
+	if (opts->mode == MODE_IMPORT && opts->nargs == 0) {
+		fprintf(stderr, "handle_core: --%s needs at least one "
+			"path to %s from. Try -h for help.\n",
+			opts->import.in_place ? "summarize" : "import",
+			opts->import.in_place ? "summarize" : "import");
+		return 1;
+	}
+	if (opts->mode == MODE_SYMBOLIZE && opts->nargs == 0) {
+		fprintf(stderr, "handle_core: --symbolize needs at least one "
+			"core. Try -h for help.\n");
+		return 1;
+	}
+	if (opts->mode == MODE_RUN_QUEUE && !opts->pol.analyze.command) {
+		fprintf(stderr, "handle_core: --run-queue needs the analyzer "
+			"to run, given with --analyze. Try -h for help.\n");
+		return 1;
+	}
+	if (opts->mode == MODE_SIDECAR && opts->nargs == 0) {
+		fprintf(stderr, "handle_core: --sidecar needs at least one "
+			"core. Try -h for help.\n");
+		return 1;
+	}
+	if (opts->mode == MODE_EXPORT && opts->nargs != 1) {
+		fprintf(stderr, "handle_core: --export needs the file to "
+			"write. Try -h for help.\n");
+		return 1;
+	}
+	if (opts->mode == MODE_MERGE && opts->nargs < 2) {
+		fprintf(stderr, "handle_core: --merge needs the file to "
+			"write and at least one export. Try -h for help.\n");
+		return 1;
+	}
+	if (opts->mode == MODE_SHOW_EXPORT && opts->nargs == 0) {
+		fprintf(stderr, "handle_core: --show-export needs at least one "
+			"export. Try -h for help.\n");
+		return 1;
+	}
+	if (opts->mode == MODE_READ_MEM && opts->nargs != 3) {
+		fprintf(stderr, "handle_core: --read-mem needs a core, an "
+			"address and a length. Try -h for help.\n");
+		return 1;
+	}
+	if (opts->mode == MODE_READ_SYM &&
+	    (opts->nargs < 2 || opts->nargs > 3)) {
+		fprintf(stderr, "handle_core: --read-sym needs a core and a "
+			"symbol. Try -h for help.\n");
+		return 1;
+	}
+	if (opts->mode == MODE_DIFF && opts->nargs != 2) {
+		fprintf(stderr, "handle_core: --diff needs two cores. Try -h "
+			"for help.\n");
+		return 1;
+	}
 	return 0;
 }
 
-int send_mail(const char *exe_name, const char *core_dir,
-	      const char *core_name, const char *email)
+static int print_record(const struct hc_record *rec, void *arg)
 {
-	char hostname[255];
-	struct hostent *fqdn;
-	const char *fqdn_name;
-	FILE *fp;
+	struct tm tm_buf;
+	char date[64], core[PATH_MAX];
 
-	if (!email)
-		return 0;
-	fp = popen(email, "w");
-	if (!fp) {
-		int err = errno;
-		syslog(LOG_USER | LOG_ERR, "popen(%s) error: %d (%s)",
-			email, err, strerror(err));
-		return err;
-	}
-	if (gethostname(hostname, sizeof(hostname))) {
-		int err = errno;
-		syslog(LOG_USER | LOG_ERR, "gethostname error: %d (%s)",
-			err, strerror(err));
-		snprintf(hostname, sizeof(hostname), "(unknown-host)");
-	}
-	fqdn = gethostbyname(hostname);
-	if (!fqdn) {
-		int err = h_errno;
-		syslog(LOG_USER | LOG_ERR, "gethostbyname(%s) error: %d",
-			hostname, err);
-		fqdn_name = hostname;
+	(void)arg;
+	strftime(date, sizeof(date), "%Y-%m-%d %H:%M:%S",
+		 localtime_r(&rec->time, &tm_buf));
+	/* Where a core which failed over went */
+	snprintf(core, sizeof(core), "%s%s%s", rec->dir,
+		 rec->dir[0] ? "/" : "", rec->core);
+	printf("%s  %-8d %-4d %14llu  %-20s %-40s %-7s %s%s%s%s\n", date,
+	       (int)rec->pid, rec->signo, (unsigned long long)rec->size,
+	       rec->exe, core, hc_form_name(rec->form), rec->func,
+	       rec->integrity ? " [" : "",
+	       rec->integrity ? hc_integrity_name(rec->integrity) : "",
+	       rec->integrity ? "]" : "");
+	return 0;
+}
+
+static int list_index(const char *core_dir)
+{
+	int ret;
+
+	printf("%-19s  %-8s %-4s %14s  %-20s %-40s %-7s %s\n", "TIME", "PID",
+	       "SIG", "SIZE", "EXE", "CORE", "FORM", "FUNC");
+	ret = hc_index_foreach(core_dir, print_record, NULL);
+	if (ret < 0) {
+		fprintf(stderr, "handle_core: unable to read the crash index "
+			"of %s: %d (%s)\n", core_dir, ret, strerror(-ret));
+		return 1;
+	}
+	return 0;
+}
+
+static int print_export_record(const char *host, const struct hc_record *rec,
+			       void *arg)
+{
+	printf("%-16s  ", host);
+	return print_record(rec, arg);
+}
+
+static int show_exports(struct options *opts)
+{
+	int i, ret, failed = 0;
+
+	printf("%-16s  %-19s  %-8s %-4s %14s  %-20s %-40s %-7s %s\n", "HOST",
+	       "TIME", "PID", "SIG", "SIZE", "EXE", "CORE", "FORM", "FUNC");
+	for (i = 0; i < opts->nargs; ++i) {
+		ret = hc_export_foreach(opts->args[i], print_export_record,
+					NULL);
+		if (ret < 0) {
+			fprintf(stderr, "handle_core: unable to read %s: "
+				"%d (%s)\n", opts->args[i], ret,
+				strerror(-ret));
+			failed = 1;
+		}
+	}
+	return failed;
+}
+
+/* --export <file> and --merge <out> <file>... */
+static int export_index(struct options *opts)
+{
+	uint64_t n;
+	int ret;
+
+	if (opts->mode == MODE_EXPORT)
+		ret = hc_export(opts->pol.core_dir, opts->host, opts->args[0],
+				&n);
+	else
+		ret = hc_export_merge(opts->args + 1, opts->nargs - 1,
+				      opts->args[0], &n);
+	if (ret) {
+		fprintf(stderr, "handle_core: unable to write %s: %d (%s)\n",
+			opts->args[0], ret, strerror(-ret));
+		return 1;
+	}
+	printf("%s: %llu records\n", opts->args[0], (unsigned long long)n);
+	return 0;
+}
+
+static int import_cores(struct options *opts)
+{
+	struct hc_import_stats st;
+	int ret;
+
+	ret = hc_import(&opts->pol, &opts->import, opts->args, opts->nargs,
+			&st);
+	if (opts->import.in_place)
+		printf("summarized %llu core%s (%llu bytes read), %llu already "
+		       "indexed, %llu non-core file%s skipped, %llu failed\n",
+		       (unsigned long long)st.summarized,
+		       st.summarized == 1 ? "" : "s",
+		       (unsigned long long)st.bytes_in,
+		       (unsigned long long)st.known,
+		       (unsigned long long)st.skipped,
+		       st.skipped == 1 ? "" : "s",
+		       (unsigned long long)st.failed);
+	else
+		printf("imported %llu core%s (%llu bytes stored for %llu bytes "
+		       "read), %llu duplicate%s, %llu non-core file%s "
+		       "skipped, %llu failed\n",
+		       (unsigned long long)st.imported,
+		       st.imported == 1 ? "" : "s",
+		       (unsigned long long)st.bytes_stored,
+		       (unsigned long long)st.bytes_in,
+		       (unsigned long long)st.duplicates,
+		       st.duplicates == 1 ? "" : "s",
+		       (unsigned long long)st.skipped,
+		       st.skipped == 1 ? "" : "s",
+		       (unsigned long long)st.failed);
+	if (ret < 0) {
+		fprintf(stderr, "handle_core: %s failed: %d (%s)\n",
+			opts->import.in_place ? "summarizing" : "import",
+			ret, strerror(-ret));
+		return 1;
+	}
+	return st.failed ? 1 : 0;
+}
+
+static void print_event(const struct hc_flight_event *ev)
+{
+	time_t secs = ev->time_ns / 1000000000ULL;
+	struct tm tm_buf;
+	char date[64];
+
+	strftime(date, sizeof(date), "%Y-%m-%d %H:%M:%S",
+		 localtime_r(&secs, &tm_buf));
+	printf("%s.%06llu %-8u %-16.16s %-8s ", date,
+	       (unsigned long long)(ev->time_ns % 1000000000ULL) / 1000,
+	       ev->pid, ev->tag, hc_flight_type_name(ev->type));
+	switch (ev->type) {
+	case HC_EV_START:
+		printf("pid=%llu signal=%llu", (unsigned long long)ev->a,
+		       (unsigned long long)ev->b);
+		break;
+	case HC_EV_ADMIT:
+		printf("store=%s input=%s", ev->a ? "hcz" : "raw",
+		       ev->b ? "file" : "pipe");
+		break;
+	case HC_EV_PROGRESS:
+		printf("read=%llu written=%llu", (unsigned long long)ev->a,
+		       (unsigned long long)ev->b);
+		break;
+	case HC_EV_PHASE:
+		printf("%s %.3f ms", hc_phase_name(ev->a), ev->b / 1e6);
+		break;
+	case HC_EV_ERROR:
+		printf("%s", hc_phase_name(ev->a));
+		break;
+	case HC_EV_EXIT:
+		printf("total %.3f ms, %llu bytes", ev->a / 1e6,
+		       (unsigned long long)ev->b);
+		break;
+	case HC_EV_SNAPSHOT:
+		printf("stopped %.3f ms, %llu threads", ev->a / 1e6,
+		       (unsigned long long)ev->b);
+		break;
+	case HC_EV_STAT_BATCH:
+	case HC_EV_UNLINK_BATCH:
+		printf("%llu cores in %.3f ms", (unsigned long long)ev->a,
+		       ev->b / 1e6);
+		break;
+	case HC_EV_COMMIT:
+		printf("%llu changes in %.3f ms", (unsigned long long)ev->a,
+		       ev->b / 1e6);
+		break;
+	case HC_EV_FAILOVER:
+		printf("at=%llu lost=%llu", (unsigned long long)ev->a,
+		       (unsigned long long)ev->b);
+		break;
+	case HC_EV_LOG_DROP:
+		printf("priority=%llu", (unsigned long long)ev->a);
+		break;
+	}
+	if (ev->err)
+		printf(" error=%d (%s)", -ev->err, strerror(-ev->err));
+	printf("\n");
+}
+
+static int show_recent(struct options *opts)
+{
+	struct hc_flight_event *evs;
+	uint64_t counters[HC_COUNT_MAX];
+	int i, n, max = 50;
+
+	if (opts->nargs > 0)
+		max = atoi(opts->args[0]);
+	if (max <= 0) {
+		fprintf(stderr, "handle_core: invalid event count\n");
+		return 1;
+	}
+	evs = calloc(max, sizeof(*evs));
+	if (!evs)
+		return 1;
+	n = hc_flight_read(evs, max);
+	if (n < 0) {
+		fprintf(stderr, "handle_core: unable to read %s: %d (%s)\n",
+			HC_FLIGHT_PATH, n, strerror(-n));
+		free(evs);
+		return 1;
+	}
+	for (i = 0; i < n; ++i)
+		print_event(&evs[i]);
+	free(evs);
+	if (hc_flight_counters(counters) == 0) {
+		printf("log messages: %llu sent, %llu to %s, %llu dropped\n",
+		       (unsigned long long)counters[HC_COUNT_LOG_SENT],
+		       (unsigned long long)counters[HC_COUNT_LOG_FALLBACK],
+		       HC_LOG_FALLBACK_PATH,
+		       (unsigned long long)counters[HC_COUNT_LOG_DROPPED]);
+		if (counters[HC_COUNT_COMMITTED])
+			printf("synced: %llu changes in %llu flushes\n",
+			       (unsigned long long)
+			       counters[HC_COUNT_COMMITTED],
+			       (unsigned long long)counters[HC_COUNT_COMMITS]);
+	}
+	return 0;
+}
+
+/* Print a byte count in a human-friendly unit into buf */
+static const char *human_bytes(char *buf, size_t len, double bytes)
+{
+	static const char *units[] = { "B", "K", "M", "G", "T" };
+	int u = 0;
+
+	while (bytes >= 1024 && u < 4) {
+		bytes /= 1024;
+		u++;
+	}
+	snprintf(buf, len, u ? "%.1f%s" : "%.0f%s", bytes, units[u]);
+	return buf;
+}
+
+/* Parse a --simulate-retention policy into pol, on top of base */
+static int parse_sim_policy(char *str, const struct hc_policy *base,
+			    struct hc_policy *pol)
+{
+	char *saveptr = NULL, *tok, *val;
+
+	*pol = *base;
+	memset(&pol->thin, 0, sizeof(pol->thin));
+	pol->max_bytes = 0;
+	pol->compress = 0;
+	for (tok = strtok_r(str, ",", &saveptr); tok;
+	     tok = strtok_r(NULL, ",", &saveptr)) {
+		val = strchr(tok, '=');
+		if (val)
+			*val++ = '\0';
+		if (!strcmp(tok, "z") && !val)
+			pol->compress = 1;
+		else if (!strcmp(tok, "m") && val)
+			pol->max_cores = atoi(val);
+		else if (!strcmp(tok, "bytes") && val)
+			pol->max_bytes = parse_size(val);
+		else if (!strcmp(tok, "thin") && val &&
+			 parse_thin_ages(val, &pol->thin) == 0)
+			continue;
+		else
+			return -1;
+		if (pol->max_cores <= 0 || (val && !strcmp(tok, "bytes") &&
+					    !pol->max_bytes))
+			return -1;
+	}
+	return 0;
+}
+
+static void print_sim_result(const char *desc, const struct hc_sim_result *r)
+{
+	char b1[16], b2[16], date[32];
+	struct tm tm_buf;
+	unsigned i;
+
+	printf("%s\n", desc);
+	printf("  %-16s %10s %8s %11s\n", "TIME", "DISK", "FILES",
+	       "SIGNATURES");
+	for (i = 0; i < r->nsamples; ++i) {
+		const struct hc_sim_sample *sm = &r->samples[i];
+		strftime(date, sizeof(date), "%Y-%m-%d %H:%M",
+			 localtime_r(&sm->time, &tm_buf));
+		printf("  %-16s %10s %8llu %11llu\n", date,
+		       human_bytes(b1, sizeof(b1), sm->bytes),
+		       (unsigned long long)sm->files,
+		       (unsigned long long)sm->signatures);
+	}
+	strftime(date, sizeof(date), "%Y-%m-%d %H:%M",
+		 localtime_r(&r->peak_time, &tm_buf));
+	printf("  peak %s at %s; %s freed by thinning and deletion\n",
+	       human_bytes(b1, sizeof(b1), r->peak_bytes), date,
+	       human_bytes(b2, sizeof(b2), r->bytes_freed));
+	printf("  %llu crashes: %llu full, %llu compressed, %llu minicores, "
+	       "%llu summaries, %llu of them deleted outright\n",
+	       (unsigned long long)r->crashes,
+	       (unsigned long long)r->forms[HC_FORM_FULL],
+	       (unsigned long long)r->forms[HC_FORM_HCZ],
+	       (unsigned long long)r->forms[HC_FORM_MINI],
+	       (unsigned long long)r->forms[HC_FORM_SUMMARY],
+	       (unsigned long long)r->deleted);
+	printf("  %llu of %llu signatures keep a core\n",
+	       (unsigned long long)r->signatures_kept,
+	       (unsigned long long)r->signatures);
+	for (i = 0; i < r->nlost; ++i)
+		printf("  lost: %s (%llu crashes)\n", r->lost[i].sig,
+		       (unsigned long long)r->lost[i].crashes);
+}
+
+static int simulate_retention(struct options *opts)
+{
+	struct hc_sim_result *results;
+	struct hc_policy *pols;
+	char desc[128], thin[96], bytes[16];
+	int i, n = opts->nargs ? opts->nargs : 1, ret;
+	struct timespec t0, t1;
+
+	pols = calloc(n, sizeof(*pols));
+	results = calloc(n, sizeof(*results));
+	if (!pols || !results) {
+		free(pols);
+		free(results);
+		return 1;
+	}
+	pols[0] = opts->pol;
+	for (i = 0; i < opts->nargs; ++i) {
+		char *arg = strdup(opts->args[i]);
+		ret = arg ? parse_sim_policy(arg, &opts->pol, &pols[i]) : -1;
+		free(arg);
+		if (ret) {
+			fprintf(stderr, "handle_core: invalid policy: %s\n",
+				opts->args[i]);
+			free(pols);
+			free(results);
+			return 1;
+		}
+	}
+	clock_gettime(CLOCK_MONOTONIC, &t0);
+	ret = hc_simulate_retention(opts->pol.core_dir, pols, n, results);
+	clock_gettime(CLOCK_MONOTONIC, &t1);
+	if (ret) {
+		fprintf(stderr, "handle_core: unable to replay the crash index "
+			"of %s: %d (%s)\n", opts->pol.core_dir, ret,
+			strerror(-ret));
+		free(pols);
+		free(results);
+		return 1;
+	}
+	for (i = 0; i < n; ++i) {
+		const struct hc_thin_policy *th = &pols[i].thin;
+		thin[0] = '\0';
+		if (hc_thin_enabled(&pols[i]))
+			snprintf(thin, sizeof(thin), " thin=%llds:%llds:%llds",
+				 (long long)th->compress,
+				 (long long)th->minicore,
+				 (long long)th->summary);
+		snprintf(desc, sizeof(desc), "policy: m=%d bytes=%s%s%s",
+			 pols[i].max_cores, pols[i].max_bytes ?
+			 human_bytes(bytes, sizeof(bytes),
+				     pols[i].max_bytes) : "-",
+			 pols[i].compress ? " z" : "", thin);
+		print_sim_result(desc, &results[i]);
+	}
+	printf("replayed %llu crashes under %d policies in %.3f s\n",
+	       (unsigned long long)results[0].crashes, n,
+	       (t1.tv_sec - t0.tv_sec) + (t1.tv_nsec - t0.tv_nsec) / 1e9);
+	free(pols);
+	free(results);
+	return 0;
+}
+
+static void print_progress(const struct hc_progress *p, uint64_t now_ns)
+{
+	char rd[16], wr[16], tot[16], rate[16], eta[32];
+	double elapsed = (now_ns - p->start_ns) / 1e9;
+
+	if (p->total && p->rate && p->bytes_read < p->total) {
+		uint64_t secs = (p->total - p->bytes_read) / p->rate;
+		snprintf(eta, sizeof(eta), "%llu:%02llu",
+			 (unsigned long long)secs / 60,
+			 (unsigned long long)secs % 60);
 	}
 	else {
-		fqdn_name = fqdn->h_name;
-	}
-	fprintf(fp, "\
-Subject: [core_dump] %s crashed on %s\r\n\r\n\
-!!!!! Crash encountered on %s !!!!!!!!!\r\n\
-executable name: %s\r\n\
-core file name: %s/%s\r\n\
-", exe_name, hostname, fqdn_name, exe_name, core_dir, core_name);
-	fclose(fp);
+		snprintf(eta, sizeof(eta), "-");
+	}
+	printf("%-8u %-16.16s %8s %8s %8s %5.1f%% %4u/%-4u %9s/s %8.1fs %8s\n",
+	       p->pid, p->exe,
+	       human_bytes(rd, sizeof(rd), p->bytes_read),
+	       human_bytes(wr, sizeof(wr), p->bytes_written),
+	       p->total ? human_bytes(tot, sizeof(tot), p->total) : "?",
+	       p->total ? 100.0 * p->bytes_read / p->total : 0.0,
+	       p->cur_seg, p->nsegs, human_bytes(rate, sizeof(rate), p->rate),
+	       elapsed, eta);
+}
+
+static int show_top(void)
+{
+	struct hc_progress p[HC_PROGRESS_SLOTS];
+	int tty = isatty(STDOUT_FILENO);
+	struct timespec ts;
+	int i, n;
+
+	while (1) {
+		n = hc_progress_read(p, HC_PROGRESS_SLOTS);
+		if (n < 0 && n != -ENOENT) {
+			fprintf(stderr, "handle_core: unable to read %s: "
+				"%d (%s)\n", HC_PROGRESS_PATH, n, strerror(-n));
+			return 1;
+		}
+		clock_gettime(CLOCK_REALTIME, &ts);
+		if (tty)
+			printf("\033[H\033[2J");
+		printf("%-8s %-16s %8s %8s %8s %6s %9s %11s %9s %8s\n",
+		       "PID", "EXE", "READ", "WRITTEN", "TOTAL", "DONE",
+		       "SEGMENT", "RATE", "ELAPSED", "ETA");
+		for (i = 0; i < n; ++i)
+			print_progress(&p[i], ts.tv_sec * 1000000000ULL +
+					      ts.tv_nsec);
+		if (!tty)
+			return 0;
+		fflush(stdout);
+		sleep(1);
+	}
+}
+
+static int take_snapshot(struct options *opts)
+{
+	struct hc_snapshot_stats st;
+	struct hc_record rec;
+	int ret;
+
+	ret = hc_snapshot(&opts->pol, opts->snapshot_pid, &opts->snapshot,
+			  &rec, &st);
+	if (ret) {
+		fprintf(stderr, "handle_core: unable to snapshot %d: %d (%s)\n",
+			opts->snapshot_pid, ret, strerror(-ret));
+		return 1;
+	}
+	printf("%s/%s: %u threads, %u segments, %llu bytes; process stopped "
+	       "for %.3f ms, memory read in %.3f ms\n", opts->pol.core_dir,
+	       rec.core, st.threads, st.segments,
+	       (unsigned long long)rec.size, st.pause_ns / 1e6,
+	       st.read_ns / 1e6);
 	return 0;
 }
 
-int main(int argc, char **argv)
+static int print_symbol(const struct hc_symbol *sym, void *arg)
 {
-	int max_cores, deleted, ret, done = 0;
-	char *exe_name, *core_dir, *email;
-	char core_name[PATH_MAX];
-	FILE *fp;
+	char buf[HC_FUNC_MAX + 32];
 
-	/* Write the core to a file */
-	ret = parse_options(argc, argv, &max_cores, &exe_name, &core_dir,
-			    &email);
+	(void)arg;
+	hc_symbol_format(sym, buf, sizeof(buf));
+	printf("  %-8d 0x%016llx %s", (int)sym->tid,
+	       (unsigned long long)sym->pc, buf);
+	if (sym->name && sym->module)
+		printf(" (%s)", sym->module);
+	printf("\n");
+	return 0;
+}
+
+static int symbolize_cores(struct options *opts)
+{
+	char path[PATH_MAX];
+	int i, ret, failed = 0;
+
+	for (i = 0; i < opts->nargs; ++i) {
+		/* Bare names are cores in core_dir */
+		if (strchr(opts->args[i], '/'))
+			snprintf(path, sizeof(path), "%s", opts->args[i]);
+		else
+			snprintf(path, sizeof(path), "%s/%s",
+				 opts->pol.core_dir, opts->args[i]);
+		printf("%s:\n", path);
+		ret = hc_symbolize(opts->pol.core_dir, path, HC_SYM_BUILD,
+				   print_symbol, NULL);
+		if (ret) {
+			fprintf(stderr, "handle_core: unable to symbolize %s: "
+				"%d (%s)\n", path, ret, strerror(-ret));
+			failed = 1;
+		}
+	}
+	return failed;
+}
+
+static int print_sidecar_line(char *line, void *arg)
+{
+	(void)arg;
+	printf("  %s\n", line);
+	return 0;
+}
+
+static int show_sidecars(struct options *opts)
+{
+	const char *core;
+	int i, ret, failed = 0;
+
+	for (i = 0; i < opts->nargs; ++i) {
+		core = strrchr(opts->args[i], '/');
+		core = core ? core + 1 : opts->args[i];
+		printf("%s:\n", core);
+		ret = hc_sidecar_foreach(opts->pol.core_dir, core,
+					 print_sidecar_line, NULL);
+		if (ret) {
+			fprintf(stderr, "handle_core: unable to read the "
+				"sidecar of %s: %d (%s)\n", core, ret,
+				strerror(-ret));
+			failed = 1;
+		}
+	}
+	return failed;
+}
+
+/* A line of a hexdump: n bytes, at most 16, at addr */
+static void dump_line(const char *prefix, uint64_t addr,
+		      const unsigned char *buf, size_t n)
+{
+	size_t i;
+
+	printf("%s%016llx", prefix, (unsigned long long)addr);
+	for (i = 0; i < 16; ++i) {
+		if (i < n)
+			printf("%s%02x", i % 8 ? " " : "  ", buf[i]);
+		else
+			printf("%s  ", i % 8 ? " " : "  ");
+	}
+	printf("  |");
+	for (i = 0; i < n; ++i)
+		putchar(buf[i] >= 0x20 && buf[i] < 0x7f ? buf[i] : '.');
+	printf("|\n");
+}
+
+/* Print len bytes at addr as a hex dump, 16 to a line. Lines the core
+ * doesn't have are run together. */
+static int dump_mem(struct hc_peek *p, uint64_t addr, uint64_t len)
+{
+	unsigned char buf[16];
+	uint64_t missing = 0, pos;
+	size_t n;
+	int ret;
+
+	for (pos = 0; pos < len; pos += n) {
+		n = len - pos < sizeof(buf) ? len - pos : sizeof(buf);
+		ret = hc_peek_mem(p, addr + pos, buf, n);
+		if (ret == -EFAULT) {
+			if (!missing)
+				printf("%016llx  not in the core",
+				       (unsigned long long)(addr + pos));
+			missing += n;
+			continue;
+		}
+		if (ret)
+			return ret;
+		if (missing)
+			printf(" (%llu bytes)\n", (unsigned long long)missing);
+		missing = 0;
+		dump_line("", addr + pos, buf, n);
+	}
+	if (missing)
+		printf(" (%llu bytes)\n", (unsigned long long)missing);
+	return 0;
+}
+
+/* --read-mem <core> <addr> <len> and --read-sym <core> <symbol> [len] */
+static int read_mem(struct options *opts)
+{
+	const char *core = opts->args[0], *what;
+	uint64_t addr, size = 0, len = 0;
+	struct hc_peek *p;
+	char *end;
+	int ret;
+
+	if (opts->mode == MODE_READ_MEM) {
+		what = "memory";
+		addr = strtoull(opts->args[1], &end, 0);
+		if (end == opts->args[1] || *end) {
+			fprintf(stderr, "handle_core: invalid address: %s\n",
+				opts->args[1]);
+			return 1;
+		}
+	} else {
+		what = opts->args[1];
+	}
+	if (opts->nargs == 3) {
+		len = parse_size(opts->args[2]);
+		if (len == 0) {
+			fprintf(stderr, "handle_core: invalid length: %s\n",
+				opts->args[2]);
+			return 1;
+		}
+	}
+	ret = hc_peek_open(opts->pol.core_dir, core, &p);
 	if (ret) {
-		syslog(LOG_USER | LOG_ERR, "parse_options error\n");
+		fprintf(stderr, "handle_core: unable to open %s: %d (%s)\n",
+			core, ret, strerror(-ret));
 		return 1;
 	}
-	get_core_name(core_dir, exe_name, core_name);
-	fp = fopen(core_name, "w");
-	if (!fp) {
-		int err = errno;
-		syslog(LOG_USER | LOG_ERR, "unable to open %s: "
-		       "error %d (%s)\n", core_name, err, strerror(err));
-		return err;
-	}
-	do {
-		size_t res;
-		char buf[BUF_SIZE];
-		size_t nread = fread(buf, 1, BUF_SIZE, stdin);
-		if (nread != BUF_SIZE) {
-			if (ferror(fp)) {
-				int err = errno;
-				syslog(LOG_USER | LOG_ERR, "error reading core "
-				       "file from stdin: %d (%s)", err, strerror(err));
-				fclose(fp);
-				return err;
-			}
-			else {
-				done = 1;
-			}
+	if (opts->mode == MODE_READ_SYM) {
+		ret = hc_peek_sym(p, what, &addr, &size);
+		if (ret) {
+			fprintf(stderr, "handle_core: unable to find %s in %s: "
+				"%d (%s)\n", what, hc_peek_path(p), ret,
+				strerror(-ret));
+			hc_peek_close(p);
+			return 1;
+		}
+		printf("%s: %s at 0x%llx, %llu bytes\n", hc_peek_path(p), what,
+		       (unsigned long long)addr, (unsigned long long)size);
+		if (!len)
+			len = size ? size : 16;
+	} else {
+		printf("%s:\n", hc_peek_path(p));
+	}
+	ret = dump_mem(p, addr, len);
+	if (ret)
+		fprintf(stderr, "handle_core: unable to read the %s of %s: "
+			"%d (%s)\n", what, hc_peek_path(p), ret,
+			strerror(-ret));
+	hc_peek_close(p);
+	return ret ? 1 : 0;
+}
+
+struct diff_print {
+	const char *a_name, *b_name;
+	struct hc_peek *a, *b;	/* NULL for a core which is gone */
+	int content;
+	int header;		/* printed */
+};
+
+static void print_diff_header(struct diff_print *d)
+{
+	if (d->header)
+		return;
+	d->header = 1;
+	printf("a: %s\nb: %s\n", d->a ? hc_peek_path(d->a) : d->a_name,
+	       d->b ? hc_peek_path(d->b) : d->b_name);
+	printf("%-8s %-16s %-16s %10s %s  %-32s %s\n", "CHANGE", "A", "B",
+	       "BYTES", "PRM", "MAPPING", "SYMBOL");
+}
+
+/* The lines of range r which differ, a page at a time from each core */
+static int dump_diff(struct hc_peek *a, struct hc_peek *b,
+		     const struct hc_diff_range *r)
+{
+	unsigned char abuf[4096], bbuf[4096];
+	uint64_t pos;
+	size_t n, i, len;
+	int aret, bret;
+
+	for (pos = 0; pos < r->len; pos += n) {
+		n = r->len - pos < sizeof(abuf) ? r->len - pos : sizeof(abuf);
+		aret = hc_peek_mem(a, r->a_addr + pos, abuf, n);
+		bret = hc_peek_mem(b, r->b_addr + pos, bbuf, n);
+		if (aret && aret != -EFAULT)
+			return aret;
+		if (bret && bret != -EFAULT)
+			return bret;
+		/* One of them is a minicore, say */
+		if (aret || bret) {
+			printf("  %016llx  not in the %s core (%zu bytes)\n",
+			       (unsigned long long)(aret ? r->a_addr + pos :
+						    r->b_addr + pos),
+			       aret ? "first" : "second", n);
+			continue;
+		}
+		for (i = 0; i < n; i += 16) {
+			len = n - i < 16 ? n - i : 16;
+			if (!memcmp(abuf + i, bbuf + i, len))
+				continue;
+			dump_line("- ", r->a_addr + pos + i, abuf + i, len);
+			dump_line("+ ", r->b_addr + pos + i, bbuf + i, len);
+		}
+	}
+	return 0;
+}
+
+static void diff_addr(uint64_t addr, int present, char *buf, size_t len)
+{
+	if (present)
+		snprintf(buf, len, "%016llx", (unsigned long long)addr);
+	else
+		snprintf(buf, len, "-");
+}
+
+static int print_diff_range(const struct hc_diff_range *r, void *arg)
+{
+	struct diff_print *d = arg;
+	char a[20], b[20], perm[4], where[64], func[HC_FUNC_MAX + 24];
+	struct hc_peek *p = r->kind == HC_DIFF_ONLY_B ? d->b : d->a;
+	struct hc_symbol sym;
+	const char *base;
+
+	print_diff_header(d);
+	diff_addr(r->a_addr, r->kind != HC_DIFF_ONLY_B, a, sizeof(a));
+	diff_addr(r->b_addr, r->kind != HC_DIFF_ONLY_A, b, sizeof(b));
+	perm[0] = r->flags & PF_R ? 'r' : '-';
+	perm[1] = r->flags & PF_W ? 'w' : '-';
+	perm[2] = r->flags & PF_X ? 'x' : '-';
+	perm[3] = '\0';
+	if (r->path) {
+		base = strrchr(r->path, '/');
+		snprintf(where, sizeof(where), "%s+0x%llx",
+			 base ? base + 1 : r->path,
+			 (unsigned long long)r->file_off);
+	} else {
+		snprintf(where, sizeof(where), "[anon]");
+	}
+	snprintf(func, sizeof(func), "-");
+	if (p && hc_peek_symbolize(p, r->kind == HC_DIFF_ONLY_B ? r->b_addr :
+				   r->a_addr, &sym) == 0 && sym.name)
+		snprintf(func, sizeof(func), "%s+0x%llx", sym.name,
+			 (unsigned long long)sym.offset);
+	printf("%-8s %-16s %-16s %10llu %s  %-32s %s\n",
+	       hc_diff_kind_name(r->kind), a, b, (unsigned long long)r->len,
+	       perm, where, func);
+	if (d->content && r->kind == HC_DIFF_CHANGED)
+		return dump_diff(d->a, d->b, r);
+	return 0;
+}
+
+/* --diff <a> <b> */
+static int diff_cores(struct options *opts)
+{
+	const char *core_dir = opts->pol.core_dir;
+	const char *a = opts->args[0], *b = opts->args[1];
+	struct diff_print d = { a, b, NULL, NULL, opts->diff_content, 0 };
+	struct hc_diff_stats st;
+	int ret;
+
+	/* Only symbols and contents need the cores themselves, which may have
+	 * been thinned away since */
+	ret = hc_peek_open(core_dir, a, &d.a);
+	if (ret == 0)
+		ret = hc_peek_open(core_dir, b, &d.b);
+	if (ret && d.content) {
+		fprintf(stderr, "handle_core: unable to open %s: %d (%s)\n",
+			d.a ? b : a, ret, strerror(-ret));
+		hc_peek_close(d.a);
+		return 1;
+	}
+	ret = hc_diff(core_dir, a, b, print_diff_range, &d, &st);
+	if (ret == 0)
+		print_diff_header(&d);
+	hc_peek_close(d.a);
+	hc_peek_close(d.b);
+	if (ret) {
+		fprintf(stderr, "handle_core: unable to compare %s and %s: "
+			"%d (%s)\n", a, b, ret, strerror(-ret));
+		return 1;
+	}
+	printf("%llu pages compared: %llu changed, %llu unknown, %llu only in "
+	       "a, %llu only in b, in %llu ranges\n",
+	       (unsigned long long)st.pages, (unsigned long long)st.changed,
+	       (unsigned long long)st.unknown, (unsigned long long)st.only_a,
+	       (unsigned long long)st.only_b, (unsigned long long)st.ranges);
+	return 0;
+}
+
+static int run_queue(struct options *opts)
+{
+	struct hc_analyze_stats st;
+	int ret;
+
+	ret = hc_analyze_run(&opts->pol, &st);
+	if (ret) {
+		fprintf(stderr, "handle_core: unable to run the analysis queue "
+			"of %s: %d (%s)\n", opts->pol.core_dir, ret,
+			strerror(-ret));
+		return 1;
+	}
+	printf("%s: %llu analyzed, %llu failed, %llu duplicates, %llu gone, "
+	       "%llu backoffs\n", opts->pol.core_dir,
+	       (unsigned long long)st.analyzed,
+	       (unsigned long long)st.failed,
+	       (unsigned long long)st.duplicates,
+	       (unsigned long long)st.gone,
+	       (unsigned long long)st.backoffs);
+	return 0;
+}
+
+static int show_health(struct options *opts)
+{
+	const struct hc_policy *pol = &opts->pol;
+	struct hc_health h;
+	char when[64];
+	struct tm tm_buf;
+	const char *dir;
+	int i, ret;
+
+	printf("%-40s %-12s %10s %8s %7s  %s\n", "DIR", "STATUS", "MS/MB",
+	       "SAMPLES", "ERRORS", "LAST ERROR");
+	for (i = -1; i < pol->nalt_dirs; ++i) {
+		dir = i < 0 ? pol->core_dir : pol->alt_dirs[i];
+		ret = hc_health_read(dir, &h);
+		if (ret) {
+			fprintf(stderr, "handle_core: unable to read the "
+				"health of %s: %d (%s)\n", dir, ret,
+				strerror(-ret));
+			return 1;
 		}
-		res = fwrite(buf, 1, nread, fp);
-		if (res != nread) {
-			int err = errno;
-			syslog(LOG_USER | LOG_ERR, "error writing core "
-			       "file to %s: %d (%s)", core_name, err, strerror(err));
-			fclose(fp);
-			return err;
+		when[0] = '\0';
+		if (h.last_error) {
+			strftime(when, sizeof(when), "%Y-%m-%d %H:%M:%S",
+				 localtime_r(&h.last_error, &tm_buf));
+			snprintf(when + strlen(when),
+				 sizeof(when) - strlen(when), " (%s)",
+				 strerror(h.last_errno));
 		}
-	} while (!done);
-	fclose(fp);
+		printf("%-40s %-12s %10.1f %8llu %7llu  %s\n", dir,
+		       h.status ? strerror(-h.status) : "ok",
+		       h.ns_per_mb / 1e6, (unsigned long long)h.samples,
+		       (unsigned long long)h.errors, when);
+	}
+	return 0;
+}
+
+static const char *fs_name(uint64_t type)
+{
+	switch (type) {
+	case 0xef53: return "ext4";
+	case 0x58465342: return "xfs";
+	case 0x9123683e: return "btrfs";
+	case 0x2fc12fc1: return "zfs";
+	case 0x6969: return "nfs";
+	case 0x794c7630: return "overlay";
+	/* Cores there take up memory, and are gone at reboot */
+	case 0x01021994: return "tmpfs!";
+	}
+	return "other";
+}
+
+static int prepare_dirs(struct options *opts)
+{
+	const struct hc_policy *pol = &opts->pol;
+	struct hc_ready r;
+	const char *dir;
+	int i, ret, failed = 0;
+
+	printf("%-40s %-24s %-8s %10s %8s  %s\n", "DIR", "STATUS", "FS",
+	       "FREE(MB)", "MS/MB", "RESERVES");
+	for (i = -1; i < pol->nalt_dirs; ++i) {
+		dir = i < 0 ? pol->core_dir : pol->alt_dirs[i];
+		ret = hc_prepare(pol, dir, &opts->prepare, &r);
+		printf("%-40s %-24s %-8s %10llu %8.1f  %ux%lluM\n", dir,
+		       ret ? strerror(-ret) : "ready",
+		       r.fs_type ? fs_name(r.fs_type) : "-",
+		       (unsigned long long)(r.avail >> 20), r.ns_per_mb / 1e6,
+		       r.nreserve, (unsigned long long)(r.reserve_size >> 20));
+		if (ret)
+			failed = 1;
+	}
+	return failed;
+}
 
-	/* Make sure we don't have too many cores sitting around. */
-	deleted = limit_core_files(core_dir, max_cores);
-	if (deleted < 0) {
-		syslog(LOG_USER | LOG_ERR, "error limiting number of core "
-			"files: %d", deleted);
+static int thin_cores(struct options *opts)
+{
+	struct hc_thin_stats st;
+	int ret;
+
+	ret = hc_thin(&opts->pol, &st);
+	if (ret) {
+		fprintf(stderr, "handle_core: unable to thin %s: %d (%s)\n",
+			opts->pol.core_dir, ret, strerror(-ret));
+		return 1;
 	}
+	printf("%s: %llu compressed, %llu cut to minicores, %llu summarized, "
+	       "%llu expired, %llu bytes freed\n", opts->pol.core_dir,
+	       (unsigned long long)st.compressed,
+	       (unsigned long long)st.minicores,
+	       (unsigned long long)st.summarized,
+	       (unsigned long long)st.expired,
+	       (unsigned long long)st.bytes_freed);
+	return 0;
+}
 
-	ret = send_mail(exe_name, core_dir, core_name, email);
+int main(int argc, char **argv)
+{
+	struct options opts;
+	int ret;
+
+	ret = parse_options(argc, argv, &opts);
 	if (ret) {
-		syslog(LOG_USER | LOG_ERR, "send_mail failed with error "
-		       "code %d\n", ret);
+		hc_log(LOG_ERR, "bad_options", "argc=%d", argc);
+		return 1;
 	}
+	if (opts.mode == MODE_LIST)
+		return list_index(opts.pol.core_dir);
+	if (opts.mode == MODE_IMPORT)
+		return import_cores(&opts);
+	if (opts.mode == MODE_RECENT)
+		return show_recent(&opts);
+	if (opts.mode == MODE_TOP)
+		return show_top();
+	if (opts.mode == MODE_SNAPSHOT)
+		return take_snapshot(&opts);
+	if (opts.mode == MODE_SYMBOLIZE)
+		return symbolize_cores(&opts);
+	if (opts.mode == MODE_THIN)
+		return thin_cores(&opts);
+	if (opts.mode == MODE_SIMULATE)
+		return simulate_retention(&opts);
+	if (opts.mode == MODE_SIDECAR)
+		return show_sidecars(&opts);
+	if (opts.mode == MODE_RUN_QUEUE)
+		return run_queue(&opts);
+	if (opts.mode == MODE_HEALTH)
+		return show_health(&opts);
+	if (opts.mode == MODE_READ_MEM || opts.mode == MODE_READ_SYM)
+		return read_mem(&opts);
+	if (opts.mode == MODE_EXPORT || opts.mode == MODE_MERGE)
+		return export_index(&opts);
+	if (opts.mode == MODE_SHOW_EXPORT)
+		return show_exports(&opts);
+	if (opts.mode == MODE_PREPARE)
+		return prepare_dirs(&opts);
+	if (opts.mode == MODE_DIFF)
+		return diff_cores(&opts);
 
-	syslog(LOG_USER | LOG_ERR, "wrote core %s. Deleted %d extra core%s\n",
-	       core_name, deleted, ((deleted == 1) ? "" : "s"));
+	/* Write the core to a file */
+	ret = hc_capture(&opts.pol, &opts.crash, STDIN_FILENO, NULL);
+	if (ret)
+		return -ret;
 	return 0;
 }
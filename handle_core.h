@@ -0,0 +1,588 @@
+#ifndef HANDLE_CORE_H
+#define HANDLE_CORE_H
+
+#include <limits.h>
+#include <stdint.h>
+#include <sys/types.h>
+#include <time.h>
+
+/*
+ * libhandle_core: the capture pipeline behind handle_core(1)
+ *
+ * Programs which already hold a pipe or file descriptor carrying a core image
+ * (a process supervisor, for example) can hand it to hc_capture() instead of
+ * exec'ing a new handler per crash. The retention and index functions are
+ * shared with the handle_core tools.
+ *
+ * Unless noted otherwise, functions return 0 (or a non-negative count) on
+ * success and a negative errno value on failure.
+ */
+
+#define HC_CORE_PREFIX "core."
+#define HC_CORE_PREFIX_SZ (sizeof(HC_CORE_PREFIX)-1)
+#define HC_INDEX_NAME ".index"
+#define HC_PARTIAL_NAME ".partial"	/* cores which didn't arrive whole */
+#define HC_EXE_NAME_MAX 256
+#define HC_FUNC_MAX 128
+#define HC_DIR_MAX 256
+
+/* Ages, in seconds, at which stored cores are thinned: compressed, cut down
+ * to a minicore, deleted leaving only their index record, and finally
+ * dropped from the index. 0 skips a step. See thin.c. */
+struct hc_thin_policy {
+	time_t compress;
+	time_t minicore;
+	time_t summary;
+	time_t expire;
+};
+
+/* I/O scheduling classes */
+enum {
+	HC_IOPRIO_BE = 2,	/* best effort */
+	HC_IOPRIO_IDLE = 3,	/* only when the disk is otherwise idle */
+};
+
+/* Running an external analyzer, such as gdb -batch, over each new core from
+ * a persistent queue. See analyze.c. */
+struct hc_analyze_policy {
+	const char *command;	/* sh -c command, given the core and exe
+				 * name as $1 and $2; NULL for none */
+	int jobs;		/* analyzers run at once */
+	int nice;		/* CPU niceness of the analyzers */
+	int ioprio;		/* their I/O class, HC_IOPRIO_* */
+	int psi_limit;		/* start none while CPU, I/O or memory
+				 * pressure is above this percentage; 0
+				 * ignores pressure */
+};
+
+/* How cores are stored, kept and announced */
+struct hc_policy {
+	const char *core_dir;	/* directory to write core files into */
+	int max_cores;		/* number of cores to keep, or 0 */
+	const char *email;	/* mail command, or NULL */
+	int compress;		/* store cores in the .hcz format */
+	uint64_t max_bytes;	/* disk space the cores may use, or 0 */
+	int sync;		/* flush cores and the index to disk */
+	int dedup_threads;	/* keep one thread per distinct stack */
+	int early_minicore;	/* also write a minicore as the core arrives */
+	int heap_stats;		/* record malloc's statistics in the
+				 * sidecar */
+	const char *const *alt_dirs;	/* where else cores may go when
+					 * core_dir's disk is failing */
+	int nalt_dirs;
+	struct hc_thin_policy thin;	/* all 0: delete cores whole */
+	struct hc_analyze_policy analyze;
+};
+
+/* What we know about a crash before reading its core */
+struct hc_crash {
+	const char *exe_name;	/* name of the executable (%e) */
+	pid_t pid;		/* pid of the crashed process, or 0 */
+	int signo;		/* fatal signal, or 0 */
+};
+
+/* One entry of the crash index */
+struct hc_record {
+	time_t time;
+	pid_t pid;
+	int signo;
+	uint64_t size;		/* size of the core image */
+	uint64_t stored;	/* bytes it takes on disk, if known */
+	uint64_t hash;		/* content hash of the core image, or 0 */
+	char exe[HC_EXE_NAME_MAX];
+	char core[NAME_MAX + 1];	/* file name relative to core_dir */
+	char func[HC_FUNC_MAX];	/* where the crashing thread was, if known */
+	int form;		/* enum hc_form */
+	char was[NAME_MAX + 1];	/* the record this one replaces, if any */
+	char dir[HC_DIR_MAX];	/* where the core went instead of core_dir,
+				 * if it failed over */
+	int integrity;		/* enum hc_integrity */
+};
+
+/* Whether all of a core arrived */
+enum hc_integrity {
+	HC_INTEGRITY_COMPLETE,	/* every segment, in full */
+	HC_INTEGRITY_TRUNCATED,	/* the stream ended early */
+	HC_INTEGRITY_MALFORMED,	/* its headers make no sense */
+	HC_INTEGRITY_UNVERIFIED,	/* not a core we can check */
+};
+
+const char *hc_integrity_name(int integrity);
+
+/* What is left of a stored core */
+enum hc_form {
+	HC_FORM_FULL,		/* the core as the kernel wrote it */
+	HC_FORM_HCZ,		/* compressed */
+	HC_FORM_MINI,		/* headers, notes and stacks only */
+	HC_FORM_SUMMARY,	/* no file, just the index record */
+	HC_FORM_EXPIRED,	/* forgotten; never returned by readers */
+};
+
+const char *hc_form_name(int form);
+
+/* Fill in the defaults used by handle_core(1) */
+void hc_policy_init(struct hc_policy *pol);
+
+/* Print the name of a new core into a buffer of size PATH_MAX */
+void hc_core_name(const char *core_dir, const char *exe_name, time_t now,
+		  char *core_name);
+
+/* Copy the core image readable from in_fd into a new file in core_dir.
+ * On success, rec describes the new core. */
+int hc_ingest(const struct hc_policy *pol, const struct hc_crash *crash,
+	      int in_fd, struct hc_record *rec);
+
+/* The whole pipeline: ingest, index, retention and notification.
+ * rec may be NULL. With pol->sync, a core which was stored but couldn't be
+ * made durable still returns the error. */
+int hc_capture(const struct hc_policy *pol, const struct hc_crash *crash,
+	       int in_fd, struct hc_record *rec);
+
+/* Delete the oldest cores in core_dir so that at most max_cores remain; a
+ * max_cores of 0 deletes nothing. Returns the number of cores deleted. */
+int hc_limit_core_files(const char *core_dir, int max_cores);
+
+/* Delete the oldest cores in pol->core_dir until both pol->max_cores and
+ * pol->max_bytes are satisfied, starting with those which didn't arrive
+ * whole. The newest core is always kept, even when it alone is over
+ * max_bytes; a max_cores of 0 limits only the bytes. Returns the number of
+ * cores deleted. */
+int hc_enforce_retention(const struct hc_policy *pol);
+
+/* List core in core_dir's HC_PARTIAL_NAME, for retention to delete first */
+int hc_partial_add(const char *core_dir, const char *core);
+
+/* What one pass of hc_thin() did */
+struct hc_thin_stats {
+	uint64_t compressed;
+	uint64_t minicores;
+	uint64_t summarized;
+	uint64_t expired;
+	uint64_t bytes_freed;
+};
+
+/* Thin the cores of pol->core_dir by age under pol->thin, then as far as
+ * needed to meet pol->max_bytes and pol->max_cores. Returns -EBUSY if
+ * another process is thinning the same directory. stats may be NULL. */
+int hc_thin(const struct hc_policy *pol, struct hc_thin_stats *stats);
+
+/* Whether pol asks for thinning rather than deletion */
+int hc_thin_enabled(const struct hc_policy *pol);
+
+/* Run hc_thin() in a detached, low priority child */
+int hc_thin_background(const struct hc_policy *pol);
+
+/* What hc_analyze_run() did */
+struct hc_analyze_stats {
+	uint64_t analyzed;	/* analyzer exited 0 */
+	uint64_t failed;	/* exited otherwise, was killed or timed out */
+	uint64_t duplicates;	/* skipped, their signature already done */
+	uint64_t gone;		/* skipped, their core no longer stored */
+	uint64_t backoffs;	/* times pressure held back new analyzers */
+};
+
+#define HC_QUEUE_DIR ".queue"
+
+/* Queue the core of rec for pol->analyze.command */
+int hc_analyze_enqueue(const struct hc_policy *pol, const struct hc_record *rec);
+
+/* Work through the queue of pol->core_dir until it is empty. The output of
+ * each analyzer goes into its core's sidecar. Returns -EBUSY if another
+ * process is already doing so. stats may be NULL. */
+int hc_analyze_run(const struct hc_policy *pol, struct hc_analyze_stats *stats);
+
+/* Run hc_analyze_run() in a detached, low priority child */
+int hc_analyze_background(const struct hc_policy *pol);
+
+/* Replaying the crash index against candidate retention policies. See
+ * simulate.c. */
+#define HC_SIM_SAMPLES 12
+#define HC_SIM_LOST 5
+#define HC_SIG_MAX (HC_EXE_NAME_MAX + HC_FUNC_MAX)
+
+struct hc_sim_sample {
+	time_t time;
+	uint64_t bytes;		/* disk space used by the cores */
+	uint64_t files;
+	uint64_t signatures;	/* distinct exe+func with a core left */
+};
+
+struct hc_sim_result {
+	uint64_t crashes;
+	uint64_t forms[HC_FORM_SUMMARY + 1];	/* cores in each form at the
+						 * end; summary includes
+						 * deleted ones */
+	uint64_t deleted;	/* removed whole, without thinning */
+	uint64_t bytes_freed;	/* by deleting and thinning */
+	uint64_t peak_bytes;
+	time_t peak_time;
+	uint64_t signatures;	/* distinct signatures seen */
+	uint64_t signatures_kept;	/* of those, with a core at the end */
+	struct hc_sim_sample samples[HC_SIM_SAMPLES];
+	unsigned nsamples;
+	struct {
+		char sig[HC_SIG_MAX];	/* exe:func */
+		uint64_t crashes;
+	} lost[HC_SIM_LOST];	/* most frequent signatures left without a
+				 * core, most crashes first */
+	unsigned nlost;
+};
+
+/* Replay the crash index of core_dir under each of pols[0..npols), as if
+ * each had been in force from the first crash, into results[0..npols).
+ * Sizes of forms which never occurred are estimated. */
+int hc_simulate_retention(const char *core_dir, const struct hc_policy *pols,
+			  int npols, struct hc_sim_result *results);
+
+/* Print the path of the crash index of core_dir into a buffer of size
+ * PATH_MAX */
+void hc_index_path(const char *core_dir, char *path);
+
+/* Append a record to the crash index of core_dir */
+int hc_index_append(const char *core_dir, const struct hc_record *rec);
+
+/* Call cb for every record in the crash index of core_dir, oldest first.
+ * Records which have been replaced by a later one are skipped. Iteration
+ * stops early if cb returns non-zero; that value is returned. */
+typedef int (*hc_index_cb_t)(const struct hc_record *rec, void *arg);
+int hc_index_foreach(const char *core_dir, hc_index_cb_t cb, void *arg);
+
+/* The crash index exported as a compact column-oriented file, so crashes
+ * can be analyzed across hosts by shipping indices instead of cores. See
+ * export.c. */
+
+/* Write core_dir's index to path, each record tagged with host, or the
+ * hostname if NULL. nrecords may be NULL. */
+int hc_export(const char *core_dir, const char *host, const char *path,
+	      uint64_t *nrecords);
+/* Combine exports into one at path, sorted by time. A host's record of a
+ * core which is in more than one of them is kept once. */
+int hc_export_merge(char *const *in, int nin, const char *path,
+		    uint64_t *nrecords);
+/* Call cb for every record of the export at path, oldest first, as for
+ * hc_index_foreach. A core outside its host's core_dir has its path in
+ * rec->dir. */
+typedef int (*hc_export_cb_t)(const char *host, const struct hc_record *rec,
+			      void *arg);
+int hc_export_foreach(const char *path, hc_export_cb_t cb, void *arg);
+
+/* Per-core sidecar files, core_dir/.sidecar/<core>, with what is known
+ * about a core beyond its index record: one line per fact, each a bare word
+ * followed by tab-separated key=value fields. See sidecar.c. */
+#define HC_SIDECAR_DIR ".sidecar"
+
+/* Print the sidecar path of core into a buffer of size PATH_MAX. All forms
+ * of a core share one sidecar. */
+void hc_sidecar_path(const char *core_dir, const char *core, char *path);
+
+/* Append one line, given without its newline */
+int hc_sidecar_printf(const char *core_dir, const char *core,
+		      const char *fmt, ...)
+	__attribute__((format(printf, 3, 4)));
+
+/* Call cb for every line of the sidecar of core, without its newline.
+ * Iteration stops early if cb returns non-zero; that value is returned. */
+typedef int (*hc_sidecar_cb_t)(char *line, void *arg);
+int hc_sidecar_foreach(const char *core_dir, const char *core,
+		       hc_sidecar_cb_t cb, void *arg);
+int hc_sidecar_remove(const char *core_dir, const char *core);
+
+/* Send a crash notification through the mail command in pol->email */
+int hc_send_mail(const struct hc_policy *pol, const struct hc_record *rec);
+
+/*
+ * Symbolization of the program counters in a core, using tables cached per
+ * build-id in core_dir/.symbols. See symtab.c.
+ */
+#define HC_SYMBOLS_DIR ".symbols"
+
+struct hc_symbol {
+	pid_t tid;
+	uint64_t pc;
+	const char *module;	/* path of the file mapped at pc, or NULL */
+	const char *name;	/* function, or NULL if not known */
+	uint64_t offset;	/* of pc from name, or into module */
+	char name_buf[HC_FUNC_MAX];
+};
+
+/* What to do about a binary whose table hasn't been built yet */
+enum {
+	HC_SYM_BUILD = 1,	/* build it now */
+	HC_SYM_BUILD_BG = 2,	/* build it in the background for next time */
+};
+
+/* Call cb for every thread of the core at path, the crashing thread first.
+ * Iteration stops early if cb returns non-zero; that value is returned. */
+typedef int (*hc_symbol_cb_t)(const struct hc_symbol *sym, void *arg);
+int hc_symbolize(const char *core_dir, const char *path, int flags,
+		 hc_symbol_cb_t cb, void *arg);
+
+/* Print a symbol as name+0xoffset, falling back to module+0xoffset */
+void hc_symbol_format(const struct hc_symbol *sym, char *buf, size_t len);
+
+/* Read-only access to a stored core, whatever format it was stored in */
+struct hc_core_file;
+
+int hc_core_open(const char *path, struct hc_core_file **cf);
+void hc_core_close(struct hc_core_file *cf);
+
+/* Size of the original core image */
+uint64_t hc_core_size(const struct hc_core_file *cf);
+int hc_core_is_compressed(const struct hc_core_file *cf);
+
+/* Read from the original core image. Returns the number of bytes read. */
+ssize_t hc_core_pread(struct hc_core_file *cf, void *buf, size_t len,
+		      uint64_t off);
+
+/* Read the whole core, checking it against its stored content hash if it has
+ * one. Returns -EBADMSG on a mismatch. hash may be NULL. */
+int hc_core_verify(struct hc_core_file *cf, uint64_t *hash);
+
+/* Reading the crashed process's memory out of a stored core without loading
+ * all of it: the segment index says where an address lies in the core, and
+ * compressed cores are decompressed a frame at a time. See peek.c. */
+struct hc_peek;
+
+/* core is the name of a core in core_dir, in whichever form it is now
+ * stored, or a path to one */
+int hc_peek_open(const char *core_dir, const char *core, struct hc_peek **pp);
+void hc_peek_close(struct hc_peek *p);
+/* Path of the stored core being read */
+const char *hc_peek_path(const struct hc_peek *p);
+/* Returns -EFAULT if the core doesn't hold all of [addr, addr + len) */
+int hc_peek_mem(struct hc_peek *p, uint64_t addr, void *buf, size_t len);
+/* Find a function or variable, given as name or module:name, module being
+ * the start of a file's base name such as "libc". Returns -ESTALE if only a
+ * file which has changed since the crash could have told. */
+int hc_peek_sym(struct hc_peek *p, const char *name, uint64_t *addr,
+		uint64_t *size);
+
+/* The symbol at addr: a function, or a variable if the mapped file still
+ * has its symbol tables. sym->name is NULL if there is none, and
+ * sym->module too if no file was mapped there. */
+int hc_peek_symbolize(struct hc_peek *p, uint64_t addr, struct hc_symbol *sym);
+
+/* Comparing two stored cores page by page, from hashes of their pages taken
+ * as they came in and kept next to their sidecars. See pagehash.c. */
+enum hc_diff_kind {
+	HC_DIFF_CHANGED,	/* in both, with different contents */
+	HC_DIFF_ONLY_A,		/* only in the first core */
+	HC_DIFF_ONLY_B,		/* only in the second */
+	HC_DIFF_UNKNOWN,	/* in both, but not hashed in one of them */
+};
+
+struct hc_diff_range {
+	int kind;		/* enum hc_diff_kind */
+	uint64_t a_addr;	/* where it is in the first core, or 0 */
+	uint64_t b_addr;	/* and in the second */
+	uint64_t len;
+	uint32_t flags;		/* PF_R, PF_W, PF_X of its segment */
+	const char *path;	/* file mapped there or just before, or NULL */
+	uint64_t file_off;	/* where the range is, or would be, in it */
+};
+
+struct hc_diff_stats {
+	uint64_t pages;		/* compared */
+	uint64_t changed, unknown, only_a, only_b;	/* pages */
+	uint64_t ranges;
+};
+
+/* Call cb for each range of memory which differs between cores a and b,
+ * named as for hc_peek_open(), in the first core's address order and then
+ * the second's. Only their page hashes are read. Returns -ENOENT if a core
+ * has none; a non-zero return from cb stops the walk and is returned. */
+typedef int (*hc_diff_cb_t)(const struct hc_diff_range *r, void *arg);
+int hc_diff(const char *core_dir, const char *a, const char *b,
+	    hc_diff_cb_t cb, void *arg, struct hc_diff_stats *st);
+const char *hc_diff_kind_name(int kind);
+
+/* Importing existing cores into core_dir */
+struct hc_import_opts {
+	int jobs;		/* worker threads */
+	uint64_t io_budget;	/* bytes/second read plus written, 0 = no limit */
+	int keep_originals;	/* don't delete the imported files */
+	int in_place;		/* only index the cores, where they lie */
+};
+
+struct hc_import_stats {
+	uint64_t imported;	/* new cores added to the store */
+	uint64_t duplicates;	/* identical to a core already stored */
+	uint64_t skipped;	/* not a core */
+	uint64_t failed;
+	uint64_t bytes_in;
+	uint64_t bytes_stored;
+	uint64_t summarized;	/* in place: cores newly indexed */
+	uint64_t known;		/* in place: cores already indexed */
+};
+
+/* Walk paths (files or directories), storing every core found in
+ * pol->core_dir according to pol, indexing it, and removing the original once
+ * the stored copy has been verified. With opts->in_place, cores are only
+ * summarized from their headers and notes, and indexed where they lie;
+ * bytes_in is then what was read of them. stats may be NULL. */
+int hc_import(const struct hc_policy *pol, const struct hc_import_opts *opts,
+	      char *const *paths, int npaths, struct hc_import_stats *stats);
+
+/* Snapshots of live processes, captured like crashed ones. See snapshot.c. */
+struct hc_snapshot_opts {
+	int jobs;		/* parallel memory readers */
+};
+
+struct hc_snapshot_stats {
+	uint64_t pause_ns;	/* how long the target was stopped */
+	uint64_t read_ns;	/* time spent reading its memory */
+	uint64_t bytes;		/* memory read */
+	uint64_t size;		/* size of the resulting core */
+	unsigned threads;
+	unsigned segments;
+};
+
+/* Write a core of the running process pid into pol->core_dir, stopping it
+ * only while its registers are collected. opts, rec and stats may be NULL. */
+int hc_snapshot(const struct hc_policy *pol, pid_t pid,
+		const struct hc_snapshot_opts *opts, struct hc_record *rec,
+		struct hc_snapshot_stats *stats);
+
+/*
+ * The flight recorder: a shared-memory ring of the most recent handler
+ * events across all processes. See flight.c.
+ */
+#define HC_FLIGHT_PATH "/dev/shm/handle_core.flight"
+
+enum hc_flight_type {
+	HC_EV_START = 1,	/* a = pid, b = signal */
+	HC_EV_ADMIT,		/* a = 1 if stored compressed, b = 1 if the
+				 * input is a regular file */
+	HC_EV_PROGRESS,		/* a = bytes read, b = bytes written */
+	HC_EV_PHASE,		/* a = enum hc_phase, b = nanoseconds taken */
+	HC_EV_ERROR,		/* err = errno, a = enum hc_phase */
+	HC_EV_EXIT,		/* err = result, a = nanoseconds, b = core size */
+	HC_EV_SNAPSHOT,		/* a = nanoseconds stopped, b = threads */
+	HC_EV_LOG_DROP,		/* err = why, a = syslog priority */
+	HC_EV_STAT_BATCH,	/* a = cores stat'ed, b = nanoseconds taken */
+	HC_EV_UNLINK_BATCH,	/* a = cores deleted, b = nanoseconds taken */
+	HC_EV_COMMIT,		/* a = changes made durable, b = nanoseconds */
+	HC_EV_FAILOVER,		/* err = why, a = offset in the core,
+				 * b = bytes lost */
+};
+
+/* Counters kept alongside the flight recorder */
+enum hc_counter {
+	HC_COUNT_LOG_SENT,	/* log messages sent to /dev/log */
+	HC_COUNT_LOG_FALLBACK,	/* written to HC_LOG_FALLBACK_PATH instead */
+	HC_COUNT_LOG_DROPPED,	/* lost */
+	HC_COUNT_COMMITTED,	/* changes made durable with pol->sync */
+	HC_COUNT_COMMITS,	/* flushes it took */
+	HC_COUNT_MAX,
+};
+
+#define HC_LOG_FALLBACK_PATH "/var/log/handle_core.log"
+
+enum hc_phase {
+	HC_PHASE_INGEST = 1,
+	HC_PHASE_INDEX,
+	HC_PHASE_RETENTION,
+	HC_PHASE_NOTIFY,
+	HC_PHASE_SYMBOLIZE,
+};
+
+struct hc_flight_event {
+	uint64_t seq;		/* 0 while the slot is being written */
+	uint64_t time_ns;	/* CLOCK_REALTIME */
+	uint32_t pid;
+	uint16_t type;		/* enum hc_flight_type */
+	uint16_t reserved;
+	int32_t err;
+	uint32_t pad;
+	uint64_t a, b;
+	char tag[16];		/* executable name, truncated */
+};
+
+/* Live progress of the captures in flight. See progress.c. */
+#define HC_PROGRESS_PATH "/dev/shm/handle_core.progress"
+#define HC_PROGRESS_SLOTS 256
+
+struct hc_progress {
+	uint32_t pid;		/* handler pid, 0 if the slot is free */
+	uint32_t cur_seg;	/* PT_LOAD segment being copied */
+	uint32_t nsegs;
+	uint32_t pad;
+	char exe[16];
+	uint64_t start_ns;	/* CLOCK_REALTIME */
+	uint64_t update_ns;
+	uint64_t total;		/* expected core size, 0 if unknown */
+	uint64_t bytes_read;
+	uint64_t bytes_written;
+	uint64_t rate;		/* recent throughput in bytes/second */
+	char reserved[40];
+};
+
+/* Copy up to max in-flight captures into out. Returns the number copied. */
+int hc_progress_read(struct hc_progress *out, int max);
+
+/* How writes to each core directory have been going, shared by all
+ * handlers. See health.c. */
+#define HC_HEALTH_PATH "/dev/shm/handle_core.health"
+
+struct hc_health {
+	int status;		/* 0 if the directory would be written to,
+				 * else why not as a negative errno */
+	uint64_t ns_per_mb;	/* recent write latency */
+	uint64_t samples;
+	uint64_t errors;
+	time_t last_error;
+	int last_errno;
+};
+
+int hc_health_read(const char *dir, struct hc_health *h);
+
+/* Getting a core directory ready at boot instead of finding out mid-crash
+ * what is wrong with it. See prepare.c. */
+#define HC_READY_NAME ".ready"
+#define HC_RESERVE_DIR ".reserve"
+
+struct hc_prepare_opts {
+	int nreserve;		/* files to preallocate for cores */
+	uint64_t reserve_size;	/* bytes each */
+	uint64_t probe_bytes;	/* written to time the disk, 0 not to */
+};
+
+/* What was found, kept in dir/.ready for captures */
+struct hc_ready {
+	char magic[8];
+	int64_t prepared;	/* time */
+	uint64_t fs_type;	/* statfs() f_type */
+	uint64_t avail;		/* bytes free, after the reserves */
+	uint64_t ns_per_mb;	/* synchronous write latency, 0 if not timed */
+	uint32_t flags;		/* HC_READY_* */
+	uint32_t nreserve;	/* reserve files in dir/.reserve */
+	uint64_t reserve_size;
+};
+
+enum {
+	HC_READY_PREALLOC = 1,	/* reserve files are preallocated */
+};
+
+/* Create and check dir, one of pol's core directories, and what captures
+ * need in it, make the reserve files and time writes, then record the
+ * result. Fails, as a capture would, if dir can't take cores. */
+int hc_prepare(const struct hc_policy *pol, const char *dir,
+	       const struct hc_prepare_opts *opts, struct hc_ready *ready);
+int hc_ready_read(const char *dir, struct hc_ready *ready);
+
+/* Copy up to max of the most recent events into evs, oldest first.
+ * Returns the number copied. */
+int hc_flight_read(struct hc_flight_event *evs, int max);
+const char *hc_flight_type_name(int type);
+const char *hc_phase_name(int phase);
+
+/* Read all HC_COUNT_MAX counters */
+int hc_flight_counters(uint64_t *counters);
+
+/* Log to syslog without ever blocking; see log.c. The message is
+ * event=<event> followed by fmt, which should be a list of key=value fields.
+ * Values which may contain spaces are quoted. */
+void hc_log(int prio, const char *event, const char *fmt, ...)
+	__attribute__((format(printf, 3, 4)));
+
+#endif
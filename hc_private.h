@@ -0,0 +1,453 @@
+#ifndef HC_PRIVATE_H
+#define HC_PRIVATE_H
+
+/*
+ * Helpers shared between the files of libhandle_core. Nothing in here is part
+ * of the public API.
+ */
+
+#include <linux/io_uring.h>
+#include <stddef.h>
+#include <stdint.h>
+#include <sys/types.h>
+
+#include "handle_core.h"
+
+/* Copy src into dst, always NUL-terminating and truncating if needed */
+void hc_strlcpy(char *dst, const char *src, size_t dst_len);
+
+/* Write all of buf to fd. Returns 0 or a negative errno. */
+int hc_write_all(int fd, const void *buf, size_t len);
+
+#define HC_HASH_SEED 0x68616e646c65636fULL
+
+/* 64-bit content hash of buf. See util.c. */
+uint64_t hc_hash64(const void *buf, size_t len);
+
+/* hc_hash64 computed piece by piece */
+struct hc_hash_state {
+	uint64_t v[4];
+	uint64_t len;
+	unsigned char tail[32];
+	size_t tail_len;
+};
+
+void hc_hash64_init(struct hc_hash_state *st);
+void hc_hash64_update(struct hc_hash_state *st, const void *buf, size_t len);
+uint64_t hc_hash64_final(const struct hc_hash_state *st);
+
+/* Copy len bytes from src to dst and hash them in the same pass. Returns
+ * zero if and only if all of them were zero. */
+uint64_t hc_hash64_copy(struct hc_hash_state *st, void *dst, const void *src,
+			size_t len);
+
+/* Fold the hash v into the running hash h */
+uint64_t hc_hash64_combine(uint64_t h, uint64_t v);
+
+/* The content hash of a whole core image, as stored in .hcz headers and the
+ * crash index: hc_hash64 of each HC_HCZ_FRAME_SIZE piece, combined. */
+uint64_t hc_content_hash(const unsigned char *p, uint64_t len);
+
+/* Non-zero if buf contains only zero bytes */
+int hc_is_zero(const void *buf, size_t len);
+
+struct timespec;
+int hc_timespec_cmp(const struct timespec *a, const struct timespec *b);
+void hc_timespec_add_ns(struct timespec *ts, uint64_t ns);
+
+/* Set the CPU niceness and I/O scheduling class (HC_IOPRIO_*) of this
+ * process, as far as it is allowed to */
+void hc_set_priority(int nice, int ioprio);
+
+/* Fork a detached grandchild with the lowest CPU and I/O priority, for work
+ * the handler shouldn't wait for. Returns 0 in the grandchild, which must
+ * finish with _exit(), 1 in the caller, or a negative errno. */
+int hc_fork_background(void);
+
+/* CLOCK_MONOTONIC in nanoseconds */
+uint64_t hc_now_ns(void);
+
+/* Start recording events for this process under tag. Safe to call more than
+ * once; recording silently does nothing if the ring can't be mapped. */
+void hc_flight_open(const char *tag);
+void hc_flight_record(enum hc_flight_type type, int err, uint64_t a,
+		      uint64_t b);
+void hc_flight_count(enum hc_counter c);
+
+
+/* Publishing this handler's progress. See progress.c. */
+struct hc_stream;
+void hc_progress_begin(const char *exe);
+void hc_progress_update(const struct hc_stream *s, uint64_t nread,
+			uint64_t nwritten);
+void hc_progress_end(void);
+
+/* Directory health and failover. See health.c. */
+void hc_health_record(const char *dir, uint64_t len, uint64_t ns, int err);
+
+/* The first of pol->core_dir and pol->alt_dirs which looks healthy */
+const char *hc_health_choose(const struct hc_policy *pol);
+
+/* Rename one of dir's reserve files to path, for a core to be written over.
+ * See prepare.c. */
+int hc_reserve_take(const char *dir, const struct hc_ready *ready,
+		    const char *path);
+
+/* Follows the writes of core, which starts out in dir, and moves it among
+ * pol's directories when they fail or stall. NULL without alt_dirs. */
+struct hc_failover;
+struct hc_failover *hc_failover_new(const struct hc_policy *pol,
+				    const char *dir, const char *core);
+
+/* Account for a write of len bytes to out_fd which took ns and returned
+ * err. Returns -EAGAIN if out_fd now refers to the core in another
+ * directory and the write should be done again, at offset redo_at of the
+ * core; a redo_at of -1 means it can't be. */
+int hc_failover_wrote(struct hc_failover *f, int out_fd, uint64_t len,
+		      uint64_t ns, int err, int64_t redo_at);
+const char *hc_failover_dir(const struct hc_failover *f);
+int hc_failover_sidecar(const struct hc_failover *f);
+void hc_failover_free(struct hc_failover *f);
+
+/* Where a core is read from. See input.c. */
+struct hc_input {
+	int fd;
+	int regular;		/* fd is a regular file */
+	off_t start;		/* offset of the core within fd */
+	off_t size;		/* bytes from start to EOF, if regular */
+	void *map_base;		/* page aligned mapping, once mapped */
+	const unsigned char *map;	/* the core within map_base */
+	struct hc_stream *stream;	/* follows the core as it is read */
+	uint64_t nread;		/* bytes of the core consumed so far */
+	uint64_t next_progress;	/* nread at the next flight recorder event */
+	struct hc_failover *failover;	/* moves the output if its disk
+					 * fails, or NULL */
+};
+
+/* stream may be NULL. For regular files, its headers are parsed up front. */
+int hc_input_init(struct hc_input *in, int fd, struct hc_stream *stream);
+
+/* Map a regular-file input so it can be parsed or transformed in place */
+int hc_input_map(struct hc_input *in);
+void hc_input_release(struct hc_input *in);
+
+/* Copy the whole input to out_fd with the cheapest method available: a
+ * reflink, copy_file_range(), a mapped write, or a plain read/write loop. */
+int hc_input_copy(struct hc_input *in, int out_fd, uint64_t *copied);
+
+/* Read up to len bytes of the core, following it with the stream. nwritten
+ * is what the caller has written so far, for progress reports. */
+ssize_t hc_input_read(struct hc_input *in, void *buf, size_t len,
+		      uint64_t nwritten);
+
+/* Compress the whole input into out_fd in the .hcz format */
+struct hc_hcz_stats;
+int hc_input_compress(struct hc_input *in, int out_fd,
+		      struct hc_hcz_stats *stats);
+
+/* Copy the input to out_fd keeping the crashing thread and one thread per
+ * distinct stack, as a sparse core of *image_size bytes. *d is set to what
+ * was found, for hc_dedup_sidecar(), or left NULL if the core was copied as
+ * it is. See dedup.c. */
+struct hc_dedup;
+int hc_input_dedup(struct hc_input *in, int out_fd, struct hc_dedup **d,
+		   uint64_t *image_size);
+int hc_dedup_sidecar(const struct hc_dedup *d, const char *core_dir,
+		     const char *core);
+void hc_dedup_free(struct hc_dedup *d);
+
+/* What glibc malloc's arenas in a core held. See heap.c. */
+struct hc_heap_arena {
+	uint64_t addr;		/* of its struct malloc_state */
+	uint64_t system_mem, max_system_mem;
+	uint64_t in_use;	/* system_mem less free and top */
+	uint64_t free_bytes, free_chunks;	/* in all bins */
+	uint64_t fast_bytes, fast_chunks;	/* of which in fastbins */
+	uint64_t top;		/* size of the top chunk */
+	uint64_t largest_free;	/* chunk, top aside */
+};
+
+struct hc_heap_stats {
+	struct hc_heap_arena *arenas;
+	unsigned narenas;
+	uint64_t system_mem, in_use, free_bytes, free_chunks, fast_bytes;
+	uint64_t top, largest_free;
+	int partial;		/* some lists were cut short or corrupt */
+	uint64_t steps, ms;
+};
+
+/* Find the arenas of the core and walk their free lists. -ENOENT if there
+ * is no glibc malloc state to be found. */
+struct hc_core_file;
+struct hc_core_meta;
+int hc_heap_stats(struct hc_core_file *cf, const struct hc_core_meta *meta,
+		  struct hc_heap_stats *st);
+int hc_heap_sidecar(const struct hc_heap_stats *st, const char *core_dir,
+		    const char *core);
+void hc_heap_free(struct hc_heap_stats *st);
+
+/* A PT_LOAD segment of a core */
+struct hc_segment {
+	uint64_t vaddr, memsz;
+	uint64_t offset, filesz;
+	uint32_t flags;		/* PF_R, PF_W, PF_X */
+};
+
+/* A thread of a core, from its NT_PRSTATUS note */
+struct hc_thread {
+	pid_t tid;
+	uint64_t pc;		/* 0 on architectures we don't know */
+	uint64_t sp;
+};
+
+/* A file mapping of a core, from the NT_FILE note */
+struct hc_mapping {
+	uint64_t start, end;
+	uint64_t offset;	/* in bytes, into the file */
+	const char *path;
+};
+
+/* What the headers of a core tell us. See elf.c. */
+struct hc_core_meta {
+	pid_t pid;
+	int signo;
+	unsigned nthreads;
+	char exe[17];		/* NT_PRPSINFO pr_fname */
+	char args[81];		/* NT_PRPSINFO pr_psargs */
+	uint64_t headers_len;	/* ELF header, program headers and notes */
+	uint64_t expected_size;	/* end of the last segment in the file */
+	struct hc_segment *segs;	/* PT_LOAD segments, in file order */
+	unsigned nsegs;
+	struct hc_thread *threads;	/* the crashing thread first */
+	unsigned nthreads_known;	/* entries in threads */
+	struct hc_mapping *maps;	/* sorted by start address */
+	unsigned nmaps;
+	char *map_paths;	/* storage for maps[].path */
+};
+
+/* Given the first len bytes of a core, return how many bytes the ELF header,
+ * program headers and notes take up, or a negative errno if this is not a
+ * core we understand. The answer may grow as more of the headers become
+ * available; -EAGAIN means len was too short to tell. */
+ssize_t hc_elf_headers_len(const unsigned char *buf, size_t len);
+
+/* Parse the headers and notes of a core. Returns -EAGAIN if buf does not
+ * hold all of them yet. */
+int hc_elf_parse(const unsigned char *buf, size_t len,
+		 struct hc_core_meta *meta);
+void hc_core_meta_free(struct hc_core_meta *meta);
+
+/* Read and parse the headers of a stored core */
+int hc_core_meta_read(struct hc_core_file *cf, struct hc_core_meta *meta);
+
+/* Read len bytes of the crashed process's memory at addr out of a stored
+ * core. Returns -EFAULT if the core doesn't have all of them. */
+int hc_core_read_mem(struct hc_core_file *cf, const struct hc_core_meta *meta,
+		     uint64_t addr, void *buf, size_t len);
+
+/* Where symbol name, or module:name, was in the core's process, from the
+ * build-id tables in core_dir or else the mapped files themselves. See
+ * symtab.c. */
+int hc_symbol_addr(const char *core_dir, struct hc_core_file *cf,
+		   const struct hc_core_meta *meta, const char *name,
+		   uint64_t *addr, uint64_t *size);
+
+/* The symbol at addr, as hc_symbolize() gives it for a thread's pc, but also
+ * finding variables in the symbol tables of the mapped file. Anonymous
+ * memory just past a file mapping, such as the rest of .bss, counts as part
+ * of that file. */
+int hc_symbol_at(const char *core_dir, struct hc_core_file *cf,
+		 const struct hc_core_meta *meta, uint64_t addr,
+		 struct hc_symbol *sym);
+
+/* Following a core as it streams through the ingest path */
+enum hc_stream_state {
+	HC_STREAM_COLLECTING,	/* buffering the headers */
+	HC_STREAM_PARSED,	/* meta is valid */
+	HC_STREAM_UNPARSEABLE,	/* not a core we understand */
+};
+
+struct hc_stream {
+	enum hc_stream_state state;
+	unsigned char *head;	/* the headers, while collecting */
+	size_t head_len, head_alloc;
+	struct hc_core_meta meta;
+	uint64_t pos;		/* bytes of the core seen so far */
+	unsigned cur_seg;	/* index in meta.segs of the segment at pos */
+	/* Called once, as soon as meta becomes valid. The raw headers are in
+	 * raw while it runs. */
+	void (*on_parsed)(const struct hc_stream *s, void *arg);
+	void *on_parsed_arg;
+	const unsigned char *raw;
+	size_t raw_len;
+	/* Called with every piece of the core at pos as it goes past. buf is
+	 * NULL when the bytes didn't pass through user space. */
+	void (*on_data)(const struct hc_stream *s, uint64_t pos,
+			const void *buf, size_t len, void *arg);
+	void *on_data_arg;
+};
+
+void hc_stream_init(struct hc_stream *s);
+void hc_stream_free(struct hc_stream *s);
+/* Account for the next len bytes of the core. buf may be NULL when the bytes
+ * went past without passing through user space. */
+void hc_stream_feed(struct hc_stream *s, const void *buf, size_t len);
+/* Parse headers that were read out of band, without moving the stream */
+void hc_stream_set_headers(struct hc_stream *s, const unsigned char *buf,
+			   size_t len);
+
+/* How much of a core arrived, once its stream has ended */
+struct hc_integrity_report {
+	int status;		/* enum hc_integrity */
+	uint64_t expected;	/* bytes the headers call for */
+	uint64_t got;
+	unsigned nsegs, complete;	/* PT_LOAD segments, and how many are
+					 * whole */
+	int cut_seg;		/* the first that isn't, or -1 */
+};
+
+void hc_stream_check(const struct hc_stream *s, struct hc_integrity_report *ic);
+/* An integrity line, and one per segment which isn't whole */
+int hc_integrity_sidecar(const struct hc_stream *s,
+			 const struct hc_integrity_report *ic,
+			 const char *core_dir, const char *core);
+
+/* Wait until everything this process has written to the index and the
+ * directory of core_dir is on disk, sharing the flush with concurrent
+ * handlers. See commit.c. */
+int hc_commit(const char *core_dir);
+
+/* Sending notifications without holding up ingest. Messages go out through
+ * pol->email in the order they were posted, from a thread started by the
+ * first one. See notify.c. */
+struct hc_notifier;
+struct hc_notifier *hc_notifier_new(const struct hc_policy *pol);
+/* Announce a crash from its notes alone, while the core is still arriving */
+void hc_notify_early(struct hc_notifier *n, const struct hc_crash *crash,
+		     const struct hc_core_meta *meta);
+/* Say where the minicore written alongside the core is */
+void hc_notify_minicore(struct hc_notifier *n, const char *exe,
+			const char *path, uint64_t size);
+/* Follow up with where the core ended up, in dir, or why it didn't */
+void hc_notify_done(struct hc_notifier *n, const char *dir,
+		    const struct hc_record *rec, int err);
+/* Wait for everything posted to be sent. Returns the first mail error. */
+int hc_notifier_finish(struct hc_notifier *n);
+
+/* Writing .hcz compressed cores. See hcz.c. */
+#define HC_HCZ_FRAME_SIZE (1 << 20)
+#define HC_HCZ_SUFFIX ".hcz"
+#define HC_HCZ_LEVEL 1
+
+struct hc_hcz_writer;
+struct hc_hcz_stats {
+	uint64_t raw_size;
+	uint64_t stored_size;
+	uint64_t hash;
+};
+
+/* fd must be seekable: the header is written last */
+int hc_hcz_writer_open(struct hc_hcz_writer **w, int fd, int level);
+int hc_hcz_write(struct hc_hcz_writer *w, const void *buf, size_t len);
+/* Bytes of compressed output so far */
+uint64_t hc_hcz_written(const struct hc_hcz_writer *w);
+/* Flush, write the frame table and header, and free the writer */
+int hc_hcz_writer_close(struct hc_hcz_writer *w, struct hc_hcz_stats *stats);
+/* Compress the stored core cf into out_fd. stats may be NULL. */
+int hc_hcz_compress_core(struct hc_core_file *cf, int out_fd,
+			 struct hc_hcz_stats *stats);
+
+/* Minicores, which thinning cuts old cores down to and capture can write
+ * as the core streams in. See mini.c. */
+#define HC_MINI_SUFFIX ".mini"
+
+/* A range of the core a minicore keeps, and where it keeps it */
+struct hc_mini_range {
+	uint64_t in_off, len;
+	uint64_t out_off;
+};
+
+struct hc_mini_layout {
+	unsigned char *head;	/* the minicore up to its first range */
+	size_t head_len;
+	struct hc_mini_range *ranges;	/* in the order of the core */
+	unsigned nranges;
+	uint64_t size;		/* of the whole minicore */
+};
+
+/* Lay out the minicore of the core whose headers are hdr */
+int hc_mini_layout(const unsigned char *hdr, size_t len,
+		   const struct hc_core_meta *meta, struct hc_mini_layout *l);
+void hc_mini_layout_free(struct hc_mini_layout *l);
+
+/* Print the path of the minicore written alongside core, next to its
+ * sidecar, into a buffer of size PATH_MAX */
+void hc_mini_path(const char *core_dir, const char *core, char *path);
+
+/* Writing the minicore of a core while the core streams past. Ranges the
+ * stream doesn't show are read from src_fd at src_start, or fail if it is
+ * -1. */
+struct hc_mini_writer;
+int hc_mini_writer_open(const struct hc_policy *pol, const char *core,
+			const unsigned char *hdr, size_t len,
+			const struct hc_core_meta *meta, int src_fd,
+			off_t src_start, struct hc_mini_writer **w);
+/* Copy what the minicore keeps of len bytes of the core at pos. Returns 1
+ * once the minicore has everything it needs. */
+int hc_mini_writer_feed(struct hc_mini_writer *w, uint64_t pos,
+			const void *buf, size_t len);
+/* Publish the complete minicore at hc_mini_path() and free w */
+int hc_mini_writer_finish(struct hc_mini_writer *w, uint64_t *size,
+			  uint64_t *ms);
+/* Free w, discarding the minicore if it wasn't finished */
+void hc_mini_writer_close(struct hc_mini_writer *w);
+
+/* Hashing each page of a core as it streams in, for hc_diff(). See
+ * pagehash.c. */
+#define HC_PAGE_SIZE 4096
+#define HC_PAGES_SUFFIX ".pages"
+
+/* Print the path of the page hashes of core, next to its sidecar, into a
+ * buffer of size PATH_MAX */
+void hc_pages_path(const char *core_dir, const char *core, char *path);
+
+struct hc_pagehash;
+int hc_pagehash_new(const struct hc_core_meta *meta, struct hc_pagehash **ph);
+void hc_pagehash_free(struct hc_pagehash *ph);
+/* Hash what len bytes of the core at pos complete. buf is NULL when they
+ * didn't pass through user space. Feeding from the start again hashes what
+ * was missed. */
+void hc_pagehash_feed(struct hc_pagehash *ph, uint64_t pos, const void *buf,
+		      size_t len);
+/* Pages with no hash yet */
+uint64_t hc_pagehash_unknown(const struct hc_pagehash *ph);
+int hc_pagehash_write(const struct hc_pagehash *ph, const char *core_dir,
+		      const char *core);
+
+/* A bare io_uring for batching system calls. See uring.c. */
+struct hc_uring {
+	int fd;
+	unsigned entries;
+	void *sq_ring, *cq_ring;
+	size_t sq_len, cq_len;
+	struct io_uring_sqe *sqes;
+	size_t sqes_len;
+	unsigned *sq_head, *sq_tail, sq_mask;
+	unsigned *cq_head, *cq_tail, cq_mask;
+	struct io_uring_cqe *cqes;
+	unsigned tail;		/* sqes handed out */
+	unsigned submitted;	/* sqes the kernel has taken */
+};
+
+int hc_uring_init(struct hc_uring *r, unsigned entries);
+void hc_uring_exit(struct hc_uring *r);
+/* Non-zero if the kernel knows the operation op */
+int hc_uring_supports(struct hc_uring *r, int op);
+/* A cleared sqe to fill in, or NULL if the queue is full */
+struct io_uring_sqe *hc_uring_sqe(struct hc_uring *r);
+/* Submit the queued sqes and wait for wait_nr completions */
+int hc_uring_submit(struct hc_uring *r, unsigned wait_nr);
+/* Pop a completion. Returns -EAGAIN if there are none. */
+int hc_uring_cqe(struct hc_uring *r, struct io_uring_cqe *cqe);
+
+#endif
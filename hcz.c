@@ -0,0 +1,527 @@
+#define _GNU_SOURCE
+#include <errno.h>
+#include <fcntl.h>
+#include <stdlib.h>
+#include <string.h>
+#include <unistd.h>
+#include <zlib.h>
+
+#include "handle_core.h"
+#include "hc_private.h"
+
+/*
+ * Compressed core format (.hcz)
+ *
+ * The core is cut into fixed-size frames which are deflated independently,
+ * so any byte range can be recovered by inflating only the frames that cover
+ * it. Frames which are entirely zero are not stored at all, and frames which
+ * do not compress are stored as-is.
+ *
+ *	struct hcz_header	at offset 0, rewritten when the file is closed
+ *	frame data		one after another
+ *	struct hcz_frame[]	frame table, at header.index_off
+ */
+
+#define HCZ_MAGIC "HCZCORE1"
+
+struct hcz_header {
+	char magic[8];
+	uint32_t frame_size;
+	uint32_t flags;
+	uint64_t raw_size;
+	uint64_t nframes;
+	uint64_t index_off;
+	uint64_t hash;		/* hc_hash64 content hash of the raw core */
+	uint64_t reserved[2];
+};
+
+enum hcz_frame_kind {
+	HCZ_FRAME_DEFLATE = 0,
+	HCZ_FRAME_ZERO = 1,
+	HCZ_FRAME_STORED = 2,
+};
+
+struct hcz_frame {
+	uint64_t offset;
+	uint32_t clen;
+	uint32_t kind;
+};
+
+/*
+ * Frames are filled HCZ_CHUNK bytes at a time, a size chosen so that the
+ * chunk, the deflate window and the compressor's tables all stay in L2.
+ * Each chunk is copied into the frame, hashed and checked for zeroes in a
+ * single pass (hc_hash64_copy), then handed straight to deflate while it is
+ * still cache-resident, instead of walking the whole 1 MiB frame once per
+ * step when it is complete. Deflate is only started once a frame turns out
+ * not to be all zeroes.
+ */
+#define HCZ_CHUNK (128 << 10)
+
+struct hc_hcz_writer {
+	int fd;
+	int level;
+	uint64_t off;		/* where the next frame goes */
+	uint64_t raw_size;
+	uint64_t hash;
+	unsigned char *frame;	/* raw data of the frame being filled */
+	size_t fill;
+	struct hc_hash_state hs;	/* of the frame being filled */
+	int nonzero;		/* the frame has a non-zero byte so far */
+	z_stream z;
+	int z_ready;		/* deflateInit succeeded */
+	size_t fed;		/* bytes of the frame given to deflate */
+	int overflow;		/* deflate output didn't fit in cbuf */
+	unsigned char *cbuf;	/* deflate output */
+	size_t cbuf_len;
+	struct hcz_frame *frames;
+	uint64_t nframes, alloc_frames;
+};
+
+static void hcz_writer_free(struct hc_hcz_writer *w)
+{
+	if (w->z_ready)
+		deflateEnd(&w->z);
+	free(w->frames);
+	free(w->frame);
+	free(w->cbuf);
+	free(w);
+}
+
+int hc_hcz_writer_open(struct hc_hcz_writer **wp, int fd, int level)
+{
+	struct hc_hcz_writer *w;
+	struct hcz_header hdr;
+	int ret;
+
+	w = calloc(1, sizeof(*w));
+	if (!w)
+		return -ENOMEM;
+	w->fd = fd;
+	w->level = level;
+	w->hash = HC_HASH_SEED;
+	hc_hash64_init(&w->hs);
+	if (deflateInit(&w->z, level) != Z_OK) {
+		ret = -ENOMEM;
+		goto error;
+	}
+	w->z_ready = 1;
+	w->cbuf_len = compressBound(HC_HCZ_FRAME_SIZE);
+	w->frame = malloc(HC_HCZ_FRAME_SIZE);
+	w->cbuf = malloc(w->cbuf_len);
+	if (!w->frame || !w->cbuf) {
+		ret = -ENOMEM;
+		goto error;
+	}
+	/* Reserve room for the header; it is filled in on close */
+	memset(&hdr, 0, sizeof(hdr));
+	ret = hc_write_all(fd, &hdr, sizeof(hdr));
+	if (ret)
+		goto error;
+	w->off = sizeof(hdr);
+	*wp = w;
+	return 0;
+error:
+	hcz_writer_free(w);
+	return ret;
+}
+
+/* Give deflate everything in the frame it hasn't seen yet */
+static void hcz_deflate(struct hc_hcz_writer *w, int flush)
+{
+	int ret;
+
+	if (w->overflow)
+		return;
+	if (w->fed == 0 && w->z.total_out == 0) {
+		w->z.next_out = w->cbuf;
+		w->z.avail_out = w->cbuf_len;
+	}
+	w->z.next_in = w->frame + w->fed;
+	w->z.avail_in = w->fill - w->fed;
+	do {
+		ret = deflate(&w->z, flush);
+	} while (ret == Z_OK && w->z.avail_out > 0 &&
+		 (w->z.avail_in > 0 || flush == Z_FINISH));
+	w->fed = w->fill;
+	if (ret == Z_BUF_ERROR)	/* no progress possible, not an error */
+		ret = Z_OK;
+	/* Running out of room means the frame doesn't compress */
+	if (ret != Z_STREAM_END && (ret != Z_OK || w->z.avail_out == 0))
+		w->overflow = 1;
+}
+
+static int hcz_flush_frame(struct hc_hcz_writer *w)
+{
+	struct hcz_frame *fr;
+	const void *out;
+	int ret;
+
+	if (w->fill == 0)
+		return 0;
+	if (w->nframes == w->alloc_frames) {
+		uint64_t alloc = w->alloc_frames ? w->alloc_frames * 2 : 256;
+		fr = realloc(w->frames, alloc * sizeof(*fr));
+		if (!fr)
+			return -ENOMEM;
+		w->frames = fr;
+		w->alloc_frames = alloc;
+	}
+	fr = &w->frames[w->nframes];
+	fr->offset = w->off;
+	w->hash = hc_hash64_combine(w->hash, hc_hash64_final(&w->hs));
+	if (!w->nonzero) {
+		fr->kind = HCZ_FRAME_ZERO;
+		fr->clen = 0;
+		out = NULL;
+	}
+	else {
+		hcz_deflate(w, Z_FINISH);
+		if (!w->overflow && w->z.total_out < w->fill) {
+			fr->kind = HCZ_FRAME_DEFLATE;
+			fr->clen = w->z.total_out;
+			out = w->cbuf;
+		}
+		else {
+			fr->kind = HCZ_FRAME_STORED;
+			fr->clen = w->fill;
+			out = w->frame;
+		}
+	}
+	if (fr->clen) {
+		ret = hc_write_all(w->fd, out, fr->clen);
+		if (ret)
+			return ret;
+	}
+	w->off += fr->clen;
+	w->raw_size += w->fill;
+	w->nframes++;
+	w->fill = 0;
+	w->fed = 0;
+	w->nonzero = 0;
+	w->overflow = 0;
+	hc_hash64_init(&w->hs);
+	deflateReset(&w->z);
+	return 0;
+}
+
+int hc_hcz_write(struct hc_hcz_writer *w, const void *buf, size_t len)
+{
+	const unsigned char *p = buf;
+	int ret;
+
+	while (len > 0) {
+		/* Up to the end of the current chunk */
+		size_t n = HCZ_CHUNK - w->fill % HCZ_CHUNK;
+		if (n > len)
+			n = len;
+		if (hc_hash64_copy(&w->hs, w->frame + w->fill, p, n))
+			w->nonzero = 1;
+		w->fill += n;
+		p += n;
+		len -= n;
+		if (w->fill == HC_HCZ_FRAME_SIZE) {
+			ret = hcz_flush_frame(w);
+			if (ret)
+				return ret;
+		}
+		else if (w->fill % HCZ_CHUNK == 0 && w->nonzero) {
+			hcz_deflate(w, Z_NO_FLUSH);
+		}
+	}
+	return 0;
+}
+
+uint64_t hc_hcz_written(const struct hc_hcz_writer *w)
+{
+	return w->off;
+}
+
+int hc_hcz_writer_close(struct hc_hcz_writer *w, struct hc_hcz_stats *stats)
+{
+	struct hcz_header hdr;
+	int ret;
+
+	ret = hcz_flush_frame(w);
+	if (ret)
+		goto done;
+	ret = hc_write_all(w->fd, w->frames, w->nframes * sizeof(*w->frames));
+	if (ret)
+		goto done;
+	memset(&hdr, 0, sizeof(hdr));
+	memcpy(hdr.magic, HCZ_MAGIC, sizeof(hdr.magic));
+	hdr.frame_size = HC_HCZ_FRAME_SIZE;
+	hdr.raw_size = w->raw_size;
+	hdr.nframes = w->nframes;
+	hdr.index_off = w->off;
+	hdr.hash = w->hash;
+	if (pwrite(w->fd, &hdr, sizeof(hdr), 0) != sizeof(hdr)) {
+		ret = errno ? -errno : -EIO;
+		goto done;
+	}
+	if (stats) {
+		stats->raw_size = w->raw_size;
+		stats->stored_size = w->off + w->nframes * sizeof(*w->frames);
+		stats->hash = w->hash;
+	}
+done:
+	hcz_writer_free(w);
+	return ret;
+}
+
+/*
+ * Reading stored cores
+ *
+ * struct hc_core_file hides whether a stored core is a plain ELF file or an
+ * .hcz file, so tools can read any byte range of the original core.
+ */
+
+struct hc_core_file {
+	int fd;
+	int compressed;
+	uint64_t size;
+	struct hcz_header hdr;
+	struct hcz_frame *frames;
+	/* the most recently inflated frame */
+	unsigned char *frame;
+	uint64_t cached_frame;
+	unsigned char *cbuf;
+};
+
+static int hcz_read_header(struct hc_core_file *cf)
+{
+	ssize_t res;
+	size_t len;
+
+	res = pread(cf->fd, &cf->hdr, sizeof(cf->hdr), 0);
+	if (res != sizeof(cf->hdr) || memcmp(cf->hdr.magic, HCZ_MAGIC, 8))
+		return 0;
+	/* Rounded up without adding to raw_size, which may be near 2^64 */
+	if (cf->hdr.frame_size != HC_HCZ_FRAME_SIZE ||
+	    cf->hdr.nframes != cf->hdr.raw_size / HC_HCZ_FRAME_SIZE +
+			       !!(cf->hdr.raw_size % HC_HCZ_FRAME_SIZE) ||
+	    (cf->hdr.raw_size && !cf->hdr.nframes))
+		return -EINVAL;
+	/* The index has to be in the file, cf->size being its length */
+	if (cf->hdr.index_off > cf->size ||
+	    cf->hdr.nframes > (cf->size - cf->hdr.index_off) /
+			      sizeof(*cf->frames))
+		return -EINVAL;
+	len = cf->hdr.nframes * sizeof(*cf->frames);
+	cf->frames = malloc(len ? len : 1);
+	cf->frame = malloc(HC_HCZ_FRAME_SIZE);
+	cf->cbuf = malloc(compressBound(HC_HCZ_FRAME_SIZE));
+	if (!cf->frames || !cf->frame || !cf->cbuf)
+		return -ENOMEM;
+	if (pread(cf->fd, cf->frames, len, cf->hdr.index_off) != (ssize_t)len)
+		return -EINVAL;
+	cf->compressed = 1;
+	cf->size = cf->hdr.raw_size;
+	cf->cached_frame = UINT64_MAX;
+	return 0;
+}
+
+int hc_core_open(const char *path, struct hc_core_file **cfp)
+{
+	struct hc_core_file *cf;
+	int ret;
+
+	cf = calloc(1, sizeof(*cf));
+	if (!cf)
+		return -ENOMEM;
+	cf->fd = open(path, O_RDONLY | O_CLOEXEC);
+	if (cf->fd < 0) {
+		ret = -errno;
+		free(cf);
+		return ret;
+	}
+	cf->size = lseek(cf->fd, 0, SEEK_END);
+	ret = hcz_read_header(cf);
+	if (ret) {
+		hc_core_close(cf);
+		return ret;
+	}
+	*cfp = cf;
+	return 0;
+}
+
+void hc_core_close(struct hc_core_file *cf)
+{
+	if (!cf)
+		return;
+	close(cf->fd);
+	free(cf->frames);
+	free(cf->frame);
+	free(cf->cbuf);
+	free(cf);
+}
+
+uint64_t hc_core_size(const struct hc_core_file *cf)
+{
+	return cf->size;
+}
+
+int hc_core_is_compressed(const struct hc_core_file *cf)
+{
+	return cf->compressed;
+}
+
+static size_t hcz_frame_len(const struct hc_core_file *cf, uint64_t i)
+{
+	if (i + 1 < cf->hdr.nframes)
+		return HC_HCZ_FRAME_SIZE;
+	return cf->hdr.raw_size - i * HC_HCZ_FRAME_SIZE;
+}
+
+static int hcz_load_frame(struct hc_core_file *cf, uint64_t i)
+{
+	const struct hcz_frame *fr = &cf->frames[i];
+	size_t len = hcz_frame_len(cf, i);
+	uLongf dlen = len;
+
+	if (cf->cached_frame == i)
+		return 0;
+	cf->cached_frame = UINT64_MAX;
+	switch (fr->kind) {
+	case HCZ_FRAME_ZERO:
+		memset(cf->frame, 0, len);
+		break;
+	case HCZ_FRAME_STORED:
+		if (fr->clen != len ||
+		    pread(cf->fd, cf->frame, len, fr->offset) != (ssize_t)len)
+			return -EIO;
+		break;
+	case HCZ_FRAME_DEFLATE:
+		if (fr->clen > compressBound(HC_HCZ_FRAME_SIZE) ||
+		    pread(cf->fd, cf->cbuf, fr->clen, fr->offset) !=
+							(ssize_t)fr->clen)
+			return -EIO;
+		if (uncompress(cf->frame, &dlen, cf->cbuf, fr->clen) != Z_OK ||
+		    dlen != len)
+			return -EIO;
+		break;
+	default:
+		return -EINVAL;
+	}
+	cf->cached_frame = i;
+	return 0;
+}
+
+ssize_t hc_core_pread(struct hc_core_file *cf, void *buf, size_t len,
+		      uint64_t off)
+{
+	unsigned char *p = buf;
+	size_t done = 0;
+	int ret;
+
+	if (!cf->compressed) {
+		ssize_t res = pread(cf->fd, buf, len, off);
+		return res < 0 ? -errno : res;
+	}
+	if (off >= cf->size)
+		return 0;
+	if (len > cf->size - off)
+		len = cf->size - off;
+	while (done < len) {
+		uint64_t i = (off + done) / HC_HCZ_FRAME_SIZE;
+		size_t in_frame = (off + done) % HC_HCZ_FRAME_SIZE;
+		size_t n = hcz_frame_len(cf, i) - in_frame;
+		if (n > len - done)
+			n = len - done;
+		ret = hcz_load_frame(cf, i);
+		if (ret)
+			return ret;
+		memcpy(p + done, cf->frame + in_frame, n);
+		done += n;
+	}
+	return done;
+}
+
+uint64_t hc_content_hash(const unsigned char *p, uint64_t len)
+{
+	uint64_t off, h = HC_HASH_SEED;
+
+	for (off = 0; off < len; off += HC_HCZ_FRAME_SIZE) {
+		size_t n = len - off;
+		if (n > HC_HCZ_FRAME_SIZE)
+			n = HC_HCZ_FRAME_SIZE;
+		h = hc_hash64_combine(h, hc_hash64(p + off, n));
+	}
+	return h;
+}
+
+int hc_hcz_compress_core(struct hc_core_file *cf, int out_fd,
+			 struct hc_hcz_stats *stats)
+{
+	struct hc_hcz_writer *w;
+	unsigned char *buf;
+	uint64_t off, data = 0;
+	ssize_t n;
+	int ret, zeroed = 0;
+
+	buf = malloc(HC_HCZ_FRAME_SIZE);
+	if (!buf)
+		return -ENOMEM;
+	ret = hc_hcz_writer_open(&w, out_fd, HC_HCZ_LEVEL);
+	if (ret) {
+		free(buf);
+		return ret;
+	}
+	for (off = 0; off < cf->size && !ret; off += n) {
+		/* Holes, as in a sparse core, needn't be read to be zeros */
+		if (!cf->compressed && data < off + HC_HCZ_FRAME_SIZE &&
+		    data != (uint64_t)-1) {
+			off_t next = lseek(cf->fd, off, SEEK_DATA);
+			if (next >= 0)
+				data = next;
+			else
+				data = errno == ENXIO ? (uint64_t)-1 : off;
+		}
+		if (!cf->compressed && data >= off + HC_HCZ_FRAME_SIZE &&
+		    off + HC_HCZ_FRAME_SIZE <= cf->size) {
+			n = HC_HCZ_FRAME_SIZE;
+			if (!zeroed)
+				memset(buf, 0, n);
+			zeroed = 1;
+			ret = hc_hcz_write(w, buf, n);
+			continue;
+		}
+		zeroed = 0;
+		n = hc_core_pread(cf, buf, HC_HCZ_FRAME_SIZE, off);
+		if (n <= 0)
+			ret = n ? n : -EIO;
+		else
+			ret = hc_hcz_write(w, buf, n);
+	}
+	free(buf);
+	if (ret) {
+		hc_hcz_writer_close(w, NULL);
+		return ret;
+	}
+	return hc_hcz_writer_close(w, stats);
+}
+
+int hc_core_verify(struct hc_core_file *cf, uint64_t *hash)
+{
+	unsigned char *buf;
+	uint64_t off, h = HC_HASH_SEED;
+	ssize_t res;
+
+	buf = malloc(HC_HCZ_FRAME_SIZE);
+	if (!buf)
+		return -ENOMEM;
+	for (off = 0; off < cf->size; off += res) {
+		res = hc_core_pread(cf, buf, HC_HCZ_FRAME_SIZE, off);
+		if (res <= 0) {
+			free(buf);
+			return res < 0 ? res : -EIO;
+		}
+		h = hc_hash64_combine(h, hc_hash64(buf, res));
+	}
+	free(buf);
+	if (cf->compressed && h != cf->hdr.hash)
+		return -EBADMSG;
+	if (hash)
+		*hash = h;
+	return 0;
+}
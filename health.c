@@ -0,0 +1,398 @@
+#define _GNU_SOURCE
+#include <errno.h>
+#include <fcntl.h>
+#include <limits.h>
+#include <stdio.h>
+#include <stdlib.h>
+#include <string.h>
+#include <sys/mman.h>
+#include <sys/stat.h>
+#include <sys/statvfs.h>
+#include <syslog.h>
+#include <time.h>
+#include <unistd.h>
+
+#include "handle_core.h"
+#include "hc_private.h"
+
+/*
+ * Directory health and failover
+ *
+ * With alternative directories in pol->alt_dirs, a capture doesn't have to
+ * go down with the disk under core_dir. How each directory's writes have
+ * been going is kept in a small table in shared memory, fed by every capture
+ * with the time each write took and any error it returned. A capture starts
+ * in the first directory, in the order given, which is writable and has
+ * neither failed recently nor been slow; if its writes then fail or stall,
+ * the partial core is moved to the next healthy directory (what was written
+ * so far is copied over, from the page cache as a rule) and the stream
+ * carries on there without the writer noticing, since the new file takes
+ * over the old file's descriptor. The rest of capture then runs in the
+ * directory the core ended up in, and core_dir's own index gets a record
+ * pointing there, with dir=, when it can be written.
+ *
+ * A directory which hasn't been written to for a while is given another
+ * chance, so one bad spell doesn't banish it for good.
+ */
+
+#define HEALTH_MAGIC 0x68636864u	/* "hchd" */
+#define HEALTH_SLOTS 64
+#define HEALTH_ERROR_HOLD 300	/* seconds an error keeps a dir out */
+#define HEALTH_STALE 600	/* seconds after which samples are forgotten */
+#define HEALTH_SLOW_NS_MB 500000000ULL	/* 2 MiB/s, smoothed */
+#define HEALTH_MIN_SAMPLES 4
+#define FAILOVER_STALL_NS 2000000000ULL	/* a write this slow moves on */
+#define FAILOVER_MAX 2		/* moves per capture */
+#define FAILOVER_CHUNK (1 << 20)
+
+struct health_slot {
+	uint64_t key;		/* hash of the dir's path, 0 if free */
+	uint64_t ns_per_mb;	/* write latency, smoothed */
+	uint64_t samples;
+	uint64_t errors;
+	int64_t last_sample;	/* CLOCK_REALTIME seconds */
+	int64_t last_error;
+	int32_t last_errno;
+	uint32_t pad[3];
+};
+
+struct health_table {
+	uint32_t magic;
+	uint32_t nslots;
+	uint64_t pad[7];
+	struct health_slot slots[HEALTH_SLOTS];
+};
+
+static struct health_table *health;
+
+static struct health_table *health_map(void)
+{
+	struct health_table *t;
+	struct stat st;
+	int fd;
+
+	if (health)
+		return health;
+	fd = open(HC_HEALTH_PATH, O_RDWR | O_CREAT | O_CLOEXEC, 0644);
+	if (fd < 0)
+		return NULL;
+	if (fstat(fd, &st) || (st.st_size < (off_t)sizeof(*t) &&
+			       ftruncate(fd, sizeof(*t)))) {
+		close(fd);
+		return NULL;
+	}
+	t = mmap(NULL, sizeof(*t), PROT_READ | PROT_WRITE, MAP_SHARED, fd, 0);
+	close(fd);
+	if (t == MAP_FAILED)
+		return NULL;
+	if (t->magic != HEALTH_MAGIC) {
+		t->nslots = HEALTH_SLOTS;
+		__atomic_store_n(&t->magic, HEALTH_MAGIC, __ATOMIC_RELEASE);
+	}
+	health = t;
+	return t;
+}
+
+/* The slot of dir, claiming a free one if it has none and create is set */
+static struct health_slot *health_slot(const char *dir, int create)
+{
+	struct health_table *t = health_map();
+	uint64_t key = hc_hash64(dir, strlen(dir)) | 1, zero;
+	unsigned i, n;
+
+	if (!t)
+		return NULL;
+	for (n = 0, i = key % HEALTH_SLOTS; n < HEALTH_SLOTS;
+	     ++n, i = (i + 1) % HEALTH_SLOTS) {
+		struct health_slot *s = &t->slots[i];
+		uint64_t k = __atomic_load_n(&s->key, __ATOMIC_ACQUIRE);
+		if (k == key)
+			return s;
+		if (k != 0)
+			continue;
+		if (!create)
+			return NULL;
+		zero = 0;
+		if (__atomic_compare_exchange_n(&s->key, &zero, key, 0,
+						__ATOMIC_ACQ_REL,
+						__ATOMIC_ACQUIRE) ||
+		    zero == key)
+			return s;
+	}
+	return NULL;
+}
+
+/* Errors which say the disk, rather than the core, is the problem */
+static int health_err(int err)
+{
+	return err == -EIO || err == -EROFS || err == -ENOSPC ||
+	       err == -EDQUOT;
+}
+
+/* Small writes are mostly fixed cost, so they count as 64KiB */
+static uint64_t health_ns_per_mb(uint64_t len, uint64_t ns)
+{
+	if (len < 65536)
+		len = 65536;
+	return ns * (1 << 20) / len;
+}
+
+void hc_health_record(const char *dir, uint64_t len, uint64_t ns, int err)
+{
+	struct health_slot *s = health_slot(dir, 1);
+	uint64_t sample, old;
+	time_t now = time(NULL);
+
+	if (!s || (err && !health_err(err)))
+		return;
+	if (err) {
+		__atomic_add_fetch(&s->errors, 1, __ATOMIC_RELAXED);
+		__atomic_store_n(&s->last_error, now, __ATOMIC_RELAXED);
+		__atomic_store_n(&s->last_errno, -err, __ATOMIC_RELAXED);
+		return;
+	}
+	sample = health_ns_per_mb(len, ns);
+	old = __atomic_load_n(&s->ns_per_mb, __ATOMIC_RELAXED);
+	if (now - __atomic_load_n(&s->last_sample, __ATOMIC_RELAXED) >
+	    HEALTH_STALE)
+		old = sample;
+	/* Races between handlers lose a sample now and then, which is fine */
+	__atomic_store_n(&s->ns_per_mb, old - old / 8 + sample / 8,
+			 __ATOMIC_RELAXED);
+	__atomic_add_fetch(&s->samples, 1, __ATOMIC_RELAXED);
+	__atomic_store_n(&s->last_sample, now, __ATOMIC_RELAXED);
+}
+
+/* Why dir shouldn't be written to, or 0 if it looks fine */
+static int health_check(const char *dir, uint64_t *ns_per_mb)
+{
+	struct health_slot *s = health_slot(dir, 0);
+	struct statvfs sv;
+	time_t now = time(NULL);
+
+	*ns_per_mb = 0;
+	if (statvfs(dir, &sv))
+		return -errno;
+	if (sv.f_flag & ST_RDONLY)
+		return -EROFS;
+	if (access(dir, W_OK))
+		return -errno;
+	if (!s)
+		return 0;
+	if (now - s->last_error < HEALTH_ERROR_HOLD)
+		return -s->last_errno ? -s->last_errno : -EIO;
+	if (now - s->last_sample > HEALTH_STALE)
+		return 0;
+	*ns_per_mb = s->ns_per_mb;
+	if (s->samples >= HEALTH_MIN_SAMPLES &&
+	    s->ns_per_mb > HEALTH_SLOW_NS_MB)
+		return -ETIMEDOUT;
+	return 0;
+}
+
+const char *hc_health_choose(const struct hc_policy *pol)
+{
+	const char *best = pol->core_dir;
+	uint64_t ns, best_ns = UINT64_MAX;
+	int i, ret;
+
+	for (i = -1; i < pol->nalt_dirs; ++i) {
+		const char *dir = i < 0 ? pol->core_dir : pol->alt_dirs[i];
+		ret = health_check(dir, &ns);
+		if (ret == 0)
+			return dir;
+		hc_log(LOG_WARNING, "dir_unhealthy", "dir=\"%s\" err=%d "
+		       "ms_per_mb=%llu", dir, -ret,
+		       (unsigned long long)ns / 1000000);
+		/* If none is healthy, the least slow which can be written */
+		if (ret == -ETIMEDOUT && ns < best_ns) {
+			best = dir;
+			best_ns = ns;
+		}
+	}
+	return best;
+}
+
+int hc_health_read(const char *dir, struct hc_health *h)
+{
+	struct health_slot *s = health_slot(dir, 0);
+	uint64_t ns;
+
+	memset(h, 0, sizeof(*h));
+	h->status = health_check(dir, &ns);
+	if (!s)
+		return health_map() ? 0 : -ENOENT;
+	h->ns_per_mb = s->ns_per_mb;
+	h->samples = s->samples;
+	h->errors = s->errors;
+	h->last_error = s->last_error;
+	h->last_errno = s->last_errno;
+	return 0;
+}
+
+struct hc_failover {
+	const struct hc_policy *pol;
+	char core[NAME_MAX + 1];
+	const char *dir;	/* where the core is now */
+	int moves;
+	/* the last move, for the sidecar */
+	const char *from;
+	uint64_t at;
+	int err;
+	uint64_t lost;		/* bytes which couldn't be copied over */
+};
+
+struct hc_failover *hc_failover_new(const struct hc_policy *pol,
+				    const char *dir, const char *core)
+{
+	struct hc_failover *f;
+
+	if (!pol->nalt_dirs)
+		return NULL;
+	f = calloc(1, sizeof(*f));
+	if (!f)
+		return NULL;
+	f->pol = pol;
+	f->dir = dir;
+	hc_strlcpy(f->core, core, sizeof(f->core));
+	return f;
+}
+
+/* The next directory after the current one which looks healthy */
+static const char *failover_next(struct hc_failover *f)
+{
+	const struct hc_policy *pol = f->pol;
+	uint64_t ns;
+	int i, cur = -1;
+
+	for (i = 0; i < pol->nalt_dirs; ++i) {
+		if (pol->alt_dirs[i] == f->dir)
+			cur = i;
+	}
+	for (i = 0; i <= pol->nalt_dirs; ++i) {
+		int j = (cur + 1 + i) % (pol->nalt_dirs + 1) - 1;
+		const char *dir = j < 0 ? pol->core_dir : pol->alt_dirs[j];
+		if (dir != f->dir && health_check(dir, &ns) == 0)
+			return dir;
+	}
+	return NULL;
+}
+
+/* Copy [0, len) of the old file into fd, leaving holes where it is zero or
+ * can't be read */
+static void failover_copy(struct hc_failover *f, int old_fd, int fd,
+			  uint64_t len)
+{
+	unsigned char *buf = malloc(FAILOVER_CHUNK);
+	uint64_t off;
+	ssize_t n;
+
+	if (!buf) {
+		f->lost += len;
+		return;
+	}
+	for (off = 0; off < len; off += FAILOVER_CHUNK) {
+		size_t want = len - off < FAILOVER_CHUNK ? len - off :
+			      FAILOVER_CHUNK;
+		n = pread(old_fd, buf, want, off);
+		if (n != (ssize_t)want) {
+			f->lost += want;
+			continue;
+		}
+		if (!hc_is_zero(buf, n) && pwrite(fd, buf, n, off) != n)
+			f->lost += n;
+	}
+	free(buf);
+}
+
+/* Move the file open as out_fd to the next healthy directory, keeping what
+ * it held up to len and leaving its offset at pos */
+static int failover_move(struct hc_failover *f, int out_fd, uint64_t len,
+			 uint64_t pos, int err)
+{
+	char path[PATH_MAX], old_path[PATH_MAX];
+	const char *dir;
+	int fd, ret;
+
+	if (f->moves >= FAILOVER_MAX)
+		return -EBUSY;
+	dir = failover_next(f);
+	if (!dir)
+		return -ENOENT;
+	snprintf(path, sizeof(path), "%s/%s", dir, f->core);
+	fd = open(path, O_RDWR | O_CREAT | O_TRUNC | O_CLOEXEC, 0666);
+	if (fd < 0) {
+		ret = -errno;
+		hc_health_record(dir, 0, 0, ret);
+		return ret;
+	}
+	failover_copy(f, out_fd, fd, len);
+	if (lseek(fd, pos, SEEK_SET) < 0 || dup3(fd, out_fd, O_CLOEXEC) < 0) {
+		err = -errno;
+		close(fd);
+		unlink(path);
+		return err;
+	}
+	close(fd);
+	snprintf(old_path, sizeof(old_path), "%s/%s", f->dir, f->core);
+	unlink(old_path);
+	hc_log(LOG_WARNING, "failover", "core=\"%s\" from=\"%s\" to=\"%s\" "
+	       "at=%llu err=%d lost=%llu", f->core, f->dir, dir,
+	       (unsigned long long)pos, -err, (unsigned long long)f->lost);
+	hc_flight_record(HC_EV_FAILOVER, err, pos, f->lost);
+	f->from = f->dir;
+	f->dir = dir;
+	f->at = pos;
+	f->err = err;
+	f->moves++;
+	return 0;
+}
+
+int hc_failover_wrote(struct hc_failover *f, int out_fd, uint64_t len,
+		      uint64_t ns, int err, int64_t redo_at)
+{
+	struct stat st;
+	off_t pos;
+
+	if (err) {
+		if (!health_err(err))
+			return err;
+		hc_health_record(f->dir, len, ns, err);
+		/* Only a write we can do again can move on after failing */
+		if (redo_at < 0 || failover_move(f, out_fd, redo_at, redo_at,
+						 err))
+			return err;
+		return -EAGAIN;
+	}
+	hc_health_record(f->dir, len, ns, 0);
+	if (ns < FAILOVER_STALL_NS ||
+	    health_ns_per_mb(len, ns) <= HEALTH_SLOW_NS_MB)
+		return 0;
+	/* Slow, but everything so far is there: take all of it along */
+	pos = lseek(out_fd, 0, SEEK_CUR);
+	if (pos < 0 || fstat(out_fd, &st))
+		return 0;
+	failover_move(f, out_fd, st.st_size, pos, -ETIMEDOUT);
+	return 0;
+}
+
+const char *hc_failover_dir(const struct hc_failover *f)
+{
+	return f->dir;
+}
+
+int hc_failover_sidecar(const struct hc_failover *f)
+{
+	if (!f->moves)
+		return 0;
+	return hc_sidecar_printf(f->dir, f->core, "failover\tfrom=%s\tto=%s\t"
+				 "at=%llu\terr=%d\tlost=%llu\tmoves=%d",
+				 f->from, f->dir, (unsigned long long)f->at,
+				 -f->err, (unsigned long long)f->lost,
+				 f->moves);
+}
+
+void hc_failover_free(struct hc_failover *f)
+{
+	free(f);
+}
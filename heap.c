@@ -0,0 +1,392 @@
+#include <elf.h>
+#include <errno.h>
+#include <stdio.h>
+#include <stdlib.h>
+#include <string.h>
+
+#include "handle_core.h"
+#include "hc_private.h"
+
+/*
+ * Allocator statistics
+ *
+ * For a crash which looks like memory trouble, what is worth knowing about
+ * the heap is mostly how the allocator saw it: how much it had taken from the
+ * system, how much of that was free, in how many pieces, and how big the
+ * largest was. That takes a walk of glibc malloc's free lists, which is done
+ * on the stored core and recorded in its sidecar, after which the heap can be
+ * thinned away like anything else.
+ *
+ * Distribution builds of libc are stripped of main_arena's symbol, so the
+ * arenas are found by their shape: main_arena lies in libc's writable data
+ * and starts a circular list of arenas through their next fields, which
+ * points back to itself while there is only one. Every candidate must also
+ * have a top chunk inside the core and a plausible system_mem. Both layouts
+ * of struct malloc_state since glibc 2.17 are tried (2.26 added
+ * have_fastchunks), and fastbin links are demangled for 2.32's safe-linking
+ * when that is what makes them valid.
+ *
+ * Chunks cached in tcache count as in use, since finding every thread's
+ * cache means walking the heap itself. Lists are walked within a step and
+ * time budget; a core whose lists were cut short or found corrupt is
+ * recorded as partial.
+ */
+
+#define HEAP_DATA_MAX (1 << 20)	/* libc data scanned for main_arena */
+#define HEAP_ARENAS_MAX 256
+#define HEAP_STEPS_MAX 2000000
+#define HEAP_BUDGET_NS 500000000ULL
+#define NFASTBINS 10
+#define NBINS 128
+#define CHUNK_ALIGN 16
+#define CHUNK_MIN 32
+
+/* Offsets into struct malloc_state, x86_64 and aarch64 */
+struct arena_layout {
+	unsigned fastbins, top, bins, next, system_mem, max_system_mem, size;
+};
+
+static const struct arena_layout layouts[] = {
+	/* glibc 2.26 and later */
+	{ 16, 96, 112, 2160, 2184, 2192, 2200 },
+	/* before, without have_fastchunks */
+	{ 8, 88, 104, 2152, 2176, 2184, 2192 },
+};
+
+struct heap_walk {
+	struct hc_core_file *cf;
+	const struct hc_core_meta *meta;
+	uint64_t steps;
+	uint64_t deadline;
+	int partial;
+};
+
+static int heap_read64(struct heap_walk *w, uint64_t addr, uint64_t *v)
+{
+	return hc_core_read_mem(w->cf, w->meta, addr, v, sizeof(*v));
+}
+
+static uint64_t get64(const unsigned char *p, unsigned off)
+{
+	uint64_t v;
+
+	memcpy(&v, p + off, sizeof(v));
+	return v;
+}
+
+/* One more list step, unless the budget is spent */
+static int heap_step(struct heap_walk *w)
+{
+	if (++w->steps > HEAP_STEPS_MAX ||
+	    ((w->steps & 1023) == 0 && hc_now_ns() > w->deadline)) {
+		w->partial = 1;
+		return 0;
+	}
+	return 1;
+}
+
+/* The size of the chunk at p, or 0 if p isn't a chunk in the core */
+static uint64_t chunk_size(struct heap_walk *w, uint64_t p)
+{
+	uint64_t size;
+
+	if (p % CHUNK_ALIGN || heap_read64(w, p + 8, &size))
+		return 0;
+	size &= ~7ULL;
+	return size >= CHUNK_MIN && size % CHUNK_ALIGN == 0 ? size : 0;
+}
+
+static void free_chunk(struct hc_heap_arena *a, uint64_t size)
+{
+	a->free_chunks++;
+	a->free_bytes += size;
+	if (size > a->largest_free)
+		a->largest_free = size;
+}
+
+/* Fastbins are singly linked through fd, mangled from glibc 2.32 on with
+ * the address it is stored at */
+static void walk_fastbin(struct heap_walk *w, struct hc_heap_arena *a,
+			 uint64_t p)
+{
+	uint64_t size, fd;
+	int mangled = -1;
+
+	while (p && heap_step(w)) {
+		size = chunk_size(w, p);
+		if (!size || heap_read64(w, p + 16, &fd)) {
+			w->partial = 1;
+			return;
+		}
+		free_chunk(a, size);
+		a->fast_chunks++;
+		a->fast_bytes += size;
+		if (mangled < 0 && fd) {
+			/* Whichever of the two reads as a chunk */
+			mangled = chunk_size(w, fd) == 0 &&
+				  chunk_size(w, ((p + 16) >> 12) ^ fd) != 0;
+		}
+		p = mangled > 0 ? ((p + 16) >> 12) ^ fd : fd;
+	}
+}
+
+/* Bin i is a circular list through fd whose head is the bin itself, seen as
+ * a chunk starting 16 bytes before its fd field */
+static void walk_bin(struct heap_walk *w, struct hc_heap_arena *a,
+		     uint64_t bin_fd_addr, uint64_t fd)
+{
+	uint64_t head = bin_fd_addr - 16, p = fd, size;
+
+	while (p != head && heap_step(w)) {
+		size = chunk_size(w, p);
+		if (!size || heap_read64(w, p + 16, &p)) {
+			w->partial = 1;
+			return;
+		}
+		free_chunk(a, size);
+	}
+}
+
+/* Whether buf, read from addr, looks like a malloc_state */
+static int arena_plausible(struct heap_walk *w, const unsigned char *buf,
+			   const struct arena_layout *l)
+{
+	uint64_t top = get64(buf, l->top);
+	uint64_t sys = get64(buf, l->system_mem);
+	uint64_t max = get64(buf, l->max_system_mem);
+	uint32_t mutex, flags;
+
+	memcpy(&mutex, buf, sizeof(mutex));
+	memcpy(&flags, buf + 4, sizeof(flags));
+	return mutex <= 2 && flags < 16 && sys && sys <= max &&
+	       max < (1ULL << 48) && sys % 4096 == 0 &&
+	       chunk_size(w, top) != 0;
+}
+
+static int arena_read(struct heap_walk *w, uint64_t addr,
+		      const struct arena_layout *l, unsigned char *buf)
+{
+	return hc_core_read_mem(w->cf, w->meta, addr, buf, l->size);
+}
+
+/* Walk the free lists of the arena in buf */
+static void arena_stats(struct heap_walk *w, uint64_t addr,
+			const unsigned char *buf,
+			const struct arena_layout *l, struct hc_heap_arena *a)
+{
+	unsigned i;
+
+	memset(a, 0, sizeof(*a));
+	a->addr = addr;
+	a->system_mem = get64(buf, l->system_mem);
+	a->max_system_mem = get64(buf, l->max_system_mem);
+	a->top = chunk_size(w, get64(buf, l->top));
+	for (i = 0; i < NFASTBINS; ++i)
+		walk_fastbin(w, a, get64(buf, l->fastbins + 8 * i));
+	/* bins[0], bins[1] are the unsorted bin; bin 0 doesn't exist */
+	for (i = 0; i < NBINS - 1; ++i) {
+		unsigned off = l->bins + 16 * i;
+		walk_bin(w, a, addr + off, get64(buf, off));
+	}
+	if (a->free_bytes + a->top > a->system_mem)
+		w->partial = 1;
+	else
+		a->in_use = a->system_mem - a->free_bytes - a->top;
+}
+
+/* Follow the arena list from main_arena at addr, which must lead back to
+ * it. Returns the number of arenas, or 0 if this isn't main_arena. */
+static int arena_list(struct heap_walk *w, uint64_t addr,
+		      const struct arena_layout *l, uint64_t *arenas)
+{
+	unsigned char *buf = malloc(l->size);
+	uint64_t a = addr;
+	int n = 0;
+
+	if (!buf)
+		return 0;
+	do {
+		if (n == HEAP_ARENAS_MAX || arena_read(w, a, l, buf) ||
+		    !arena_plausible(w, buf, l)) {
+			n = 0;
+			break;
+		}
+		arenas[n++] = a;
+		a = get64(buf, l->next);
+	} while (a != addr);
+	free(buf);
+	return n;
+}
+
+/* Look for main_arena in data read from addr */
+static int find_main_arena(struct heap_walk *w, const unsigned char *data,
+			   uint64_t addr, size_t len, uint64_t *arenas,
+			   const struct arena_layout **lp)
+{
+	unsigned i;
+	size_t off;
+	int n;
+
+	for (i = 0; i < sizeof(layouts) / sizeof(layouts[0]); ++i) {
+		const struct arena_layout *l = &layouts[i];
+		for (off = 0; off + l->size <= len; off += 8) {
+			uint64_t next = get64(data, off + l->next);
+			/* Cheap checks first: the list is never empty, and
+			 * non-main arenas live in their own mmaps */
+			if (!next || next % 8 ||
+			    (next != addr + off && next >= addr &&
+			     next < addr + len) ||
+			    !arena_plausible(w, data + off, l))
+				continue;
+			n = arena_list(w, addr + off, l, arenas);
+			if (n) {
+				*lp = l;
+				return n;
+			}
+		}
+	}
+	return 0;
+}
+
+static int is_libc(const char *path)
+{
+	const char *base = strrchr(path, '/');
+
+	base = base ? base + 1 : path;
+	return !strncmp(base, "libc.so", 7) || !strncmp(base, "libc-2.", 7);
+}
+
+int hc_heap_stats(struct hc_core_file *cf, const struct hc_core_meta *meta,
+		  struct hc_heap_stats *st)
+{
+	uint64_t arenas[HEAP_ARENAS_MAX];
+	const struct arena_layout *l = NULL;
+	struct heap_walk w = { cf, meta, 0, 0, 0 };
+	unsigned char *data = NULL, *buf;
+	uint64_t start = hc_now_ns();
+	unsigned i, j;
+	int n = 0;
+
+	memset(st, 0, sizeof(*st));
+	w.deadline = start + HEAP_BUDGET_NS;
+	/* main_arena is initialized data, so it is in a writable file
+	 * mapping of libc */
+	for (i = 0; i < meta->nmaps && !n; ++i) {
+		const struct hc_mapping *m = &meta->maps[i];
+		size_t len = m->end - m->start;
+		if (!is_libc(m->path) || len > HEAP_DATA_MAX)
+			continue;
+		for (j = 0; j < meta->nsegs; ++j) {
+			if (meta->segs[j].vaddr == m->start &&
+			    (meta->segs[j].flags & PF_W))
+				break;
+		}
+		if (j == meta->nsegs)
+			continue;
+		free(data);
+		data = malloc(len);
+		if (!data)
+			return -ENOMEM;
+		if (hc_core_read_mem(cf, meta, m->start, data, len))
+			continue;
+		n = find_main_arena(&w, data, m->start, len, arenas, &l);
+	}
+	free(data);
+	if (!n)
+		return -ENOENT;
+
+	st->arenas = calloc(n, sizeof(*st->arenas));
+	buf = malloc(l->size);
+	if (!st->arenas || !buf) {
+		free(buf);
+		hc_heap_free(st);
+		return -ENOMEM;
+	}
+	for (i = 0; i < (unsigned)n; ++i) {
+		struct hc_heap_arena *a = &st->arenas[i];
+		if (arena_read(&w, arenas[i], l, buf))
+			continue;
+		arena_stats(&w, arenas[i], buf, l, a);
+		st->narenas++;
+		st->system_mem += a->system_mem;
+		st->in_use += a->in_use;
+		st->free_bytes += a->free_bytes;
+		st->free_chunks += a->free_chunks;
+		st->fast_bytes += a->fast_bytes;
+		st->top += a->top;
+		if (a->largest_free > st->largest_free)
+			st->largest_free = a->largest_free;
+	}
+	free(buf);
+	st->partial = w.partial;
+	st->steps = w.steps;
+	st->ms = (hc_now_ns() - start) / 1000000;
+	return 0;
+}
+
+/* How much of the free memory, tops included, lies outside the largest
+ * piece of it, in thousandths */
+static unsigned heap_frag(uint64_t free_bytes, uint64_t largest)
+{
+	if (!free_bytes)
+		return 0;
+	return 1000 - largest * 1000 / free_bytes;
+}
+
+int hc_heap_sidecar(const struct hc_heap_stats *st, const char *core_dir,
+		    const char *core)
+{
+	uint64_t largest;
+	unsigned i;
+	int ret;
+
+	largest = st->largest_free;
+	for (i = 0; i < st->narenas; ++i) {
+		if (st->arenas[i].top > largest)
+			largest = st->arenas[i].top;
+	}
+	ret = hc_sidecar_printf(core_dir, core, "heap\tallocator=glibc\t"
+				"arenas=%u\tsystem_mem=%llu\tin_use=%llu\t"
+				"free=%llu\tfree_chunks=%llu\tfast=%llu\t"
+				"top=%llu\tlargest_free=%llu\tfrag=%u\t"
+				"partial=%d\tms=%llu", st->narenas,
+				(unsigned long long)st->system_mem,
+				(unsigned long long)st->in_use,
+				(unsigned long long)st->free_bytes,
+				(unsigned long long)st->free_chunks,
+				(unsigned long long)st->fast_bytes,
+				(unsigned long long)st->top,
+				(unsigned long long)st->largest_free,
+				heap_frag(st->free_bytes + st->top, largest),
+				st->partial, (unsigned long long)st->ms);
+	for (i = 0; i < st->narenas && !ret; ++i) {
+		const struct hc_heap_arena *a = &st->arenas[i];
+		largest = a->largest_free > a->top ? a->largest_free : a->top;
+		ret = hc_sidecar_printf(core_dir, core, "arena\taddr=0x%llx\t"
+					"system_mem=%llu\tmax_system_mem=%llu\t"
+					"in_use=%llu\tfree=%llu\t"
+					"free_chunks=%llu\tfast=%llu\t"
+					"fast_chunks=%llu\ttop=%llu\t"
+					"largest_free=%llu\tfrag=%u",
+					(unsigned long long)a->addr,
+					(unsigned long long)a->system_mem,
+					(unsigned long long)a->max_system_mem,
+					(unsigned long long)a->in_use,
+					(unsigned long long)a->free_bytes,
+					(unsigned long long)a->free_chunks,
+					(unsigned long long)a->fast_bytes,
+					(unsigned long long)a->fast_chunks,
+					(unsigned long long)a->top,
+					(unsigned long long)a->largest_free,
+					heap_frag(a->free_bytes + a->top,
+						  largest));
+	}
+	return ret;
+}
+
+void hc_heap_free(struct hc_heap_stats *st)
+{
+	free(st->arenas);
+	st->arenas = NULL;
+	st->narenas = 0;
+}
@@ -0,0 +1,641 @@
+#define _GNU_SOURCE
+#include <dirent.h>
+#include <errno.h>
+#include <fcntl.h>
+#include <limits.h>
+#include <pthread.h>
+#include <stdio.h>
+#include <stdlib.h>
+#include <string.h>
+#include <sys/stat.h>
+#include <syslog.h>
+#include <time.h>
+#include <unistd.h>
+
+#include "handle_core.h"
+#include "hc_private.h"
+
+/*
+ * Importing core backlogs
+ *
+ * Worker threads share one stack of paths. A worker that pops a directory
+ * pushes its entries back on the stack, so large trees are walked in parallel
+ * as well as imported in parallel. Each core is written to a temporary file in
+ * core_dir, checked against the content hash computed while writing it, and
+ * only then linked under its final name, indexed, and its original removed.
+ * Cores whose content hash matches one already in the store are not stored
+ * again.
+ *
+ * Summarizing in place indexes a backlog without moving it. Only a core's
+ * headers and notes are read, which tell its exe, pid, signal and expected
+ * size, plus the ELF header page of the crashing thread's binary to
+ * symbolize it, so each core costs kilobytes however large it is. Cores are
+ * indexed by their real path, through the record's dir when they lie outside
+ * core_dir, which keeps retention and thinning away from them; cores already
+ * indexed are skipped, so a run can be repeated as the backlog grows.
+ */
+
+#define IMPORT_CHUNK (4 << 20)
+
+struct dedup_entry {
+	uint64_t hash;
+	char core[NAME_MAX + 1];
+};
+
+struct import_ctx {
+	const struct hc_policy *pol;
+	const struct hc_import_opts *opts;
+	char core_dir_real[PATH_MAX];
+
+	pthread_mutex_t lock;
+	pthread_cond_t cond;
+	char **stack;		/* paths still to visit */
+	size_t nstack, alloc_stack;
+	int busy;		/* workers currently visiting a path */
+	int stop;		/* fatal error, give up */
+
+	struct dedup_entry *dedup;	/* open-addressing table by hash */
+	size_t dedup_mask, ndedup;
+
+	char **known;		/* in place: cores already indexed, sorted */
+	size_t nknown, alloc_known;
+
+	struct timespec budget_next;	/* when the I/O budget is next free */
+	struct hc_import_stats stats;
+};
+
+static int push_path(struct import_ctx *ctx, const char *path)
+{
+	char *dup = strdup(path);
+
+	if (!dup)
+		return -ENOMEM;
+	if (ctx->nstack == ctx->alloc_stack) {
+		size_t alloc = ctx->alloc_stack ? ctx->alloc_stack * 2 : 64;
+		char **stack = realloc(ctx->stack, alloc * sizeof(*stack));
+		if (!stack) {
+			free(dup);
+			return -ENOMEM;
+		}
+		ctx->stack = stack;
+		ctx->alloc_stack = alloc;
+	}
+	ctx->stack[ctx->nstack++] = dup;
+	pthread_cond_signal(&ctx->cond);
+	return 0;
+}
+
+/* Must be called with ctx->lock held */
+static struct dedup_entry *dedup_find(struct import_ctx *ctx, uint64_t hash)
+{
+	size_t i = hash & ctx->dedup_mask;
+
+	while (ctx->dedup[i].hash && ctx->dedup[i].hash != hash)
+		i = (i + 1) & ctx->dedup_mask;
+	return &ctx->dedup[i];
+}
+
+/* Must be called with ctx->lock held */
+static int dedup_add(struct import_ctx *ctx, uint64_t hash, const char *core)
+{
+	struct dedup_entry *e;
+
+	if (!hash)
+		return 0;
+	if ((ctx->ndedup + 1) * 2 > ctx->dedup_mask + 1) {
+		struct dedup_entry *old = ctx->dedup;
+		size_t i, old_len = ctx->dedup_mask + 1;
+		ctx->dedup = calloc(old_len * 2, sizeof(*ctx->dedup));
+		if (!ctx->dedup) {
+			ctx->dedup = old;
+			return -ENOMEM;
+		}
+		ctx->dedup_mask = old_len * 2 - 1;
+		for (i = 0; i < old_len; ++i) {
+			if (old[i].hash)
+				*dedup_find(ctx, old[i].hash) = old[i];
+		}
+		free(old);
+	}
+	e = dedup_find(ctx, hash);
+	if (!e->hash)
+		ctx->ndedup++;
+	e->hash = hash;
+	hc_strlcpy(e->core, core, sizeof(e->core));
+	return 0;
+}
+
+static int dedup_load_cb(const struct hc_record *rec, void *arg)
+{
+	struct import_ctx *ctx = arg;
+	char path[PATH_MAX];
+
+	snprintf(path, sizeof(path), "%s/%s", ctx->pol->core_dir, rec->core);
+	if (access(path, F_OK))
+		return 0;
+	return dedup_add(ctx, rec->hash, rec->core);
+}
+
+/* The name a summarized core is known by: its real path, or its name if it
+ * is in core_dir */
+static const char *known_key(struct import_ctx *ctx, const char *dir,
+			     const char *core, char *key)
+{
+	if (!dir[0] || !strcmp(dir, ctx->core_dir_real))
+		return core;
+	snprintf(key, PATH_MAX, "%s/%s", dir, core);
+	return key;
+}
+
+static int known_load_cb(const struct hc_record *rec, void *arg)
+{
+	struct import_ctx *ctx = arg;
+	char buf[PATH_MAX];
+	const char *key;
+	char *dup;
+
+	key = known_key(ctx, rec->dir, rec->core, buf);
+	if (ctx->nknown == ctx->alloc_known) {
+		size_t alloc = ctx->alloc_known ? ctx->alloc_known * 2 : 1024;
+		char **known = realloc(ctx->known, alloc * sizeof(*known));
+		if (!known)
+			return -ENOMEM;
+		ctx->known = known;
+		ctx->alloc_known = alloc;
+	}
+	dup = strdup(key);
+	if (!dup)
+		return -ENOMEM;
+	ctx->known[ctx->nknown++] = dup;
+	return 0;
+}
+
+static int cmp_known(const void *a, const void *b)
+{
+	return strcmp(*(char *const *)a, *(char *const *)b);
+}
+
+/* Block until len more bytes of I/O fit in the budget */
+static void budget_take(struct import_ctx *ctx, uint64_t len)
+{
+	struct timespec now, when;
+	uint64_t ns;
+
+	if (!ctx->opts->io_budget)
+		return;
+	ns = len * 1000000000ULL / ctx->opts->io_budget;
+	clock_gettime(CLOCK_MONOTONIC, &now);
+	pthread_mutex_lock(&ctx->lock);
+	if (hc_timespec_cmp(&ctx->budget_next, &now) < 0)
+		ctx->budget_next = now;
+	when = ctx->budget_next;
+	hc_timespec_add_ns(&ctx->budget_next, ns);
+	pthread_mutex_unlock(&ctx->lock);
+	while (clock_nanosleep(CLOCK_MONOTONIC, TIMER_ABSTIME, &when, NULL) ==
+	       EINTR)
+		;
+}
+
+/* Store in into the already open tmp_fd, returning what it looks like */
+static int import_store(struct import_ctx *ctx, struct hc_input *in,
+			int tmp_fd, struct hc_hcz_stats *st)
+{
+	struct hc_hcz_writer *w;
+	uint64_t off;
+	int ret;
+
+	if (!ctx->pol->compress) {
+		/* Hash the original so the copy can be checked against it.
+		 * The copy itself is a reflink or copy_file_range when
+		 * possible, which we charge like a plain copy. */
+		budget_take(ctx, in->size * 2);
+		st->hash = hc_content_hash(in->map, in->size);
+		ret = hc_input_copy(in, tmp_fd, &st->raw_size);
+		st->stored_size = st->raw_size;
+		return ret;
+	}
+	ret = hc_hcz_writer_open(&w, tmp_fd, HC_HCZ_LEVEL);
+	if (ret)
+		return ret;
+	for (off = 0; off < (uint64_t)in->size; off += IMPORT_CHUNK) {
+		size_t len = in->size - off;
+		if (len > IMPORT_CHUNK)
+			len = IMPORT_CHUNK;
+		budget_take(ctx, len);
+		ret = hc_hcz_write(w, in->map + off, len);
+		if (ret) {
+			hc_hcz_writer_close(w, NULL);
+			return ret;
+		}
+	}
+	return hc_hcz_writer_close(w, st);
+}
+
+/* Check the stored copy and return its content hash */
+static int import_verify(struct import_ctx *ctx, const char *path,
+			 uint64_t *hash)
+{
+	struct hc_core_file *cf;
+	int ret;
+
+	ret = hc_core_open(path, &cf);
+	if (ret)
+		return ret;
+	budget_take(ctx, hc_core_size(cf));
+	ret = hc_core_verify(cf, hash);
+	hc_core_close(cf);
+	return ret;
+}
+
+/* Give the temporary file its permanent name, without clobbering anything */
+static int import_publish(struct import_ctx *ctx, const char *tmp,
+			  const char *exe, time_t when, struct hc_record *rec)
+{
+	char base[PATH_MAX], path[PATH_MAX];
+	const char *slash;
+	int i, len;
+
+	hc_core_name(ctx->pol->core_dir, exe, when, base);
+	for (i = 0; i < 1000; ++i) {
+		if (i == 0)
+			len = snprintf(path, sizeof(path), "%s%s", base,
+				       ctx->pol->compress ? HC_HCZ_SUFFIX : "");
+		else
+			len = snprintf(path, sizeof(path), "%s-%d%s", base, i,
+				       ctx->pol->compress ? HC_HCZ_SUFFIX : "");
+		if (len >= (int)sizeof(path))
+			return -ENAMETOOLONG;
+		if (link(tmp, path) == 0) {
+			unlink(tmp);
+			slash = strrchr(path, '/');
+			hc_strlcpy(rec->core, slash + 1, sizeof(rec->core));
+			return 0;
+		}
+		if (errno != EEXIST)
+			return -errno;
+	}
+	return -EEXIST;
+}
+
+/* Returns 0 once the core is stored, 1 if path is not a core */
+static int import_file(struct import_ctx *ctx, const char *path,
+		       const struct stat *st)
+{
+	char tmp[PATH_MAX];
+	struct hc_core_meta meta;
+	struct hc_hcz_stats hst;
+	struct hc_record rec;
+	struct hc_input in;
+	struct dedup_entry *dup;
+	uint64_t hash;
+	int fd, tmp_fd = -1, ret;
+
+	fd = open(path, O_RDONLY | O_CLOEXEC);
+	if (fd < 0)
+		return -errno;
+	ret = hc_input_init(&in, fd, NULL);
+	if (ret)
+		goto done;
+	if (in.size < 64) {
+		ret = 1;
+		goto done;
+	}
+	ret = hc_input_map(&in);
+	if (ret)
+		goto done;
+	if (hc_elf_parse(in.map, in.size, &meta)) {
+		ret = 1;
+		goto done;
+	}
+	/* What the record needs of meta, which freeing it clears */
+	memset(&rec, 0, sizeof(rec));
+	rec.pid = meta.pid;
+	rec.signo = meta.signo;
+	hc_strlcpy(rec.exe, meta.exe[0] ? meta.exe : "unknown",
+		   sizeof(rec.exe));
+	hc_core_meta_free(&meta);
+
+	snprintf(tmp, sizeof(tmp), "%s/.import.XXXXXX", ctx->pol->core_dir);
+	tmp_fd = mkostemp(tmp, O_CLOEXEC);
+	if (tmp_fd < 0) {
+		ret = -errno;
+		goto done;
+	}
+	fchmod(tmp_fd, 0644);
+	ret = import_store(ctx, &in, tmp_fd, &hst);
+	if (ret == 0 && ctx->pol->sync && fdatasync(tmp_fd))
+		ret = -errno;
+	if (close(tmp_fd) && !ret)
+		ret = -errno;
+	tmp_fd = -1;
+	if (ret == 0)
+		ret = import_verify(ctx, tmp, &hash);
+	if (ret == 0 && hash != hst.hash)
+		ret = -EBADMSG;
+	if (ret) {
+		unlink(tmp);
+		goto done;
+	}
+
+	rec.time = st->st_mtime;
+	rec.size = in.size;
+	rec.stored = hst.stored_size;
+	rec.hash = hash;
+	rec.form = ctx->pol->compress ? HC_FORM_HCZ : HC_FORM_FULL;
+
+	pthread_mutex_lock(&ctx->lock);
+	dup = dedup_find(ctx, hash);
+	if (dup->hash) {
+		/* Point the record at the copy we already have */
+		hc_strlcpy(rec.core, dup->core, sizeof(rec.core));
+		ctx->stats.duplicates++;
+		pthread_mutex_unlock(&ctx->lock);
+		unlink(tmp);
+	}
+	else {
+		ret = import_publish(ctx, tmp, rec.exe, rec.time, &rec);
+		if (ret == 0) {
+			dedup_add(ctx, hash, rec.core);
+			ctx->stats.imported++;
+			ctx->stats.bytes_stored += rec.stored;
+		}
+		pthread_mutex_unlock(&ctx->lock);
+		if (ret) {
+			unlink(tmp);
+			goto done;
+		}
+	}
+	ret = hc_index_append(ctx->pol->core_dir, &rec);
+	/* The original goes only once the copy is known to be on disk */
+	if (ret == 0 && ctx->pol->sync)
+		ret = hc_commit(ctx->pol->core_dir);
+	if (ret)
+		goto done;
+	if (!ctx->opts->keep_originals && unlink(path))
+		ret = -errno;
+done:
+	if (tmp_fd >= 0) {
+		close(tmp_fd);
+		unlink(tmp);
+	}
+	hc_input_release(&in);
+	close(fd);
+	return ret;
+}
+
+static int summarize_func(const struct hc_symbol *sym, void *arg)
+{
+	struct hc_record *rec = arg;
+
+	hc_symbol_format(sym, rec->func, sizeof(rec->func));
+	return 1;
+}
+
+/* Index the core at path where it lies. Returns 1 if it is not a core. */
+static int summarize_file(struct import_ctx *ctx, const char *path,
+			  const struct stat *st)
+{
+	char real[PATH_MAX], buf[PATH_MAX];
+	struct hc_core_meta meta;
+	struct hc_core_file *cf;
+	struct hc_record rec;
+	uint64_t read;
+	const char *key;
+	char *slash;
+	size_t len;
+	int ret;
+
+	if (st->st_size < 64)
+		return 1;
+	if (!realpath(path, real))
+		return -errno;
+	slash = strrchr(real, '/');
+	*slash = '\0';
+	memset(&rec, 0, sizeof(rec));
+	if (strcmp(real, ctx->core_dir_real)) {
+		if (strlen(real) >= sizeof(rec.dir))
+			return -ENAMETOOLONG;
+		hc_strlcpy(rec.dir, real, sizeof(rec.dir));
+	}
+	hc_strlcpy(rec.core, slash + 1, sizeof(rec.core));
+	key = known_key(ctx, rec.dir, rec.core, buf);
+	if (bsearch(&key, ctx->known, ctx->nknown, sizeof(*ctx->known),
+		    cmp_known)) {
+		pthread_mutex_lock(&ctx->lock);
+		ctx->stats.known++;
+		pthread_mutex_unlock(&ctx->lock);
+		return 0;
+	}
+	*slash = '/';
+
+	ret = hc_core_open(real, &cf);
+	if (ret)
+		return ret == -EINVAL ? 1 : ret;
+	ret = hc_core_meta_read(cf, &meta);
+	if (ret) {
+		hc_core_close(cf);
+		return ret == -ENOEXEC ? 1 : ret;
+	}
+	read = meta.headers_len;
+	budget_take(ctx, read);
+	rec.time = st->st_mtime;
+	rec.pid = meta.pid;
+	rec.signo = meta.signo;
+	rec.size = hc_core_size(cf);
+	rec.stored = st->st_blocks * 512;
+	len = strlen(rec.core);
+	if (hc_core_is_compressed(cf))
+		rec.form = HC_FORM_HCZ;
+	else if (len > strlen(HC_MINI_SUFFIX) &&
+		 !strcmp(rec.core + len - strlen(HC_MINI_SUFFIX),
+			 HC_MINI_SUFFIX))
+		rec.form = HC_FORM_MINI;
+	else
+		rec.form = HC_FORM_FULL;
+	if (rec.size < meta.expected_size)
+		rec.integrity = HC_INTEGRITY_TRUNCATED;
+	hc_strlcpy(rec.exe, meta.exe[0] ? meta.exe : "unknown",
+		   sizeof(rec.exe));
+	hc_core_meta_free(&meta);
+	hc_core_close(cf);
+
+	/* Tables are built for binaries still around, once each */
+	hc_symbolize(ctx->pol->core_dir, real, HC_SYM_BUILD, summarize_func,
+		     &rec);
+	ret = hc_index_append(ctx->pol->core_dir, &rec);
+	if (ret)
+		return ret;
+	if (rec.integrity == HC_INTEGRITY_TRUNCATED && !rec.dir[0])
+		hc_partial_add(ctx->pol->core_dir, rec.core);
+	pthread_mutex_lock(&ctx->lock);
+	ctx->stats.summarized++;
+	ctx->stats.bytes_in += read;
+	pthread_mutex_unlock(&ctx->lock);
+	return 0;
+}
+
+static int import_dir(struct import_ctx *ctx, const char *path)
+{
+	char real[PATH_MAX], child[PATH_MAX];
+	struct dirent *de;
+	DIR *dp;
+	int ret = 0;
+
+	/* Never import the store into itself */
+	if (!ctx->opts->in_place && realpath(path, real) &&
+	    !strcmp(real, ctx->core_dir_real))
+		return 0;
+	dp = opendir(path);
+	if (!dp)
+		return -errno;
+	while ((de = readdir(dp))) {
+		if (!strcmp(de->d_name, ".") || !strcmp(de->d_name, ".."))
+			continue;
+		/* Such as the sidecars and minicores of a store */
+		if (ctx->opts->in_place && de->d_name[0] == '.')
+			continue;
+		snprintf(child, sizeof(child), "%s/%s", path, de->d_name);
+		pthread_mutex_lock(&ctx->lock);
+		ret = push_path(ctx, child);
+		pthread_mutex_unlock(&ctx->lock);
+		if (ret)
+			break;
+	}
+	closedir(dp);
+	return ret;
+}
+
+static void import_path(struct import_ctx *ctx, const char *path)
+{
+	struct stat st;
+	int ret;
+
+	if (lstat(path, &st)) {
+		ret = -errno;
+	}
+	else if (S_ISDIR(st.st_mode)) {
+		ret = import_dir(ctx, path);
+	}
+	else if (S_ISREG(st.st_mode) && ctx->opts->in_place) {
+		ret = summarize_file(ctx, path, &st);
+		pthread_mutex_lock(&ctx->lock);
+		if (ret > 0)
+			ctx->stats.skipped++;
+		pthread_mutex_unlock(&ctx->lock);
+	}
+	else if (S_ISREG(st.st_mode)) {
+		ret = import_file(ctx, path, &st);
+		pthread_mutex_lock(&ctx->lock);
+		if (ret == 0)
+			ctx->stats.bytes_in += st.st_size;
+		else if (ret > 0)
+			ctx->stats.skipped++;
+		pthread_mutex_unlock(&ctx->lock);
+	}
+	else {
+		ret = 0;
+	}
+	if (ret < 0) {
+		hc_log(LOG_ERR, "import_failed", "path=\"%s\" err=%d",
+		       path, -ret);
+		pthread_mutex_lock(&ctx->lock);
+		ctx->stats.failed++;
+		if (ret == -ENOSPC)
+			ctx->stop = 1;
+		pthread_mutex_unlock(&ctx->lock);
+	}
+}
+
+static void *import_worker(void *arg)
+{
+	struct import_ctx *ctx = arg;
+	char *path;
+
+	pthread_mutex_lock(&ctx->lock);
+	while (1) {
+		while (!ctx->nstack && ctx->busy && !ctx->stop)
+			pthread_cond_wait(&ctx->cond, &ctx->lock);
+		if (ctx->stop || !ctx->nstack)
+			break;
+		path = ctx->stack[--ctx->nstack];
+		ctx->busy++;
+		pthread_mutex_unlock(&ctx->lock);
+		import_path(ctx, path);
+		free(path);
+		pthread_mutex_lock(&ctx->lock);
+		ctx->busy--;
+	}
+	/* Wake up the others so they notice we're done */
+	pthread_cond_broadcast(&ctx->cond);
+	pthread_mutex_unlock(&ctx->lock);
+	return NULL;
+}
+
+int hc_import(const struct hc_policy *pol, const struct hc_import_opts *opts,
+	      char *const *paths, int npaths, struct hc_import_stats *stats)
+{
+	struct import_ctx ctx;
+	pthread_t *threads;
+	int i, jobs, ret = 0, started = 0;
+
+	memset(&ctx, 0, sizeof(ctx));
+	ctx.pol = pol;
+	ctx.opts = opts;
+	pthread_mutex_init(&ctx.lock, NULL);
+	pthread_cond_init(&ctx.cond, NULL);
+	if (!realpath(pol->core_dir, ctx.core_dir_real))
+		return -errno;
+	ctx.dedup_mask = 1023;
+	ctx.dedup = calloc(ctx.dedup_mask + 1, sizeof(*ctx.dedup));
+	if (!ctx.dedup)
+		return -ENOMEM;
+	ret = hc_index_foreach(pol->core_dir, opts->in_place ? known_load_cb :
+			       dedup_load_cb, &ctx);
+	if (ret == 0 && ctx.nknown)
+		qsort(ctx.known, ctx.nknown, sizeof(*ctx.known), cmp_known);
+	for (i = 0; i < npaths && ret == 0; ++i)
+		ret = push_path(&ctx, paths[i]);
+	if (ret)
+		goto done;
+
+	jobs = opts->jobs > 0 ? opts->jobs : 1;
+	threads = calloc(jobs, sizeof(*threads));
+	if (!threads) {
+		ret = -ENOMEM;
+		goto done;
+	}
+	for (i = 0; i < jobs; ++i) {
+		if (pthread_create(&threads[i], NULL, import_worker, &ctx))
+			break;
+		started++;
+	}
+	if (!started) {
+		/* Do the work ourselves rather than not at all */
+		import_worker(&ctx);
+	}
+	for (i = 0; i < started; ++i)
+		pthread_join(threads[i], NULL);
+	free(threads);
+
+	/* Summarizing leaves cores be; one flush covers all the records */
+	if (opts->in_place)
+		ret = pol->sync ? hc_commit(pol->core_dir) : 0;
+	else
+		ret = hc_thin_enabled(pol) ? hc_thin(pol, NULL) :
+					     hc_enforce_retention(pol);
+	if (ret > 0)
+		ret = 0;
+done:
+	for (i = 0; i < (int)ctx.nstack; ++i)
+		free(ctx.stack[i]);
+	free(ctx.stack);
+	free(ctx.dedup);
+	for (i = 0; i < (int)ctx.nknown; ++i)
+		free(ctx.known[i]);
+	free(ctx.known);
+	pthread_mutex_destroy(&ctx.lock);
+	pthread_cond_destroy(&ctx.cond);
+	if (stats)
+		*stats = ctx.stats;
+	return ret;
+}
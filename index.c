@@ -0,0 +1,276 @@
+#include <errno.h>
+#include <fcntl.h>
+#include <limits.h>
+#include <stdio.h>
+#include <stdlib.h>
+#include <string.h>
+#include <unistd.h>
+
+#include "handle_core.h"
+#include "hc_private.h"
+
+/*
+ * The crash index
+ *
+ * The index is a text file in core_dir with one line per captured core. Each
+ * line is a list of tab-separated key=value fields. Readers skip keys they do
+ * not know, so fields can be added without breaking older tools. Records are
+ * appended with a single write() on an O_APPEND descriptor, which keeps
+ * concurrent handlers from interleaving their lines.
+ *
+ * The file is never rewritten. When a core is thinned, a new record naming
+ * the old one in its was= field is appended instead, and readers skip any
+ * record that a later line replaces.
+ *
+ * A record with a dir= field stands for a core which failed over to another
+ * directory; its file, sidecar and full record are in that directory. Cores
+ * which didn't arrive whole say so in integrity=, which complete ones leave
+ * out.
+ */
+
+#define INDEX_LINE_MAX 4096
+
+/* Copy src into dst, replacing the characters which delimit index fields */
+static void index_escape(char *dst, size_t dst_len, const char *src)
+{
+	size_t i;
+
+	for (i = 0; src[i] && i + 1 < dst_len; ++i) {
+		char c = src[i];
+		dst[i] = (c == '\t' || c == '\n' || c == '\r') ? '_' : c;
+	}
+	dst[i] = '\0';
+}
+
+void hc_index_path(const char *core_dir, char *path)
+{
+	snprintf(path, PATH_MAX, "%s/%s", core_dir, HC_INDEX_NAME);
+}
+
+static const char *form_names[] = {
+	[HC_FORM_FULL] = "full",
+	[HC_FORM_HCZ] = "hcz",
+	[HC_FORM_MINI] = "mini",
+	[HC_FORM_SUMMARY] = "summary",
+	[HC_FORM_EXPIRED] = "expired",
+};
+
+const char *hc_form_name(int form)
+{
+	if (form < 0 || form > HC_FORM_EXPIRED)
+		return "unknown";
+	return form_names[form];
+}
+
+static const char *integrity_names[] = {
+	[HC_INTEGRITY_COMPLETE] = "complete",
+	[HC_INTEGRITY_TRUNCATED] = "truncated",
+	[HC_INTEGRITY_MALFORMED] = "malformed",
+	[HC_INTEGRITY_UNVERIFIED] = "unverified",
+};
+
+const char *hc_integrity_name(int integrity)
+{
+	if (integrity < 0 || integrity > HC_INTEGRITY_UNVERIFIED)
+		return "unknown";
+	return integrity_names[integrity];
+}
+
+int hc_index_append(const char *core_dir, const struct hc_record *rec)
+{
+	char path[PATH_MAX], line[INDEX_LINE_MAX];
+	char exe[HC_EXE_NAME_MAX], core[NAME_MAX + 1], func[HC_FUNC_MAX];
+	char was[NAME_MAX + 1], dir[HC_DIR_MAX];
+	int fd, len, ret = 0;
+
+	index_escape(exe, sizeof(exe), rec->exe);
+	index_escape(core, sizeof(core), rec->core);
+	index_escape(func, sizeof(func), rec->func);
+	index_escape(was, sizeof(was), rec->was);
+	index_escape(dir, sizeof(dir), rec->dir);
+	len = snprintf(line, sizeof(line),
+		"time=%lld\tpid=%d\tsignal=%d\tsize=%llu\tstored=%llu\t"
+		"hash=%016llx\texe=%s\tcore=%s\tfunc=%s\tform=%s%s%s%s%s%s%s\n",
+		(long long)rec->time, (int)rec->pid, rec->signo,
+		(unsigned long long)rec->size, (unsigned long long)rec->stored,
+		(unsigned long long)rec->hash, exe, core, func,
+		hc_form_name(rec->form), was[0] ? "\twas=" : "", was,
+		dir[0] ? "\tdir=" : "", dir,
+		rec->integrity ? "\tintegrity=" : "",
+		rec->integrity ? hc_integrity_name(rec->integrity) : "");
+	if (len >= (int)sizeof(line))
+		return -ENAMETOOLONG;
+	hc_index_path(core_dir, path);
+	fd = open(path, O_WRONLY | O_APPEND | O_CREAT | O_CLOEXEC, 0644);
+	if (fd < 0)
+		return -errno;
+	if (write(fd, line, len) != len)
+		ret = errno ? -errno : -EIO;
+	close(fd);
+	return ret;
+}
+
+/* Parse one index line into rec. Returns 0 if the line looked valid. */
+static int index_parse(char *line, struct hc_record *rec)
+{
+	char *saveptr = NULL, *tok;
+	size_t len;
+	int i;
+
+	memset(rec, 0, sizeof(*rec));
+	rec->form = -1;
+	for (tok = strtok_r(line, "\t\n", &saveptr); tok;
+	     tok = strtok_r(NULL, "\t\n", &saveptr)) {
+		char *val = strchr(tok, '=');
+		if (!val)
+			continue;
+		*val++ = '\0';
+		if (!strcmp(tok, "time"))
+			rec->time = strtoll(val, NULL, 10);
+		else if (!strcmp(tok, "pid"))
+			rec->pid = atoi(val);
+		else if (!strcmp(tok, "signal"))
+			rec->signo = atoi(val);
+		else if (!strcmp(tok, "size"))
+			rec->size = strtoull(val, NULL, 10);
+		else if (!strcmp(tok, "stored"))
+			rec->stored = strtoull(val, NULL, 10);
+		else if (!strcmp(tok, "hash"))
+			rec->hash = strtoull(val, NULL, 16);
+		else if (!strcmp(tok, "exe"))
+			hc_strlcpy(rec->exe, val, sizeof(rec->exe));
+		else if (!strcmp(tok, "core"))
+			hc_strlcpy(rec->core, val, sizeof(rec->core));
+		else if (!strcmp(tok, "func"))
+			hc_strlcpy(rec->func, val, sizeof(rec->func));
+		else if (!strcmp(tok, "was"))
+			hc_strlcpy(rec->was, val, sizeof(rec->was));
+		else if (!strcmp(tok, "dir"))
+			hc_strlcpy(rec->dir, val, sizeof(rec->dir));
+		else if (!strcmp(tok, "integrity")) {
+			for (i = 0; i <= HC_INTEGRITY_UNVERIFIED; ++i) {
+				if (!strcmp(val, integrity_names[i]))
+					rec->integrity = i;
+			}
+		}
+		else if (!strcmp(tok, "form")) {
+			for (i = 0; i <= HC_FORM_EXPIRED; ++i) {
+				if (!strcmp(val, form_names[i]))
+					rec->form = i;
+			}
+		}
+	}
+	/* Records from before forms were recorded */
+	if (rec->form < 0) {
+		len = strlen(rec->core);
+		rec->form = (len > 4 && !strcmp(rec->core + len - 4,
+						HC_HCZ_SUFFIX)) ?
+			    HC_FORM_HCZ : HC_FORM_FULL;
+	}
+	return rec->core[0] ? 0 : -EINVAL;
+}
+
+/* Cores named in the was= field of some record, with the line of the last
+ * such record */
+struct index_replaced {
+	char *core;
+	long line;
+};
+
+static int cmp_replaced(const void *a, const void *b)
+{
+	const struct index_replaced *ra = a, *rb = b;
+
+	return strcmp(ra->core, rb->core);
+}
+
+/* Collect the replaced records of the index, sorted by name. Most indexes
+ * have none, and this costs only a scan for "\twas=". */
+static int index_replaced(FILE *fp, struct index_replaced **out, size_t *n)
+{
+	char line[INDEX_LINE_MAX];
+	struct index_replaced *r = NULL, *tmp;
+	size_t alloc = 0, i, j;
+	struct hc_record rec;
+	long lineno = 0;
+
+	*n = 0;
+	while (fgets(line, sizeof(line), fp)) {
+		lineno++;
+		if (!strstr(line, "\twas=") || index_parse(line, &rec) ||
+		    !rec.was[0])
+			continue;
+		if (*n == alloc) {
+			alloc = alloc ? alloc * 2 : 64;
+			tmp = realloc(r, alloc * sizeof(*r));
+			if (!tmp)
+				goto nomem;
+			r = tmp;
+		}
+		r[*n].core = strdup(rec.was);
+		if (!r[*n].core)
+			goto nomem;
+		r[*n].line = lineno;
+		(*n)++;
+	}
+	/* Sort, keeping only the last line for each name */
+	qsort(r, *n, sizeof(*r), cmp_replaced);
+	for (i = 0, j = 0; i < *n; ++i) {
+		if (j && !strcmp(r[j - 1].core, r[i].core)) {
+			if (r[i].line > r[j - 1].line)
+				r[j - 1].line = r[i].line;
+			free(r[i].core);
+			continue;
+		}
+		r[j++] = r[i];
+	}
+	*n = j;
+	*out = r;
+	return 0;
+nomem:
+	for (i = 0; i < *n; ++i)
+		free(r[i].core);
+	free(r);
+	*n = 0;
+	return -ENOMEM;
+}
+
+int hc_index_foreach(const char *core_dir, hc_index_cb_t cb, void *arg)
+{
+	char path[PATH_MAX], line[INDEX_LINE_MAX];
+	struct index_replaced *replaced = NULL, *r, key;
+	struct hc_record rec;
+	size_t nreplaced, i;
+	long lineno = 0;
+	FILE *fp;
+	int ret = 0;
+
+	hc_index_path(core_dir, path);
+	fp = fopen(path, "re");
+	if (!fp)
+		return (errno == ENOENT) ? 0 : -errno;
+	ret = index_replaced(fp, &replaced, &nreplaced);
+	if (ret) {
+		fclose(fp);
+		return ret;
+	}
+	rewind(fp);
+	while (fgets(line, sizeof(line), fp)) {
+		lineno++;
+		if (index_parse(line, &rec) || rec.form == HC_FORM_EXPIRED)
+			continue;
+		key.core = rec.core;
+		r = nreplaced ? bsearch(&key, replaced, nreplaced,
+					sizeof(*replaced), cmp_replaced) : NULL;
+		if (r && r->line > lineno)
+			continue;
+		ret = cb(&rec, arg);
+		if (ret)
+			break;
+	}
+	fclose(fp);
+	for (i = 0; i < nreplaced; ++i)
+		free(replaced[i].core);
+	free(replaced);
+	return ret;
+}
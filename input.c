@@ -0,0 +1,344 @@
+#define _GNU_SOURCE
+#include <errno.h>
+#include <linux/fs.h>
+#include <stdint.h>
+#include <stdlib.h>
+#include <string.h>
+#include <sys/ioctl.h>
+#include <sys/mman.h>
+#include <sys/stat.h>
+#include <unistd.h>
+
+#include "hc_private.h"
+
+/*
+ * Core input
+ *
+ * The kernel hands us cores through a pipe, but cores re-ingested from
+ * elsewhere (systemd-coredump, gcore, replay harnesses) arrive as a regular
+ * file on stdin. For those we can avoid pulling every byte through user space:
+ * a reflink shares the extents outright when both files live on the same
+ * filesystem, copy_file_range() lets the kernel (or the filesystem) do the
+ * copy otherwise, and stages which need to look at the data (compression)
+ * mmap the input instead of reading it into buffers.
+ */
+
+#define BUF_SIZE 65536
+#define COPY_CHUNK (64 << 20)
+#define PROGRESS_EVERY (64 << 20)
+#define HEADERS_MAX (64 << 20)
+
+/* Data copied by the kernel never passes through our buffers, so read the
+ * headers of a regular-file core separately for the stream to parse. */
+static void input_prime(struct hc_input *in)
+{
+	unsigned char *buf = NULL, *nbuf;
+	size_t len = BUF_SIZE;
+	ssize_t got, need;
+
+	while (1) {
+		nbuf = realloc(buf, len);
+		if (!nbuf)
+			break;
+		buf = nbuf;
+		got = pread(in->fd, buf, len, in->start);
+		if (got <= 0)
+			break;
+		need = hc_elf_headers_len(buf, got);
+		if (need == -ENOEXEC) {
+			/* for the stream to say what is wrong with it */
+			hc_stream_set_headers(in->stream, buf, got);
+			free(buf);
+			return;
+		}
+		if (need < 0 || need > HEADERS_MAX)
+			break;
+		if (need <= got) {
+			hc_stream_set_headers(in->stream, buf, got);
+			free(buf);
+			return;
+		}
+		if ((size_t)got < len)
+			break;
+		len = need;
+	}
+	free(buf);
+	in->stream->state = HC_STREAM_UNPARSEABLE;
+}
+
+int hc_input_init(struct hc_input *in, int fd, struct hc_stream *stream)
+{
+	struct stat st;
+
+	memset(in, 0, sizeof(*in));
+	in->fd = fd;
+	in->stream = stream;
+	in->next_progress = PROGRESS_EVERY;
+	if (fstat(fd, &st))
+		return -errno;
+	if (!S_ISREG(st.st_mode))
+		return 0;
+	in->start = lseek(fd, 0, SEEK_CUR);
+	if (in->start < 0 || in->start > st.st_size)
+		return 0;
+	in->regular = 1;
+	in->size = st.st_size - in->start;
+	if (stream)
+		input_prime(in);
+	return 0;
+}
+
+int hc_input_map(struct hc_input *in)
+{
+	void *map;
+	off_t page_off;
+
+	if (in->map)
+		return 0;
+	if (!in->regular)
+		return -ESPIPE;
+	if (in->size == 0)
+		return -ENODATA;
+	/* mmap offsets must be page aligned; the core may start anywhere */
+	page_off = in->start & ~((off_t)sysconf(_SC_PAGESIZE) - 1);
+	map = mmap(NULL, in->size + (in->start - page_off), PROT_READ,
+		   MAP_PRIVATE, in->fd, page_off);
+	if (map == MAP_FAILED)
+		return -errno;
+	madvise(map, in->size + (in->start - page_off), MADV_SEQUENTIAL);
+	in->map_base = map;
+	in->map = (const unsigned char *)map + (in->start - page_off);
+	return 0;
+}
+
+void hc_input_release(struct hc_input *in)
+{
+	if (in->map_base)
+		munmap(in->map_base, in->size + (in->map - (const unsigned char *)in->map_base));
+	in->map_base = NULL;
+	in->map = NULL;
+}
+
+/* Account for len more bytes of the core having been consumed: follow the
+ * stream, publish live progress, and record a flight recorder event every
+ * PROGRESS_EVERY bytes. buf is NULL if the data never reached user space. */
+static void input_advance(struct hc_input *in, const void *buf, size_t len,
+			  uint64_t nwritten)
+{
+	in->nread += len;
+	if (in->stream)
+		hc_stream_feed(in->stream, buf, len);
+	hc_progress_update(in->stream, in->nread, nwritten);
+	if (in->nread < in->next_progress)
+		return;
+	hc_flight_record(HC_EV_PROGRESS, 0, in->nread, nwritten);
+	in->next_progress = in->nread + PROGRESS_EVERY;
+}
+
+ssize_t hc_input_read(struct hc_input *in, void *buf, size_t len,
+		      uint64_t nwritten)
+{
+	ssize_t n;
+
+	do {
+		if (in->regular)
+			n = pread(in->fd, buf, len, in->start + in->nread);
+		else
+			n = read(in->fd, buf, len);
+	} while (n < 0 && errno == EINTR);
+	if (n < 0)
+		return -errno;
+	if (n > 0)
+		input_advance(in, buf, n, nwritten);
+	return n;
+}
+
+/* hc_write_all() of what goes at offset at of the output, timed for the
+ * failover, which may move the output elsewhere and have it written again */
+static int input_write(struct hc_input *in, int out_fd, const void *buf,
+		       size_t len, uint64_t at)
+{
+	uint64_t t;
+	int ret;
+
+	do {
+		t = hc_now_ns();
+		ret = hc_write_all(out_fd, buf, len);
+		if (!in->failover)
+			return ret;
+		ret = hc_failover_wrote(in->failover, out_fd, len,
+					hc_now_ns() - t, ret, at);
+	} while (ret == -EAGAIN);
+	return ret;
+}
+
+/* Share the input's extents with out_fd. Only possible for a whole file. */
+static int input_reflink(struct hc_input *in, int out_fd, uint64_t *copied)
+{
+	if (in->start != 0)
+		return -EINVAL;
+	if (ioctl(out_fd, FICLONE, in->fd))
+		return -errno;
+	*copied = in->size;
+	input_advance(in, NULL, in->size, *copied);
+	return 0;
+}
+
+static int input_copy_range(struct hc_input *in, int out_fd, uint64_t *copied)
+{
+	loff_t off = in->start;
+	uint64_t t;
+	int ret;
+
+	while (1) {
+		ssize_t res;
+		t = hc_now_ns();
+		res = copy_file_range(in->fd, &off, out_fd, NULL, COPY_CHUNK,
+				      0);
+		if (res == 0)
+			return 0;
+		ret = res < 0 ? -errno : 0;
+		if (in->failover) {
+			/* off only moves on success, so a failed chunk can be
+			 * copied again */
+			ret = hc_failover_wrote(in->failover, out_fd,
+						res > 0 ? res : 0,
+						hc_now_ns() - t, ret, *copied);
+		}
+		if (ret == -EAGAIN || ret == -EINTR)
+			continue;
+		if (ret)
+			return ret;
+		*copied += res;
+		input_advance(in, NULL, res, *copied);
+	}
+}
+
+static int input_copy_map(struct hc_input *in, int out_fd, uint64_t *copied)
+{
+	uint64_t off;
+	int ret;
+
+	ret = hc_input_map(in);
+	if (ret)
+		return ret;
+	for (off = 0; off < (uint64_t)in->size; off += COPY_CHUNK) {
+		size_t len = in->size - off;
+		if (len > COPY_CHUNK)
+			len = COPY_CHUNK;
+		ret = input_write(in, out_fd, in->map + off, len, *copied);
+		if (ret)
+			return ret;
+		*copied += len;
+		input_advance(in, in->map + off, len, *copied);
+	}
+	return 0;
+}
+
+static int input_copy_read(struct hc_input *in, int out_fd, uint64_t *copied)
+{
+	char buf[BUF_SIZE];
+	int ret;
+
+	while (1) {
+		ssize_t nread = read(in->fd, buf, BUF_SIZE);
+		if (nread == 0)
+			return 0;
+		if (nread < 0) {
+			if (errno == EINTR)
+				continue;
+			return -errno;
+		}
+		ret = input_write(in, out_fd, buf, nread, *copied);
+		if (ret)
+			return ret;
+		*copied += nread;
+		input_advance(in, buf, nread, *copied);
+	}
+}
+
+/* Errors which mean "this method is not available here", rather than
+ * "the copy failed". */
+static int copy_unsupported(int err)
+{
+	return err == -EXDEV || err == -ENOSYS || err == -EINVAL ||
+		err == -EOPNOTSUPP || err == -ENOTTY || err == -EBADF ||
+		err == -ETXTBSY || err == -EPERM;
+}
+
+static int input_copy(struct hc_input *in, int out_fd, uint64_t *copied)
+{
+	int ret;
+
+	*copied = 0;
+	if (in->regular) {
+		ret = input_reflink(in, out_fd, copied);
+		if (ret == 0 || !copy_unsupported(ret))
+			return ret;
+		ret = input_copy_range(in, out_fd, copied);
+		/* copy_file_range can only fail before it has copied anything
+		 * for lack of support, so falling back from here is safe. */
+		if (ret == 0 || !copy_unsupported(ret) || *copied)
+			return ret;
+		ret = input_copy_map(in, out_fd, copied);
+		if (ret == 0 || *copied)
+			return ret;
+	}
+	return input_copy_read(in, out_fd, copied);
+}
+
+int hc_input_copy(struct hc_input *in, int out_fd, uint64_t *copied)
+{
+	int ret = input_copy(in, out_fd, copied);
+
+	hc_flight_record(HC_EV_PROGRESS, ret, *copied, *copied);
+	return ret;
+}
+
+int hc_input_compress(struct hc_input *in, int out_fd,
+		      struct hc_hcz_stats *stats)
+{
+	struct hc_hcz_writer *w;
+	char buf[BUF_SIZE];
+	uint64_t off;
+	int ret;
+
+	memset(stats, 0, sizeof(*stats));
+	ret = hc_hcz_writer_open(&w, out_fd, HC_HCZ_LEVEL);
+	if (ret)
+		return ret;
+	if (in->regular && hc_input_map(in) == 0) {
+		for (off = 0; off < (uint64_t)in->size && !ret;
+		     off += COPY_CHUNK) {
+			size_t len = in->size - off;
+			if (len > COPY_CHUNK)
+				len = COPY_CHUNK;
+			ret = hc_hcz_write(w, in->map + off, len);
+			input_advance(in, in->map + off, len,
+				      hc_hcz_written(w));
+		}
+	}
+	else {
+		while (1) {
+			ssize_t nread = read(in->fd, buf, BUF_SIZE);
+			if (nread == 0)
+				break;
+			if (nread < 0) {
+				if (errno == EINTR)
+					continue;
+				ret = -errno;
+				break;
+			}
+			ret = hc_hcz_write(w, buf, nread);
+			if (ret)
+				break;
+			input_advance(in, buf, nread, hc_hcz_written(w));
+		}
+	}
+	hc_flight_record(HC_EV_PROGRESS, ret, in->nread, hc_hcz_written(w));
+	if (ret) {
+		hc_hcz_writer_close(w, NULL);
+		return ret;
+	}
+	return hc_hcz_writer_close(w, stats);
+}
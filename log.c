@@ -0,0 +1,137 @@
+#include <errno.h>
+#include <fcntl.h>
+#include <stdarg.h>
+#include <stdio.h>
+#include <string.h>
+#include <sys/socket.h>
+#include <sys/stat.h>
+#include <sys/un.h>
+#include <syslog.h>
+#include <time.h>
+#include <unistd.h>
+
+#include "handle_core.h"
+#include "hc_private.h"
+
+/*
+ * Logging that can't stall the crash path
+ *
+ * syslog(3) blocks on /dev/log when journald or the syslog daemon is wedged,
+ * which is common during exactly the incidents where cores are piling up,
+ * and a blocked handler holds up the dying process. Messages are instead
+ * sent as datagrams with MSG_DONTWAIT. If the socket is full or missing, the
+ * message is appended to a small local fallback file instead, and if that
+ * fails too it is dropped. Sent, fallback and dropped messages are counted
+ * in the flight recorder, which also notes every drop.
+ *
+ * Messages are lists of key=value fields, starting with event=<name>.
+ */
+
+#define LOG_MSG_MAX 1024
+#define LOG_SOCKET "/dev/log"
+#define LOG_FALLBACK_MAX (1 << 20)
+
+static int log_fd = -1;
+
+static int log_connect(void)
+{
+	struct sockaddr_un sun;
+
+	if (log_fd >= 0)
+		close(log_fd);
+	log_fd = socket(AF_UNIX, SOCK_DGRAM | SOCK_NONBLOCK | SOCK_CLOEXEC, 0);
+	if (log_fd < 0)
+		return -errno;
+	memset(&sun, 0, sizeof(sun));
+	sun.sun_family = AF_UNIX;
+	hc_strlcpy(sun.sun_path, LOG_SOCKET, sizeof(sun.sun_path));
+	if (connect(log_fd, (struct sockaddr *)&sun, sizeof(sun))) {
+		int ret = -errno;
+		close(log_fd);
+		log_fd = -1;
+		return ret;
+	}
+	return 0;
+}
+
+static int log_send(const char *msg, size_t len)
+{
+	int ret, tries;
+
+	for (tries = 0; tries < 2; ++tries) {
+		if (log_fd < 0) {
+			ret = log_connect();
+			if (ret)
+				return ret;
+		}
+		if (send(log_fd, msg, len, MSG_DONTWAIT | MSG_NOSIGNAL) >= 0)
+			return 0;
+		ret = -errno;
+		/* The daemon may have restarted: reconnect once. Anything
+		 * else, such as EAGAIN from a full socket, is final. */
+		if (ret != -ECONNREFUSED && ret != -ENOTCONN)
+			return ret;
+		close(log_fd);
+		log_fd = -1;
+	}
+	return ret;
+}
+
+/* Append to the fallback file, rotating it once it reaches
+ * LOG_FALLBACK_MAX so that it stays bounded. */
+static int log_fallback(const char *msg, size_t len)
+{
+	struct stat st;
+	int fd, ret = 0;
+
+	fd = open(HC_LOG_FALLBACK_PATH, O_WRONLY | O_APPEND | O_CREAT |
+		  O_NONBLOCK | O_CLOEXEC, 0640);
+	if (fd < 0)
+		return -errno;
+	if (fstat(fd, &st) == 0 && st.st_size >= LOG_FALLBACK_MAX) {
+		close(fd);
+		rename(HC_LOG_FALLBACK_PATH, HC_LOG_FALLBACK_PATH ".old");
+		fd = open(HC_LOG_FALLBACK_PATH, O_WRONLY | O_APPEND | O_CREAT |
+			  O_NONBLOCK | O_CLOEXEC, 0640);
+		if (fd < 0)
+			return -errno;
+	}
+	if (write(fd, msg, len) != (ssize_t)len)
+		ret = errno ? -errno : -EIO;
+	close(fd);
+	return ret;
+}
+
+void hc_log(int prio, const char *event, const char *fmt, ...)
+{
+	char body[LOG_MSG_MAX], msg[LOG_MSG_MAX + 64], stamp[32];
+	struct tm tm_buf;
+	time_t now;
+	va_list ap;
+	int len, ret;
+
+	len = snprintf(body, sizeof(body), "event=%s ", event);
+	va_start(ap, fmt);
+	vsnprintf(body + len, sizeof(body) - len, fmt, ap);
+	va_end(ap);
+
+	len = snprintf(msg, sizeof(msg), "<%d>handle_core[%d]: %s",
+		       LOG_USER | prio, (int)getpid(), body);
+	ret = log_send(msg, len);
+	if (ret == 0) {
+		hc_flight_count(HC_COUNT_LOG_SENT);
+		return;
+	}
+	/* The fallback file gets a timestamp instead of the priority */
+	time(&now);
+	strftime(stamp, sizeof(stamp), "%Y-%m-%dT%H:%M:%S",
+		 localtime_r(&now, &tm_buf));
+	len = snprintf(msg, sizeof(msg), "%s handle_core[%d]: %s\n", stamp,
+		       (int)getpid(), body);
+	if (log_fallback(msg, len) == 0) {
+		hc_flight_count(HC_COUNT_LOG_FALLBACK);
+		return;
+	}
+	hc_flight_count(HC_COUNT_LOG_DROPPED);
+	hc_flight_record(HC_EV_LOG_DROP, ret, prio, 0);
+}
@@ -0,0 +1,339 @@
+#define _GNU_SOURCE
+#include <elf.h>
+#include <errno.h>
+#include <fcntl.h>
+#include <limits.h>
+#include <stdio.h>
+#include <stdlib.h>
+#include <string.h>
+#include <sys/stat.h>
+#include <unistd.h>
+
+#include "handle_core.h"
+#include "hc_private.h"
+
+/*
+ * Minicores
+ *
+ * A minicore is an ELF core holding the notes, the stack of every thread
+ * from its stack pointer up, small writable mappings such as the .data and
+ * .bss of each binary, and the first page of every mapped ELF file, which
+ * is enough to find build-ids. gdb loads it, and it can be symbolized and
+ * its stacks read, at a small fraction of the size of the core.
+ *
+ * Thinning cuts old cores down to minicores. Capture can also write one
+ * while the core streams in: everything it keeps lies at known offsets of
+ * the core once the headers have been parsed, so the minicore's headers are
+ * written straight away and each kept range is copied out of the stream as
+ * it goes past. The minicore is complete, and is published next to the
+ * core's sidecar, as soon as the last kept range has gone by. The kernel
+ * writes cores in address order, so for a piped core that is usually the
+ * main thread's stack near the end; what it saves is the wait for the rest
+ * of capture (compressing, flushing, symbolizing, indexing), and it is
+ * ready at once for a core ingested from a file.
+ */
+
+#define MINI_STACK_MAX (512 << 10)	/* stack kept above each sp */
+#define MINI_RW_MAX (128 << 10)	/* writable mappings kept whole */
+#define MINI_PAGE 4096ULL
+#define MINI_TMP ".mini.XXXXXX"
+
+/* The part of a PT_LOAD segment a minicore keeps: from the lowest stack
+ * pointer in it, a small writable mapping whole, or the ELF header page of a
+ * file mapping */
+static void mini_keep(const struct hc_core_meta *meta, const Elf64_Phdr *ph,
+		      uint64_t *start, uint64_t *end)
+{
+	uint64_t seg_end = ph->p_vaddr + ph->p_filesz;
+	unsigned i;
+
+	*start = *end = ph->p_vaddr;
+	for (i = 0; i < meta->nthreads_known; ++i) {
+		uint64_t sp = meta->threads[i].sp & ~(MINI_PAGE - 1);
+		if (sp < ph->p_vaddr || sp >= seg_end)
+			continue;
+		if (*end == ph->p_vaddr || sp < *start)
+			*start = sp;
+		if (sp + MINI_STACK_MAX > *end)
+			*end = sp + MINI_STACK_MAX;
+	}
+	if (*end != ph->p_vaddr) {
+		if (*end > seg_end)
+			*end = seg_end;
+		return;
+	}
+	if ((ph->p_flags & PF_W) && ph->p_filesz <= MINI_RW_MAX) {
+		*end = seg_end;
+		return;
+	}
+	for (i = 0; i < meta->nmaps; ++i) {
+		if (meta->maps[i].start == ph->p_vaddr &&
+		    meta->maps[i].offset == 0) {
+			*end = ph->p_vaddr + (ph->p_filesz < MINI_PAGE ?
+					      ph->p_filesz : MINI_PAGE);
+			return;
+		}
+	}
+}
+
+/* Segments are split where the kept part doesn't start at the segment's
+ * start, since file data always starts there */
+int hc_mini_layout(const unsigned char *hdr, size_t len,
+		   const struct hc_core_meta *meta, struct hc_mini_layout *l)
+{
+	const Elf64_Ehdr *in_eh = (const Elf64_Ehdr *)hdr;
+	const Elf64_Phdr *in_ph;
+	Elf64_Ehdr *eh;
+	Elf64_Phdr *ph;
+	uint64_t off, notes_len = 0;
+	int i, n = 0;
+
+	memset(l, 0, sizeof(*l));
+	if (len < sizeof(*in_eh) || in_eh->e_phoff > len ||
+	    in_eh->e_phnum * sizeof(*in_ph) > len - in_eh->e_phoff)
+		return -EINVAL;
+	in_ph = (const Elf64_Phdr *)(hdr + in_eh->e_phoff);
+	for (i = 0; i < in_eh->e_phnum; ++i) {
+		if (in_ph[i].p_type == PT_NOTE) {
+			if (in_ph[i].p_offset > len ||
+			    in_ph[i].p_filesz > len - in_ph[i].p_offset)
+				return -EINVAL;
+			notes_len += in_ph[i].p_filesz;
+		}
+		n += in_ph[i].p_type == PT_LOAD ? 2 : 1;
+	}
+	/* Notes go straight after the program headers, data after that */
+	l->head_len = (sizeof(*eh) + n * sizeof(*ph) + notes_len +
+		       MINI_PAGE - 1) & ~(MINI_PAGE - 1);
+	l->head = calloc(1, l->head_len);
+	l->ranges = calloc(in_eh->e_phnum, sizeof(*l->ranges));
+	if (!l->head || !l->ranges) {
+		hc_mini_layout_free(l);
+		return -ENOMEM;
+	}
+	eh = (Elf64_Ehdr *)l->head;
+	ph = (Elf64_Phdr *)(l->head + sizeof(*eh));
+	off = l->head_len;
+	n = 0;
+	for (i = 0; i < in_eh->e_phnum; ++i) {
+		Elf64_Phdr p = in_ph[i];
+		uint64_t start, end;
+		if (p.p_type != PT_LOAD) {
+			ph[n++] = p;
+			continue;
+		}
+		mini_keep(meta, &p, &start, &end);
+		if (start > p.p_vaddr) {
+			ph[n] = p;
+			ph[n].p_memsz = start - p.p_vaddr;
+			ph[n].p_filesz = 0;
+			ph[n].p_offset = 0;
+			n++;
+		}
+		off = (off + MINI_PAGE - 1) & ~(MINI_PAGE - 1);
+		ph[n] = p;
+		ph[n].p_vaddr = start;
+		ph[n].p_paddr = 0;
+		ph[n].p_memsz = p.p_vaddr + p.p_memsz - start;
+		ph[n].p_filesz = end - start;
+		ph[n].p_offset = end > start ? off : 0;
+		if (end > start) {
+			struct hc_mini_range *r = &l->ranges[l->nranges++];
+			r->in_off = p.p_offset + start - p.p_vaddr;
+			r->len = end - start;
+			r->out_off = off;
+		}
+		off += end - start;
+		n++;
+	}
+	/* Now the notes, which follow the program headers */
+	notes_len = sizeof(*eh) + n * sizeof(*ph);
+	for (i = 0; i < n; ++i) {
+		if (ph[i].p_type != PT_NOTE)
+			continue;
+		memcpy(l->head + notes_len, hdr + ph[i].p_offset,
+		       ph[i].p_filesz);
+		ph[i].p_offset = notes_len;
+		notes_len += ph[i].p_filesz;
+	}
+	*eh = *in_eh;
+	eh->e_phoff = sizeof(*eh);
+	eh->e_phnum = n;
+	eh->e_shoff = 0;
+	eh->e_shnum = 0;
+	eh->e_shstrndx = 0;
+	/* The last segments may have kept nothing */
+	l->size = off;
+	return 0;
+}
+
+void hc_mini_layout_free(struct hc_mini_layout *l)
+{
+	free(l->head);
+	free(l->ranges);
+	l->head = NULL;
+	l->ranges = NULL;
+}
+
+struct hc_mini_writer {
+	struct hc_mini_layout layout;
+	const struct hc_policy *pol;
+	char core[NAME_MAX + 1];
+	char tmp[PATH_MAX];
+	int fd;
+	int src_fd;		/* to read ranges the stream doesn't show us */
+	off_t src_start;
+	unsigned cur;		/* the first range not yet copied in full */
+	uint64_t copied;	/* of range cur */
+	uint64_t start_ns;
+};
+
+int hc_mini_writer_open(const struct hc_policy *pol, const char *core,
+			const unsigned char *hdr, size_t len,
+			const struct hc_core_meta *meta, int src_fd,
+			off_t src_start, struct hc_mini_writer **wp)
+{
+	struct hc_mini_writer *w;
+	char dir[PATH_MAX];
+	int ret;
+
+	*wp = NULL;
+	w = calloc(1, sizeof(*w));
+	if (!w)
+		return -ENOMEM;
+	w->fd = -1;
+	w->pol = pol;
+	w->src_fd = src_fd;
+	w->src_start = src_start;
+	w->start_ns = hc_now_ns();
+	hc_strlcpy(w->core, core, sizeof(w->core));
+	ret = hc_mini_layout(hdr, len, meta, &w->layout);
+	if (ret)
+		goto fail;
+	snprintf(dir, sizeof(dir), "%s/%s", pol->core_dir, HC_SIDECAR_DIR);
+	if (mkdir(dir, 0755) && errno != EEXIST) {
+		ret = -errno;
+		goto fail;
+	}
+	snprintf(w->tmp, sizeof(w->tmp), "%s/%s/%s", pol->core_dir,
+		 HC_SIDECAR_DIR, MINI_TMP);
+	w->fd = mkostemp(w->tmp, O_CLOEXEC);
+	if (w->fd < 0) {
+		ret = -errno;
+		w->tmp[0] = '\0';
+		goto fail;
+	}
+	fchmod(w->fd, 0644);
+	ret = hc_write_all(w->fd, w->layout.head, w->layout.head_len);
+	if (ret)
+		goto fail;
+	*wp = w;
+	return 0;
+fail:
+	hc_mini_writer_close(w);
+	return ret;
+}
+
+/* Copy the part of range r which lies in [pos, pos + len) */
+static int mini_copy(struct hc_mini_writer *w, const struct hc_mini_range *r,
+		     uint64_t pos, const unsigned char *buf, size_t len)
+{
+	uint64_t from = r->in_off + w->copied, to = r->in_off + r->len;
+	unsigned char *tmp = NULL;
+	size_t n;
+	int ret = 0;
+
+	if (to > pos + len)
+		to = pos + len;
+	if (from >= to)
+		return 0;
+	n = to - from;
+	if (!buf) {
+		tmp = malloc(n);
+		if (!tmp)
+			return -ENOMEM;
+		if (w->src_fd < 0 ||
+		    pread(w->src_fd, tmp, n, w->src_start + from) != (ssize_t)n)
+			ret = -EIO;
+		buf = tmp;
+		pos = from;
+	}
+	if (ret == 0 && pwrite(w->fd, buf + (from - pos), n,
+			       r->out_off + w->copied) != (ssize_t)n)
+		ret = errno ? -errno : -EIO;
+	free(tmp);
+	if (ret == 0)
+		w->copied += n;
+	return ret;
+}
+
+int hc_mini_writer_feed(struct hc_mini_writer *w, uint64_t pos,
+			const void *buf, size_t len)
+{
+	const struct hc_mini_layout *l = &w->layout;
+	int ret;
+
+	if (w->cur >= l->nranges)
+		return 0;
+	while (w->cur < l->nranges &&
+	       l->ranges[w->cur].in_off < pos + len) {
+		const struct hc_mini_range *r = &l->ranges[w->cur];
+		/* Gone past without our seeing it, if the stream skipped
+		 * ahead */
+		if (r->in_off + w->copied < pos && buf)
+			return -EIO;
+		ret = mini_copy(w, r, pos, buf, len);
+		if (ret)
+			return ret;
+		if (w->copied < r->len)
+			break;
+		w->cur++;
+		w->copied = 0;
+	}
+	return w->cur == l->nranges;
+}
+
+int hc_mini_writer_finish(struct hc_mini_writer *w, uint64_t *size,
+			  uint64_t *ms)
+{
+	char path[PATH_MAX];
+	int ret = 0;
+
+	if (w->cur < w->layout.nranges)
+		ret = -EAGAIN;
+	else if (ftruncate(w->fd, w->layout.size) ||
+		 (w->pol->sync && fdatasync(w->fd)))
+		ret = -errno;
+	if (ret == 0) {
+		hc_mini_path(w->pol->core_dir, w->core, path);
+		if (rename(w->tmp, path))
+			ret = -errno;
+		else
+			w->tmp[0] = '\0';
+	}
+	*size = w->layout.size;
+	*ms = (hc_now_ns() - w->start_ns) / 1000000;
+	hc_mini_writer_close(w);
+	return ret;
+}
+
+void hc_mini_writer_close(struct hc_mini_writer *w)
+{
+	if (!w)
+		return;
+	if (w->fd >= 0)
+		close(w->fd);
+	if (w->tmp[0])
+		unlink(w->tmp);
+	hc_mini_layout_free(&w->layout);
+	free(w);
+}
+
+void hc_mini_path(const char *core_dir, const char *core, char *path)
+{
+	size_t len;
+
+	hc_sidecar_path(core_dir, core, path);
+	len = strlen(path);
+	snprintf(path + len, PATH_MAX - len, "%s", HC_MINI_SUFFIX);
+}
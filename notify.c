@@ -0,0 +1,279 @@
+#define _GNU_SOURCE
+#include <errno.h>
+#include <netdb.h>
+#include <pthread.h>
+#include <stdio.h>
+#include <stdlib.h>
+#include <string.h>
+#include <syslog.h>
+#include <unistd.h>
+
+#include "handle_core.h"
+#include "hc_private.h"
+
+/*
+ * Notification
+ *
+ * Writing a large core can take minutes, and nobody should have to wait that
+ * long to hear about a crash. hc_capture() therefore sends two messages: one
+ * as soon as the notes at the start of the core have been parsed, with what
+ * they say about the crash, and one once the core is stored, with a third in
+ * between if a minicore is written alongside the core. They all go out
+ * from a thread of their own, since the mail command may take its time and
+ * the pipe from the kernel must keep draining meanwhile.
+ */
+
+struct notify_msg {
+	struct notify_msg *next;
+	char *text;
+};
+
+struct hc_notifier {
+	const struct hc_policy *pol;
+	pthread_mutex_t lock;
+	pthread_cond_t cond;
+	struct notify_msg *head, **tail;
+	pthread_t thread;
+	int started;
+	int done;		/* no more messages will be posted */
+	int err;		/* from the first mail that failed */
+};
+
+/* Send text through the mail command, after a Subject line and the name of
+ * the host */
+static int notify_send(const struct hc_policy *pol, const char *subject,
+		       const char *text)
+{
+	char hostname[255];
+	struct hostent *fqdn;
+	const char *fqdn_name;
+	FILE *fp;
+
+	fp = popen(pol->email, "w");
+	if (!fp) {
+		int err = errno;
+		hc_log(LOG_ERR, "popen_failed", "cmd=\"%s\" err=%d",
+		       pol->email, err);
+		return err;
+	}
+	if (gethostname(hostname, sizeof(hostname))) {
+		int err = errno;
+		hc_log(LOG_ERR, "gethostname_failed", "err=%d", err);
+		snprintf(hostname, sizeof(hostname), "(unknown-host)");
+	}
+	fqdn = gethostbyname(hostname);
+	if (!fqdn) {
+		int err = h_errno;
+		hc_log(LOG_ERR, "gethostbyname_failed", "host=\"%s\" "
+		       "h_errno=%d", hostname, err);
+		fqdn_name = hostname;
+	}
+	else {
+		fqdn_name = fqdn->h_name;
+	}
+	fprintf(fp, "\
+Subject: [core_dump] %s on %s\r\n\r\n\
+!!!!! Crash encountered on %s !!!!!!!!!\r\n\
+%s", subject, hostname, fqdn_name, text);
+	pclose(fp);
+	return 0;
+}
+
+int hc_send_mail(const struct hc_policy *pol, const struct hc_record *rec)
+{
+	char subject[HC_EXE_NAME_MAX + 16];
+	char *text;
+	int ret;
+
+	if (!pol->email)
+		return 0;
+	if (asprintf(&text, "\
+executable name: %s\r\n\
+core file name: %s/%s\r\n\
+crashed in: %s\r\n\
+", rec->exe, pol->core_dir, rec->core,
+		     rec->func[0] ? rec->func : "(unknown)") < 0)
+		return ENOMEM;
+	snprintf(subject, sizeof(subject), "%s crashed", rec->exe);
+	ret = notify_send(pol, subject, text);
+	free(text);
+	return ret;
+}
+
+/* Messages are posted as "subject\ntext" */
+static void *notify_thread(void *arg)
+{
+	struct hc_notifier *n = arg;
+	struct notify_msg *msg;
+	char *text;
+	int ret;
+
+	pthread_mutex_lock(&n->lock);
+	while (1) {
+		while (!n->head && !n->done)
+			pthread_cond_wait(&n->cond, &n->lock);
+		msg = n->head;
+		if (!msg)
+			break;
+		n->head = msg->next;
+		if (!n->head)
+			n->tail = &n->head;
+		pthread_mutex_unlock(&n->lock);
+		text = strchr(msg->text, '\n');
+		*text++ = '\0';
+		ret = notify_send(n->pol, msg->text, text);
+		free(msg->text);
+		free(msg);
+		pthread_mutex_lock(&n->lock);
+		if (ret && !n->err)
+			n->err = ret;
+	}
+	pthread_mutex_unlock(&n->lock);
+	return NULL;
+}
+
+struct hc_notifier *hc_notifier_new(const struct hc_policy *pol)
+{
+	struct hc_notifier *n;
+
+	if (!pol->email)
+		return NULL;
+	n = calloc(1, sizeof(*n));
+	if (!n)
+		return NULL;
+	n->pol = pol;
+	n->tail = &n->head;
+	pthread_mutex_init(&n->lock, NULL);
+	pthread_cond_init(&n->cond, NULL);
+	return n;
+}
+
+/* Queue text for the notifier thread, starting it if need be. If there is
+ * no thread to be had, the message is sent right here. */
+static void notify_post(struct hc_notifier *n, char *text)
+{
+	struct notify_msg *msg;
+	char *body;
+	int ret;
+
+	msg = malloc(sizeof(*msg));
+	if (!msg) {
+		free(text);
+		return;
+	}
+	msg->next = NULL;
+	msg->text = text;
+	pthread_mutex_lock(&n->lock);
+	if (!n->started)
+		n->started = pthread_create(&n->thread, NULL, notify_thread,
+					    n) ? -1 : 1;
+	if (n->started > 0) {
+		*n->tail = msg;
+		n->tail = &msg->next;
+		pthread_cond_signal(&n->cond);
+		pthread_mutex_unlock(&n->lock);
+		return;
+	}
+	pthread_mutex_unlock(&n->lock);
+	body = strchr(text, '\n');
+	*body++ = '\0';
+	ret = notify_send(n->pol, text, body);
+	if (ret && !n->err)
+		n->err = ret;
+	free(text);
+	free(msg);
+}
+
+void hc_notify_early(struct hc_notifier *n, const struct hc_crash *crash,
+		     const struct hc_core_meta *meta)
+{
+	const char *exe;
+	char *text;
+	int signo;
+
+	if (!n)
+		return;
+	exe = crash->exe_name ? crash->exe_name : meta->exe;
+	signo = crash->signo ? crash->signo : meta->signo;
+	if (asprintf(&text, "%s crashed (writing core)\n\
+executable name: %s\r\n\
+command line: %s\r\n\
+pid: %d\r\n\
+signal: %d (%s)\r\n\
+threads: %u\r\n\
+pc: 0x%llx\r\n\
+core size: %llu bytes, still being written\r\n\
+", exe, exe, meta->args, (int)(crash->pid ? crash->pid : meta->pid), signo,
+		     strsignal(signo), meta->nthreads,
+		     meta->nthreads_known ?
+		     (unsigned long long)meta->threads[0].pc : 0ULL,
+		     (unsigned long long)meta->expected_size) < 0)
+		return;
+	notify_post(n, text);
+}
+
+void hc_notify_minicore(struct hc_notifier *n, const char *exe,
+			const char *path, uint64_t size)
+{
+	char *text;
+
+	if (!n)
+		return;
+	if (asprintf(&text, "%s crashed (minicore ready)\n\
+executable name: %s\r\n\
+minicore file name: %s\r\n\
+minicore size: %llu bytes\r\n\
+", exe, exe, path, (unsigned long long)size) < 0)
+		return;
+	notify_post(n, text);
+}
+
+void hc_notify_done(struct hc_notifier *n, const char *dir,
+		    const struct hc_record *rec, int err)
+{
+	char *text;
+	int ret;
+
+	if (!n)
+		return;
+	if (err)
+		ret = asprintf(&text, "%s crashed (core lost)\n\
+executable name: %s\r\n\
+core file name: %s/%s\r\n\
+error: %s\r\n\
+", rec->exe, rec->exe, dir, rec->core, strerror(-err));
+	else
+		ret = asprintf(&text, "%s crashed\n\
+executable name: %s\r\n\
+core file name: %s/%s\r\n\
+core size: %llu bytes, %llu stored\r\n\
+core integrity: %s\r\n\
+crashed in: %s\r\n\
+", rec->exe, rec->exe, dir, rec->core,
+			       (unsigned long long)rec->size,
+			       (unsigned long long)rec->stored,
+			       hc_integrity_name(rec->integrity),
+			       rec->func[0] ? rec->func : "(unknown)");
+	if (ret < 0)
+		return;
+	notify_post(n, text);
+}
+
+int hc_notifier_finish(struct hc_notifier *n)
+{
+	int err;
+
+	if (!n)
+		return 0;
+	pthread_mutex_lock(&n->lock);
+	n->done = 1;
+	pthread_cond_signal(&n->cond);
+	pthread_mutex_unlock(&n->lock);
+	if (n->started > 0)
+		pthread_join(n->thread, NULL);
+	err = n->err;
+	pthread_mutex_destroy(&n->lock);
+	pthread_cond_destroy(&n->cond);
+	free(n);
+	return err;
+}
@@ -0,0 +1,589 @@
+#define _GNU_SOURCE
+#include <errno.h>
+#include <fcntl.h>
+#include <limits.h>
+#include <stdio.h>
+#include <stdlib.h>
+#include <string.h>
+#include <sys/mman.h>
+#include <sys/stat.h>
+#include <unistd.h>
+
+#include "handle_core.h"
+#include "hc_private.h"
+
+/*
+ * Page hashes
+ *
+ * Two crashes of the same service mostly differ in a little of their memory,
+ * and finding which little would otherwise mean reading both cores whole. As
+ * a core streams in, each page of its PT_LOAD segments is hashed, and the
+ * hashes go next to its sidecar, in core_dir/.sidecar/<core>.pages, at 8
+ * bytes a page. Comparing two cores is then a walk over two such tables, and
+ * only the pages found to differ are ever read out of the cores, which for a
+ * compressed core decompresses just the frames holding them.
+ *
+ * Addresses move from one run to the next, so segments are paired by what
+ * is mapped there: the file and offset for file mappings, and the offset it
+ * would have had for anonymous memory just past one, such as the rest of
+ * .bss. Other anonymous segments are paired by address, and failing that in
+ * order among those with the same permissions, which pairs stacks with
+ * stacks. Pages whose bytes never passed through user space have no hash
+ * and are reported as unknown.
+ */
+
+#define PAGES_MAGIC "HCPAGES1"
+#define PAGES_TMP ".pages.XXXXXX"
+#define PAGES_UNKNOWN 0		/* the hash of a page never seen */
+#define PAGES_NO_NAME UINT32_MAX
+
+struct pages_header {
+	char magic[8];
+	uint32_t page_size;
+	uint32_t nsegs;
+	uint64_t npages;
+	uint64_t names_len;
+};
+
+/* Followed by the hashes of all pages, segment by segment, then the names */
+struct pages_seg {
+	uint64_t vaddr;
+	uint64_t filesz;	/* bytes of it in the core */
+	uint64_t file_off;	/* where it is, or would be, in the file */
+	uint64_t first;		/* index of the hash of its first page */
+	uint32_t npages;
+	uint32_t flags;		/* PF_R, PF_W, PF_X */
+	uint32_t name;		/* of the mapped file, or PAGES_NO_NAME */
+	uint32_t reserved;
+};
+
+struct hc_pagehash {
+	struct pages_header h;
+	struct pages_seg *segs;
+	uint64_t *offs;		/* of each segment in the core */
+	uint64_t *hashes;
+	char *names;
+	unsigned cur;		/* segment being fed */
+	uint64_t pos;		/* end of the last piece fed */
+	struct hc_hash_state st;	/* of the page being fed, if have */
+	int have;
+};
+
+void hc_pages_path(const char *core_dir, const char *core, char *path)
+{
+	size_t len;
+
+	hc_sidecar_path(core_dir, core, path);
+	len = strlen(path);
+	snprintf(path + len, PATH_MAX - len, "%s", HC_PAGES_SUFFIX);
+}
+
+/* The file mapped at addr or, for anonymous memory starting where a file
+ * mapping ends, that mapping */
+static const struct hc_mapping *pages_mapping(const struct hc_core_meta *meta,
+					      uint64_t addr)
+{
+	unsigned lo = 0, hi = meta->nmaps;
+
+	while (lo < hi) {
+		unsigned mid = lo + (hi - lo) / 2;
+		if (meta->maps[mid].start <= addr)
+			lo = mid + 1;
+		else
+			hi = mid;
+	}
+	if (lo == 0 || addr > meta->maps[lo - 1].end)
+		return NULL;
+	return &meta->maps[lo - 1];
+}
+
+int hc_pagehash_new(const struct hc_core_meta *meta, struct hc_pagehash **php)
+{
+	const struct hc_mapping *m, *last = NULL;
+	uint32_t last_name = PAGES_NO_NAME;
+	struct hc_pagehash *ph;
+	size_t names_alloc = 0, len;
+	unsigned i;
+
+	*php = NULL;
+	ph = calloc(1, sizeof(*ph));
+	if (!ph)
+		return -ENOMEM;
+	memcpy(ph->h.magic, PAGES_MAGIC, sizeof(ph->h.magic));
+	ph->h.page_size = HC_PAGE_SIZE;
+	ph->h.nsegs = meta->nsegs;
+	ph->segs = calloc(meta->nsegs + 1, sizeof(*ph->segs));
+	ph->offs = calloc(meta->nsegs + 1, sizeof(*ph->offs));
+	if (!ph->segs || !ph->offs)
+		goto nomem;
+	for (i = 0; i < meta->nsegs; ++i) {
+		const struct hc_segment *seg = &meta->segs[i];
+		struct pages_seg *ps = &ph->segs[i];
+		ps->vaddr = seg->vaddr;
+		ps->filesz = seg->filesz;
+		ps->flags = seg->flags;
+		ps->first = ph->h.npages;
+		ps->npages = (seg->filesz + HC_PAGE_SIZE - 1) / HC_PAGE_SIZE;
+		ps->name = PAGES_NO_NAME;
+		ph->offs[i] = seg->offset;
+		ph->h.npages += ps->npages;
+		m = pages_mapping(meta, seg->vaddr);
+		if (!m || !m->path[0])
+			continue;
+		ps->file_off = m->offset + (seg->vaddr - m->start);
+		/* Segments of the same file come together */
+		if (last && !strcmp(last->path, m->path)) {
+			ps->name = last_name;
+			continue;
+		}
+		len = strlen(m->path) + 1;
+		if (ph->h.names_len + len > names_alloc) {
+			char *names;
+			names_alloc = 2 * names_alloc + len + 256;
+			names = realloc(ph->names, names_alloc);
+			if (!names)
+				goto nomem;
+			ph->names = names;
+		}
+		ps->name = ph->h.names_len;
+		memcpy(ph->names + ph->h.names_len, m->path, len);
+		ph->h.names_len += len;
+		last = m;
+		last_name = ps->name;
+	}
+	ph->hashes = calloc(ph->h.npages + 1, sizeof(*ph->hashes));
+	if (!ph->hashes)
+		goto nomem;
+	*php = ph;
+	return 0;
+nomem:
+	hc_pagehash_free(ph);
+	return -ENOMEM;
+}
+
+void hc_pagehash_free(struct hc_pagehash *ph)
+{
+	if (!ph)
+		return;
+	free(ph->segs);
+	free(ph->offs);
+	free(ph->hashes);
+	free(ph->names);
+	free(ph);
+}
+
+static void pages_set(struct hc_pagehash *ph, uint64_t i, uint64_t h)
+{
+	ph->hashes[i] = h == PAGES_UNKNOWN ? PAGES_UNKNOWN + 1 : h;
+}
+
+void hc_pagehash_feed(struct hc_pagehash *ph, uint64_t pos, const void *buf,
+		      size_t len)
+{
+	const unsigned char *p = buf;
+	uint64_t end = pos + len;
+
+	/* Starting over, to hash what the stream didn't show */
+	if (pos < ph->pos) {
+		ph->cur = 0;
+		ph->have = 0;
+	}
+	ph->pos = end;
+	while (pos < end && ph->cur < ph->h.nsegs) {
+		const struct pages_seg *ps = &ph->segs[ph->cur];
+		uint64_t off = ph->offs[ph->cur];
+		uint64_t seg_end = off + ps->filesz, page, in_page, page_len, n;
+		if (pos >= seg_end) {
+			ph->cur++;
+			ph->have = 0;
+			continue;
+		}
+		if (end <= off)
+			break;
+		if (pos < off) {
+			if (p)
+				p += off - pos;
+			pos = off;
+		}
+		page = (pos - off) / HC_PAGE_SIZE;
+		in_page = (pos - off) % HC_PAGE_SIZE;
+		page_len = seg_end - (pos - in_page);
+		if (page_len > HC_PAGE_SIZE)
+			page_len = HC_PAGE_SIZE;
+		n = page_len - in_page;
+		if (n > end - pos)
+			n = end - pos;
+		if (!p) {
+			/* The page won't be seen whole */
+			ph->have = 0;
+		}
+		else if (in_page == 0 && n == page_len) {
+			pages_set(ph, ps->first + page, hc_hash64(p, n));
+		}
+		else if (in_page == 0 || ph->have) {
+			if (in_page == 0)
+				hc_hash64_init(&ph->st);
+			hc_hash64_update(&ph->st, p, n);
+			ph->have = in_page + n < page_len;
+			if (!ph->have)
+				pages_set(ph, ps->first + page,
+					  hc_hash64_final(&ph->st));
+		}
+		if (p)
+			p += n;
+		pos += n;
+	}
+}
+
+uint64_t hc_pagehash_unknown(const struct hc_pagehash *ph)
+{
+	uint64_t i, n = 0;
+
+	for (i = 0; i < ph->h.npages; ++i)
+		n += ph->hashes[i] == PAGES_UNKNOWN;
+	return n;
+}
+
+int hc_pagehash_write(const struct hc_pagehash *ph, const char *core_dir,
+		      const char *core)
+{
+	char tmp[PATH_MAX], path[PATH_MAX];
+	int fd, ret;
+
+	snprintf(tmp, sizeof(tmp), "%s/%s", core_dir, HC_SIDECAR_DIR);
+	if (mkdir(tmp, 0755) && errno != EEXIST)
+		return -errno;
+	snprintf(tmp, sizeof(tmp), "%s/%s/%s", core_dir, HC_SIDECAR_DIR,
+		 PAGES_TMP);
+	fd = mkostemp(tmp, O_CLOEXEC);
+	if (fd < 0)
+		return -errno;
+	fchmod(fd, 0644);
+	ret = hc_write_all(fd, &ph->h, sizeof(ph->h));
+	if (ret == 0)
+		ret = hc_write_all(fd, ph->segs,
+				   ph->h.nsegs * sizeof(*ph->segs));
+	if (ret == 0)
+		ret = hc_write_all(fd, ph->hashes,
+				   ph->h.npages * sizeof(*ph->hashes));
+	if (ret == 0)
+		ret = hc_write_all(fd, ph->names, ph->h.names_len);
+	if (close(fd) && ret == 0)
+		ret = -errno;
+	hc_pages_path(core_dir, core, path);
+	if (ret == 0 && rename(tmp, path))
+		ret = -errno;
+	if (ret)
+		unlink(tmp);
+	return ret;
+}
+
+/*
+ * Comparing tables
+ */
+
+struct pages_table {
+	void *map;
+	size_t len;
+	const struct pages_header *h;
+	const struct pages_seg *segs;
+	const uint64_t *hashes;
+	const char *names;
+	int *pair;		/* index of the paired segment, or -1 */
+};
+
+static int table_open(const char *core_dir, const char *core,
+		      struct pages_table *t)
+{
+	char dir[PATH_MAX], path[PATH_MAX];
+	const char *slash = strrchr(core, '/');
+	const struct pages_header *h;
+	struct stat st;
+	uint64_t need;
+	int fd;
+
+	memset(t, 0, sizeof(*t));
+	/* A path to a core has its tables in its own directory */
+	if (slash) {
+		snprintf(dir, sizeof(dir), "%.*s", (int)(slash - core), core);
+		core_dir = slash == core ? "/" : dir;
+		core = slash + 1;
+	}
+	hc_pages_path(core_dir, core, path);
+	fd = open(path, O_RDONLY | O_CLOEXEC);
+	if (fd < 0)
+		return -errno;
+	if (fstat(fd, &st) || st.st_size < (off_t)sizeof(*h)) {
+		close(fd);
+		return -EINVAL;
+	}
+	t->len = st.st_size;
+	t->map = mmap(NULL, t->len, PROT_READ, MAP_SHARED, fd, 0);
+	close(fd);
+	if (t->map == MAP_FAILED)
+		return -errno;
+	h = t->map;
+	need = sizeof(*h) + (uint64_t)h->nsegs * sizeof(*t->segs) +
+		h->npages * sizeof(*t->hashes) + h->names_len;
+	if (memcmp(h->magic, PAGES_MAGIC, sizeof(h->magic)) ||
+	    h->npages > t->len || h->names_len > t->len || need > t->len) {
+		munmap(t->map, t->len);
+		return -EINVAL;
+	}
+	t->h = h;
+	t->segs = (const struct pages_seg *)(h + 1);
+	t->hashes = (const uint64_t *)(t->segs + h->nsegs);
+	t->names = (const char *)(t->hashes + h->npages);
+	t->pair = malloc((h->nsegs + 1) * sizeof(*t->pair));
+	if (!t->pair) {
+		munmap(t->map, t->len);
+		return -ENOMEM;
+	}
+	memset(t->pair, 0xff, (h->nsegs + 1) * sizeof(*t->pair));
+	return 0;
+}
+
+static void table_close(struct pages_table *t)
+{
+	if (t->map)
+		munmap(t->map, t->len);
+	free(t->pair);
+}
+
+static const char *seg_name(const struct pages_table *t,
+			    const struct pages_seg *s)
+{
+	if (s->name == PAGES_NO_NAME || s->name >= t->h->names_len)
+		return NULL;
+	return t->names + s->name;
+}
+
+static int seg_valid(const struct pages_table *t, const struct pages_seg *s)
+{
+	return s->first + s->npages <= t->h->npages;
+}
+
+static void pair(struct pages_table *a, unsigned i, struct pages_table *b,
+		 unsigned j)
+{
+	a->pair[i] = j;
+	b->pair[j] = i;
+}
+
+/* Pair off the segments of a and b */
+static void pair_segs(struct pages_table *a, struct pages_table *b)
+{
+	const struct pages_seg *sa, *sb;
+	const char *na, *nb;
+	unsigned i, j, from;
+
+	/* The same place in the same file, or the same address */
+	for (i = 0; i < a->h->nsegs; ++i) {
+		sa = &a->segs[i];
+		na = seg_name(a, sa);
+		for (j = 0; j < b->h->nsegs; ++j) {
+			sb = &b->segs[j];
+			nb = seg_name(b, sb);
+			if (b->pair[j] >= 0 || !na != !nb)
+				continue;
+			if (na ? (sa->file_off == sb->file_off &&
+				  !strcmp(na, nb)) : sa->vaddr == sb->vaddr) {
+				pair(a, i, b, j);
+				break;
+			}
+		}
+	}
+	/* What anonymous memory is left, in order */
+	for (i = 0, from = 0; i < a->h->nsegs; ++i) {
+		sa = &a->segs[i];
+		if (a->pair[i] >= 0 || seg_name(a, sa))
+			continue;
+		for (j = from; j < b->h->nsegs; ++j) {
+			sb = &b->segs[j];
+			if (b->pair[j] < 0 && !seg_name(b, sb) &&
+			    sb->flags == sa->flags) {
+				pair(a, i, b, j);
+				from = j + 1;
+				break;
+			}
+		}
+	}
+}
+
+struct diff_run {
+	struct hc_diff_range r;
+	hc_diff_cb_t cb;
+	void *arg;
+	struct hc_diff_stats *st;
+	int open;
+};
+
+/* Hand the range being built to the callback */
+static int run_flush(struct diff_run *run)
+{
+	if (!run->open)
+		return 0;
+	run->open = 0;
+	run->st->ranges++;
+	return run->cb(&run->r, run->arg);
+}
+
+/* Add page i of segment sa and page j of sb, either of which may be NULL,
+ * to the range being built, if they differ as kind */
+static int run_add(struct diff_run *run, int kind,
+		   const struct pages_table *ta, const struct pages_seg *sa,
+		   const struct pages_table *tb, const struct pages_seg *sb,
+		   uint64_t page)
+{
+	uint64_t a_addr = sa ? sa->vaddr + page * HC_PAGE_SIZE : 0;
+	uint64_t b_addr = sb ? sb->vaddr + page * HC_PAGE_SIZE : 0;
+	const struct pages_seg *s = sa ? sa : sb;
+	uint64_t len = s->filesz - page * HC_PAGE_SIZE;
+	int ret;
+
+	if (len > HC_PAGE_SIZE)
+		len = HC_PAGE_SIZE;
+	if (run->open && run->r.kind == kind &&
+	    (!sa || run->r.a_addr + run->r.len == a_addr) &&
+	    (!sb || run->r.b_addr + run->r.len == b_addr)) {
+		run->r.len += len;
+		return 0;
+	}
+	ret = run_flush(run);
+	if (ret)
+		return ret;
+	run->open = 1;
+	run->r.kind = kind;
+	run->r.a_addr = a_addr;
+	run->r.b_addr = b_addr;
+	run->r.len = len;
+	run->r.flags = s->flags;
+	run->r.path = sa ? seg_name(ta, sa) : seg_name(tb, sb);
+	run->r.file_off = s->file_off + page * HC_PAGE_SIZE;
+	return 0;
+}
+
+static int diff_pair(struct diff_run *run, const struct pages_table *a,
+		     const struct pages_seg *sa, const struct pages_table *b,
+		     const struct pages_seg *sb)
+{
+	uint64_t i, ha, hb, n = sa->npages < sb->npages ? sa->npages :
+					sb->npages;
+	int ret = 0;
+
+	for (i = 0; i < n && ret == 0; ++i) {
+		ha = a->hashes[sa->first + i];
+		hb = b->hashes[sb->first + i];
+		run->st->pages++;
+		if (ha == PAGES_UNKNOWN || hb == PAGES_UNKNOWN) {
+			run->st->unknown++;
+			ret = run_add(run, HC_DIFF_UNKNOWN, a, sa, b, sb, i);
+		}
+		else if (ha != hb) {
+			run->st->changed++;
+			ret = run_add(run, HC_DIFF_CHANGED, a, sa, b, sb, i);
+		}
+		else {
+			ret = run_flush(run);
+		}
+	}
+	/* One grew */
+	for (; i < sa->npages && ret == 0; ++i) {
+		run->st->only_a++;
+		ret = run_add(run, HC_DIFF_ONLY_A, a, sa, b, NULL, i);
+	}
+	for (; i < sb->npages && ret == 0; ++i) {
+		run->st->only_b++;
+		ret = run_add(run, HC_DIFF_ONLY_B, a, NULL, b, sb, i);
+	}
+	return ret ? ret : run_flush(run);
+}
+
+static int diff_alone(struct diff_run *run, int kind,
+		      const struct pages_table *t, const struct pages_seg *s)
+{
+	uint64_t i;
+	int ret = 0;
+
+	for (i = 0; i < s->npages && ret == 0; ++i) {
+		if (kind == HC_DIFF_ONLY_A) {
+			run->st->only_a++;
+			ret = run_add(run, kind, t, s, NULL, NULL, i);
+		}
+		else {
+			run->st->only_b++;
+			ret = run_add(run, kind, NULL, NULL, t, s, i);
+		}
+	}
+	return ret ? ret : run_flush(run);
+}
+
+int hc_diff(const char *core_dir, const char *a, const char *b,
+	    hc_diff_cb_t cb, void *arg, struct hc_diff_stats *st)
+{
+	struct pages_table ta, tb;
+	struct diff_run run;
+	unsigned i;
+	int ret;
+
+	memset(st, 0, sizeof(*st));
+	ret = table_open(core_dir, a, &ta);
+	if (ret)
+		return ret;
+	ret = table_open(core_dir, b, &tb);
+	if (ret) {
+		table_close(&ta);
+		return ret;
+	}
+	if (ta.h->page_size != tb.h->page_size) {
+		ret = -EINVAL;
+		goto out;
+	}
+	for (i = 0; i < ta.h->nsegs; ++i) {
+		if (!seg_valid(&ta, &ta.segs[i]))
+			ret = -EINVAL;
+	}
+	for (i = 0; i < tb.h->nsegs; ++i) {
+		if (!seg_valid(&tb, &tb.segs[i]))
+			ret = -EINVAL;
+	}
+	if (ret)
+		goto out;
+	pair_segs(&ta, &tb);
+	memset(&run, 0, sizeof(run));
+	run.cb = cb;
+	run.arg = arg;
+	run.st = st;
+	for (i = 0; i < ta.h->nsegs && ret == 0; ++i) {
+		if (ta.pair[i] >= 0)
+			ret = diff_pair(&run, &ta, &ta.segs[i], &tb,
+					&tb.segs[ta.pair[i]]);
+		else
+			ret = diff_alone(&run, HC_DIFF_ONLY_A, &ta,
+					 &ta.segs[i]);
+	}
+	for (i = 0; i < tb.h->nsegs && ret == 0; ++i) {
+		if (tb.pair[i] < 0)
+			ret = diff_alone(&run, HC_DIFF_ONLY_B, &tb,
+					 &tb.segs[i]);
+	}
+out:
+	table_close(&ta);
+	table_close(&tb);
+	return ret;
+}
+
+const char *hc_diff_kind_name(int kind)
+{
+	switch (kind) {
+	case HC_DIFF_CHANGED:
+		return "changed";
+	case HC_DIFF_ONLY_A:
+		return "only-a";
+	case HC_DIFF_ONLY_B:
+		return "only-b";
+	case HC_DIFF_UNKNOWN:
+		return "unknown";
+	}
+	return "?";
+}
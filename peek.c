@@ -0,0 +1,129 @@
+#define _GNU_SOURCE
+#include <errno.h>
+#include <limits.h>
+#include <stdio.h>
+#include <stdlib.h>
+#include <string.h>
+#include <unistd.h>
+
+#include "handle_core.h"
+#include "hc_private.h"
+
+/*
+ * Reading a stored core's memory
+ *
+ * Quick questions about a crash, such as the value of a global or what a
+ * buffer held, need a few bytes of the core. Only its headers are parsed,
+ * which gives the segment index; each read is then a pread of the segment
+ * holding the address, and for a compressed core that decompresses just the
+ * frames it covers. Symbols are found through the build-id tables and the
+ * mapped files, as for symbolizing.
+ *
+ * Thinning changes how a core is stored, and so its name, so a core is
+ * looked for in each form in turn, and then as the minicore written early
+ * during capture. A minicore holds the stacks and small writable mappings,
+ * which is where globals live, and reads of anything else fail with -EFAULT
+ * as for any memory the kernel didn't dump. A core thinned to its index
+ * record has nothing left to read.
+ */
+
+struct hc_peek {
+	char core_dir[PATH_MAX];
+	char path[PATH_MAX];
+	struct hc_core_file *cf;
+	struct hc_core_meta meta;
+};
+
+/* The name of a core without its storage suffix */
+static void peek_base(const char *core, char *base)
+{
+	const char *sfx[] = { HC_HCZ_SUFFIX, HC_MINI_SUFFIX };
+	size_t len = strlen(core), n;
+	unsigned i;
+
+	hc_strlcpy(base, core, NAME_MAX + 1);
+	for (i = 0; i < sizeof(sfx) / sizeof(sfx[0]); ++i) {
+		n = strlen(sfx[i]);
+		if (len > n && !strcmp(core + len - n, sfx[i])) {
+			base[len - n] = '\0';
+			return;
+		}
+	}
+}
+
+static int peek_find(const char *core_dir, const char *core, char *path)
+{
+	const char *sfx[] = { "", HC_HCZ_SUFFIX, HC_MINI_SUFFIX };
+	char base[NAME_MAX + 1];
+	unsigned i;
+
+	if (strchr(core, '/')) {
+		hc_strlcpy(path, core, PATH_MAX);
+		return access(path, R_OK) ? -errno : 0;
+	}
+	peek_base(core, base);
+	for (i = 0; i < sizeof(sfx) / sizeof(sfx[0]); ++i) {
+		snprintf(path, PATH_MAX, "%s/%s%s", core_dir, base, sfx[i]);
+		if (access(path, R_OK) == 0)
+			return 0;
+	}
+	hc_mini_path(core_dir, base, path);
+	return access(path, R_OK) ? -ENOENT : 0;
+}
+
+int hc_peek_open(const char *core_dir, const char *core, struct hc_peek **pp)
+{
+	struct hc_peek *p;
+	int ret;
+
+	*pp = NULL;
+	p = calloc(1, sizeof(*p));
+	if (!p)
+		return -ENOMEM;
+	hc_strlcpy(p->core_dir, core_dir, sizeof(p->core_dir));
+	ret = peek_find(core_dir, core, p->path);
+	if (ret == 0)
+		ret = hc_core_open(p->path, &p->cf);
+	if (ret == 0)
+		ret = hc_core_meta_read(p->cf, &p->meta);
+	if (ret) {
+		hc_peek_close(p);
+		return ret;
+	}
+	*pp = p;
+	return 0;
+}
+
+void hc_peek_close(struct hc_peek *p)
+{
+	if (!p)
+		return;
+	if (p->cf) {
+		hc_core_meta_free(&p->meta);
+		hc_core_close(p->cf);
+	}
+	free(p);
+}
+
+const char *hc_peek_path(const struct hc_peek *p)
+{
+	return p->path;
+}
+
+int hc_peek_mem(struct hc_peek *p, uint64_t addr, void *buf, size_t len)
+{
+	if (addr + len < addr)
+		return -EFAULT;
+	return hc_core_read_mem(p->cf, &p->meta, addr, buf, len);
+}
+
+int hc_peek_sym(struct hc_peek *p, const char *name, uint64_t *addr,
+		uint64_t *size)
+{
+	return hc_symbol_addr(p->core_dir, p->cf, &p->meta, name, addr, size);
+}
+
+int hc_peek_symbolize(struct hc_peek *p, uint64_t addr, struct hc_symbol *sym)
+{
+	return hc_symbol_at(p->core_dir, p->cf, &p->meta, addr, sym);
+}
@@ -0,0 +1,307 @@
+#define _GNU_SOURCE
+#include <dirent.h>
+#include <errno.h>
+#include <fcntl.h>
+#include <limits.h>
+#include <stdio.h>
+#include <stdlib.h>
+#include <string.h>
+#include <sys/stat.h>
+#include <sys/statfs.h>
+#include <sys/statvfs.h>
+#include <syslog.h>
+#include <time.h>
+#include <unistd.h>
+
+#include "handle_core.h"
+#include "hc_private.h"
+
+/*
+ * Preparing core directories
+ *
+ * A missing core_dir, a read-only remount or a full disk otherwise shows up
+ * as a failed open() in the middle of a crash. Run at boot, --prepare finds
+ * these out ahead of time: it creates core_dir and the directories and files
+ * captures expect (the index, sidecars, symbol tables, the shared-memory
+ * flight recorder, progress and health tables), checks that it can write
+ * there, and preallocates reserve files. It then times a few synchronous
+ * writes, which go into the health table as samples, so a slow disk is
+ * avoided from the first crash on when there are fallback directories.
+ *
+ * What it found goes into core_dir/.ready, a fixed-size record which a
+ * capture reads whole. If reserve files were made, a capture renames one into
+ * place as its core instead of creating a file: the blocks are already
+ * allocated, so a disk which has since filled up still takes the core, up to
+ * the reserve's size, and the file is cut to the core's size at the end.
+ * Reserves used up are made again at the next --prepare.
+ */
+
+#define READY_MAGIC "HCREADY1"
+#define PREPARE_CHUNK (4 << 20)
+#define PREPARE_TMP ".prepare.XXXXXX"
+
+int hc_ready_read(const char *dir, struct hc_ready *ready)
+{
+	char path[PATH_MAX];
+	ssize_t n;
+	int fd;
+
+	snprintf(path, sizeof(path), "%s/%s", dir, HC_READY_NAME);
+	fd = open(path, O_RDONLY | O_CLOEXEC);
+	if (fd < 0)
+		return -errno;
+	n = read(fd, ready, sizeof(*ready));
+	close(fd);
+	if (n != sizeof(*ready) ||
+	    memcmp(ready->magic, READY_MAGIC, sizeof(ready->magic)))
+		return -EBADMSG;
+	return 0;
+}
+
+static void reserve_path(const char *dir, unsigned i, char *path)
+{
+	snprintf(path, PATH_MAX, "%s/%s/%u", dir, HC_RESERVE_DIR, i);
+}
+
+int hc_reserve_take(const char *dir, const struct hc_ready *ready,
+		    const char *path)
+{
+	char src[PATH_MAX];
+	unsigned i;
+
+	for (i = 0; i < ready->nreserve; ++i) {
+		reserve_path(dir, i, src);
+		if (rename(src, path) == 0) {
+			hc_log(LOG_INFO, "reserve_used", "path=\"%s\" "
+			       "reserve=%u", path, i);
+			return 0;
+		}
+		if (errno != ENOENT)
+			return -errno;
+	}
+	return -ENOENT;
+}
+
+static int prepare_mkdir(const char *dir, const char *sub)
+{
+	char path[PATH_MAX];
+
+	snprintf(path, sizeof(path), "%s/%s", dir, sub);
+	if (mkdir(path, 0755) && errno != EEXIST)
+		return -errno;
+	return 0;
+}
+
+/* Space the reserve files still need */
+static uint64_t reserve_shortfall(const char *dir,
+				  const struct hc_prepare_opts *opts)
+{
+	char path[PATH_MAX];
+	uint64_t need = 0, have;
+	struct stat st;
+	int i;
+
+	for (i = 0; i < opts->nreserve; ++i) {
+		reserve_path(dir, i, path);
+		have = stat(path, &st) ? 0 : (uint64_t)st.st_blocks * 512;
+		if (have < opts->reserve_size)
+			need += opts->reserve_size - have;
+	}
+	return need;
+}
+
+/* Make the reserve files, or top them up */
+static int prepare_reserves(const char *dir,
+			    const struct hc_prepare_opts *opts,
+			    struct hc_ready *ready)
+{
+	char path[PATH_MAX], *end;
+	struct dirent *de;
+	struct stat st;
+	unsigned long n;
+	unsigned i;
+	DIR *dp;
+	int fd, ret = 0;
+
+	for (i = 0; i < (unsigned)opts->nreserve; ++i) {
+		reserve_path(dir, i, path);
+		if (stat(path, &st) == 0 &&
+		    (uint64_t)st.st_blocks * 512 >= opts->reserve_size)
+			continue;
+		fd = open(path, O_WRONLY | O_CREAT | O_CLOEXEC, 0644);
+		if (fd < 0)
+			return -errno;
+		if (fallocate(fd, 0, 0, opts->reserve_size))
+			ret = -errno;
+		close(fd);
+		if (ret) {
+			/* A sparse reserve would reserve nothing */
+			unlink(path);
+			return ret;
+		}
+	}
+	/* Fewer than last time. Captures take reserves from anywhere in the
+	 * range, so the leftovers need not follow on from opts->nreserve. */
+	snprintf(path, sizeof(path), "%s/%s", dir, HC_RESERVE_DIR);
+	dp = opendir(path);
+	while (dp && (de = readdir(dp))) {
+		errno = 0;
+		n = strtoul(de->d_name, &end, 10);
+		if (*de->d_name < '0' || *de->d_name > '9' || *end || errno ||
+		    n < (unsigned long)opts->nreserve)
+			continue;
+		unlinkat(dirfd(dp), de->d_name, 0);
+	}
+	if (dp)
+		closedir(dp);
+	ready->nreserve = opts->nreserve;
+	ready->reserve_size = opts->reserve_size;
+	if (opts->nreserve)
+		ready->flags |= HC_READY_PREALLOC;
+	return 0;
+}
+
+/* Time synchronous writes of len bytes, a chunk at a time, each a sample
+ * for the health table */
+static int prepare_probe(const char *dir, uint64_t len, uint64_t *ns_per_mb)
+{
+	char path[PATH_MAX];
+	unsigned char *buf;
+	uint64_t off, t, total = 0;
+	size_t n;
+	int fd, ret = 0;
+
+	buf = malloc(PREPARE_CHUNK);
+	if (!buf)
+		return -ENOMEM;
+	/* Not zeroes, which some filesystems and devices skip */
+	for (n = 0; n < PREPARE_CHUNK; ++n)
+		buf[n] = n * 131 + (n >> 12);
+	snprintf(path, sizeof(path), "%s/%s", dir, PREPARE_TMP);
+	fd = mkostemp(path, O_CLOEXEC);
+	if (fd < 0) {
+		ret = -errno;
+		free(buf);
+		return ret;
+	}
+	unlink(path);
+	for (off = 0; off < len && ret == 0; off += n) {
+		n = len - off < PREPARE_CHUNK ? len - off : PREPARE_CHUNK;
+		t = hc_now_ns();
+		ret = hc_write_all(fd, buf, n);
+		if (ret == 0 && fdatasync(fd))
+			ret = -errno;
+		t = hc_now_ns() - t;
+		hc_health_record(dir, n, t, ret);
+		total += t;
+	}
+	close(fd);
+	free(buf);
+	if (ret == 0 && len)
+		*ns_per_mb = total * (1 << 20) / len;
+	return ret;
+}
+
+static int prepare_write(const char *dir, const struct hc_ready *ready)
+{
+	char tmp[PATH_MAX], path[PATH_MAX];
+	int fd, ret;
+
+	snprintf(tmp, sizeof(tmp), "%s/%s", dir, PREPARE_TMP);
+	fd = mkostemp(tmp, O_CLOEXEC);
+	if (fd < 0)
+		return -errno;
+	fchmod(fd, 0644);
+	ret = hc_write_all(fd, ready, sizeof(*ready));
+	if (ret == 0 && fsync(fd))
+		ret = -errno;
+	if (close(fd) && ret == 0)
+		ret = -errno;
+	snprintf(path, sizeof(path), "%s/%s", dir, HC_READY_NAME);
+	if (ret == 0 && rename(tmp, path))
+		ret = -errno;
+	if (ret)
+		unlink(tmp);
+	return ret;
+}
+
+int hc_prepare(const struct hc_policy *pol, const char *dir,
+	       const struct hc_prepare_opts *opts, struct hc_ready *ready)
+{
+	const char *subs[] = { HC_SIDECAR_DIR, HC_SYMBOLS_DIR, HC_RESERVE_DIR,
+			       HC_QUEUE_DIR };
+	char path[PATH_MAX];
+	struct statvfs vfs;
+	struct statfs fs;
+	struct stat st;
+	uint64_t need, probe;
+	unsigned i, nsubs;
+	int fd, ret;
+
+	memset(ready, 0, sizeof(*ready));
+	memcpy(ready->magic, READY_MAGIC, sizeof(ready->magic));
+	ready->prepared = time(NULL);
+	if (mkdir(dir, 0755) && errno != EEXIST)
+		return -errno;
+	if (stat(dir, &st))
+		return -errno;
+	if (!S_ISDIR(st.st_mode))
+		return -ENOTDIR;
+	if (access(dir, W_OK | X_OK))
+		return -errno;
+	if (statvfs(dir, &vfs) || statfs(dir, &fs))
+		return -errno;
+	ready->fs_type = fs.f_type;
+	ready->avail = (uint64_t)vfs.f_bavail * vfs.f_frsize;
+	if (vfs.f_flag & ST_RDONLY) {
+		hc_health_record(dir, 0, 0, -EROFS);
+		return -EROFS;
+	}
+
+	/* What captures would otherwise create as they go */
+	nsubs = sizeof(subs) / sizeof(subs[0]);
+	if (!pol->analyze.command)
+		nsubs--;
+	for (i = 0; i < nsubs; ++i) {
+		ret = prepare_mkdir(dir, subs[i]);
+		if (ret)
+			return ret;
+	}
+	hc_index_path(dir, path);
+	fd = open(path, O_WRONLY | O_APPEND | O_CREAT | O_CLOEXEC, 0644);
+	if (fd < 0)
+		return -errno;
+	close(fd);
+	hc_flight_open("prepare");
+	hc_progress_begin("prepare");
+	hc_progress_end();
+
+	need = reserve_shortfall(dir, opts);
+	if (need > ready->avail) {
+		hc_health_record(dir, 0, 0, -ENOSPC);
+		return -ENOSPC;
+	}
+	/* Timing takes no more than a quarter of what the reserves leave */
+	probe = opts->probe_bytes;
+	if (probe > (ready->avail - need) / 4)
+		probe = (ready->avail - need) / 4;
+	ret = prepare_reserves(dir, opts, ready);
+	if (ret == -EOPNOTSUPP)
+		hc_log(LOG_WARNING, "prepare_no_reserve", "dir=\"%s\"", dir);
+	else if (ret)
+		return ret;
+	if (probe) {
+		ret = prepare_probe(dir, probe, &ready->ns_per_mb);
+		if (ret)
+			return ret;
+	}
+	if (statvfs(dir, &vfs) == 0)
+		ready->avail = (uint64_t)vfs.f_bavail * vfs.f_frsize;
+	ret = prepare_write(dir, ready);
+	if (ret == 0)
+		hc_log(LOG_INFO, "prepared", "dir=\"%s\" avail=%llu "
+		       "ns_per_mb=%llu reserves=%u", dir,
+		       (unsigned long long)ready->avail,
+		       (unsigned long long)ready->ns_per_mb, ready->nreserve);
+	return ret;
+}
@@ -0,0 +1,170 @@
+#include <errno.h>
+#include <fcntl.h>
+#include <signal.h>
+#include <string.h>
+#include <sys/mman.h>
+#include <sys/stat.h>
+#include <time.h>
+#include <unistd.h>
+
+#include "handle_core.h"
+#include "hc_private.h"
+
+/*
+ * Live progress of in-flight captures
+ *
+ * Each handler claims a slot in a shared-memory table for the duration of
+ * its ingest and keeps it up to date as the core streams through: bytes read
+ * and written, the segment being copied, and a smoothed throughput. The
+ * expected total comes from the program headers, so readers can work out an
+ * ETA. Slots are claimed by compare-and-swap on the pid field; a slot whose
+ * owner died without releasing it is reclaimed by the next handler that
+ * notices.
+ */
+
+#define PROGRESS_MAGIC 0x68637072u	/* "hcpr" */
+#define RATE_INTERVAL_NS 250000000ULL
+
+struct progress_table {
+	uint32_t magic;
+	uint32_t nslots;
+	char pad[56];
+	struct hc_progress slot[HC_PROGRESS_SLOTS];
+};
+
+static struct progress_table *table;
+static struct hc_progress *mine;
+static uint64_t rate_t, rate_bytes;	/* last throughput sample */
+
+static struct progress_table *progress_map(int flags)
+{
+	struct progress_table *t;
+	struct stat st;
+	int fd;
+
+	fd = open(HC_PROGRESS_PATH, flags | O_CLOEXEC, 0644);
+	if (fd < 0)
+		return NULL;
+	if (fstat(fd, &st) || (st.st_size < (off_t)sizeof(*t) &&
+	    (!(flags & O_CREAT) || ftruncate(fd, sizeof(*t))))) {
+		close(fd);
+		return NULL;
+	}
+	t = mmap(NULL, sizeof(*t), (flags & O_ACCMODE) == O_RDONLY ?
+		 PROT_READ : PROT_READ | PROT_WRITE, MAP_SHARED, fd, 0);
+	close(fd);
+	if (t == MAP_FAILED)
+		return NULL;
+	if ((flags & O_CREAT) && !t->magic) {
+		t->nslots = HC_PROGRESS_SLOTS;
+		__atomic_store_n(&t->magic, PROGRESS_MAGIC, __ATOMIC_RELEASE);
+	}
+	if (__atomic_load_n(&t->magic, __ATOMIC_ACQUIRE) != PROGRESS_MAGIC ||
+	    t->nslots != HC_PROGRESS_SLOTS) {
+		munmap(t, sizeof(*t));
+		return NULL;
+	}
+	return t;
+}
+
+static int owner_gone(uint32_t pid)
+{
+	return pid && kill(pid, 0) && errno == ESRCH;
+}
+
+static uint64_t realtime_ns(void)
+{
+	struct timespec ts;
+
+	clock_gettime(CLOCK_REALTIME, &ts);
+	return ts.tv_sec * 1000000000ULL + ts.tv_nsec;
+}
+
+void hc_progress_begin(const char *exe)
+{
+	uint32_t me = getpid();
+	int i;
+
+	if (mine)
+		return;
+	if (!table)
+		table = progress_map(O_RDWR | O_CREAT);
+	if (!table)
+		return;
+	for (i = 0; i < HC_PROGRESS_SLOTS; ++i) {
+		struct hc_progress *p = &table->slot[i];
+		uint32_t pid = __atomic_load_n(&p->pid, __ATOMIC_RELAXED);
+		if (pid && !owner_gone(pid))
+			continue;
+		if (!__atomic_compare_exchange_n(&p->pid, &pid, me, 0,
+						 __ATOMIC_ACQUIRE,
+						 __ATOMIC_RELAXED))
+			continue;
+		mine = p;
+		break;
+	}
+	if (!mine)
+		return;
+	hc_strlcpy(mine->exe, exe ? exe : "", sizeof(mine->exe));
+	mine->start_ns = mine->update_ns = realtime_ns();
+	mine->total = mine->bytes_read = mine->bytes_written = 0;
+	mine->cur_seg = mine->nsegs = 0;
+	mine->rate = 0;
+	rate_t = hc_now_ns();
+	rate_bytes = 0;
+}
+
+void hc_progress_update(const struct hc_stream *s, uint64_t nread,
+			uint64_t nwritten)
+{
+	uint64_t now;
+
+	if (!mine)
+		return;
+	if (s && s->state == HC_STREAM_PARSED) {
+		mine->total = s->meta.expected_size;
+		mine->nsegs = s->meta.nsegs;
+		mine->cur_seg = s->cur_seg;
+	}
+	__atomic_store_n(&mine->bytes_read, nread, __ATOMIC_RELAXED);
+	__atomic_store_n(&mine->bytes_written, nwritten, __ATOMIC_RELAXED);
+	now = hc_now_ns();
+	if (now - rate_t >= RATE_INTERVAL_NS) {
+		uint64_t inst = (nread - rate_bytes) * 1000000000ULL /
+				(now - rate_t);
+		/* Exponentially smoothed, weighted towards recent samples */
+		mine->rate = mine->rate ? (mine->rate * 3 + inst * 5) / 8 : inst;
+		rate_t = now;
+		rate_bytes = nread;
+		mine->update_ns = realtime_ns();
+	}
+}
+
+void hc_progress_end(void)
+{
+	if (!mine)
+		return;
+	__atomic_store_n(&mine->pid, 0, __ATOMIC_RELEASE);
+	mine = NULL;
+}
+
+int hc_progress_read(struct hc_progress *out, int max)
+{
+	struct progress_table *t;
+	int i, n = 0;
+
+	t = progress_map(O_RDONLY);
+	if (!t)
+		return errno ? -errno : -EINVAL;
+	for (i = 0; i < HC_PROGRESS_SLOTS && n < max; ++i) {
+		uint32_t pid = __atomic_load_n(&t->slot[i].pid,
+					       __ATOMIC_ACQUIRE);
+		if (!pid || owner_gone(pid))
+			continue;
+		memcpy(&out[n], &t->slot[i], sizeof(out[n]));
+		out[n].pid = pid;
+		n++;
+	}
+	munmap(t, sizeof(*t));
+	return n;
+}
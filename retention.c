@@ -0,0 +1,402 @@
+#define _GNU_SOURCE
+#include <dirent.h>
+#include <errno.h>
+#include <fcntl.h>
+#include <limits.h>
+#include <stdio.h>
+#include <stdlib.h>
+#include <string.h>
+#include <sys/stat.h>
+#include <syslog.h>
+#include <unistd.h>
+
+#include "handle_core.h"
+#include "hc_private.h"
+
+#define MAX_CORE_SCAN 500000
+
+/*
+ * Retention
+ *
+ * After a crash storm a core_dir can hold thousands of cores, and stat'ing
+ * every one for the byte quota and then deleting the oldest used to cost one
+ * blocking system call each. Both are now issued in batches of up to
+ * RETENTION_QD operations through an io_uring, relative to a descriptor for
+ * core_dir, and each batch is timed in the flight recorder. Kernels without
+ * io_uring, or without its statx and unlinkat operations, get the same
+ * batches done with plain system calls.
+ *
+ * Cores which didn't arrive whole are listed in core_dir/.partial, and are
+ * the first to go: when something has to be deleted, every partial core but
+ * the newest core is deleted before any complete one.
+ */
+
+#define RETENTION_QD 64
+
+struct retention_core {
+	char *name;
+	uint64_t bytes;		/* disk space used */
+	int partial;		/* listed in HC_PARTIAL_NAME */
+	int gone;		/* unlinked, or found missing */
+};
+
+struct retention {
+	int dir_fd;
+	struct hc_uring ring;
+	int use_ring;
+	struct statx *stx;	/* RETENTION_QD results */
+};
+
+int hc_partial_add(const char *core_dir, const char *core)
+{
+	char path[PATH_MAX], line[NAME_MAX + 2];
+	int fd, len, ret = 0;
+
+	snprintf(path, sizeof(path), "%s/%s", core_dir, HC_PARTIAL_NAME);
+	len = snprintf(line, sizeof(line), "%s\n", core);
+	fd = open(path, O_WRONLY | O_APPEND | O_CREAT | O_CLOEXEC, 0644);
+	if (fd < 0)
+		return -errno;
+	if (write(fd, line, len) != len)
+		ret = errno ? -errno : -EIO;
+	close(fd);
+	return ret;
+}
+
+static int cmp_core_ptr(const void *a, const void *b)
+{
+	const struct retention_core *const *ca = a, *const *cb = b;
+
+	return strcmp((*ca)->name, (*cb)->name);
+}
+
+/* Mark the cores listed in HC_PARTIAL_NAME. Returns how many listed names
+ * weren't found, whose lines are then due for pruning. */
+static int retention_partial(struct retention *r, struct retention_core *cores,
+			     int n)
+{
+	struct retention_core **by_name, key, *kp = &key, **hit;
+	char line[NAME_MAX + 2];
+	int i, fd, stale = 0;
+	FILE *fp;
+
+	fd = openat(r->dir_fd, HC_PARTIAL_NAME, O_RDONLY | O_CLOEXEC);
+	if (fd < 0)
+		return 0;
+	fp = fdopen(fd, "r");
+	by_name = malloc((n ? n : 1) * sizeof(*by_name));
+	if (!fp || !by_name) {
+		if (fp)
+			fclose(fp);
+		else
+			close(fd);
+		free(by_name);
+		return 0;
+	}
+	for (i = 0; i < n; ++i)
+		by_name[i] = &cores[i];
+	qsort(by_name, n, sizeof(*by_name), cmp_core_ptr);
+	while (fgets(line, sizeof(line), fp)) {
+		line[strcspn(line, "\n")] = '\0';
+		key.name = line;
+		hit = n ? bsearch(&kp, by_name, n, sizeof(*by_name),
+				  cmp_core_ptr) : NULL;
+		if (hit)
+			(*hit)->partial = 1;
+		else
+			stale++;
+	}
+	fclose(fp);
+	free(by_name);
+	return stale;
+}
+
+/* Rewrite HC_PARTIAL_NAME with only the partial cores still present */
+static void retention_prune_partial(struct retention *r,
+				    const struct retention_core *cores, int n)
+{
+	char tmp[NAME_MAX + 1];
+	FILE *fp;
+	int i, fd;
+
+	snprintf(tmp, sizeof(tmp), "%s.%d", HC_PARTIAL_NAME, (int)getpid());
+	fd = openat(r->dir_fd, tmp, O_WRONLY | O_CREAT | O_TRUNC | O_CLOEXEC,
+		    0644);
+	if (fd < 0)
+		return;
+	fp = fdopen(fd, "w");
+	if (!fp) {
+		close(fd);
+		unlinkat(r->dir_fd, tmp, 0);
+		return;
+	}
+	for (i = 0; i < n; ++i) {
+		if (cores[i].partial)
+			fprintf(fp, "%s\n", cores[i].name);
+	}
+	if (fclose(fp) || renameat(r->dir_fd, tmp, r->dir_fd, HC_PARTIAL_NAME))
+		unlinkat(r->dir_fd, tmp, 0);
+}
+
+/* Compare two core file names. We want reverse alphabetical order */
+static int compare_core_file_names(const void *a, const void *b)
+{
+	const struct retention_core *ca = a;
+	const struct retention_core *cb = b;
+	return strcmp(cb->name, ca->name);
+}
+
+static int retention_init(struct retention *r, const char *core_dir,
+			  int need_stat)
+{
+	memset(r, 0, sizeof(*r));
+	r->ring.fd = -1;
+	r->dir_fd = open(core_dir, O_RDONLY | O_DIRECTORY | O_CLOEXEC);
+	if (r->dir_fd < 0)
+		return -errno;
+	if (need_stat) {
+		r->stx = calloc(RETENTION_QD, sizeof(*r->stx));
+		if (!r->stx)
+			return -ENOMEM;
+	}
+	if (hc_uring_init(&r->ring, RETENTION_QD) == 0) {
+		r->use_ring = hc_uring_supports(&r->ring, IORING_OP_STATX) &&
+			      hc_uring_supports(&r->ring, IORING_OP_UNLINKAT);
+		if (!r->use_ring)
+			hc_uring_exit(&r->ring);
+	}
+	return 0;
+}
+
+static void retention_free(struct retention *r)
+{
+	if (r->use_ring)
+		hc_uring_exit(&r->ring);
+	if (r->dir_fd >= 0)
+		close(r->dir_fd);
+	free(r->stx);
+}
+
+/* Run one batch of statx or unlinkat over cores[0..n), leaving the result
+ * of each in res[]. Without the ring, only the entries of res[] which are
+ * -ECANCELED are run. */
+static void retention_batch(struct retention *r, int op,
+			    struct retention_core *cores, int n, int *res)
+{
+	struct io_uring_cqe cqe;
+	int i, done;
+
+	if (!r->use_ring) {
+		for (i = 0; i < n; ++i) {
+			if (res[i] != -ECANCELED)
+				continue;
+			if (op == IORING_OP_STATX)
+				res[i] = statx(r->dir_fd, cores[i].name,
+					       AT_SYMLINK_NOFOLLOW,
+					       STATX_BLOCKS, &r->stx[i]);
+			else
+				res[i] = unlinkat(r->dir_fd, cores[i].name,
+						  0);
+			if (res[i])
+				res[i] = -errno;
+		}
+		return;
+	}
+	for (i = 0; i < n; ++i) {
+		struct io_uring_sqe *sqe = hc_uring_sqe(&r->ring);
+		sqe->opcode = op;
+		sqe->fd = r->dir_fd;
+		sqe->addr = (uintptr_t)cores[i].name;
+		if (op == IORING_OP_STATX) {
+			sqe->len = STATX_BLOCKS;
+			sqe->off = (uintptr_t)&r->stx[i];
+			sqe->statx_flags = AT_SYMLINK_NOFOLLOW;
+		}
+		sqe->user_data = i;
+	}
+	for (done = 0; done < n; ) {
+		if (hc_uring_submit(&r->ring, n - done) < 0) {
+			/* Finish whatever didn't complete the slow way.
+			 * Repeating an operation that did happen is
+			 * harmless. */
+			hc_uring_exit(&r->ring);
+			r->use_ring = 0;
+			retention_batch(r, op, cores, n, res);
+			return;
+		}
+		while (hc_uring_cqe(&r->ring, &cqe) == 0) {
+			if (cqe.user_data < (uint64_t)n)
+				res[cqe.user_data] = cqe.res;
+			done++;
+		}
+	}
+}
+
+/* Apply op to all of cores[0..n) in batches, timing each batch. Returns the
+ * number of operations that succeeded, or the first error other than
+ * ENOENT; we may be racing with another handle_core process which deleted
+ * the old core first. */
+static int retention_run(struct retention *r, int op,
+			 struct retention_core *cores, int n)
+{
+	int res[RETENTION_QD];
+	int i, j, batch, ok = 0, err = 0;
+	uint64_t t;
+
+	for (i = 0; i < n; i += batch) {
+		batch = n - i < RETENTION_QD ? n - i : RETENTION_QD;
+		t = hc_now_ns();
+		for (j = 0; j < batch; ++j)
+			res[j] = -ECANCELED;
+		retention_batch(r, op, cores + i, batch, res);
+		for (j = 0; j < batch; ++j) {
+			if (op == IORING_OP_STATX)
+				cores[i + j].bytes = res[j] ? 0 :
+					r->stx[j].stx_blocks * 512;
+			else
+				cores[i + j].gone = res[j] == 0 ||
+						    res[j] == -ENOENT;
+			if (res[j] == 0)
+				ok++;
+			else if (res[j] != -ENOENT && !err)
+				err = res[j];
+			if (res[j] && res[j] != -ENOENT)
+				hc_log(LOG_ERR, op == IORING_OP_STATX ?
+				       "stat_failed" : "unlink_failed",
+				       "core=\"%s\" err=%d", cores[i + j].name,
+				       -res[j]);
+		}
+		hc_flight_record(op == IORING_OP_STATX ? HC_EV_STAT_BATCH :
+				 HC_EV_UNLINK_BATCH, err, batch,
+				 hc_now_ns() - t);
+		if (err)
+			return err;
+	}
+	return ok;
+}
+
+static int retention_enforce(const char *core_dir, int max_cores,
+			     uint64_t max_bytes)
+{
+	int i, j, ret, num_cores = 0, alloc_cores = 64, keep, stale, npartial;
+	struct retention_core *cores = malloc(sizeof(*cores) * alloc_cores);
+	struct retention r;
+	DIR *dp = NULL;
+	uint64_t total;
+
+	ret = retention_init(&r, core_dir, max_bytes != 0);
+	if (ret || !cores) {
+		ret = ret ? ret : -ENOMEM;
+		goto done;
+	}
+	dp = opendir(core_dir);
+	if (!dp) {
+		ret = -errno;
+		goto done;
+	}
+	/* Scan through core files. If the number of files we're looking at is
+	 * getting too large, we content ourselves with just what we've already
+	 * scanned. This does mean we could delete newer files than we really
+	 * intend. However, we need to avoid allocating a ridiculous amount of
+	 * memory.
+	 */
+	while (1) {
+		struct dirent *de = readdir(dp);
+		if (!de)
+			break;
+		/* ignore non-core files */
+		if (strncmp(de->d_name, HC_CORE_PREFIX, HC_CORE_PREFIX_SZ))
+			continue;
+		cores[num_cores].name = strdup(de->d_name);
+		if (!cores[num_cores].name)
+			break;
+		cores[num_cores].bytes = 0;
+		cores[num_cores].partial = 0;
+		cores[num_cores].gone = 0;
+		num_cores++;
+		if (num_cores > MAX_CORE_SCAN)
+			break;
+		if (num_cores == alloc_cores) {
+			struct retention_core *newptr = realloc(cores,
+					sizeof(*cores) * alloc_cores * 2);
+			if (!newptr)
+				break;
+			cores = newptr;
+			alloc_cores *= 2;
+		}
+	}
+	qsort(cores, num_cores, sizeof(*cores), compare_core_file_names);
+	stale = retention_partial(&r, cores, num_cores);
+	/* Partial cores after the complete ones, newest first within each,
+	 * except that the newest core stays first whatever it is */
+	for (i = 1, j = 1; i < num_cores; ++i) {
+		struct retention_core tmp = cores[i];
+		if (tmp.partial)
+			continue;
+		memmove(&cores[j + 1], &cores[j], (i - j) * sizeof(*cores));
+		cores[j++] = tmp;
+	}
+	/* The newest core at least, whatever max_cores says; max_cores <= 0
+	 * puts no limit on the number */
+	keep = max_cores > 0 && max_cores < num_cores ? max_cores : num_cores;
+	if (max_bytes && keep > 1) {
+		ret = retention_run(&r, IORING_OP_STATX, cores, keep);
+		if (ret < 0)
+			goto done;
+		/* Keep the newest cores that fit, and always the newest */
+		total = cores[0].bytes;
+		for (i = 1; i < keep; ++i) {
+			total += cores[i].bytes;
+			if (total > max_bytes)
+				break;
+		}
+		keep = i;
+	}
+	/* delete core files which are too old, oldest first */
+	for (i = 0; i < (num_cores - keep) / 2; ++i) {
+		struct retention_core tmp = cores[keep + i];
+		cores[keep + i] = cores[num_cores - 1 - i];
+		cores[num_cores - 1 - i] = tmp;
+	}
+	ret = retention_run(&r, IORING_OP_UNLINKAT, cores + keep,
+			    num_cores - keep);
+	/* and whatever was recorded about them beyond the index, but only for
+	 * those which are gone: a core whose unlink failed keeps all of it */
+	if (num_cores > keep &&
+	    faccessat(r.dir_fd, HC_SIDECAR_DIR, F_OK, 0) == 0) {
+		for (i = keep; i < num_cores; ++i) {
+			if (cores[i].gone)
+				hc_sidecar_remove(core_dir, cores[i].name);
+		}
+	}
+	for (i = keep, npartial = 0; i < num_cores; ++i) {
+		if (!cores[i].gone)
+			continue;
+		npartial += cores[i].partial;
+		cores[i].partial = 0;
+	}
+	if (stale || npartial)
+		retention_prune_partial(&r, cores, num_cores);
+done:
+	if (cores) {
+		for (i = 0; i < num_cores; ++i)
+			free(cores[i].name);
+		free(cores);
+	}
+	if (dp)
+		closedir(dp);
+	retention_free(&r);
+	return ret;
+}
+
+/* Step through core_dir and delete core files which have old looking names */
+int hc_limit_core_files(const char *core_dir, int max_cores)
+{
+	return retention_enforce(core_dir, max_cores, 0);
+}
+
+int hc_enforce_retention(const struct hc_policy *pol)
+{
+	return retention_enforce(pol->core_dir, pol->max_cores,
+				 pol->max_bytes);
+}
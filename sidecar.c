@@ -0,0 +1,116 @@
+#define _GNU_SOURCE
+#include <errno.h>
+#include <fcntl.h>
+#include <limits.h>
+#include <stdarg.h>
+#include <stdio.h>
+#include <stdlib.h>
+#include <string.h>
+#include <sys/stat.h>
+#include <unistd.h>
+
+#include "handle_core.h"
+#include "hc_private.h"
+
+/*
+ * Sidecars
+ *
+ * What we learn about a core beyond its index record goes into a small text
+ * file next to it, core_dir/.sidecar/<core>, named after the core as it was
+ * first stored so that it survives the core being thinned. Like the index,
+ * it is written by appending whole lines of tab-separated key=value fields,
+ * each starting with a bare word saying what the line describes; readers
+ * skip lines they don't know.
+ */
+
+void hc_sidecar_path(const char *core_dir, const char *core, char *path)
+{
+	size_t len = strlen(core);
+	const char *sfx[] = { HC_HCZ_SUFFIX, HC_MINI_SUFFIX };
+	unsigned i;
+
+	for (i = 0; i < sizeof(sfx) / sizeof(sfx[0]); ++i) {
+		size_t n = strlen(sfx[i]);
+		if (len > n && !strcmp(core + len - n, sfx[i]))
+			len -= n;
+	}
+	snprintf(path, PATH_MAX, "%s/%s/%.*s", core_dir, HC_SIDECAR_DIR,
+		 (int)len, core);
+}
+
+int hc_sidecar_printf(const char *core_dir, const char *core,
+		      const char *fmt, ...)
+{
+	char path[PATH_MAX];
+	va_list ap;
+	char *line;
+	int fd, len, ret = 0;
+
+	va_start(ap, fmt);
+	len = vasprintf(&line, fmt, ap);
+	va_end(ap);
+	if (len < 0)
+		return -ENOMEM;
+	snprintf(path, sizeof(path), "%s/%s", core_dir, HC_SIDECAR_DIR);
+	if (mkdir(path, 0755) && errno != EEXIST) {
+		ret = -errno;
+		goto out;
+	}
+	hc_sidecar_path(core_dir, core, path);
+	fd = open(path, O_WRONLY | O_APPEND | O_CREAT | O_CLOEXEC, 0644);
+	if (fd < 0) {
+		ret = -errno;
+		goto out;
+	}
+	/* The line and its newline, which takes the terminator's place, in
+	 * one write so that concurrent writers don't interleave */
+	line[len++] = '\n';
+	if (write(fd, line, len) != len)
+		ret = errno ? -errno : -EIO;
+	close(fd);
+out:
+	free(line);
+	return ret;
+}
+
+int hc_sidecar_foreach(const char *core_dir, const char *core,
+		       hc_sidecar_cb_t cb, void *arg)
+{
+	char path[PATH_MAX];
+	char *line = NULL;
+	size_t alloc = 0;
+	ssize_t len;
+	FILE *fp;
+	int ret = 0;
+
+	hc_sidecar_path(core_dir, core, path);
+	fp = fopen(path, "re");
+	if (!fp)
+		return -errno;
+	while (ret == 0 && (len = getline(&line, &alloc, fp)) > 0) {
+		if (line[len - 1] == '\n')
+			line[len - 1] = '\0';
+		ret = cb(line, arg);
+	}
+	free(line);
+	fclose(fp);
+	return ret;
+}
+
+int hc_sidecar_remove(const char *core_dir, const char *core)
+{
+	char path[PATH_MAX];
+
+	/* and the minicore and page hashes written alongside the core, if
+	 * any */
+	hc_mini_path(core_dir, core, path);
+	if (unlink(path) && errno != ENOENT)
+		return -errno;
+	hc_pages_path(core_dir, core, path);
+	if (unlink(path) && errno != ENOENT)
+		return -errno;
+	hc_sidecar_path(core_dir, core, path);
+	if (unlink(path) && errno != ENOENT)
+		return -errno;
+	return 0;
+}
@@ -0,0 +1,342 @@
+#define _GNU_SOURCE
+#include <errno.h>
+#include <stdio.h>
+#include <stdlib.h>
+#include <string.h>
+
+#include "handle_core.h"
+#include "hc_private.h"
+
+/*
+ * Retention simulator
+ *
+ * The index remembers every crash, including those whose cores have long
+ * been deleted or thinned, so it can be replayed against a policy to see what
+ * that policy would have kept. Each crash arrives at its recorded time as a
+ * full or compressed core, then thinning by age and the quotas are applied
+ * the way capture applies them: with thinning, by hc_thin()'s rules, and
+ * otherwise by deleting the oldest cores. The newest core is always left
+ * alone.
+ *
+ * Cores only ever move forward through the forms and are stored in order of
+ * arrival, so each stage of thinning and deletion just advances a cursor over
+ * the crashes and a whole replay is linear in the length of the history.
+ *
+ * Sizes come from the index. A form a crash never took is estimated from
+ * the crashes that did: compressed cores from the overall ratio of the
+ * compressed cores recorded, minicores from their average size.
+ */
+
+#define SIM_HCZ_RATIO 0.15	/* when no compressed core is recorded */
+#define SIM_MINI_BYTES (256 << 10)
+#define SIM_DELETED (HC_FORM_SUMMARY + 1)
+
+struct sim_crash {
+	time_t time;
+	uint64_t size[HC_FORM_SUMMARY + 1];	/* in each form */
+	unsigned sig;
+	char *name;		/* the signature, while loading */
+};
+
+struct sim_history {
+	struct sim_crash *crashes;	/* oldest first */
+	size_t n, alloc;
+	char **sigs;		/* by signature id */
+	unsigned nsigs;
+	/* for estimating sizes */
+	uint64_t hcz_raw, hcz_stored;
+	uint64_t mini_bytes, nmini;
+};
+
+/* One policy's replay */
+struct sim_state {
+	const struct hc_policy *pol;
+	const struct sim_history *h;
+	unsigned char *form;	/* of each crash so far */
+	uint64_t *kept;		/* cores left per signature */
+	uint64_t bytes, files, sigs_kept;
+	size_t age_cur[HC_FORM_SUMMARY + 1];
+	size_t quota_cur[HC_FORM_SUMMARY + 1];
+	size_t head;		/* oldest crash which may still have a file */
+	struct hc_sim_result *res;
+};
+
+/* Keep only what the replay needs; a long history has millions of
+ * records. Sizes the record doesn't give are left 0 for now. */
+static int sim_collect(const struct hc_record *rec, void *arg)
+{
+	struct sim_history *h = arg;
+	char sig[HC_SIG_MAX];
+	struct sim_crash *c;
+
+	if (h->n == h->alloc) {
+		size_t alloc = h->alloc ? h->alloc * 2 : 1024;
+		c = realloc(h->crashes, alloc * sizeof(*c));
+		if (!c)
+			return -ENOMEM;
+		h->crashes = c;
+		h->alloc = alloc;
+	}
+	snprintf(sig, sizeof(sig), "%s:%s", rec->exe,
+		 rec->func[0] ? rec->func : "?");
+	c = &h->crashes[h->n];
+	memset(c, 0, sizeof(*c));
+	c->name = strdup(sig);
+	if (!c->name)
+		return -ENOMEM;
+	h->n++;
+	c->time = rec->time;
+	c->size[HC_FORM_FULL] = rec->size ? rec->size : rec->stored;
+	if (rec->form == HC_FORM_HCZ && rec->stored && rec->size) {
+		c->size[HC_FORM_HCZ] = rec->stored;
+		h->hcz_raw += rec->size;
+		h->hcz_stored += rec->stored;
+	}
+	else if (rec->form == HC_FORM_MINI && rec->stored) {
+		c->size[HC_FORM_MINI] = rec->stored;
+		h->mini_bytes += rec->stored;
+		h->nmini++;
+	}
+	return 0;
+}
+
+static int cmp_crash_time(const void *a, const void *b)
+{
+	const struct sim_crash *ca = a, *cb = b;
+
+	if (ca->time != cb->time)
+		return ca->time < cb->time ? -1 : 1;
+	return 0;
+}
+
+static int cmp_crash_name(const void *a, const void *b, void *arg)
+{
+	const struct sim_crash *crashes = arg;
+
+	return strcmp(crashes[*(const size_t *)a].name,
+		      crashes[*(const size_t *)b].name);
+}
+
+static void sim_history_free(struct sim_history *h)
+{
+	size_t i;
+
+	for (i = 0; i < h->n; ++i)
+		free(h->crashes[i].name);
+	for (i = 0; i < h->nsigs; ++i)
+		free(h->sigs[i]);
+	free(h->sigs);
+	free(h->crashes);
+}
+
+static int sim_load(const char *core_dir, struct sim_history *h)
+{
+	double ratio = SIM_HCZ_RATIO;
+	uint64_t mini = SIM_MINI_BYTES;
+	struct sim_crash *c;
+	size_t *order, i;
+	int ret, form;
+
+	memset(h, 0, sizeof(*h));
+	ret = hc_index_foreach(core_dir, sim_collect, h);
+	if (ret < 0 || h->n == 0)
+		return ret < 0 ? ret : 0;
+	qsort(h->crashes, h->n, sizeof(*h->crashes), cmp_crash_time);
+	if (h->hcz_raw)
+		ratio = (double)h->hcz_stored / h->hcz_raw;
+	if (h->nmini)
+		mini = h->mini_bytes / h->nmini;
+	for (i = 0; i < h->n; ++i) {
+		c = &h->crashes[i];
+		if (!c->size[HC_FORM_HCZ])
+			c->size[HC_FORM_HCZ] = c->size[HC_FORM_FULL] * ratio;
+		if (!c->size[HC_FORM_MINI])
+			c->size[HC_FORM_MINI] = mini;
+		for (form = HC_FORM_HCZ; form <= HC_FORM_MINI; ++form)
+			if (c->size[form] > c->size[form - 1])
+				c->size[form] = c->size[form - 1];
+	}
+
+	/* Number the signatures, handing their names over to sigs[] */
+	order = calloc(h->n, sizeof(*order));
+	h->sigs = calloc(h->n, sizeof(*h->sigs));
+	if (!order || !h->sigs) {
+		free(order);
+		return -ENOMEM;
+	}
+	for (i = 0; i < h->n; ++i)
+		order[i] = i;
+	qsort_r(order, h->n, sizeof(*order), cmp_crash_name, h->crashes);
+	for (i = 0; i < h->n; ++i) {
+		c = &h->crashes[order[i]];
+		if (h->nsigs && !strcmp(c->name, h->sigs[h->nsigs - 1]))
+			free(c->name);
+		else
+			h->sigs[h->nsigs++] = c->name;
+		c->name = NULL;
+		c->sig = h->nsigs - 1;
+	}
+	free(order);
+	return 0;
+}
+
+/* Move crash i to form, which may be SIM_DELETED */
+static void sim_step(struct sim_state *s, size_t i, int form)
+{
+	const struct sim_crash *c = &s->h->crashes[i];
+	int old = s->form[i];
+	uint64_t now = form >= HC_FORM_SUMMARY ? 0 : c->size[form];
+
+	if (form <= old)
+		return;
+	s->bytes -= c->size[old];
+	s->bytes += now;
+	s->res->bytes_freed += c->size[old] - now;
+	s->form[i] = form;
+	if (old < HC_FORM_SUMMARY && form >= HC_FORM_SUMMARY) {
+		s->files--;
+		if (--s->kept[c->sig] == 0)
+			s->sigs_kept--;
+	}
+	if (form == SIM_DELETED && old < HC_FORM_SUMMARY)
+		s->res->deleted++;
+}
+
+static int sim_over(const struct sim_state *s, int count_too)
+{
+	const struct hc_policy *pol = s->pol;
+
+	if (pol->max_bytes && s->bytes > pol->max_bytes)
+		return 1;
+	return count_too && pol->max_cores > 0 &&
+	       s->files > (uint64_t)pol->max_cores;
+}
+
+/* Crash n - 1 has just arrived */
+static void sim_enforce(struct sim_state *s, size_t n)
+{
+	const struct hc_thin_policy *thin = &s->pol->thin;
+	time_t now = s->h->crashes[n - 1].time;
+	time_t ages[] = { 0, thin->compress, thin->minicore, thin->summary };
+	int form;
+
+	if (!hc_thin_enabled(s->pol)) {
+		while (s->head + 1 < n && sim_over(s, 1))
+			sim_step(s, s->head++, SIM_DELETED);
+		return;
+	}
+	for (form = HC_FORM_HCZ; form <= HC_FORM_SUMMARY; ++form) {
+		size_t *cur = &s->age_cur[form];
+		if (!ages[form])
+			continue;
+		while (*cur + 1 < n &&
+		       now - s->h->crashes[*cur].time >= ages[form])
+			sim_step(s, (*cur)++, form);
+	}
+	for (form = HC_FORM_HCZ; form <= HC_FORM_SUMMARY; ++form) {
+		size_t *cur = &s->quota_cur[form];
+		while (*cur + 1 < n && sim_over(s, form == HC_FORM_SUMMARY))
+			sim_step(s, (*cur)++, form);
+	}
+}
+
+static void sim_sample(struct sim_state *s, time_t when)
+{
+	struct hc_sim_sample *sm = &s->res->samples[s->res->nsamples++];
+
+	sm->time = when;
+	sm->bytes = s->bytes;
+	sm->files = s->files;
+	sm->signatures = s->sigs_kept;
+}
+
+static int sim_run(const struct sim_history *h, const struct hc_policy *pol,
+		   struct hc_sim_result *res)
+{
+	struct sim_state s;
+	uint64_t *crashes;
+	time_t first, span;
+	size_t i;
+	unsigned j, k;
+
+	memset(res, 0, sizeof(*res));
+	memset(&s, 0, sizeof(s));
+	s.pol = pol;
+	s.h = h;
+	s.res = res;
+	s.form = calloc(h->n + 1, 1);
+	s.kept = calloc(h->nsigs + 1, sizeof(*s.kept));
+	crashes = calloc(h->nsigs + 1, sizeof(*crashes));
+	if (!s.form || !s.kept || !crashes) {
+		free(s.form);
+		free(s.kept);
+		free(crashes);
+		return -ENOMEM;
+	}
+	res->crashes = h->n;
+	res->signatures = h->nsigs;
+	first = h->n ? h->crashes[0].time : 0;
+	span = h->n ? h->crashes[h->n - 1].time - first : 0;
+	for (i = 0; i < h->n; ++i) {
+		const struct sim_crash *c = &h->crashes[i];
+		/* Samples fall evenly over the history, the last one at its
+		 * end */
+		while (res->nsamples < HC_SIM_SAMPLES - 1 &&
+		       first + span * (res->nsamples + 1) / HC_SIM_SAMPLES <
+		       c->time)
+			sim_sample(&s, first + span * (res->nsamples + 1) /
+				   HC_SIM_SAMPLES);
+		s.form[i] = pol->compress ? HC_FORM_HCZ : HC_FORM_FULL;
+		s.bytes += c->size[s.form[i]];
+		s.files++;
+		if (s.kept[c->sig]++ == 0)
+			s.sigs_kept++;
+		crashes[c->sig]++;
+		sim_enforce(&s, i + 1);
+		if (s.bytes > res->peak_bytes) {
+			res->peak_bytes = s.bytes;
+			res->peak_time = c->time;
+		}
+	}
+	if (h->n)
+		sim_sample(&s, first + span);
+
+	for (i = 0; i < h->n; ++i)
+		res->forms[s.form[i] > HC_FORM_SUMMARY ? HC_FORM_SUMMARY :
+			   s.form[i]]++;
+	res->signatures_kept = s.sigs_kept;
+	/* The most frequent signatures left with nothing but summaries */
+	for (j = 0; j < h->nsigs; ++j) {
+		if (s.kept[j])
+			continue;
+		for (k = res->nlost; k > 0 &&
+		     res->lost[k - 1].crashes < crashes[j]; --k) {
+			if (k < HC_SIM_LOST)
+				res->lost[k] = res->lost[k - 1];
+		}
+		if (k >= HC_SIM_LOST)
+			continue;
+		hc_strlcpy(res->lost[k].sig, h->sigs[j],
+			   sizeof(res->lost[k].sig));
+		res->lost[k].crashes = crashes[j];
+		if (res->nlost < HC_SIM_LOST)
+			res->nlost++;
+	}
+	free(s.form);
+	free(s.kept);
+	free(crashes);
+	return 0;
+}
+
+int hc_simulate_retention(const char *core_dir, const struct hc_policy *pols,
+			  int npols, struct hc_sim_result *results)
+{
+	struct sim_history h;
+	int i, ret;
+
+	ret = sim_load(core_dir, &h);
+	for (i = 0; i < npols && ret == 0; ++i)
+		ret = sim_run(&h, &pols[i], &results[i]);
+	sim_history_free(&h);
+	return ret;
+}
@@ -0,0 +1,715 @@
+#define _GNU_SOURCE
+#include <dirent.h>
+#include <elf.h>
+#include <errno.h>
+#include <fcntl.h>
+#include <limits.h>
+#include <pthread.h>
+#include <stdio.h>
+#include <stdlib.h>
+#include <string.h>
+#include <sys/procfs.h>
+#include <sys/ptrace.h>
+#include <sys/uio.h>
+#include <sys/wait.h>
+#include <syslog.h>
+#include <unistd.h>
+
+#include "handle_core.h"
+#include "hc_private.h"
+
+/*
+ * Snapshots of live processes
+ *
+ * gcore keeps its target stopped for the whole dump. Here the target is only
+ * stopped for as long as it takes to collect the registers of its threads:
+ * everything that can be read without stopping it (maps, auxv, stat) is read
+ * beforehand, all threads are seized first and then interrupted together, and
+ * they are let go as soon as their registers are in hand. Memory is then read
+ * from /proc/<pid>/mem by parallel per-segment readers while the process
+ * runs, so the image is not an atomic snapshot of memory, only of the
+ * registers.
+ *
+ * The ELF core is assembled in an anonymous file in core_dir and then handed
+ * to hc_capture() like any other core, so compression, naming, indexing and
+ * retention are the same as for cores delivered by the kernel.
+ */
+
+#if defined(__x86_64__)
+#define SNAP_MACHINE EM_X86_64
+#elif defined(__aarch64__)
+#define SNAP_MACHINE EM_AARCH64
+#else
+#error "snapshots are not supported on this architecture"
+#endif
+
+#define NOTE_ALIGN(x) (((x) + 3) & ~(size_t)3)
+#define READ_CHUNK (1 << 20)
+
+struct snap_map {
+	uint64_t start, end;
+	uint64_t pgoff;
+	int prot;		/* PF_R, PF_W, PF_X */
+	uint64_t dump_len;	/* bytes of the mapping to dump */
+	uint64_t file_off;	/* where its data goes in the core */
+	char path[PATH_MAX];
+};
+
+struct snap_thread {
+	pid_t tid;
+	int stop_sig;		/* signal to hand back when detaching */
+	int fpvalid;
+	struct elf_prstatus prs;
+	elf_fpregset_t fpregs;
+};
+
+struct snap {
+	pid_t pid;
+	struct snap_map *maps;
+	int nmaps;
+	struct snap_thread *threads;
+	int nthreads, alloc_threads;
+	struct elf_prpsinfo psinfo;
+	pid_t ppid, pgrp, sid;
+	unsigned char *auxv;
+	size_t auxv_len;
+	char comm[17];
+
+	/* reading memory */
+	int mem_fd, out_fd;
+	pthread_mutex_t lock;
+	int next_map;
+	int err;
+	uint64_t bytes;
+};
+
+static int read_file(const char *path, unsigned char **buf, size_t *len)
+{
+	size_t alloc = 4096;
+	ssize_t res;
+	int fd;
+
+	*len = 0;
+	*buf = NULL;
+	fd = open(path, O_RDONLY | O_CLOEXEC);
+	if (fd < 0)
+		return -errno;
+	while (1) {
+		unsigned char *nbuf = realloc(*buf, alloc + 1);
+		if (!nbuf) {
+			close(fd);
+			return -ENOMEM;
+		}
+		*buf = nbuf;
+		res = read(fd, *buf + *len, alloc - *len);
+		if (res < 0) {
+			if (errno == EINTR)
+				continue;
+			res = -errno;
+			close(fd);
+			return res;
+		}
+		if (res == 0)
+			break;
+		*len += res;
+		if (*len == alloc)
+			alloc *= 2;
+	}
+	(*buf)[*len] = '\0';
+	close(fd);
+	return 0;
+}
+
+/* Decide how much of a mapping to dump, roughly as the kernel's default
+ * coredump_filter would: all of anonymous and writable mappings, only the ELF
+ * header page of read-only file mappings, nothing unreadable. */
+static void snap_filter(struct snap_map *m)
+{
+	m->dump_len = m->end - m->start;
+	if (!(m->prot & PF_R) || !strcmp(m->path, "[vvar]") ||
+	    !strcmp(m->path, "[vvar_vclock]") || !strcmp(m->path, "[vsyscall]"))
+		m->dump_len = 0;
+	else if (m->path[0] == '/' && !(m->prot & PF_W))
+		m->dump_len = m->pgoff == 0 ? 4096 : 0;
+}
+
+static int snap_read_maps(struct snap *sn)
+{
+	char path[64];
+	unsigned char *buf;
+	char *line, *saveptr = NULL;
+	size_t len;
+	int ret, alloc = 64;
+
+	snprintf(path, sizeof(path), "/proc/%d/maps", sn->pid);
+	ret = read_file(path, &buf, &len);
+	if (ret)
+		return ret;
+	sn->maps = calloc(alloc, sizeof(*sn->maps));
+	if (!sn->maps) {
+		free(buf);
+		return -ENOMEM;
+	}
+	for (line = strtok_r((char *)buf, "\n", &saveptr); line;
+	     line = strtok_r(NULL, "\n", &saveptr)) {
+		struct snap_map *m;
+		unsigned long long start, end, pgoff;
+		char perms[5];
+		int name_off = 0;
+		if (sscanf(line, "%llx-%llx %4s %llx %*s %*s %n", &start, &end,
+			   perms, &pgoff, &name_off) < 4)
+			continue;
+		if (sn->nmaps == alloc) {
+			struct snap_map *nmaps;
+			alloc *= 2;
+			nmaps = realloc(sn->maps, alloc * sizeof(*nmaps));
+			if (!nmaps) {
+				free(buf);
+				return -ENOMEM;
+			}
+			sn->maps = nmaps;
+		}
+		m = &sn->maps[sn->nmaps++];
+		memset(m, 0, sizeof(*m));
+		m->start = start;
+		m->end = end;
+		m->pgoff = pgoff;
+		m->prot = (perms[0] == 'r' ? PF_R : 0) |
+			  (perms[1] == 'w' ? PF_W : 0) |
+			  (perms[2] == 'x' ? PF_X : 0);
+		if (name_off)
+			hc_strlcpy(m->path, line + name_off, sizeof(m->path));
+		snap_filter(m);
+	}
+	free(buf);
+	return sn->nmaps ? 0 : -ESRCH;
+}
+
+static int snap_read_procinfo(struct snap *sn)
+{
+	char path[64], *p, *end;
+	unsigned char *buf;
+	size_t len, i;
+	char state;
+	int ret;
+
+	snprintf(path, sizeof(path), "/proc/%d/stat", sn->pid);
+	ret = read_file(path, &buf, &len);
+	if (ret)
+		return ret;
+	/* pid (comm) state ppid pgrp session ... where comm may hold spaces
+	 * and parentheses */
+	p = strchr((char *)buf, '(');
+	end = strrchr((char *)buf, ')');
+	if (!p || !end || end < p) {
+		free(buf);
+		return -EINVAL;
+	}
+	*end = '\0';
+	hc_strlcpy(sn->comm, p + 1, sizeof(sn->comm));
+	if (sscanf(end + 2, "%c %d %d %d", &state, &sn->ppid, &sn->pgrp,
+		   &sn->sid) != 4) {
+		free(buf);
+		return -EINVAL;
+	}
+	free(buf);
+
+	memset(&sn->psinfo, 0, sizeof(sn->psinfo));
+	sn->psinfo.pr_sname = state;
+	sn->psinfo.pr_state = state == 'R' ? 0 : state == 'S' ? 1 :
+			      state == 'D' ? 2 : state == 'T' ? 3 : 4;
+	sn->psinfo.pr_pid = sn->pid;
+	sn->psinfo.pr_ppid = sn->ppid;
+	sn->psinfo.pr_pgrp = sn->pgrp;
+	sn->psinfo.pr_sid = sn->sid;
+	memcpy(sn->psinfo.pr_fname, sn->comm, sizeof(sn->psinfo.pr_fname));
+
+	snprintf(path, sizeof(path), "/proc/%d/cmdline", sn->pid);
+	if (read_file(path, &buf, &len) == 0) {
+		for (i = 0; i + 1 < len; ++i) {
+			if (buf[i] == '\0')
+				buf[i] = ' ';
+		}
+		hc_strlcpy(sn->psinfo.pr_psargs, (char *)buf,
+			   sizeof(sn->psinfo.pr_psargs));
+		free(buf);
+	}
+
+	snprintf(path, sizeof(path), "/proc/%d/auxv", sn->pid);
+	if (read_file(path, &sn->auxv, &sn->auxv_len))
+		sn->auxv_len = 0;
+	return 0;
+}
+
+static struct snap_thread *snap_find_thread(struct snap *sn, pid_t tid)
+{
+	int i;
+
+	for (i = 0; i < sn->nthreads; ++i) {
+		if (sn->threads[i].tid == tid)
+			return &sn->threads[i];
+	}
+	return NULL;
+}
+
+/* Seize every thread, including ones created while we were seizing. Seizing
+ * does not stop anything. Returns the number of new threads found. */
+static int snap_seize_new(struct snap *sn)
+{
+	char path[64];
+	struct dirent *de;
+	DIR *dp;
+	int found = 0;
+
+	snprintf(path, sizeof(path), "/proc/%d/task", sn->pid);
+	dp = opendir(path);
+	if (!dp)
+		return -errno;
+	while ((de = readdir(dp))) {
+		pid_t tid = atoi(de->d_name);
+		struct snap_thread *t;
+		if (tid <= 0 || snap_find_thread(sn, tid))
+			continue;
+		if (ptrace(PTRACE_SEIZE, tid, 0, 0)) {
+			/* it may have exited in the meantime */
+			if (errno == ESRCH)
+				continue;
+			found = -errno;
+			break;
+		}
+		if (sn->nthreads == sn->alloc_threads) {
+			int alloc = sn->alloc_threads ? sn->alloc_threads * 2 : 16;
+			t = realloc(sn->threads, alloc * sizeof(*t));
+			if (!t) {
+				ptrace(PTRACE_DETACH, tid, 0, 0);
+				found = -ENOMEM;
+				break;
+			}
+			sn->threads = t;
+			sn->alloc_threads = alloc;
+		}
+		t = &sn->threads[sn->nthreads++];
+		memset(t, 0, sizeof(*t));
+		t->tid = tid;
+		found++;
+	}
+	closedir(dp);
+	return found;
+}
+
+static void snap_detach_all(struct snap *sn)
+{
+	int i;
+
+	for (i = 0; i < sn->nthreads; ++i)
+		ptrace(PTRACE_DETACH, sn->threads[i].tid, 0,
+		       sn->threads[i].stop_sig);
+}
+
+/* Stop all threads, copy their registers and let them go again. Returns how
+ * long the process was stopped in *pause_ns. */
+static int snap_registers(struct snap *sn, uint64_t *pause_ns)
+{
+	uint64_t t0;
+	int i, ret;
+
+	do {
+		ret = snap_seize_new(sn);
+	} while (ret > 0);
+	if (ret < 0) {
+		snap_detach_all(sn);
+		return ret;
+	}
+
+	t0 = hc_now_ns();
+	for (i = 0; i < sn->nthreads; ++i)
+		ptrace(PTRACE_INTERRUPT, sn->threads[i].tid, 0, 0);
+	for (i = 0; i < sn->nthreads; ++i) {
+		struct snap_thread *t = &sn->threads[i];
+		struct iovec iov;
+		int status;
+		if (waitpid(t->tid, &status, __WALL) != t->tid ||
+		    !WIFSTOPPED(status)) {
+			/* gone while we were stopping it */
+			t->tid = -t->tid;
+			continue;
+		}
+		/* A signal-delivery-stop must hand its signal back */
+		if ((status >> 16) != PTRACE_EVENT_STOP &&
+		    WSTOPSIG(status) != SIGTRAP)
+			t->stop_sig = WSTOPSIG(status);
+		iov.iov_base = &t->prs.pr_reg;
+		iov.iov_len = sizeof(t->prs.pr_reg);
+		if (ptrace(PTRACE_GETREGSET, t->tid, NT_PRSTATUS, &iov))
+			memset(&t->prs.pr_reg, 0, sizeof(t->prs.pr_reg));
+		iov.iov_base = &t->fpregs;
+		iov.iov_len = sizeof(t->fpregs);
+		t->fpvalid = !ptrace(PTRACE_GETREGSET, t->tid, NT_PRFPREG,
+				     &iov);
+	}
+	for (i = 0; i < sn->nthreads; ++i) {
+		if (sn->threads[i].tid > 0)
+			ptrace(PTRACE_DETACH, sn->threads[i].tid, 0,
+			       sn->threads[i].stop_sig);
+	}
+	*pause_ns = hc_now_ns() - t0;
+
+	/* Forget threads which exited, keeping the main thread first */
+	ret = 0;
+	for (i = 0; i < sn->nthreads; ++i) {
+		if (sn->threads[i].tid > 0)
+			sn->threads[ret++] = sn->threads[i];
+	}
+	sn->nthreads = ret;
+	for (i = 1; i < sn->nthreads; ++i) {
+		if (sn->threads[i].tid == sn->pid) {
+			struct snap_thread tmp = sn->threads[0];
+			sn->threads[0] = sn->threads[i];
+			sn->threads[i] = tmp;
+		}
+	}
+	for (i = 0; i < sn->nthreads; ++i) {
+		struct elf_prstatus *prs = &sn->threads[i].prs;
+		prs->pr_pid = sn->threads[i].tid;
+		prs->pr_ppid = sn->ppid;
+		prs->pr_pgrp = sn->pgrp;
+		prs->pr_sid = sn->sid;
+		prs->pr_fpvalid = sn->threads[i].fpvalid;
+	}
+	return sn->nthreads ? 0 : -ESRCH;
+}
+
+/* Notes */
+
+struct notebuf {
+	unsigned char *p;
+	size_t len, alloc;
+};
+
+static int note_add(struct notebuf *nb, int type, const void *desc,
+		    size_t descsz)
+{
+	static const char name[] = "CORE";
+	size_t need = sizeof(Elf64_Nhdr) + NOTE_ALIGN(sizeof(name)) +
+		      NOTE_ALIGN(descsz);
+	Elf64_Nhdr nh;
+
+	if (nb->len + need > nb->alloc) {
+		size_t alloc = (nb->len + need) * 2;
+		unsigned char *p = realloc(nb->p, alloc);
+		if (!p)
+			return -ENOMEM;
+		nb->p = p;
+		nb->alloc = alloc;
+	}
+	nh.n_namesz = sizeof(name);
+	nh.n_descsz = descsz;
+	nh.n_type = type;
+	memset(nb->p + nb->len, 0, need);
+	memcpy(nb->p + nb->len, &nh, sizeof(nh));
+	memcpy(nb->p + nb->len + sizeof(nh), name, sizeof(name));
+	memcpy(nb->p + nb->len + sizeof(nh) + NOTE_ALIGN(sizeof(name)), desc,
+	       descsz);
+	nb->len += need;
+	return 0;
+}
+
+/* NT_FILE: which files are mapped where */
+static int note_add_files(struct notebuf *nb, struct snap *sn)
+{
+	size_t count = 0, names = 0, len, off;
+	unsigned char *desc;
+	uint64_t *w;
+	int i, ret;
+
+	for (i = 0; i < sn->nmaps; ++i) {
+		if (sn->maps[i].path[0] == '/') {
+			count++;
+			names += strlen(sn->maps[i].path) + 1;
+		}
+	}
+	len = 16 + count * 24 + names;
+	desc = calloc(1, len);
+	if (!desc)
+		return -ENOMEM;
+	w = (uint64_t *)desc;
+	w[0] = count;
+	w[1] = 4096;
+	off = 16 + count * 24;
+	count = 0;
+	for (i = 0; i < sn->nmaps; ++i) {
+		const struct snap_map *m = &sn->maps[i];
+		if (m->path[0] != '/')
+			continue;
+		w[2 + count * 3] = m->start;
+		w[3 + count * 3] = m->end;
+		w[4 + count * 3] = m->pgoff / 4096;
+		count++;
+		strcpy((char *)desc + off, m->path);
+		off += strlen(m->path) + 1;
+	}
+	ret = note_add(nb, NT_FILE, desc, len);
+	free(desc);
+	return ret;
+}
+
+static int snap_notes(struct snap *sn, struct notebuf *nb)
+{
+	int i, ret = 0;
+
+	for (i = 0; i < sn->nthreads && !ret; ++i) {
+		struct snap_thread *t = &sn->threads[i];
+		ret = note_add(nb, NT_PRSTATUS, &t->prs, sizeof(t->prs));
+		if (i == 0 && !ret) {
+			ret = note_add(nb, NT_PRPSINFO, &sn->psinfo,
+				       sizeof(sn->psinfo));
+			if (!ret && sn->auxv_len)
+				ret = note_add(nb, NT_AUXV, sn->auxv,
+					       sn->auxv_len);
+			if (!ret)
+				ret = note_add_files(nb, sn);
+		}
+		if (!ret && t->fpvalid)
+			ret = note_add(nb, NT_PRFPREG, &t->fpregs,
+				       sizeof(t->fpregs));
+	}
+	return ret;
+}
+
+/* Write the ELF header, program headers and notes, and work out where each
+ * mapping's data goes. Returns the total size of the core. */
+static int snap_write_headers(struct snap *sn, uint64_t *total)
+{
+	struct notebuf nb = { NULL, 0, 0 };
+	Elf64_Ehdr eh;
+	Elf64_Phdr *ph;
+	size_t phlen;
+	uint64_t off;
+	int i, ret;
+
+	ret = snap_notes(sn, &nb);
+	if (ret)
+		goto done;
+	phlen = (sn->nmaps + 1) * sizeof(Elf64_Phdr);
+	ph = calloc(sn->nmaps + 1, sizeof(Elf64_Phdr));
+	if (!ph) {
+		ret = -ENOMEM;
+		goto done;
+	}
+	memset(&eh, 0, sizeof(eh));
+	memcpy(eh.e_ident, ELFMAG, SELFMAG);
+	eh.e_ident[EI_CLASS] = ELFCLASS64;
+	eh.e_ident[EI_DATA] = __BYTE_ORDER == __LITTLE_ENDIAN ? ELFDATA2LSB :
+								ELFDATA2MSB;
+	eh.e_ident[EI_VERSION] = EV_CURRENT;
+	eh.e_ident[EI_OSABI] = ELFOSABI_NONE;
+	eh.e_type = ET_CORE;
+	eh.e_machine = SNAP_MACHINE;
+	eh.e_version = EV_CURRENT;
+	eh.e_phoff = sizeof(eh);
+	eh.e_ehsize = sizeof(eh);
+	eh.e_phentsize = sizeof(Elf64_Phdr);
+	eh.e_phnum = sn->nmaps + 1;
+
+	ph[0].p_type = PT_NOTE;
+	ph[0].p_offset = sizeof(eh) + phlen;
+	ph[0].p_filesz = nb.len;
+	off = (ph[0].p_offset + nb.len + 4095) & ~4095ULL;
+	for (i = 0; i < sn->nmaps; ++i) {
+		struct snap_map *m = &sn->maps[i];
+		Elf64_Phdr *p = &ph[i + 1];
+		p->p_type = PT_LOAD;
+		p->p_flags = m->prot;
+		p->p_vaddr = m->start;
+		p->p_memsz = m->end - m->start;
+		p->p_offset = off;
+		p->p_filesz = m->dump_len;
+		p->p_align = 4096;
+		m->file_off = off;
+		off += m->dump_len;
+	}
+	*total = off;
+	if (pwrite(sn->out_fd, &eh, sizeof(eh), 0) != sizeof(eh) ||
+	    pwrite(sn->out_fd, ph, phlen, sizeof(eh)) != (ssize_t)phlen ||
+	    pwrite(sn->out_fd, nb.p, nb.len, ph[0].p_offset) != (ssize_t)nb.len)
+		ret = errno ? -errno : -EIO;
+	else if (ftruncate(sn->out_fd, off))
+		ret = -errno;
+	free(ph);
+done:
+	free(nb.p);
+	return ret;
+}
+
+/* Copy one mapping from /proc/<pid>/mem. Pages that can't be read (the
+ * mapping shrank, or is backed by a truncated file) are left as holes,
+ * which read back as zeros. */
+static int snap_copy_map(struct snap *sn, const struct snap_map *m,
+			 unsigned char *buf, uint64_t *copied)
+{
+	uint64_t off = 0;
+
+	while (off < m->dump_len) {
+		size_t n = m->dump_len - off;
+		ssize_t res;
+		if (n > READ_CHUNK)
+			n = READ_CHUNK;
+		res = pread(sn->mem_fd, buf, n, m->start + off);
+		if (res <= 0) {
+			if (res < 0 && errno == EINTR)
+				continue;
+			off += 4096;
+			continue;
+		}
+		if (!hc_is_zero(buf, res) &&
+		    pwrite(sn->out_fd, buf, res, m->file_off + off) != res)
+			return errno ? -errno : -EIO;
+		off += res;
+		*copied += res;
+	}
+	return 0;
+}
+
+static void *snap_reader(void *arg)
+{
+	struct snap *sn = arg;
+	unsigned char *buf = malloc(READ_CHUNK);
+	uint64_t copied = 0;
+	int i, ret = buf ? 0 : -ENOMEM;
+
+	while (!ret) {
+		pthread_mutex_lock(&sn->lock);
+		i = sn->err ? sn->nmaps : sn->next_map++;
+		pthread_mutex_unlock(&sn->lock);
+		if (i >= sn->nmaps)
+			break;
+		if (sn->maps[i].dump_len)
+			ret = snap_copy_map(sn, &sn->maps[i], buf, &copied);
+	}
+	free(buf);
+	pthread_mutex_lock(&sn->lock);
+	if (ret && !sn->err)
+		sn->err = ret;
+	sn->bytes += copied;
+	pthread_mutex_unlock(&sn->lock);
+	return NULL;
+}
+
+static int snap_read_memory(struct snap *sn, int jobs)
+{
+	char path[64];
+	pthread_t *threads;
+	int i, started = 0;
+
+	snprintf(path, sizeof(path), "/proc/%d/mem", sn->pid);
+	sn->mem_fd = open(path, O_RDONLY | O_CLOEXEC);
+	if (sn->mem_fd < 0)
+		return -errno;
+	if (jobs < 1)
+		jobs = 1;
+	if (jobs > sn->nmaps)
+		jobs = sn->nmaps;
+	threads = calloc(jobs, sizeof(*threads));
+	if (threads) {
+		for (i = 0; i < jobs; ++i) {
+			if (pthread_create(&threads[i], NULL, snap_reader, sn))
+				break;
+			started++;
+		}
+	}
+	if (!started)
+		snap_reader(sn);
+	for (i = 0; i < started; ++i)
+		pthread_join(threads[i], NULL);
+	free(threads);
+	close(sn->mem_fd);
+	return sn->err;
+}
+
+/* An unnamed file in core_dir to assemble the core in. Being on the same
+ * filesystem lets hc_capture() reflink it rather than copy it. */
+static int snap_tmpfile(const char *core_dir)
+{
+	char path[PATH_MAX];
+	int fd;
+
+	fd = open(core_dir, O_TMPFILE | O_RDWR | O_CLOEXEC, 0600);
+	if (fd >= 0)
+		return fd;
+	snprintf(path, sizeof(path), "%s/.snapshot.XXXXXX", core_dir);
+	fd = mkostemp(path, O_CLOEXEC);
+	if (fd < 0)
+		return -errno;
+	unlink(path);
+	return fd;
+}
+
+int hc_snapshot(const struct hc_policy *pol, pid_t pid,
+		const struct hc_snapshot_opts *opts, struct hc_record *rec,
+		struct hc_snapshot_stats *stats)
+{
+	struct hc_snapshot_stats st;
+	struct hc_crash crash;
+	struct snap sn;
+	uint64_t t;
+	int ret;
+
+	memset(&sn, 0, sizeof(sn));
+	memset(&st, 0, sizeof(st));
+	sn.pid = pid;
+	sn.out_fd = -1;
+	pthread_mutex_init(&sn.lock, NULL);
+
+	/* Everything that doesn't need the target stopped comes first */
+	ret = snap_read_procinfo(&sn);
+	if (ret == 0)
+		ret = snap_read_maps(&sn);
+	if (ret)
+		goto done;
+	sn.out_fd = snap_tmpfile(pol->core_dir);
+	if (sn.out_fd < 0) {
+		ret = sn.out_fd;
+		goto done;
+	}
+
+	ret = snap_registers(&sn, &st.pause_ns);
+	if (ret)
+		goto done;
+	st.threads = sn.nthreads;
+	st.segments = sn.nmaps;
+
+	t = hc_now_ns();
+	ret = snap_write_headers(&sn, &st.size);
+	if (ret == 0)
+		ret = snap_read_memory(&sn, opts ? opts->jobs : 1);
+	st.read_ns = hc_now_ns() - t;
+	st.bytes = sn.bytes;
+	if (ret)
+		goto done;
+	hc_log(LOG_INFO, "snapshot", "pid=%d exe=\"%s\" threads=%d "
+	       "pause_us=%llu bytes=%llu read_ms=%llu", pid, sn.comm,
+	       sn.nthreads, (unsigned long long)st.pause_ns / 1000,
+	       (unsigned long long)st.bytes,
+	       (unsigned long long)st.read_ns / 1000000);
+
+	if (lseek(sn.out_fd, 0, SEEK_SET)) {
+		ret = -errno;
+		goto done;
+	}
+	memset(&crash, 0, sizeof(crash));
+	crash.exe_name = sn.comm;
+	crash.pid = pid;
+	hc_flight_open(sn.comm);
+	hc_flight_record(HC_EV_SNAPSHOT, 0, st.pause_ns, sn.nthreads);
+	ret = hc_capture(pol, &crash, sn.out_fd, rec);
+done:
+	if (sn.out_fd >= 0)
+		close(sn.out_fd);
+	free(sn.maps);
+	free(sn.threads);
+	free(sn.auxv);
+	pthread_mutex_destroy(&sn.lock);
+	if (stats)
+		*stats = st;
+	return ret;
+}
@@ -0,0 +1,930 @@
+#define _GNU_SOURCE
+#include <elf.h>
+#include <errno.h>
+#include <fcntl.h>
+#include <limits.h>
+#include <stdio.h>
+#include <stdlib.h>
+#include <string.h>
+#include <sys/mman.h>
+#include <sys/stat.h>
+#include <syslog.h>
+#include <time.h>
+#include <unistd.h>
+
+#include "handle_core.h"
+#include "hc_private.h"
+
+/*
+ * Symbolization
+ *
+ * Program counters are turned into function names with a table built once
+ * per build-id and kept in core_dir/.symbols/<build-id>.sym. The table is an
+ * array of (file offset, size, name) entries sorted by offset, followed by the
+ * names, so a lookup is a binary search over an mmap of the file. Keying on
+ * the offset into the mapped file rather than on the link-time address means
+ * the load address never needs to be worked out: the NT_FILE note already
+ * says which offset of which file each page came from.
+ *
+ * The build-id of a mapped file is read out of the core itself, from the ELF
+ * headers that the kernel dumps at the start of every file mapping, and
+ * compared against the file on disk before the latter is used to build a
+ * table, so that a binary upgraded since the crash is never trusted. Only
+ * function symbols from .symtab and .dynsym are used; there is no line or
+ * inline information.
+ */
+
+#define SYMTAB_MAGIC "HCSYMTB1"
+#define SYMTAB_STALE_SECS 3600	/* age at which a half-built table is junk */
+#define BUILD_ID_MAX 64		/* bytes */
+
+struct symtab_header {
+	char magic[8];
+	uint32_t nsyms;
+	uint32_t reserved;
+	uint64_t names_off;
+	uint64_t names_len;
+};
+
+struct symtab_entry {
+	uint64_t off;		/* offset of the function in the file */
+	uint32_t size;
+	uint32_t name;		/* offset in the names */
+};
+
+struct symtab {
+	void *map;
+	size_t len;
+	const struct symtab_entry *ent;
+	uint32_t nsyms;
+	const char *names;
+	uint64_t names_len;
+};
+
+/* Find the build-id note among the notes at p. Returns its length. */
+static int note_build_id(const unsigned char *p, size_t len,
+			 unsigned char *id)
+{
+	size_t off = 0;
+
+	while (off + sizeof(Elf64_Nhdr) <= len) {
+		Elf64_Nhdr nh;
+		size_t desc_off, next;
+		memcpy(&nh, p + off, sizeof(nh));
+		desc_off = off + sizeof(nh) + ((nh.n_namesz + 3) & ~3u);
+		next = desc_off + ((nh.n_descsz + 3) & ~3u);
+		if (desc_off > len || next > len || next <= off)
+			break;
+		if (nh.n_type == NT_GNU_BUILD_ID && nh.n_namesz == 4 &&
+		    !memcmp(p + off + sizeof(nh), "GNU", 4) &&
+		    nh.n_descsz > 0 && nh.n_descsz <= BUILD_ID_MAX) {
+			memcpy(id, p + desc_off, nh.n_descsz);
+			return nh.n_descsz;
+		}
+		off = next;
+	}
+	return -ENOENT;
+}
+
+static int elf_check(const Elf64_Ehdr *eh, size_t len)
+{
+	if (len < sizeof(*eh) || memcmp(eh->e_ident, ELFMAG, SELFMAG) ||
+	    eh->e_ident[EI_CLASS] != ELFCLASS64 ||
+	    eh->e_phentsize != sizeof(Elf64_Phdr))
+		return -ENOEXEC;
+	return 0;
+}
+
+/* Read the build-id of the file mapped at m out of the core. The kernel
+ * dumps the first page of every file mapping which starts with an ELF
+ * header, and the notes are nearly always on that page. */
+static int core_build_id(struct hc_core_file *cf,
+			 const struct hc_core_meta *meta,
+			 const struct hc_mapping *m, unsigned char *id)
+{
+	unsigned char page[4096];
+	const Elf64_Ehdr *eh = (const Elf64_Ehdr *)page;
+	const Elf64_Phdr *ph;
+	int i, ret;
+
+	if (m->offset != 0 || m->end - m->start < sizeof(page) ||
+	    hc_core_read_mem(cf, meta, m->start, page, sizeof(page)))
+		return -ENOENT;
+	if (elf_check(eh, sizeof(page)) ||
+	    eh->e_phoff + eh->e_phnum * sizeof(*ph) > sizeof(page))
+		return -ENOENT;
+	ph = (const Elf64_Phdr *)(page + eh->e_phoff);
+	for (i = 0; i < eh->e_phnum; ++i) {
+		if (ph[i].p_type != PT_NOTE ||
+		    ph[i].p_offset + ph[i].p_filesz > sizeof(page))
+			continue;
+		ret = note_build_id(page + ph[i].p_offset, ph[i].p_filesz, id);
+		if (ret > 0)
+			return ret;
+	}
+	return -ENOENT;
+}
+
+/* Build-id of a mapped ELF file */
+static int file_build_id(const unsigned char *p, size_t len,
+			 unsigned char *id)
+{
+	const Elf64_Ehdr *eh = (const Elf64_Ehdr *)p;
+	const Elf64_Phdr *ph;
+	int i, ret;
+
+	if (elf_check(eh, len) ||
+	    eh->e_phoff + eh->e_phnum * sizeof(*ph) > len)
+		return -ENOEXEC;
+	ph = (const Elf64_Phdr *)(p + eh->e_phoff);
+	for (i = 0; i < eh->e_phnum; ++i) {
+		if (ph[i].p_type != PT_NOTE ||
+		    ph[i].p_offset + ph[i].p_filesz > len)
+			continue;
+		ret = note_build_id(p + ph[i].p_offset, ph[i].p_filesz, id);
+		if (ret > 0)
+			return ret;
+	}
+	return -ENOENT;
+}
+
+static void build_id_hex(const unsigned char *id, int len, char *hex)
+{
+	int i;
+
+	for (i = 0; i < len; ++i)
+		sprintf(hex + 2 * i, "%02x", id[i]);
+	hex[2 * len] = '\0';
+}
+
+static void symtab_path(const char *core_dir, const char *hex,
+			const char *suffix, char *path)
+{
+	snprintf(path, PATH_MAX, "%s/%s/%s%s", core_dir, HC_SYMBOLS_DIR, hex,
+		 suffix);
+}
+
+static int symtab_open(const char *path, struct symtab *tab)
+{
+	const struct symtab_header *h;
+	struct stat st;
+	int fd;
+
+	fd = open(path, O_RDONLY | O_CLOEXEC);
+	if (fd < 0)
+		return -errno;
+	if (fstat(fd, &st) || st.st_size < (off_t)sizeof(*h)) {
+		close(fd);
+		return -EINVAL;
+	}
+	tab->len = st.st_size;
+	tab->map = mmap(NULL, tab->len, PROT_READ, MAP_SHARED, fd, 0);
+	close(fd);
+	if (tab->map == MAP_FAILED)
+		return -errno;
+	h = tab->map;
+	if (memcmp(h->magic, SYMTAB_MAGIC, sizeof(h->magic)) ||
+	    sizeof(*h) + (uint64_t)h->nsyms * sizeof(*tab->ent) > h->names_off ||
+	    h->names_off + h->names_len > tab->len) {
+		munmap(tab->map, tab->len);
+		return -EINVAL;
+	}
+	tab->ent = (const struct symtab_entry *)(h + 1);
+	tab->nsyms = h->nsyms;
+	tab->names = (const char *)tab->map + h->names_off;
+	tab->names_len = h->names_len;
+	return 0;
+}
+
+static void symtab_close(struct symtab *tab)
+{
+	munmap(tab->map, tab->len);
+}
+
+/* Find the function containing file offset off */
+static const char *symtab_lookup(const struct symtab *tab, uint64_t off,
+				 uint64_t *delta)
+{
+	const struct symtab_entry *e;
+	uint32_t lo = 0, hi = tab->nsyms;
+
+	while (lo < hi) {
+		uint32_t mid = lo + (hi - lo) / 2;
+		if (tab->ent[mid].off <= off)
+			lo = mid + 1;
+		else
+			hi = mid;
+	}
+	if (lo == 0)
+		return NULL;
+	e = &tab->ent[lo - 1];
+	if (e->size && off - e->off >= e->size)
+		return NULL;
+	if (e->name >= tab->names_len)
+		return NULL;
+	*delta = off - e->off;
+	return tab->names + e->name;
+}
+
+/*
+ * Building tables
+ */
+
+struct sym_builder {
+	struct symtab_entry *ent;
+	size_t nent, alloc;
+	const char *names;	/* of the symbol table being read */
+	size_t names_len;
+	char *out_names;
+	size_t out_len, out_alloc;
+};
+
+static int builder_add(struct sym_builder *b, uint64_t off, uint64_t size,
+		       const char *name)
+{
+	size_t len = strlen(name) + 1;
+
+	if (b->nent == b->alloc) {
+		size_t alloc = b->alloc ? b->alloc * 2 : 1024;
+		struct symtab_entry *ent = realloc(b->ent,
+						   alloc * sizeof(*ent));
+		if (!ent)
+			return -ENOMEM;
+		b->ent = ent;
+		b->alloc = alloc;
+	}
+	if (b->out_len + len > b->out_alloc) {
+		size_t alloc = b->out_alloc ? b->out_alloc * 2 : 65536;
+		char *names;
+		while (alloc < b->out_len + len)
+			alloc *= 2;
+		names = realloc(b->out_names, alloc);
+		if (!names)
+			return -ENOMEM;
+		b->out_names = names;
+		b->out_alloc = alloc;
+	}
+	b->ent[b->nent].off = off;
+	b->ent[b->nent].size = size > UINT32_MAX ? UINT32_MAX : size;
+	b->ent[b->nent].name = b->out_len;
+	b->nent++;
+	memcpy(b->out_names + b->out_len, name, len);
+	b->out_len += len;
+	return 0;
+}
+
+/* Add the function symbols of one symbol table section */
+static int builder_add_section(struct sym_builder *b, const unsigned char *p,
+			       size_t len, const Elf64_Shdr *sh,
+			       const Elf64_Shdr *strsh, const Elf64_Phdr *ph,
+			       int phnum)
+{
+	const Elf64_Sym *sym;
+	size_t i, n;
+	int j, ret;
+
+	if (sh->sh_offset + sh->sh_size > len ||
+	    strsh->sh_offset + strsh->sh_size > len || strsh->sh_size == 0 ||
+	    sh->sh_entsize != sizeof(*sym))
+		return -EINVAL;
+	sym = (const Elf64_Sym *)(p + sh->sh_offset);
+	n = sh->sh_size / sizeof(*sym);
+	b->names = (const char *)p + strsh->sh_offset;
+	b->names_len = strsh->sh_size;
+	for (i = 0; i < n; ++i) {
+		int type = ELF64_ST_TYPE(sym[i].st_info);
+		if ((type != STT_FUNC && type != STT_GNU_IFUNC) ||
+		    sym[i].st_shndx == SHN_UNDEF || !sym[i].st_name ||
+		    sym[i].st_name >= b->names_len ||
+		    !memchr(b->names + sym[i].st_name, '\0',
+			    b->names_len - sym[i].st_name))
+			continue;
+		/* Translate the link-time address to a file offset */
+		for (j = 0; j < phnum; ++j) {
+			if (ph[j].p_type != PT_LOAD ||
+			    sym[i].st_value < ph[j].p_vaddr ||
+			    sym[i].st_value - ph[j].p_vaddr >= ph[j].p_filesz)
+				continue;
+			ret = builder_add(b, sym[i].st_value - ph[j].p_vaddr +
+					  ph[j].p_offset, sym[i].st_size,
+					  b->names + sym[i].st_name);
+			if (ret)
+				return ret;
+			break;
+		}
+	}
+	return 0;
+}
+
+static int cmp_entry(const void *a, const void *b)
+{
+	const struct symtab_entry *ea = a, *eb = b;
+
+	if (ea->off != eb->off)
+		return (ea->off > eb->off) - (ea->off < eb->off);
+	/* Among aliases, prefer the one that knows its size */
+	return (ea->size < eb->size) - (ea->size > eb->size);
+}
+
+static int symtab_write(const char *tmp, struct sym_builder *b)
+{
+	struct symtab_header h;
+	size_t i, n = 0;
+	int fd, ret = 0;
+
+	qsort(b->ent, b->nent, sizeof(*b->ent), cmp_entry);
+	for (i = 0; i < b->nent; ++i) {
+		if (n && b->ent[n - 1].off == b->ent[i].off)
+			continue;
+		b->ent[n++] = b->ent[i];
+	}
+	memset(&h, 0, sizeof(h));
+	memcpy(h.magic, SYMTAB_MAGIC, sizeof(h.magic));
+	h.nsyms = n;
+	h.names_off = sizeof(h) + n * sizeof(*b->ent);
+	h.names_len = b->out_len;
+	fd = open(tmp, O_WRONLY | O_TRUNC | O_CLOEXEC);
+	if (fd < 0)
+		return -errno;
+	ret = hc_write_all(fd, &h, sizeof(h));
+	if (!ret)
+		ret = hc_write_all(fd, b->ent, n * sizeof(*b->ent));
+	if (!ret)
+		ret = hc_write_all(fd, b->out_names, b->out_len);
+	if (close(fd) && !ret)
+		ret = -errno;
+	return ret;
+}
+
+/* Build the table for the ELF file at path, as long as it still has the
+ * build-id we expect. The table is written to a temporary file which also
+ * serves as a lock against other handlers building the same table. */
+static int symtab_build(const char *core_dir, const char *path,
+			const unsigned char *id, int id_len)
+{
+	char hex[2 * BUILD_ID_MAX + 1], tmp[PATH_MAX], dst[PATH_MAX];
+	unsigned char file_id[BUILD_ID_MAX];
+	struct sym_builder b;
+	const Elf64_Ehdr *eh;
+	const Elf64_Shdr *sh;
+	const Elf64_Phdr *ph;
+	unsigned char *p;
+	struct stat st;
+	int fd, i, ret;
+
+	build_id_hex(id, id_len, hex);
+	snprintf(dst, sizeof(dst), "%s/%s", core_dir, HC_SYMBOLS_DIR);
+	if (mkdir(dst, 0755) && errno != EEXIST)
+		return -errno;
+	symtab_path(core_dir, hex, ".tmp", tmp);
+	symtab_path(core_dir, hex, ".sym", dst);
+	fd = open(tmp, O_WRONLY | O_CREAT | O_EXCL | O_CLOEXEC, 0644);
+	if (fd < 0 && errno == EEXIST && stat(tmp, &st) == 0 &&
+	    st.st_mtime + SYMTAB_STALE_SECS < time(NULL)) {
+		unlink(tmp);
+		fd = open(tmp, O_WRONLY | O_CREAT | O_EXCL | O_CLOEXEC, 0644);
+	}
+	if (fd < 0)
+		return errno == EEXIST ? -EBUSY : -errno;
+	close(fd);
+
+	memset(&b, 0, sizeof(b));
+	p = MAP_FAILED;
+	fd = open(path, O_RDONLY | O_CLOEXEC);
+	if (fd < 0 || fstat(fd, &st)) {
+		ret = -errno;
+		goto out;
+	}
+	p = mmap(NULL, st.st_size, PROT_READ, MAP_PRIVATE, fd, 0);
+	if (p == MAP_FAILED) {
+		ret = -errno;
+		goto out;
+	}
+	ret = file_build_id(p, st.st_size, file_id);
+	if (ret != id_len || memcmp(file_id, id, id_len)) {
+		ret = -ESTALE;
+		goto out;
+	}
+	eh = (const Elf64_Ehdr *)p;
+	if (eh->e_shentsize != sizeof(*sh) ||
+	    eh->e_shoff + eh->e_shnum * sizeof(*sh) > (uint64_t)st.st_size) {
+		ret = -ENOEXEC;
+		goto out;
+	}
+	sh = (const Elf64_Shdr *)(p + eh->e_shoff);
+	ph = (const Elf64_Phdr *)(p + eh->e_phoff);
+	for (i = 0; i < eh->e_shnum; ++i) {
+		if ((sh[i].sh_type != SHT_SYMTAB &&
+		     sh[i].sh_type != SHT_DYNSYM) ||
+		    sh[i].sh_link >= eh->e_shnum)
+			continue;
+		ret = builder_add_section(&b, p, st.st_size, &sh[i],
+					  &sh[sh[i].sh_link], ph, eh->e_phnum);
+		if (ret == -ENOMEM)
+			goto out;
+	}
+	/* A table with no symbols still saves rebuilding it next time */
+	ret = symtab_write(tmp, &b);
+	if (ret == 0 && rename(tmp, dst))
+		ret = -errno;
+out:
+	if (ret)
+		unlink(tmp);
+	if (p != MAP_FAILED)
+		munmap(p, st.st_size);
+	if (fd >= 0)
+		close(fd);
+	free(b.ent);
+	free(b.out_names);
+	return ret;
+}
+
+/* The file to build a table from: while the process is still around, its
+ * map_files link reaches the very file it had mapped, even if that has
+ * since been replaced on disk. */
+static void mapping_source(pid_t pid, const struct hc_mapping *m, char *path)
+{
+	snprintf(path, PATH_MAX, "/proc/%d/map_files/%llx-%llx", (int)pid,
+		 (unsigned long long)m->start, (unsigned long long)m->end);
+	if (pid > 0 && access(path, R_OK) == 0)
+		return;
+	hc_strlcpy(path, m->path, PATH_MAX);
+}
+
+/* Build a table in the background, so that the handler can exit without
+ * waiting for it */
+static void symtab_build_background(const char *core_dir, const char *path,
+				    const unsigned char *id, int id_len)
+{
+	int ret;
+
+	if (hc_fork_background() != 0)
+		return;
+	ret = symtab_build(core_dir, path, id, id_len);
+	if (ret && ret != -EBUSY)
+		hc_log(LOG_WARNING, "symtab_failed", "path=\"%s\" err=%d",
+		       path, -ret);
+	_exit(0);
+}
+
+/* Mapping of the core containing addr */
+static const struct hc_mapping *find_mapping(const struct hc_core_meta *meta,
+					     uint64_t addr)
+{
+	unsigned lo = 0, hi = meta->nmaps;
+
+	while (lo < hi) {
+		unsigned mid = lo + (hi - lo) / 2;
+		if (meta->maps[mid].start <= addr)
+			lo = mid + 1;
+		else
+			hi = mid;
+	}
+	if (lo == 0 || addr >= meta->maps[lo - 1].end)
+		return NULL;
+	return &meta->maps[lo - 1];
+}
+
+/* The first mapping of the same file, which holds its ELF headers */
+static const struct hc_mapping *find_head(const struct hc_core_meta *meta,
+					  const struct hc_mapping *m)
+{
+	unsigned i;
+
+	for (i = 0; i < meta->nmaps; ++i) {
+		if (meta->maps[i].offset == 0 &&
+		    !strcmp(meta->maps[i].path, m->path))
+			return &meta->maps[i];
+	}
+	return NULL;
+}
+
+static void symbolize_thread(const char *core_dir, struct hc_core_file *cf,
+			     const struct hc_core_meta *meta, int flags,
+			     const struct hc_thread *t, struct hc_symbol *sym)
+{
+	char hex[2 * BUILD_ID_MAX + 1], path[PATH_MAX];
+	unsigned char id[BUILD_ID_MAX];
+	const struct hc_mapping *m, *head;
+	struct symtab tab;
+	uint64_t off;
+	int id_len;
+
+	memset(sym, 0, sizeof(*sym));
+	sym->tid = t->tid;
+	sym->pc = t->pc;
+	m = find_mapping(meta, t->pc);
+	if (!m)
+		return;
+	off = t->pc - m->start + m->offset;
+	sym->module = m->path;
+	sym->offset = off;
+	head = find_head(meta, m);
+	if (!head)
+		return;
+	id_len = core_build_id(cf, meta, head, id);
+	if (id_len <= 0)
+		return;
+	build_id_hex(id, id_len, hex);
+	symtab_path(core_dir, hex, ".sym", path);
+	if (symtab_open(path, &tab)) {
+		if (!flags)
+			return;
+		mapping_source(meta->pid, head, path);
+		if (flags & HC_SYM_BUILD_BG) {
+			symtab_build_background(core_dir, path, id, id_len);
+			return;
+		}
+		if (symtab_build(core_dir, path, id, id_len))
+			return;
+		symtab_path(core_dir, hex, ".sym", path);
+		if (symtab_open(path, &tab))
+			return;
+	}
+	sym->name = symtab_lookup(&tab, off, &sym->offset);
+	if (sym->name) {
+		/* Keep the name once the table is unmapped */
+		hc_strlcpy(sym->name_buf, sym->name, sizeof(sym->name_buf));
+		sym->name = sym->name_buf;
+	}
+	else {
+		sym->offset = off;
+	}
+	symtab_close(&tab);
+}
+
+int hc_symbolize(const char *core_dir, const char *path, int flags,
+		 hc_symbol_cb_t cb, void *arg)
+{
+	struct hc_core_file *cf;
+	struct hc_core_meta meta;
+	struct hc_symbol sym;
+	unsigned i;
+	int ret;
+
+	ret = hc_core_open(path, &cf);
+	if (ret)
+		return ret;
+	ret = hc_core_meta_read(cf, &meta);
+	if (ret) {
+		hc_core_close(cf);
+		return ret;
+	}
+	for (i = 0; i < meta.nthreads_known; ++i) {
+		symbolize_thread(core_dir, cf, &meta, flags, &meta.threads[i],
+				 &sym);
+		ret = cb(&sym, arg);
+		if (ret)
+			break;
+	}
+	hc_core_meta_free(&meta);
+	hc_core_close(cf);
+	return ret;
+}
+
+void hc_symbol_format(const struct hc_symbol *sym, char *buf, size_t len)
+{
+	const char *base;
+
+	if (sym->name) {
+		snprintf(buf, len, "%s+0x%llx", sym->name,
+			 (unsigned long long)sym->offset);
+	}
+	else if (sym->module) {
+		base = strrchr(sym->module, '/');
+		snprintf(buf, len, "%s+0x%llx", base ? base + 1 : sym->module,
+			 (unsigned long long)sym->offset);
+	}
+	else {
+		snprintf(buf, len, "0x%llx", (unsigned long long)sym->pc);
+	}
+}
+
+/*
+ * Finding symbols by name
+ *
+ * The tables only hold functions, and are keyed by offset, so a name is
+ * looked for there with a scan and otherwise in the symbol tables of the
+ * file itself, which covers variables, as long as its build-id still matches
+ * the core's. Either way the answer is placed by where the file was mapped.
+ */
+
+/* Whether module names the file at path: its whole base name, or the part
+ * of it before a '.' or '-' */
+static int module_match(const char *path, const char *module, size_t len)
+{
+	const char *base = strrchr(path, '/');
+
+	base = base ? base + 1 : path;
+	return !strncmp(base, module, len) &&
+	       (base[len] == '\0' || base[len] == '.' || base[len] == '-');
+}
+
+/* Where file offset off of the file mapped at head ended up */
+static int offset_addr(const struct hc_core_meta *meta,
+		       const struct hc_mapping *head, uint64_t off,
+		       uint64_t *addr)
+{
+	unsigned i;
+
+	for (i = 0; i < meta->nmaps; ++i) {
+		const struct hc_mapping *m = &meta->maps[i];
+		if (strcmp(m->path, head->path) || off < m->offset ||
+		    off - m->offset >= m->end - m->start)
+			continue;
+		*addr = m->start + off - m->offset;
+		return 0;
+	}
+	return -ENOENT;
+}
+
+static int table_find(const struct symtab *tab, const char *name,
+		      uint64_t *off, uint64_t *size)
+{
+	uint32_t i;
+
+	for (i = 0; i < tab->nsyms; ++i) {
+		const struct symtab_entry *e = &tab->ent[i];
+		if (e->name < tab->names_len &&
+		    !strcmp(tab->names + e->name, name)) {
+			*off = e->off;
+			*size = e->size;
+			return 0;
+		}
+	}
+	return -ENOENT;
+}
+
+/* An ELF file mapped for its symbol tables */
+struct elf_file {
+	unsigned char *p;
+	size_t len;
+	uint64_t base;		/* load address of the segment at offset 0 */
+};
+
+/* Map the ELF file at path, which must have build-id id */
+static int elf_file_open(const char *path, const unsigned char *id,
+			 int id_len, struct elf_file *f)
+{
+	unsigned char file_id[BUILD_ID_MAX];
+	const Elf64_Ehdr *eh;
+	const Elf64_Phdr *ph;
+	struct stat st;
+	int fd, i, ret;
+
+	fd = open(path, O_RDONLY | O_CLOEXEC);
+	if (fd < 0)
+		return -errno;
+	if (fstat(fd, &st)) {
+		close(fd);
+		return -errno;
+	}
+	f->len = st.st_size;
+	f->p = mmap(NULL, f->len, PROT_READ, MAP_PRIVATE, fd, 0);
+	close(fd);
+	if (f->p == MAP_FAILED)
+		return -errno;
+	if (file_build_id(f->p, f->len, file_id) != id_len ||
+	    memcmp(file_id, id, id_len)) {
+		ret = -ESTALE;
+		goto fail;
+	}
+	eh = (const Elf64_Ehdr *)f->p;
+	if (eh->e_shentsize != sizeof(Elf64_Shdr) ||
+	    eh->e_shoff + eh->e_shnum * sizeof(Elf64_Shdr) > f->len) {
+		ret = -ENOEXEC;
+		goto fail;
+	}
+	/* The load bias, from the segment mapped at head */
+	ph = (const Elf64_Phdr *)(f->p + eh->e_phoff);
+	for (i = 0; i < eh->e_phnum; ++i) {
+		if (ph[i].p_type == PT_LOAD && ph[i].p_offset == 0) {
+			f->base = ph[i].p_vaddr;
+			return 0;
+		}
+	}
+	ret = -ENOENT;
+fail:
+	munmap(f->p, f->len);
+	return ret;
+}
+
+static void elf_file_close(struct elf_file *f)
+{
+	munmap(f->p, f->len);
+}
+
+/* The symbols of section i, if it is a symbol table, and their names */
+static const Elf64_Sym *elf_file_syms(const struct elf_file *f, int i,
+				      size_t *nsyms, const char **strs,
+				      uint64_t *strs_len)
+{
+	const Elf64_Ehdr *eh = (const Elf64_Ehdr *)f->p;
+	const Elf64_Shdr *sh = (const Elf64_Shdr *)(f->p + eh->e_shoff);
+	const Elf64_Shdr *strsh;
+
+	if ((sh[i].sh_type != SHT_SYMTAB && sh[i].sh_type != SHT_DYNSYM) ||
+	    sh[i].sh_link >= eh->e_shnum ||
+	    sh[i].sh_entsize != sizeof(Elf64_Sym))
+		return NULL;
+	strsh = &sh[sh[i].sh_link];
+	if (sh[i].sh_offset + sh[i].sh_size > f->len ||
+	    strsh->sh_offset + strsh->sh_size > f->len)
+		return NULL;
+	*nsyms = sh[i].sh_size / sizeof(Elf64_Sym);
+	*strs = (const char *)f->p + strsh->sh_offset;
+	*strs_len = strsh->sh_size;
+	return (const Elf64_Sym *)(f->p + sh[i].sh_offset);
+}
+
+/* Look for name in the symbol tables of the ELF file at path, which must
+ * have build-id id, and place it relative to head */
+static int file_find(const char *path, const unsigned char *id, int id_len,
+		     const struct hc_mapping *head, const char *name,
+		     uint64_t *addr, uint64_t *size)
+{
+	struct elf_file f = { NULL, 0, 0 };
+	const Elf64_Sym *sym;
+	const char *strs;
+	uint64_t strs_len;
+	size_t j, nsyms;
+	int i, shnum, ret;
+
+	ret = elf_file_open(path, id, id_len, &f);
+	if (ret)
+		return ret;
+	ret = -ENOENT;
+	shnum = ((const Elf64_Ehdr *)f.p)->e_shnum;
+	for (i = 0; i < shnum && ret == -ENOENT; ++i) {
+		sym = elf_file_syms(&f, i, &nsyms, &strs, &strs_len);
+		for (j = 0; sym && j < nsyms; ++j) {
+			const char *s = strs + sym[j].st_name;
+			if (sym[j].st_shndx == SHN_UNDEF ||
+			    ELF64_ST_TYPE(sym[j].st_info) == STT_TLS ||
+			    sym[j].st_name >= strs_len ||
+			    strncmp(s, name, strs_len - sym[j].st_name))
+				continue;
+			*addr = head->start + sym[j].st_value - f.base;
+			*size = sym[j].st_size;
+			ret = 0;
+			break;
+		}
+	}
+	elf_file_close(&f);
+	return ret;
+}
+
+int hc_symbol_addr(const char *core_dir, struct hc_core_file *cf,
+		   const struct hc_core_meta *meta, const char *name,
+		   uint64_t *addr, uint64_t *size)
+{
+	char hex[2 * BUILD_ID_MAX + 1], path[PATH_MAX];
+	unsigned char id[BUILD_ID_MAX];
+	const char *colon = strchr(name, ':');
+	const char *module = NULL;
+	size_t module_len = 0;
+	struct symtab tab;
+	uint64_t off;
+	unsigned i, j;
+	int id_len, ret, err = -ENOENT;
+
+	if (colon && colon[1] != ':') {
+		module = name;
+		module_len = colon - name;
+		name = colon + 1;
+	}
+	for (i = 0; i < meta->nmaps; ++i) {
+		const struct hc_mapping *head = &meta->maps[i];
+		if (head->offset != 0 || !head->path[0] ||
+		    (module && !module_match(head->path, module, module_len)))
+			continue;
+		/* Each file once */
+		for (j = 0; j < i; ++j) {
+			if (meta->maps[j].offset == 0 &&
+			    !strcmp(meta->maps[j].path, head->path))
+				break;
+		}
+		if (j < i)
+			continue;
+		id_len = core_build_id(cf, meta, head, id);
+		if (id_len <= 0)
+			continue;
+		build_id_hex(id, id_len, hex);
+		symtab_path(core_dir, hex, ".sym", path);
+		if (symtab_open(path, &tab) == 0) {
+			ret = table_find(&tab, name, &off, size);
+			symtab_close(&tab);
+			if (ret == 0 && offset_addr(meta, head, off, addr) == 0)
+				return 0;
+		}
+		mapping_source(meta->pid, head, path);
+		ret = file_find(path, id, id_len, head, name, addr, size);
+		if (ret == 0)
+			return 0;
+		/* A file which has changed since is worth mentioning */
+		if (ret != -ENOENT)
+			err = ret;
+	}
+	return err;
+}
+
+/* The function or variable of the ELF file at path, which must have build-id
+ * id, holding addr of the process, given head */
+static int file_lookup(const char *path, const unsigned char *id, int id_len,
+		       const struct hc_mapping *head, uint64_t addr,
+		       struct hc_symbol *out)
+{
+	struct elf_file f = { NULL, 0, 0 };
+	const Elf64_Sym *sym, *best = NULL;
+	const char *strs, *name = NULL;
+	uint64_t strs_len, value;
+	size_t j, nsyms;
+	int i, shnum, ret;
+
+	ret = elf_file_open(path, id, id_len, &f);
+	if (ret)
+		return ret;
+	value = addr - head->start + f.base;
+	shnum = ((const Elf64_Ehdr *)f.p)->e_shnum;
+	for (i = 0; i < shnum; ++i) {
+		sym = elf_file_syms(&f, i, &nsyms, &strs, &strs_len);
+		for (j = 0; sym && j < nsyms; ++j) {
+			int type = ELF64_ST_TYPE(sym[j].st_info);
+			if (sym[j].st_shndx == SHN_UNDEF ||
+			    sym[j].st_shndx == SHN_ABS ||
+			    (type != STT_OBJECT && type != STT_FUNC) ||
+			    sym[j].st_name == 0 ||
+			    sym[j].st_name >= strs_len ||
+			    value < sym[j].st_value ||
+			    value - sym[j].st_value >=
+			    (sym[j].st_size ? sym[j].st_size : 1))
+				continue;
+			if (!best || sym[j].st_value > best->st_value) {
+				best = &sym[j];
+				name = strs + sym[j].st_name;
+			}
+		}
+	}
+	if (best) {
+		hc_strlcpy(out->name_buf, name, sizeof(out->name_buf));
+		out->name = out->name_buf;
+		out->offset = value - best->st_value;
+	}
+	elf_file_close(&f);
+	return best ? 0 : -ENOENT;
+}
+
+int hc_symbol_at(const char *core_dir, struct hc_core_file *cf,
+		 const struct hc_core_meta *meta, uint64_t addr,
+		 struct hc_symbol *sym)
+{
+	char hex[2 * BUILD_ID_MAX + 1], path[PATH_MAX];
+	unsigned char id[BUILD_ID_MAX];
+	const struct hc_mapping *m, *head;
+	struct symtab tab;
+	uint64_t off;
+	unsigned i;
+	int id_len;
+
+	memset(sym, 0, sizeof(*sym));
+	sym->pc = addr;
+	m = find_mapping(meta, addr);
+	/* or the file mapping the segment holding addr follows on from */
+	for (i = 0; !m && i < meta->nsegs; ++i) {
+		const struct hc_segment *seg = &meta->segs[i];
+		if (addr >= seg->vaddr && addr - seg->vaddr < seg->memsz &&
+		    seg->vaddr > 0)
+			m = find_mapping(meta, seg->vaddr - 1);
+	}
+	if (!m || !m->path[0])
+		return -ENOENT;
+	off = addr - m->start + m->offset;
+	sym->module = m->path;
+	sym->offset = off;
+	head = find_head(meta, m);
+	if (!head)
+		return 0;
+	id_len = core_build_id(cf, meta, head, id);
+	if (id_len <= 0)
+		return 0;
+	build_id_hex(id, id_len, hex);
+	symtab_path(core_dir, hex, ".sym", path);
+	if (symtab_open(path, &tab) == 0) {
+		sym->name = symtab_lookup(&tab, off, &sym->offset);
+		if (sym->name) {
+			hc_strlcpy(sym->name_buf, sym->name,
+				   sizeof(sym->name_buf));
+			sym->name = sym->name_buf;
+		}
+		else {
+			sym->offset = off;
+		}
+		symtab_close(&tab);
+		if (sym->name)
+			return 0;
+	}
+	/* Variables are only in the file's own tables */
+	mapping_source(meta->pid, head, path);
+	file_lookup(path, id, id_len, head, addr, sym);
+	return 0;
+}
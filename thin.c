@@ -0,0 +1,476 @@
+#define _GNU_SOURCE
+#include <dirent.h>
+#include <errno.h>
+#include <fcntl.h>
+#include <limits.h>
+#include <stdio.h>
+#include <stdlib.h>
+#include <string.h>
+#include <sys/file.h>
+#include <sys/stat.h>
+#include <syslog.h>
+#include <time.h>
+#include <unistd.h>
+
+#include "handle_core.h"
+#include "hc_private.h"
+
+/*
+ * Progressive thinning
+ *
+ * Instead of keeping a core whole until it is deleted, cores are made
+ * smaller in steps as they age, or as the store runs over its quota:
+ *
+ *	full	the core as the kernel wrote it
+ *	hcz	compressed
+ *	mini	an ELF core holding only the notes, the stacks of the threads,
+ *		small writable mappings and the first page of every mapped ELF
+ *		file (see mini.c), so it can still be symbolized and its
+ *		stacks read
+ *	summary	no file left, just the index record
+ *	expired	the index record is dropped too
+ *
+ * Each step writes the new form to a temporary file, renames it into place,
+ * removes the old form and appends an index record which replaces the old
+ * one. Under quota pressure the oldest cores are compressed first, then cut
+ * down to minicores, then summarized; the newest core is never touched.
+ * Only one thinner runs per core_dir at a time.
+ */
+
+#define THIN_LOCK ".thin.lock"
+#define THIN_TMP ".thin.XXXXXX"
+#define THIN_CHUNK HC_HCZ_FRAME_SIZE
+
+struct thin_core {
+	char *name;
+	int form;
+	time_t mtime;
+	mode_t mode;
+	uint64_t bytes;		/* disk space used */
+};
+
+struct thin_ctx {
+	const struct hc_policy *pol;
+	int dir_fd;
+	struct hc_record *recs;	/* the index, sorted by core name */
+	size_t nrecs, alloc_recs;
+	struct hc_thin_stats *stats;
+};
+
+static int cmp_record_core(const void *a, const void *b)
+{
+	const struct hc_record *ra = a, *rb = b;
+
+	return strcmp(ra->core, rb->core);
+}
+
+static int thin_collect_record(const struct hc_record *rec, void *arg)
+{
+	struct thin_ctx *ctx = arg;
+
+	/* Cores which failed over live, and are thinned, elsewhere */
+	if (rec->dir[0])
+		return 0;
+	if (ctx->nrecs == ctx->alloc_recs) {
+		size_t alloc = ctx->alloc_recs ? ctx->alloc_recs * 2 : 256;
+		struct hc_record *recs = realloc(ctx->recs,
+						 alloc * sizeof(*recs));
+		if (!recs)
+			return -ENOMEM;
+		ctx->recs = recs;
+		ctx->alloc_recs = alloc;
+	}
+	ctx->recs[ctx->nrecs++] = *rec;
+	return 0;
+}
+
+/* The index record of a core, or a minimal one if it was never indexed */
+static void thin_record(struct thin_ctx *ctx, const struct thin_core *c,
+			struct hc_record *rec)
+{
+	struct hc_record key, *found;
+
+	hc_strlcpy(key.core, c->name, sizeof(key.core));
+	found = ctx->nrecs ? bsearch(&key, ctx->recs, ctx->nrecs,
+				     sizeof(*ctx->recs), cmp_record_core) :
+			     NULL;
+	if (found) {
+		*rec = *found;
+		return;
+	}
+	memset(rec, 0, sizeof(*rec));
+	rec->time = c->mtime;
+	hc_strlcpy(rec->exe, "unknown", sizeof(rec->exe));
+	hc_strlcpy(rec->core, c->name, sizeof(rec->core));
+}
+
+static int form_of(const char *name)
+{
+	size_t len = strlen(name);
+
+	if (len > strlen(HC_MINI_SUFFIX) &&
+	    !strcmp(name + len - strlen(HC_MINI_SUFFIX), HC_MINI_SUFFIX))
+		return HC_FORM_MINI;
+	if (len > strlen(HC_HCZ_SUFFIX) &&
+	    !strcmp(name + len - strlen(HC_HCZ_SUFFIX), HC_HCZ_SUFFIX))
+		return HC_FORM_HCZ;
+	return HC_FORM_FULL;
+}
+
+/* name without its form suffix, plus suffix */
+static void form_name(const char *name, const char *suffix, char *out)
+{
+	size_t len = strlen(name);
+
+	switch (form_of(name)) {
+	case HC_FORM_MINI:
+		len -= strlen(HC_MINI_SUFFIX);
+		break;
+	case HC_FORM_HCZ:
+		len -= strlen(HC_HCZ_SUFFIX);
+		break;
+	}
+	snprintf(out, NAME_MAX + 1, "%.*s%s", (int)len, name, suffix);
+}
+
+static int copy_range(struct hc_core_file *cf, int out_fd, uint64_t off,
+		      uint64_t len, uint64_t out_off, unsigned char *buf)
+{
+	while (len > 0) {
+		size_t n = len < THIN_CHUNK ? len : THIN_CHUNK;
+		ssize_t r = hc_core_pread(cf, buf, n, off);
+		if (r != (ssize_t)n)
+			return r < 0 ? r : -EIO;
+		if (pwrite(out_fd, buf, n, out_off) != (ssize_t)n)
+			return -errno;
+		off += n;
+		out_off += n;
+		len -= n;
+	}
+	return 0;
+}
+
+/* Write a minicore of cf */
+static int thin_minicore(struct hc_core_file *cf, int out_fd)
+{
+	struct hc_mini_layout l;
+	struct hc_core_meta meta;
+	unsigned char *hdr = NULL, *buf = NULL;
+	unsigned i;
+	int ret;
+
+	ret = hc_core_meta_read(cf, &meta);
+	if (ret)
+		return ret;
+	hdr = malloc(meta.headers_len);
+	buf = malloc(THIN_CHUNK);
+	if (!hdr || !buf) {
+		ret = -ENOMEM;
+		goto out;
+	}
+	if (hc_core_pread(cf, hdr, meta.headers_len, 0) !=
+	    (ssize_t)meta.headers_len) {
+		ret = -EIO;
+		goto out;
+	}
+	ret = hc_mini_layout(hdr, meta.headers_len, &meta, &l);
+	if (ret)
+		goto out;
+	ret = hc_write_all(out_fd, l.head, l.head_len);
+	for (i = 0; i < l.nranges && ret == 0; ++i)
+		ret = copy_range(cf, out_fd, l.ranges[i].in_off,
+				 l.ranges[i].len, l.ranges[i].out_off, buf);
+	if (ret == 0 && ftruncate(out_fd, l.size))
+		ret = -errno;
+	hc_mini_layout_free(&l);
+out:
+	free(buf);
+	free(hdr);
+	hc_core_meta_free(&meta);
+	return ret;
+}
+
+/* Move core c to form, appending a record which replaces its old one */
+static int thin_step(struct thin_ctx *ctx, struct thin_core *c, int form)
+{
+	char tmp[PATH_MAX], path[PATH_MAX], name[NAME_MAX + 1];
+	struct hc_core_file *cf = NULL;
+	struct timespec times[2];
+	struct hc_record rec;
+	struct stat st;
+	int fd = -1, ret;
+
+	thin_record(ctx, c, &rec);
+	hc_strlcpy(rec.was, c->name, sizeof(rec.was));
+	rec.form = form;
+	snprintf(path, sizeof(path), "%s/%s", ctx->pol->core_dir, c->name);
+	if (form == HC_FORM_SUMMARY) {
+		if (unlink(path) && errno != ENOENT)
+			return -errno;
+		rec.stored = 0;
+		ret = hc_index_append(ctx->pol->core_dir, &rec);
+		if (ret == 0) {
+			ctx->stats->summarized++;
+			ctx->stats->bytes_freed += c->bytes;
+			c->form = form;
+			c->bytes = 0;
+		}
+		return ret;
+	}
+
+	form_name(c->name, form == HC_FORM_HCZ ? HC_HCZ_SUFFIX : HC_MINI_SUFFIX,
+		  name);
+	snprintf(tmp, sizeof(tmp), "%s/%s", ctx->pol->core_dir, THIN_TMP);
+	ret = hc_core_open(path, &cf);
+	if (ret)
+		return ret;
+	fd = mkostemp(tmp, O_CLOEXEC);
+	if (fd < 0) {
+		ret = -errno;
+		hc_core_close(cf);
+		return ret;
+	}
+	ret = form == HC_FORM_HCZ ? hc_hcz_compress_core(cf, fd, NULL) :
+				    thin_minicore(cf, fd);
+	hc_core_close(cf);
+	if (ret == 0) {
+		/* Keep the crash time, which is what ages are measured by */
+		times[0].tv_sec = times[1].tv_sec = c->mtime;
+		times[0].tv_nsec = times[1].tv_nsec = 0;
+		futimens(fd, times);
+		fchmod(fd, c->mode & 07777);
+		if (fstat(fd, &st) || (ctx->pol->sync && fdatasync(fd)))
+			ret = -errno;
+	}
+	if (close(fd) && !ret)
+		ret = -errno;
+	if (ret == 0) {
+		snprintf(path, sizeof(path), "%s/%s", ctx->pol->core_dir,
+			 name);
+		if (rename(tmp, path))
+			ret = -errno;
+	}
+	if (ret) {
+		unlink(tmp);
+		return ret;
+	}
+	if (strcmp(name, c->name))
+		unlinkat(ctx->dir_fd, c->name, 0);
+	hc_strlcpy(rec.core, name, sizeof(rec.core));
+	rec.stored = st.st_size;
+	ret = hc_index_append(ctx->pol->core_dir, &rec);
+	if (form == HC_FORM_HCZ)
+		ctx->stats->compressed++;
+	else
+		ctx->stats->minicores++;
+	if (c->bytes > (uint64_t)st.st_blocks * 512)
+		ctx->stats->bytes_freed += c->bytes - st.st_blocks * 512;
+	free(c->name);
+	c->name = strdup(name);
+	c->form = form;
+	c->bytes = st.st_blocks * 512;
+	return c->name ? ret : -ENOMEM;
+}
+
+/* Newest first, as retention orders them */
+static int cmp_core(const void *a, const void *b)
+{
+	const struct thin_core *ca = a, *cb = b;
+
+	if (ca->mtime != cb->mtime)
+		return ca->mtime < cb->mtime ? 1 : -1;
+	return strcmp(cb->name, ca->name);
+}
+
+static int thin_scan(struct thin_ctx *ctx, struct thin_core **out, int *n)
+{
+	struct thin_core *cores = NULL, *tmp;
+	int alloc = 0, dup_fd;
+	struct dirent *de;
+	struct stat st;
+	DIR *dp;
+
+	*n = 0;
+	dup_fd = dup(ctx->dir_fd);
+	dp = dup_fd < 0 ? NULL : fdopendir(dup_fd);
+	if (!dp) {
+		if (dup_fd >= 0)
+			close(dup_fd);
+		return -errno;
+	}
+	while ((de = readdir(dp))) {
+		if (strncmp(de->d_name, HC_CORE_PREFIX, HC_CORE_PREFIX_SZ) ||
+		    fstatat(ctx->dir_fd, de->d_name, &st, AT_SYMLINK_NOFOLLOW) ||
+		    !S_ISREG(st.st_mode))
+			continue;
+		if (*n == alloc) {
+			alloc = alloc ? alloc * 2 : 64;
+			tmp = realloc(cores, alloc * sizeof(*cores));
+			if (!tmp)
+				break;
+			cores = tmp;
+		}
+		cores[*n].name = strdup(de->d_name);
+		if (!cores[*n].name)
+			break;
+		cores[*n].form = form_of(de->d_name);
+		cores[*n].mtime = st.st_mtime;
+		cores[*n].mode = st.st_mode;
+		cores[*n].bytes = st.st_blocks * 512;
+		(*n)++;
+	}
+	closedir(dp);
+	if (*n)
+		qsort(cores, *n, sizeof(*cores), cmp_core);
+	*out = cores;
+	return 0;
+}
+
+/* Form a core of this age should have been thinned to */
+static int thin_target(const struct hc_thin_policy *thin, time_t age)
+{
+	if (thin->summary && age >= thin->summary)
+		return HC_FORM_SUMMARY;
+	if (thin->minicore && age >= thin->minicore)
+		return HC_FORM_MINI;
+	if (thin->compress && age >= thin->compress)
+		return HC_FORM_HCZ;
+	return HC_FORM_FULL;
+}
+
+static void thin_failed(const struct thin_core *c, int form, int err)
+{
+	hc_log(LOG_ERR, "thin_failed", "core=\"%s\" form=%s err=%d", c->name,
+	       hc_form_name(form), -err);
+}
+
+int hc_thin(const struct hc_policy *pol, struct hc_thin_stats *stats)
+{
+	const struct hc_thin_policy *thin = &pol->thin;
+	struct thin_core *cores = NULL;
+	struct hc_thin_stats st_buf;
+	struct thin_ctx ctx;
+	char path[PATH_MAX];
+	int i, n = 0, form, files, lock_fd, ret;
+	uint64_t total;
+	time_t now = time(NULL);
+	size_t r;
+
+	if (!stats)
+		stats = &st_buf;
+	memset(stats, 0, sizeof(*stats));
+	memset(&ctx, 0, sizeof(ctx));
+	ctx.pol = pol;
+	ctx.stats = stats;
+	snprintf(path, sizeof(path), "%s/%s", pol->core_dir, THIN_LOCK);
+	lock_fd = open(path, O_RDWR | O_CREAT | O_CLOEXEC, 0644);
+	if (lock_fd < 0)
+		return -errno;
+	if (flock(lock_fd, LOCK_EX | LOCK_NB)) {
+		ret = errno == EWOULDBLOCK ? -EBUSY : -errno;
+		close(lock_fd);
+		return ret;
+	}
+	ctx.dir_fd = open(pol->core_dir, O_RDONLY | O_DIRECTORY | O_CLOEXEC);
+	if (ctx.dir_fd < 0) {
+		ret = -errno;
+		goto out;
+	}
+	ret = hc_index_foreach(pol->core_dir, thin_collect_record, &ctx);
+	if (ret < 0)
+		goto out;
+	if (ctx.nrecs)
+		qsort(ctx.recs, ctx.nrecs, sizeof(*ctx.recs), cmp_record_core);
+	ret = thin_scan(&ctx, &cores, &n);
+	if (ret)
+		goto out;
+
+	/* By age. The newest core is left alone. */
+	for (i = 1; i < n; ++i) {
+		form = thin_target(thin, now - cores[i].mtime);
+		if (form <= cores[i].form)
+			continue;
+		ret = thin_step(&ctx, &cores[i], form);
+		if (ret)
+			thin_failed(&cores[i], form, ret);
+	}
+	/* Summaries which have outlived their usefulness */
+	for (r = 0; thin->expire && r < ctx.nrecs; ++r) {
+		struct hc_record rec = ctx.recs[r];
+		if (rec.form != HC_FORM_SUMMARY ||
+		    now - rec.time < thin->expire)
+			continue;
+		hc_strlcpy(rec.was, rec.core, sizeof(rec.was));
+		rec.form = HC_FORM_EXPIRED;
+		if (hc_index_append(pol->core_dir, &rec) == 0) {
+			hc_sidecar_remove(pol->core_dir, rec.core);
+			stats->expired++;
+		}
+	}
+
+	/* By quota: one step at a time over all the old cores, oldest first,
+	 * so that history is thinned evenly rather than lost from the end */
+	for (form = HC_FORM_HCZ; form <= HC_FORM_SUMMARY; ++form) {
+		for (i = n - 1; i >= 1; --i) {
+			int j;
+			total = 0;
+			files = 0;
+			for (j = 0; j < n; ++j) {
+				total += cores[j].bytes;
+				files += cores[j].form < HC_FORM_SUMMARY;
+			}
+			if (!(pol->max_bytes && total > pol->max_bytes) &&
+			    !(form == HC_FORM_SUMMARY && pol->max_cores > 0 &&
+			      files > pol->max_cores))
+				break;
+			if (cores[i].form >= form)
+				continue;
+			ret = thin_step(&ctx, &cores[i], form);
+			if (ret)
+				thin_failed(&cores[i], form, ret);
+		}
+	}
+	ret = 0;
+	if (pol->sync && (stats->compressed || stats->minicores ||
+			  stats->summarized || stats->expired))
+		ret = hc_commit(pol->core_dir);
+out:
+	for (i = 0; i < n; ++i)
+		free(cores[i].name);
+	free(cores);
+	free(ctx.recs);
+	if (ctx.dir_fd >= 0)
+		close(ctx.dir_fd);
+	close(lock_fd);
+	return ret;
+}
+
+int hc_thin_enabled(const struct hc_policy *pol)
+{
+	const struct hc_thin_policy *t = &pol->thin;
+
+	return t->compress || t->minicore || t->summary || t->expire;
+}
+
+int hc_thin_background(const struct hc_policy *pol)
+{
+	struct hc_thin_stats st;
+	int ret;
+
+	ret = hc_fork_background();
+	if (ret != 0)
+		return ret < 0 ? ret : 0;
+	ret = hc_thin(pol, &st);
+	if (ret && ret != -EBUSY)
+		hc_log(LOG_ERR, "thin_failed", "dir=\"%s\" err=%d",
+		       pol->core_dir, -ret);
+	else if (!ret)
+		hc_log(LOG_INFO, "thinned", "dir=\"%s\" compressed=%llu "
+		       "minicores=%llu summarized=%llu expired=%llu freed=%llu",
+		       pol->core_dir, (unsigned long long)st.compressed,
+		       (unsigned long long)st.minicores,
+		       (unsigned long long)st.summarized,
+		       (unsigned long long)st.expired,
+		       (unsigned long long)st.bytes_freed);
+	_exit(0);
+}
@@ -0,0 +1,156 @@
+#include <errno.h>
+#include <stdlib.h>
+#include <string.h>
+#include <sys/mman.h>
+#include <sys/syscall.h>
+#include <unistd.h>
+
+#include "hc_private.h"
+
+/*
+ * A minimal io_uring
+ *
+ * Just enough of the ring protocol to queue a batch of operations, submit
+ * them with one system call and reap the completions, without depending on
+ * liburing. The submission queue array is filled in order, so entry i of
+ * the array always points at sqe i.
+ */
+
+static int uring_setup(unsigned entries, struct io_uring_params *p)
+{
+	return syscall(__NR_io_uring_setup, entries, p);
+}
+
+static int uring_enter(int fd, unsigned to_submit, unsigned min_complete,
+		       unsigned flags)
+{
+	return syscall(__NR_io_uring_enter, fd, to_submit, min_complete, flags,
+		       NULL, 0);
+}
+
+int hc_uring_init(struct hc_uring *r, unsigned entries)
+{
+	struct io_uring_params p;
+	void *sq, *cq;
+	unsigned i;
+
+	memset(r, 0, sizeof(*r));
+	memset(&p, 0, sizeof(p));
+	r->fd = uring_setup(entries, &p);
+	if (r->fd < 0)
+		return -errno;
+	r->sq_len = p.sq_off.array + p.sq_entries * sizeof(unsigned);
+	r->cq_len = p.cq_off.cqes + p.cq_entries * sizeof(struct io_uring_cqe);
+	if ((p.features & IORING_FEAT_SINGLE_MMAP) && r->cq_len > r->sq_len)
+		r->sq_len = r->cq_len;
+	sq = mmap(NULL, r->sq_len, PROT_READ | PROT_WRITE,
+		  MAP_SHARED | MAP_POPULATE, r->fd, IORING_OFF_SQ_RING);
+	if (sq == MAP_FAILED)
+		goto fail;
+	r->sq_ring = sq;
+	if (p.features & IORING_FEAT_SINGLE_MMAP) {
+		cq = sq;
+	}
+	else {
+		cq = mmap(NULL, r->cq_len, PROT_READ | PROT_WRITE,
+			  MAP_SHARED | MAP_POPULATE, r->fd, IORING_OFF_CQ_RING);
+		if (cq == MAP_FAILED)
+			goto fail;
+		r->cq_ring = cq;
+	}
+	r->sqes_len = p.sq_entries * sizeof(struct io_uring_sqe);
+	r->sqes = mmap(NULL, r->sqes_len, PROT_READ | PROT_WRITE,
+		       MAP_SHARED | MAP_POPULATE, r->fd, IORING_OFF_SQES);
+	if (r->sqes == MAP_FAILED) {
+		r->sqes = NULL;
+		goto fail;
+	}
+	r->sq_head = (unsigned *)((char *)sq + p.sq_off.head);
+	r->sq_tail = (unsigned *)((char *)sq + p.sq_off.tail);
+	r->sq_mask = *(unsigned *)((char *)sq + p.sq_off.ring_mask);
+	r->cq_head = (unsigned *)((char *)cq + p.cq_off.head);
+	r->cq_tail = (unsigned *)((char *)cq + p.cq_off.tail);
+	r->cq_mask = *(unsigned *)((char *)cq + p.cq_off.ring_mask);
+	r->cqes = (struct io_uring_cqe *)((char *)cq + p.cq_off.cqes);
+	r->entries = p.sq_entries;
+	for (i = 0; i < p.sq_entries; ++i)
+		((unsigned *)((char *)sq + p.sq_off.array))[i] = i;
+	return 0;
+fail:
+	i = errno;
+	hc_uring_exit(r);
+	return -i;
+}
+
+void hc_uring_exit(struct hc_uring *r)
+{
+	if (r->sqes)
+		munmap(r->sqes, r->sqes_len);
+	if (r->cq_ring)
+		munmap(r->cq_ring, r->cq_len);
+	if (r->sq_ring)
+		munmap(r->sq_ring, r->sq_len);
+	if (r->fd >= 0)
+		close(r->fd);
+	memset(r, 0, sizeof(*r));
+	r->fd = -1;
+}
+
+int hc_uring_supports(struct hc_uring *r, int op)
+{
+	struct io_uring_probe *probe;
+	size_t len = sizeof(*probe) + 256 * sizeof(struct io_uring_probe_op);
+	int ret = 0;
+
+	probe = calloc(1, len);
+	if (!probe)
+		return 0;
+	if (syscall(__NR_io_uring_register, r->fd, IORING_REGISTER_PROBE,
+		    probe, 256) == 0 && op <= probe->last_op)
+		ret = !!(probe->ops[op].flags & IO_URING_OP_SUPPORTED);
+	free(probe);
+	return ret;
+}
+
+struct io_uring_sqe *hc_uring_sqe(struct hc_uring *r)
+{
+	unsigned head = __atomic_load_n(r->sq_head, __ATOMIC_ACQUIRE);
+	struct io_uring_sqe *sqe;
+
+	if (r->tail - head >= r->entries)
+		return NULL;
+	sqe = &r->sqes[r->tail & r->sq_mask];
+	memset(sqe, 0, sizeof(*sqe));
+	r->tail++;
+	return sqe;
+}
+
+int hc_uring_submit(struct hc_uring *r, unsigned wait_nr)
+{
+	unsigned n;
+	int ret;
+
+	__atomic_store_n(r->sq_tail, r->tail, __ATOMIC_RELEASE);
+	n = r->tail - r->submitted;
+	for (;;) {
+		ret = uring_enter(r->fd, n, wait_nr,
+				  wait_nr ? IORING_ENTER_GETEVENTS : 0);
+		if (ret >= 0 || errno != EINTR)
+			break;
+	}
+	if (ret < 0)
+		return -errno;
+	r->submitted += ret;
+	return ret;
+}
+
+int hc_uring_cqe(struct hc_uring *r, struct io_uring_cqe *cqe)
+{
+	unsigned head = *r->cq_head;
+
+	if (head == __atomic_load_n(r->cq_tail, __ATOMIC_ACQUIRE))
+		return -EAGAIN;
+	*cqe = r->cqes[head & r->cq_mask];
+	__atomic_store_n(r->cq_head, head + 1, __ATOMIC_RELEASE);
+	return 0;
+}
@@ -0,0 +1,331 @@
+#include <errno.h>
+#include <string.h>
+#include <sys/resource.h>
+#include <sys/syscall.h>
+#include <sys/wait.h>
+#include <time.h>
+#include <unistd.h>
+
+#include "hc_private.h"
+
+void hc_strlcpy(char *dst, const char *src, size_t dst_len)
+{
+	size_t len = strlen(src);
+
+	if (dst_len == 0)
+		return;
+	if (len >= dst_len)
+		len = dst_len - 1;
+	memcpy(dst, src, len);
+	dst[len] = '\0';
+}
+
+int hc_write_all(int fd, const void *buf, size_t len)
+{
+	const char *p = buf;
+
+	while (len > 0) {
+		ssize_t res = write(fd, p, len);
+		if (res < 0) {
+			if (errno == EINTR)
+				continue;
+			return -errno;
+		}
+		p += res;
+		len -= res;
+	}
+	return 0;
+}
+
+int hc_timespec_cmp(const struct timespec *a, const struct timespec *b)
+{
+	if (a->tv_sec != b->tv_sec)
+		return a->tv_sec < b->tv_sec ? -1 : 1;
+	if (a->tv_nsec != b->tv_nsec)
+		return a->tv_nsec < b->tv_nsec ? -1 : 1;
+	return 0;
+}
+
+void hc_timespec_add_ns(struct timespec *ts, uint64_t ns)
+{
+	ns += ts->tv_nsec;
+	ts->tv_sec += ns / 1000000000ULL;
+	ts->tv_nsec = ns % 1000000000ULL;
+}
+
+#define IOPRIO_WHO_PROCESS 1
+#define IOPRIO_CLASS_SHIFT 13
+#define IOPRIO_BE_LEVEL 4	/* the middle of the best effort class */
+
+void hc_set_priority(int nice, int ioprio)
+{
+	setpriority(PRIO_PROCESS, 0, nice);
+	syscall(SYS_ioprio_set, IOPRIO_WHO_PROCESS, 0,
+		(ioprio << IOPRIO_CLASS_SHIFT) |
+		(ioprio == HC_IOPRIO_BE ? IOPRIO_BE_LEVEL : 0));
+}
+
+int hc_fork_background(void)
+{
+	pid_t pid;
+
+	pid = fork();
+	if (pid < 0)
+		return -errno;
+	if (pid == 0) {
+		/* The intermediate child exits at once, so the grandchild is
+		 * reparented and nobody has to wait for it */
+		if (fork() != 0)
+			_exit(0);
+		setsid();
+		hc_set_priority(19, HC_IOPRIO_IDLE);
+		return 0;
+	}
+	waitpid(pid, NULL, 0);
+	return 1;
+}
+
+uint64_t hc_now_ns(void)
+{
+	struct timespec ts;
+
+	clock_gettime(CLOCK_MONOTONIC, &ts);
+	return ts.tv_sec * 1000000000ULL + ts.tv_nsec;
+}
+
+/*
+ * A fast 64-bit non-cryptographic hash in the style of xxHash64: four
+ * independent lanes over 32-byte stripes, then a final avalanche. It is used
+ * for dedup and integrity checks, never for anything security related.
+ */
+
+#define PRIME1 0x9E3779B185EBCA87ULL
+#define PRIME2 0xC2B2AE3D27D4EB4FULL
+#define PRIME3 0x165667B19E3779F9ULL
+#define PRIME4 0x85EBCA77C2B2AE63ULL
+#define PRIME5 0x27D4EB2F165667C5ULL
+
+static inline uint64_t rotl64(uint64_t x, int r)
+{
+	return (x << r) | (x >> (64 - r));
+}
+
+static inline uint64_t load64(const unsigned char *p)
+{
+	uint64_t v;
+	memcpy(&v, p, sizeof(v));
+	return v;
+}
+
+static inline uint64_t hash_round(uint64_t acc, uint64_t in)
+{
+	acc += in * PRIME2;
+	acc = rotl64(acc, 31);
+	return acc * PRIME1;
+}
+
+static inline uint64_t hash_merge(uint64_t acc, uint64_t v)
+{
+	acc ^= hash_round(0, v);
+	return acc * PRIME1 + PRIME4;
+}
+
+uint64_t hc_hash64(const void *buf, size_t len)
+{
+	const unsigned char *p = buf, *end = p + len;
+	uint64_t h;
+
+	if (len >= 32) {
+		uint64_t v1 = HC_HASH_SEED + PRIME1 + PRIME2;
+		uint64_t v2 = HC_HASH_SEED + PRIME2;
+		uint64_t v3 = HC_HASH_SEED;
+		uint64_t v4 = HC_HASH_SEED - PRIME1;
+		do {
+			v1 = hash_round(v1, load64(p));
+			v2 = hash_round(v2, load64(p + 8));
+			v3 = hash_round(v3, load64(p + 16));
+			v4 = hash_round(v4, load64(p + 24));
+			p += 32;
+		} while (p + 32 <= end);
+		h = rotl64(v1, 1) + rotl64(v2, 7) + rotl64(v3, 12) +
+			rotl64(v4, 18);
+		h = hash_merge(h, v1);
+		h = hash_merge(h, v2);
+		h = hash_merge(h, v3);
+		h = hash_merge(h, v4);
+	}
+	else {
+		h = HC_HASH_SEED + PRIME5;
+	}
+	h += len;
+	for (; p + 8 <= end; p += 8) {
+		h ^= hash_round(0, load64(p));
+		h = rotl64(h, 27) * PRIME1 + PRIME4;
+	}
+	for (; p < end; ++p) {
+		h ^= (*p) * PRIME5;
+		h = rotl64(h, 11) * PRIME1;
+	}
+	h ^= h >> 33;
+	h *= PRIME2;
+	h ^= h >> 29;
+	h *= PRIME3;
+	h ^= h >> 32;
+	return h;
+}
+
+/*
+ * The same hash over data that arrives in pieces. Whole stripes go straight
+ * into the lanes; a partial stripe waits in tail for the next piece.
+ */
+
+void hc_hash64_init(struct hc_hash_state *st)
+{
+	st->v[0] = HC_HASH_SEED + PRIME1 + PRIME2;
+	st->v[1] = HC_HASH_SEED + PRIME2;
+	st->v[2] = HC_HASH_SEED;
+	st->v[3] = HC_HASH_SEED - PRIME1;
+	st->len = 0;
+	st->tail_len = 0;
+}
+
+static inline void hash_stripe(uint64_t *v, uint64_t a, uint64_t b,
+			       uint64_t c, uint64_t d)
+{
+	v[0] = hash_round(v[0], a);
+	v[1] = hash_round(v[1], b);
+	v[2] = hash_round(v[2], c);
+	v[3] = hash_round(v[3], d);
+}
+
+uint64_t hc_hash64_copy(struct hc_hash_state *st, void *dst, const void *src,
+			size_t len)
+{
+	const unsigned char *p = src, *end = p + len;
+	unsigned char *q = dst;
+	uint64_t v[4], acc = 0;
+
+	st->len += len;
+	if (st->tail_len) {
+		size_t n = 32 - st->tail_len;
+		if (n > len)
+			n = len;
+		memcpy(st->tail + st->tail_len, p, n);
+		memcpy(q, p, n);
+		st->tail_len += n;
+		for (; n > 0; --n, ++q)
+			acc |= *p++;
+		if (st->tail_len < 32)
+			return acc;
+		hash_stripe(st->v, load64(st->tail), load64(st->tail + 8),
+			    load64(st->tail + 16), load64(st->tail + 24));
+		st->tail_len = 0;
+	}
+	/* The fused loop: each stripe is loaded once, then hashed, checked
+	 * for zero and stored while it is in registers */
+	memcpy(v, st->v, sizeof(v));
+	while (p + 32 <= end) {
+		uint64_t a = load64(p), b = load64(p + 8);
+		uint64_t c = load64(p + 16), d = load64(p + 24);
+		hash_stripe(v, a, b, c, d);
+		acc |= a | b | c | d;
+		memcpy(q, &a, 8);
+		memcpy(q + 8, &b, 8);
+		memcpy(q + 16, &c, 8);
+		memcpy(q + 24, &d, 8);
+		p += 32;
+		q += 32;
+	}
+	memcpy(st->v, v, sizeof(v));
+	st->tail_len = end - p;
+	memcpy(st->tail, p, st->tail_len);
+	memcpy(q, p, st->tail_len);
+	for (; p < end; ++p)
+		acc |= *p;
+	return acc;
+}
+
+void hc_hash64_update(struct hc_hash_state *st, const void *buf, size_t len)
+{
+	const unsigned char *p = buf, *end = p + len;
+
+	st->len += len;
+	if (st->tail_len) {
+		size_t n = 32 - st->tail_len;
+		if (n > len)
+			n = len;
+		memcpy(st->tail + st->tail_len, p, n);
+		st->tail_len += n;
+		p += n;
+		if (st->tail_len < 32)
+			return;
+		hash_stripe(st->v, load64(st->tail), load64(st->tail + 8),
+			    load64(st->tail + 16), load64(st->tail + 24));
+		st->tail_len = 0;
+	}
+	for (; p + 32 <= end; p += 32)
+		hash_stripe(st->v, load64(p), load64(p + 8), load64(p + 16),
+			    load64(p + 24));
+	st->tail_len = end - p;
+	memcpy(st->tail, p, st->tail_len);
+}
+
+uint64_t hc_hash64_final(const struct hc_hash_state *st)
+{
+	const unsigned char *p = st->tail, *end = p + st->tail_len;
+	uint64_t h;
+
+	if (st->len >= 32) {
+		h = rotl64(st->v[0], 1) + rotl64(st->v[1], 7) +
+			rotl64(st->v[2], 12) + rotl64(st->v[3], 18);
+		h = hash_merge(h, st->v[0]);
+		h = hash_merge(h, st->v[1]);
+		h = hash_merge(h, st->v[2]);
+		h = hash_merge(h, st->v[3]);
+	}
+	else {
+		h = HC_HASH_SEED + PRIME5;
+	}
+	h += st->len;
+	for (; p + 8 <= end; p += 8) {
+		h ^= hash_round(0, load64(p));
+		h = rotl64(h, 27) * PRIME1 + PRIME4;
+	}
+	for (; p < end; ++p) {
+		h ^= (*p) * PRIME5;
+		h = rotl64(h, 11) * PRIME1;
+	}
+	h ^= h >> 33;
+	h *= PRIME2;
+	h ^= h >> 29;
+	h *= PRIME3;
+	h ^= h >> 32;
+	return h;
+}
+
+uint64_t hc_hash64_combine(uint64_t h, uint64_t v)
+{
+	return hash_merge(h, v);
+}
+
+int hc_is_zero(const void *buf, size_t len)
+{
+	const unsigned char *p = buf, *end = p + len;
+
+	/* OR whole blocks together so the compiler can vectorize the loop
+	 * and we only branch once per block. */
+	while (p + 64 <= end) {
+		uint64_t acc = 0;
+		int i;
+		for (i = 0; i < 8; ++i)
+			acc |= load64(p + i * 8);
+		if (acc)
+			return 0;
+		p += 64;
+	}
+	for (; p < end; ++p) {
+		if (*p)
+			return 0;
+	}
+	return 1;
+}